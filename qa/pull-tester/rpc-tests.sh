@@ -37,6 +37,7 @@ testScripts=(
 testScriptsExt=(
     'bigblocks.py'
     'bipdersig-p2p.py'
+    'blockdownload.py'
     'getblocktemplate_longpoll.py'
     'getblocktemplate_proposals.py'
     'txn_clone.py --mineblock'
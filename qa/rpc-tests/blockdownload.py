@@ -0,0 +1,63 @@
+#!/usr/bin/env python2
+# Copyright (c) 2015 The Bitcoin XT developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#
+# Benchmark block download: a fresh node syncs a chain from several peers
+# at once, then the time it took and how the blocks were spread across the
+# peers is reported from getpeerinfo.
+#
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.util import *
+
+import time
+
+class BlockDownloadTest(BitcoinTestFramework):
+
+    def add_options(self, parser):
+        parser.add_option("--blocks", dest="blocks", default=1000, type="int",
+                          help="Length of the chain to download (default: %default)")
+        parser.add_option("--peers", dest="peers", default=3, type="int",
+                          help="Number of peers to download it from (default: %default)")
+
+    def setup_chain(self):
+        print("Initializing test directory "+self.options.tmpdir)
+        initialize_chain_clean(self.options.tmpdir, self.options.peers + 1)
+
+    def setup_network(self):
+        # The last node is the one that downloads; it stays unconnected
+        # until the chain is ready.
+        self.nodes = start_nodes(self.options.peers + 1, self.options.tmpdir)
+        for i in range(1, self.options.peers):
+            connect_nodes_bi(self.nodes, i - 1, i)
+        self.is_network_split = False
+
+    def run_test(self):
+        peers = self.nodes[:-1]
+        node = self.nodes[-1]
+
+        print("Mining %d blocks" % self.options.blocks)
+        peers[0].generate(self.options.blocks)
+        sync_blocks(peers)
+
+        start = time.time()
+        for i in range(len(peers)):
+            connect_nodes(node, i)
+        sync_blocks(self.nodes, wait=0.1)
+        elapsed = time.time() - start
+        assert_equal(node.getblockcount(), self.options.blocks)
+
+        print("Downloaded %d blocks from %d peers in %.2f s (%.0f blocks/s)" %
+              (self.options.blocks, len(peers), elapsed, self.options.blocks / elapsed))
+        downloaded = 0
+        for peer in node.getpeerinfo():
+            print("  peer=%d: %d blocks, %d bytes, %d taken over, at most %d in flight, %.1f ms/block, %d bytes/s" %
+                  (peer["id"], peer["blocksdownloaded"], peer["blockbytesdownloaded"], peer["blockstakenover"],
+                   peer["inflightmax"], peer.get("blockdownloadtime", 0) * 1000, peer.get("blockdownloadrate", 0)))
+            downloaded += peer["blocksdownloaded"]
+        # Each block is credited to the one peer that delivered it first.
+        assert_equal(downloaded, self.options.blocks)
+
+if __name__ == '__main__':
+    BlockDownloadTest().main()
@@ -4,116 +4,68 @@
 # file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #
-# Test -maxmempooltx limit-number-of-transactions-in-mempool
+# Test -maxmempool limit-size-of-mempool
 # code
 #
 
 from test_framework.test_framework import BitcoinTestFramework
 from test_framework.util import *
-import os
-import shutil
+from decimal import Decimal
 import time
 
-class MempoolCoinbaseTest(BitcoinTestFramework):
+class MempoolLimitTest(BitcoinTestFramework):
 
     def setup_network(self):
-        # Three nodes
-        args = ["-maxmempooltx=11", "-checkmempool", "-debug=mempool"]
+        # node0 keeps everything, node1 is limited to one megabyte
         self.nodes = []
-        self.nodes.append(start_node(0, self.options.tmpdir, args))
-        self.nodes.append(start_node(1, self.options.tmpdir, args))
-        self.nodes.append(start_node(2, self.options.tmpdir, args))
+        self.nodes.append(start_node(0, self.options.tmpdir, ["-maxmempool=0", "-debug=mempool"]))
+        self.nodes.append(start_node(1, self.options.tmpdir, ["-maxmempool=1", "-checkmempool", "-debug=mempool"]))
+        self.nodes.append(start_node(2, self.options.tmpdir, ["-debug=mempool"]))
         connect_nodes_bi(self.nodes, 0, 1)
         connect_nodes_bi(self.nodes, 0, 2)
         self.is_network_split = False
 
-    def create_tx(self, from_txid, to_address, amount, node=0):
-        inputs = [{ "txid" : from_txid, "vout" : 0}]
-        outputs = { to_address : amount }
-        rawtx = self.nodes[node].createrawtransaction(inputs, outputs)
-        signresult = self.nodes[node].signrawtransaction(rawtx)
+    def create_big_tx(self, from_txid, addresses, fee):
+        # Around 50 kilobytes: 1500 outputs of 0.02 BTC each
+        inputs = [{ "txid" : from_txid, "vout" : 0 }]
+        outputs = {}
+        for address in addresses:
+            outputs[address] = Decimal("0.02")
+        outputs[addresses[0]] += Decimal(50) - Decimal("0.02") * len(addresses) - fee
+        rawtx = self.nodes[0].createrawtransaction(inputs, outputs)
+        signresult = self.nodes[0].signrawtransaction(rawtx)
         assert_equal(signresult["complete"], True)
         return signresult["hex"]
 
     def run_test(self):
-        node0_address = self.nodes[0].getnewaddress()
-        node1_address = self.nodes[1].getnewaddress()
+        addresses = [ self.nodes[2].getnewaddress() for i in range(1500) ]
 
-        # 20 transactions
-        b = [ self.nodes[0].getblockhash(n) for n in range(1, 21) ]
+        # 25 unrelated transactions, each paying more than the one before
+        b = [ self.nodes[0].getblockhash(n) for n in range(1, 26) ]
         coinbase_txids = [ self.nodes[0].getblock(h)['tx'][0] for h in b ]
-        spends1_raw = [ self.create_tx(txid, node0_address, 50) for txid in coinbase_txids ]
-        spends1_id = [ self.nodes[0].sendrawtransaction(tx) for tx in spends1_raw ]
-
-        # -maxmempooltx doesn't evict transactions submitted via sendrawtransaction:
-        assert_equal(len(self.nodes[0].getrawmempool()), 20)
-
-        # ... and doesn't evict sendtoaddress() transactions:
-        spends1_id.append(self.nodes[0].sendtoaddress(node0_address, 50))
-        assert_equal(len(self.nodes[0].getrawmempool()), 21)
-
-        time.sleep(1) # wait just a bit for node0 to send transactions to node1
-
-        # ... node1's mempool should be limited
-        assert(len(self.nodes[1].getrawmempool()) <= 11)
-
-        # have other node create five transactions...
-        node1_txids = []
-        for i in range(5):
-            node1_txids.append(self.nodes[1].sendtoaddress(node1_address, 50))
-
-        # it's mempool should be limited, but should contain those txids:
+        txids = []
+        for i, txid in enumerate(coinbase_txids):
+            fee = Decimal("0.001") * (i + 1)
+            txids.append(self.nodes[0].sendrawtransaction(self.create_big_tx(txid, addresses, fee)))
+
+        # Without a limit, node0 keeps them all
+        assert_equal(len(self.nodes[0].getrawmempool()), 25)
+        assert(self.nodes[0].getmempoolinfo()["bytes"] > 1000000)
+        assert_equal(self.nodes[0].getmempoolinfo()["maxmempool"], 0)
+
+        time.sleep(5) # wait for node0 to send transactions to node1
+
+        # node1 stays within its limit by evicting the lowest fee rates...
+        info = self.nodes[1].getmempoolinfo()
+        assert_equal(info["maxmempool"], 1000000)
+        assert(info["bytes"] <= 1000000)
         node1_txs = set(self.nodes[1].getrawmempool())
-        assert(node1_txs.issuperset(node1_txids))
-        # The first send-to-self is guaranteed to evict another of node0's transaction.
-        # The second (and subsequent) might try (and fail) to evict the first
-        # send-to-self, in which case the mempool size can be bigger than -maxmempooltx
-        assert(len(self.nodes[1].getrawmempool()) <= 11+4)
-
-        time.sleep(1)
-
-        # node0's mempool should still have all its transactions:
-        node0_txs = set(self.nodes[0].getrawmempool())
-        assert(node0_txs.issuperset(spends1_id))
-
-
-        # Have each node mine a block, should empty mempools:
-        blocks = []
-        blocks.extend(self.nodes[0].generate(1))
-        sync_blocks(self.nodes)      
-        blocks.extend(self.nodes[1].generate(1))
-        sync_blocks(self.nodes)      
-
-        assert_equal(len(self.nodes[0].getrawmempool()), 0)
-        assert_equal(len(self.nodes[1].getrawmempool()), 0)
-
-        # Second test:
-        #    eviction of long chains of dependent transactions
-        parent_ids = [spends1_id[0], node1_txids[0]]
-        send_addresses = [node0_address, node1_address]
-        chained_ids = [[],[]]
-        send_amount = 50
-        for i in range(5):
-            send_amount = send_amount-0.001 # send with sufficient fee
-            for node in range(2):
-                raw = self.create_tx(parent_ids[node], send_addresses[node], send_amount, node)
-                parent_ids[node] = self.nodes[node].sendrawtransaction(raw)
-                chained_ids[node].append(parent_ids[node])
-
-        sync_mempools(self.nodes) # Wait for all ten txns in all mempools
-        assert_equal(len(self.nodes[2].getrawmempool()), 10)
-
-        # Have both nodes generate high-priority transactions to exercise chained-transaction-eviction
-        # code
-        tx_ids = [[],[]]
-        for i in range(3):
-            for node in range(2):
-                tx_ids[node].append(self.nodes[node].sendtoaddress(send_addresses[node], 25))
+        assert(len(node1_txs) < 25)
+        assert(txids[-1] in node1_txs)
+        assert(txids[0] not in node1_txs)
 
-        # Give a little time for transactions to make their way to node2, it's mempool should
-        # remain under limit
-        time.sleep(1)
-        assert(len(self.nodes[2].getrawmempool()) <= 11)
+        # ... and from then on asks for more than what it evicted
+        assert(info["mempoolminfee"] > 0)
 
 if __name__ == '__main__':
-    MempoolCoinbaseTest().main()
+    MempoolLimitTest().main()
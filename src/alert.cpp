@@ -131,7 +131,12 @@ bool CAlert::RelayTo(CNode* pnode) const
     if (pnode->nVersion == 0)
         return false;
     // returns true if wasn't already contained in the set
-    if (pnode->setKnown.insert(GetHash()).second)
+    bool fInserted;
+    {
+        LOCK(pnode->cs_inventory);
+        fInserted = pnode->setKnown.insert(GetHash()).second;
+    }
+    if (fInserted)
     {
         if (AppliesTo(pnode->nVersion, pnode->strSubVer) ||
             AppliesToMe() ||
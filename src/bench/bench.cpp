@@ -0,0 +1,71 @@
+// Copyright (c) 2015 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <sys/time.h>
+
+std::map<std::string, benchmark::BenchFunction> benchmark::BenchRunner::benchmarks;
+
+static double gettimedouble(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_usec * 0.000001 + tv.tv_sec;
+}
+
+benchmark::BenchRunner::BenchRunner(std::string name, benchmark::BenchFunction func)
+{
+    benchmarks.insert(std::make_pair(name, func));
+}
+
+void
+benchmark::BenchRunner::RunAll(double elapsedTimeForOne)
+{
+    std::cout << "Benchmark" << "," << "count" << "," << "min" << "," << "max" << "," << "average" << "\n";
+
+    for (std::map<std::string,benchmark::BenchFunction>::iterator it = benchmarks.begin();
+         it != benchmarks.end(); ++it) {
+
+        State state(it->first, elapsedTimeForOne);
+        BenchFunction& func = it->second;
+        func(state);
+    }
+}
+
+benchmark::State::State(std::string _name, double _maxElapsed) :
+    name(_name), maxElapsed(_maxElapsed), beginTime(0), lastTime(0), count(0)
+{
+    minTime = std::numeric_limits<double>::max();
+    maxTime = std::numeric_limits<double>::min();
+}
+
+bool
+benchmark::State::KeepRunning()
+{
+    double now;
+    if (count == 0) {
+        beginTime = now = gettimedouble();
+    }
+    else {
+        now = gettimedouble();
+        double elapsed = now - lastTime;
+        if (elapsed > maxTime) maxTime = elapsed;
+        if (elapsed < minTime) minTime = elapsed;
+    }
+    lastTime = now;
+    ++count;
+
+    if (now - beginTime < maxElapsed) return true; // Keep going
+
+    --count;
+
+    // Output results
+    double average = (now-beginTime)/count;
+    std::cout << std::fixed << std::setprecision(6) << name << "," << count << "," << minTime << "," << maxTime << "," << average << "\n";
+
+    return false;
+}
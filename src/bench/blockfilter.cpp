@@ -0,0 +1,115 @@
+// Copyright (c) 2015 The Bitcoin XT developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "blockfilter.h"
+#include "bloom.h"
+#include "merkleblock.h"
+#include "primitives/block.h"
+#include "random.h"
+#include "undo.h"
+
+#include <assert.h>
+
+#include <boost/foreach.hpp>
+
+/** Transactions of the benchmark block, each spending two outputs and paying to two */
+static const int BLOCKFILTER_TXS = 2000;
+/** Scripts a light client wallet watches */
+static const int BLOCKFILTER_WALLET_SCRIPTS = 100;
+
+static CScript RandomP2PKH()
+{
+    uint256 hash = GetRandHash();
+    return CScript() << OP_DUP << OP_HASH160 << std::vector<unsigned char>(hash.begin(), hash.begin() + 20) << OP_EQUALVERIFY << OP_CHECKSIG;
+}
+
+/** A full block of pay-to-pubkey-hash transactions, with its undo data. */
+struct BlockFilterSetup
+{
+    CBlock block;
+    CBlockUndo blockundo;
+    std::vector<CScript> vWallet;
+
+    BlockFilterSetup()
+    {
+        CMutableTransaction coinbase;
+        coinbase.vin.resize(1);
+        coinbase.vout.resize(1);
+        coinbase.vout[0].scriptPubKey = RandomP2PKH();
+        block.vtx.push_back(coinbase);
+        for (int i = 0; i < BLOCKFILTER_TXS; i++) {
+            CMutableTransaction tx;
+            CTxUndo txundo;
+            tx.vin.resize(2);
+            for (int j = 0; j < 2; j++) {
+                tx.vin[j].prevout = COutPoint(GetRandHash(), j);
+                tx.vin[j].scriptSig = CScript() << std::vector<unsigned char>(72) << std::vector<unsigned char>(33);
+                txundo.vprevout.push_back(CTxInUndo(CTxOut(100000, RandomP2PKH())));
+            }
+            tx.vout.resize(2);
+            for (int j = 0; j < 2; j++) {
+                tx.vout[j].nValue = 50000;
+                tx.vout[j].scriptPubKey = RandomP2PKH();
+            }
+            block.vtx.push_back(tx);
+            blockundo.vtxundo.push_back(txundo);
+        }
+        block.hashMerkleRoot = block.BuildMerkleTree();
+
+        // A wallet with one of its scripts in the block.
+        vWallet.push_back(block.vtx[1].vout[0].scriptPubKey);
+        while (vWallet.size() < BLOCKFILTER_WALLET_SCRIPTS)
+            vWallet.push_back(RandomP2PKH());
+    }
+};
+
+/**
+ * Build the basic filter of a block of BLOCKFILTER_TXS transactions, as
+ * ConnectBlock does with -blockfilterindex. This is done once per block,
+ * however many light clients there are.
+ */
+static void BlockFilterBuild(benchmark::State& state)
+{
+    BlockFilterSetup setup;
+    while (state.KeepRunning()) {
+        CBlockFilter filter(BASIC_FILTER, setup.block, setup.blockundo);
+        assert(filter.GetFilter().GetN() > 0);
+    }
+}
+
+/** Test the filter of the block for the scripts of a wallet, as a light client does. */
+static void BlockFilterMatch(benchmark::State& state)
+{
+    BlockFilterSetup setup;
+    CBlockFilter filter(BASIC_FILTER, setup.block, setup.blockundo);
+    GCSFilter::ElementSet elements;
+    BOOST_FOREACH(const CScript& script, setup.vWallet)
+        elements.insert(GCSFilter::Element(script.begin(), script.end()));
+    while (state.KeepRunning()) {
+        bool fMatch = filter.GetFilter().MatchAny(elements);
+        assert(fMatch);
+    }
+}
+
+/**
+ * Serve the block as a merkle block to one bloom filtering client watching
+ * the same wallet: the work a node does for every such client and block.
+ */
+static void BlockFilterBloomMerkleBlock(benchmark::State& state)
+{
+    BlockFilterSetup setup;
+    while (state.KeepRunning()) {
+        CBloomFilter bloom(BLOCKFILTER_WALLET_SCRIPTS, 0.0001, 0, BLOOM_UPDATE_ALL);
+        BOOST_FOREACH(const CScript& script, setup.vWallet)
+            bloom.insert(std::vector<unsigned char>(script.begin() + 3, script.begin() + 23));
+        CMerkleBlock merkleBlock(setup.block, bloom);
+        assert(!merkleBlock.vMatchedTxn.empty());
+    }
+}
+
+BENCHMARK(BlockFilterBuild);
+BENCHMARK(BlockFilterMatch);
+BENCHMARK(BlockFilterBloomMerkleBlock);
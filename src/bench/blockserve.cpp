@@ -0,0 +1,178 @@
+// Copyright (c) 2015 The Bitcoin XT developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "arith_uint256.h"
+#include "blockstore.h"
+#include "chainparams.h"
+#include "clientversion.h"
+#include "main.h"
+#include "pow.h"
+#include "random.h"
+#include "rawblockcache.h"
+#include "util.h"
+#include "utiltime.h"
+
+#include <assert.h>
+
+#include <boost/filesystem.hpp>
+
+/** Serialized size of the benchmark block; one iteration serves one block of about 1 MB. */
+static const size_t BENCH_BLOCK_SIZE = 1000000;
+
+/**
+ * A block of about BENCH_BLOCK_SIZE stored in a block file in a temporary
+ * data directory, as a peer downloading the chain would ask for it.
+ */
+struct BlockServeSetup
+{
+    boost::filesystem::path pathTemp;
+    CBlock block;
+    uint256 hash;
+    CDiskBlockPos pos;
+
+    BlockServeSetup()
+    {
+        pathTemp = GetTempPath() / strprintf("bench_bitcoin_%lu_%i", (unsigned long)GetTime(), (int)GetRand(100000));
+        boost::filesystem::create_directories(pathTemp);
+        mapArgs["-datadir"] = pathTemp.string();
+        ClearDatadirCache();
+
+        CMutableTransaction coinbase;
+        coinbase.vin.resize(1);
+        coinbase.vout.resize(1);
+        block.vtx.push_back(coinbase);
+        size_t nSize = ::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION) + 2;
+        while (true) {
+            CMutableTransaction tx;
+            tx.vin.resize(1);
+            tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+            tx.vin[0].scriptSig = CScript() << std::vector<unsigned char>(72) << std::vector<unsigned char>(33);
+            tx.vout.resize(2);
+            tx.vout[0].scriptPubKey = CScript() << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20) << OP_EQUALVERIFY << OP_CHECKSIG;
+            tx.vout[1].scriptPubKey = tx.vout[0].scriptPubKey;
+            size_t nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+            if (nSize + nTxSize > BENCH_BLOCK_SIZE)
+                break;
+            nSize += nTxSize;
+            block.vtx.push_back(tx);
+        }
+        block.hashMerkleRoot = block.BuildMerkleTree();
+        block.nTime = GetTime();
+        block.nBits = UintToArith256(Params().GetConsensus().powLimit).GetCompact();
+        while (!CheckProofOfWork(block.GetHash(), block.nBits, Params().GetConsensus()))
+            block.nNonce++;
+        hash = block.GetHash();
+
+        pos = CDiskBlockPos(0, 0);
+        bool fWritten = WriteBlockToDisk(block, pos, Params().MessageStart());
+        assert(fWritten);
+    }
+
+    ~BlockServeSetup()
+    {
+        rawBlockCache.Clear();
+        blockFileStore.Clear();
+        boost::filesystem::remove_all(pathTemp);
+        mapArgs.erase("-datadir");
+        ClearDatadirCache();
+    }
+};
+
+/** Read the block into a CBlock and serialize it again, as blocks were served before. */
+static void BlockServeDeserialize(benchmark::State& state)
+{
+    BlockServeSetup setup;
+    while (state.KeepRunning()) {
+        CBlock block;
+        bool fRead = ReadBlockFromDisk(block, setup.pos);
+        assert(fRead);
+        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+        ss << CMessageHeader(Params().MessageStart(), "block", 0) << block;
+        CNetMessage::FinalizeHeader(ss);
+    }
+}
+
+/** Read the block as stored, with the cache emptied every time. */
+static void BlockServeRaw(benchmark::State& state)
+{
+    BlockServeSetup setup;
+    while (state.KeepRunning()) {
+        rawBlockCache.Clear();
+        CSerializeDataRef pmsg = GetBlockMessage(setup.hash, setup.pos);
+        assert(pmsg);
+    }
+}
+
+/** Serve the block from the cache of recently served blocks. */
+static void BlockServeCached(benchmark::State& state)
+{
+    BlockServeSetup setup;
+    while (state.KeepRunning()) {
+        CSerializeDataRef pmsg = GetBlockMessage(setup.hash, setup.pos);
+        assert(pmsg);
+    }
+}
+
+/** Read the block through a freshly opened FILE*, as every block was read before blockFileStore. */
+static void BlockReadFile(benchmark::State& state)
+{
+    BlockServeSetup setup;
+    while (state.KeepRunning()) {
+        CBlock block;
+        CAutoFile filein(OpenBlockFile(setup.pos, true), SER_DISK, CLIENT_VERSION);
+        assert(!filein.IsNull());
+        filein >> block;
+    }
+}
+
+/** Read the block through the mapping of its file. */
+static void BlockReadMapped(benchmark::State& state)
+{
+    BlockServeSetup setup;
+    while (state.KeepRunning()) {
+        CBlock block;
+        CBlockFileReader filein(blockFileStore, setup.pos, "blk", SER_DISK, CLIENT_VERSION);
+        assert(!filein.IsNull());
+        filein >> block;
+    }
+}
+
+/** Read just the first transaction of the block, where opening the file is most of the cost. */
+static void TxReadFile(benchmark::State& state)
+{
+    BlockServeSetup setup;
+    while (state.KeepRunning()) {
+        CBlockHeader header;
+        CTransaction tx;
+        CAutoFile filein(OpenBlockFile(setup.pos, true), SER_DISK, CLIENT_VERSION);
+        assert(!filein.IsNull());
+        filein >> header;
+        fseek(filein.Get(), GetSizeOfCompactSize(setup.block.vtx.size()), SEEK_CUR);
+        filein >> tx;
+    }
+}
+
+static void TxReadMapped(benchmark::State& state)
+{
+    BlockServeSetup setup;
+    while (state.KeepRunning()) {
+        CBlockHeader header;
+        CTransaction tx;
+        CBlockFileReader filein(blockFileStore, setup.pos, "blk", SER_DISK, CLIENT_VERSION);
+        assert(!filein.IsNull());
+        filein >> header;
+        filein.ignore(GetSizeOfCompactSize(setup.block.vtx.size()));
+        filein >> tx;
+    }
+}
+
+BENCHMARK(BlockServeDeserialize);
+BENCHMARK(BlockServeRaw);
+BENCHMARK(BlockServeCached);
+BENCHMARK(BlockReadFile);
+BENCHMARK(BlockReadMapped);
+BENCHMARK(TxReadFile);
+BENCHMARK(TxReadMapped);
@@ -0,0 +1,108 @@
+// Copyright (c) 2015 The Bitcoin XT developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "chain.h"
+#include "chainparams.h"
+#include "coins.h"
+#include "main.h"
+#include "miner.h"
+#include "random.h"
+#include "txmempool.h"
+#include "utiltime.h"
+
+#include <assert.h>
+
+/**
+ * A chain tip and a mempool of nTx anyone-can-spend transactions, a third
+ * of them with one or two unconfirmed ancestors, paying random fees.
+ * Installed as the node's chain and UTXO set for the lifetime of the setup.
+ */
+struct BlockTemplateSetup
+{
+    CCoinsView coinsDummy;
+    CCoinsViewCache coins;
+    std::vector<uint256> vHashes;
+    std::vector<CBlockIndex> vIndex;
+    CCoinsViewCache* pcoinsTipSaved;
+
+    BlockTemplateSetup(int nTx) : coins(&coinsDummy), vHashes(200), vIndex(200)
+    {
+        const int64_t nNow = GetTime();
+        for (size_t i = 0; i < vIndex.size(); i++) {
+            vHashes[i] = GetRandHash();
+            vIndex[i].phashBlock = &vHashes[i];
+            vIndex[i].pprev = i ? &vIndex[i - 1] : NULL;
+            vIndex[i].nHeight = i;
+            vIndex[i].nTime = nNow - 600 * (vIndex.size() - i);
+            vIndex[i].nBits = Params().GenesisBlock().nBits;
+            vIndex[i].nVersion = 4;
+            mapBlockIndex[vHashes[i]] = &vIndex[i];
+        }
+        chainActive.SetTip(&vIndex.back());
+        coins.SetBestBlock(vHashes.back());
+        pcoinsTipSaved = pcoinsTip;
+        pcoinsTip = &coins;
+
+        const CScript scriptTrue = CScript() << OP_TRUE;
+        LOCK(mempool.cs);
+        CTransaction txPrev;
+        for (int i = 0; i < nTx; i++) {
+            CTransaction txFrom = txPrev;
+            if (i % 3 == 0) {
+                // Start a new chain, spending a confirmed coin
+                CMutableTransaction funding;
+                funding.vin.resize(1);
+                funding.vin[0].prevout = COutPoint(GetRandHash(), 0);
+                funding.vout.resize(1);
+                funding.vout[0].scriptPubKey = scriptTrue;
+                funding.vout[0].nValue = 50 * COIN;
+                txFrom = funding;
+                coins.ModifyCoins(txFrom.GetHash())->FromTx(txFrom, 1);
+            }
+
+            CAmount nFee = 1000 + GetRand(50000);
+            CMutableTransaction tx;
+            tx.vin.resize(1);
+            tx.vin[0].prevout = COutPoint(txFrom.GetHash(), 0);
+            tx.vout.resize(1);
+            tx.vout[0].scriptPubKey = scriptTrue;
+            tx.vout[0].nValue = txFrom.vout[0].nValue - nFee;
+            txPrev = tx;
+            mempool.addUnchecked(txPrev.GetHash(), CTxMemPoolEntry(txPrev, nFee, nNow, 0.0, vIndex.size()));
+        }
+    }
+
+    ~BlockTemplateSetup()
+    {
+        mempool.clear();
+        pcoinsTip = pcoinsTipSaved;
+        chainActive.SetTip(NULL);
+        for (size_t i = 0; i < vHashes.size(); i++)
+            mapBlockIndex.erase(vHashes[i]);
+    }
+};
+
+/** Build a block template, as getblocktemplate does, from a mempool of nTx transactions. */
+static void BlockTemplate(benchmark::State& state, int nTx)
+{
+    BlockTemplateSetup setup(nTx);
+    const CScript scriptPubKey = CScript() << OP_TRUE;
+
+    LOCK(cs_main);
+    while (state.KeepRunning()) {
+        CBlockTemplate* pblocktemplate = CreateNewBlock(scriptPubKey);
+        assert(pblocktemplate->block.vtx.size() > 1);
+        delete pblocktemplate;
+    }
+}
+
+static void BlockTemplate_10k(benchmark::State& state) { BlockTemplate(state, 10000); }
+static void BlockTemplate_50k(benchmark::State& state) { BlockTemplate(state, 50000); }
+static void BlockTemplate_200k(benchmark::State& state) { BlockTemplate(state, 200000); }
+
+BENCHMARK(BlockTemplate_10k);
+BENCHMARK(BlockTemplate_50k);
+BENCHMARK(BlockTemplate_200k);
@@ -0,0 +1,94 @@
+// Copyright (c) 2015 The Bitcoin XT developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "bloom.h"
+#include "crypto/common.h"
+#include "net.h"
+#include "primitives/transaction.h"
+#include "random.h"
+
+#include <assert.h>
+
+/** Scripts and outpoints each filtering peer's wallet watches */
+static const int BLOOM_WALLET_ELEMENTS = 100;
+
+static std::vector<unsigned char> RandomHash160()
+{
+    uint256 hash = GetRandHash();
+    return std::vector<unsigned char>(hash.begin(), hash.begin() + 20);
+}
+
+/** A pay-to-pubkey-hash transaction spending two outputs and paying to two. */
+static CTransaction RandomTx()
+{
+    CMutableTransaction tx;
+    tx.vin.resize(2);
+    for (int i = 0; i < 2; i++) {
+        tx.vin[i].prevout = COutPoint(GetRandHash(), i);
+        tx.vin[i].scriptSig = CScript() << std::vector<unsigned char>(72, 1) << std::vector<unsigned char>(33, 2);
+    }
+    tx.vout.resize(2);
+    for (int i = 0; i < 2; i++) {
+        tx.vout[i].nValue = 50000;
+        tx.vout[i].scriptPubKey = CScript() << OP_DUP << OP_HASH160 << RandomHash160() << OP_EQUALVERIFY << OP_CHECKSIG;
+    }
+    return tx;
+}
+
+/**
+ * Relay transactions to nPeers peers that each loaded a bloom filter for a
+ * wallet of their own, as RelayTransaction does: the transaction's elements
+ * are prepared once and every filter is tested against them. Each iteration
+ * relays one transaction.
+ */
+static void BloomRelay(benchmark::State& state, int nPeers)
+{
+    std::vector<CBloomFilter> vFilters;
+    for (int i = 0; i < nPeers; i++) {
+        CBloomFilter filter(BLOOM_WALLET_ELEMENTS, 0.0001, GetRand(1 << 30), BLOOM_UPDATE_ALL);
+        for (int j = 0; j < BLOOM_WALLET_ELEMENTS; j++)
+            filter.insert(RandomHash160());
+        vFilters.push_back(filter);
+    }
+    std::vector<CTransaction> vTx;
+    for (int i = 0; i < 100; i++)
+        vTx.push_back(RandomTx());
+
+    size_t n = 0;
+    while (state.KeepRunning()) {
+        CBloomTxElements elements(vTx[n++ % vTx.size()]);
+        for (int i = 0; i < nPeers; i++)
+            vFilters[i].IsRelevantAndUpdate(elements);
+    }
+}
+
+static void BloomRelay_1(benchmark::State& state) { BloomRelay(state, 1); }
+static void BloomRelay_10(benchmark::State& state) { BloomRelay(state, 10); }
+static void BloomRelay_100(benchmark::State& state) { BloomRelay(state, 100); }
+static void BloomRelay_500(benchmark::State& state) { BloomRelay(state, 500); }
+
+/**
+ * Check whether a peer knows of a new transaction and remember that it was
+ * told, as PushInventory and SendMessages do with each peer's known
+ * inventory filter.
+ */
+static void InventoryKnown(benchmark::State& state)
+{
+    CRollingBloomFilter filter(INVENTORY_KNOWN_SIZE, 0.000001, GetRand(1 << 30));
+    uint256 hash = GetRandHash();
+    uint64_t n = 0;
+    while (state.KeepRunning()) {
+        WriteLE64(hash.begin(), n++);
+        if (!filter.contains(hash))
+            filter.insert(hash);
+    }
+}
+
+BENCHMARK(BloomRelay_1);
+BENCHMARK(BloomRelay_10);
+BENCHMARK(BloomRelay_100);
+BENCHMARK(BloomRelay_500);
+BENCHMARK(InventoryKnown);
@@ -0,0 +1,136 @@
+// Copyright (c) 2015 The Bitcoin XT developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "coins.h"
+#include "random.h"
+#include "tinyformat.h"
+
+#include <iostream>
+#include <map>
+#include <vector>
+
+/** Blocks and transactions per block in one simulated download. */
+static const int COINSCACHE_BLOCKS = 200;
+static const int COINSCACHE_TXS_PER_BLOCK = 300;
+/** The fixed -dbcache of the simulation. */
+static const size_t COINSCACHE_BUDGET = 4 << 20;
+
+/**
+ * The coin database: a map, which counts the reads that reach it. Coins
+ * are read back output by output, as from the per-outpoint database.
+ */
+class CCoinsViewCountingMap : public CCoinsView
+{
+public:
+    std::map<uint256, CCoins> mapCoins;
+    uint256 hashBestBlock;
+    mutable uint64_t nReads;
+
+    CCoinsViewCountingMap() : nReads(0) {}
+
+    bool GetCoins(const uint256& txid, CCoins& coins) const
+    {
+        nReads++;
+        std::map<uint256, CCoins>::const_iterator it = mapCoins.find(txid);
+        if (it == mapCoins.end())
+            return false;
+        coins.Clear();
+        coins.fCoinBase = it->second.fCoinBase;
+        coins.nHeight = it->second.nHeight;
+        coins.nVersion = it->second.nVersion;
+        for (unsigned int n = 0; n < it->second.vout.size(); n++) {
+            if (it->second.IsAvailable(n)) {
+                coins.vout.resize(n + 1);
+                coins.vout[n] = it->second.vout[n];
+            }
+        }
+        return true;
+    }
+
+    bool HaveCoins(const uint256& txid) const { return mapCoins.count(txid) > 0; }
+    uint256 GetBestBlock() const { return hashBestBlock; }
+
+    bool BatchWrite(CCoinsMap& mapCoinsIn, const uint256& hashBlock)
+    {
+        for (CCoinsMap::iterator it = mapCoinsIn.begin(); it != mapCoinsIn.end(); it++) {
+            if (!(it->second.flags & CCoinsCacheEntry::DIRTY))
+                continue;
+            if (it->second.coins.IsPruned())
+                mapCoins.erase(it->first);
+            else
+                mapCoins[it->first] = it->second.coins;
+        }
+        mapCoinsIn.clear();
+        hashBestBlock = hashBlock;
+        return true;
+    }
+};
+
+/**
+ * Connect blocks from an empty UTXO set through a coin cache limited to
+ * COINSCACHE_BUDGET, flushing it whenever it grows past that, as
+ * FlushStateToDisk does during the initial block download. Transactions
+ * pay to two or (now and then) twenty pay-to-pubkey-hash outputs, and spend
+ * one or two outputs: mostly recent ones, otherwise any, as on the real
+ * chain.
+ *
+ * Reports how many of the spent coins were still in the cache, and how
+ * many transactions the cache held per MiB when it was flushed. Both go up
+ * when cache entries take less memory.
+ */
+static void CoinsCacheIBD(benchmark::State& state)
+{
+    uint64_t nSpends = 0, nMisses = 0, nFlushes = 0, nCachedAtFlush = 0, nUsageAtFlush = 0;
+    while (state.KeepRunning()) {
+        CCoinsViewCountingMap base;
+        CCoinsViewCache cache(&base);
+        std::vector<COutPoint> vUnspent;
+        for (int nBlock = 0; nBlock < COINSCACHE_BLOCKS; nBlock++) {
+            for (int i = 0; i < COINSCACHE_TXS_PER_BLOCK; i++) {
+                int nInputs = vUnspent.empty() ? 0 : 1 + insecure_rand() % 2;
+                for (int j = 0; j < nInputs && !vUnspent.empty(); j++) {
+                    size_t n = vUnspent.size();
+                    size_t pos = insecure_rand() % 4 != 0 ? n - 1 - insecure_rand() % std::min<size_t>(n, 5000) : insecure_rand() % n;
+                    COutPoint prevout = vUnspent[pos];
+                    vUnspent[pos] = vUnspent.back();
+                    vUnspent.pop_back();
+
+                    uint64_t nReads = base.nReads;
+                    const CCoins* coins = cache.AccessCoins(prevout.hash);
+                    nSpends++;
+                    nMisses += base.nReads - nReads;
+                    assert(coins && coins->IsAvailable(prevout.n));
+                    cache.ModifyCoins(prevout.hash)->Spend(prevout.n);
+                }
+
+                uint256 txid = GetRandHash();
+                CCoinsModifier coins = cache.ModifyCoins(txid);
+                coins->nVersion = 1;
+                coins->nHeight = nBlock;
+                coins->vout.resize(i % 50 == 0 ? 20 : 2);
+                for (size_t n = 0; n < coins->vout.size(); n++) {
+                    coins->vout[n].nValue = 1 + insecure_rand() % 100000000;
+                    uint256 hash = GetRandHash();
+                    coins->vout[n].scriptPubKey = CScript() << OP_DUP << OP_HASH160 << std::vector<unsigned char>(hash.begin(), hash.begin() + 20) << OP_EQUALVERIFY << OP_CHECKSIG;
+                    vUnspent.push_back(COutPoint(txid, n));
+                }
+            }
+            cache.SetBestBlock(GetRandHash());
+            size_t nUsage = cache.DynamicMemoryUsage();
+            if (nUsage > COINSCACHE_BUDGET) {
+                nFlushes++;
+                nCachedAtFlush += cache.GetCacheSize();
+                nUsageAtFlush += nUsage;
+                cache.Flush();
+            }
+        }
+    }
+    if (nSpends > 0 && nFlushes > 0)
+        std::cout << strprintf("CoinsCacheIBD: %.2f%% of spent coins found in the cache, %.0f transactions cached per MiB\n",
+            100.0 * (nSpends - nMisses) / nSpends, (double)nCachedAtFlush / nUsageAtFlush * (1 << 20));
+}
+
+BENCHMARK(CoinsCacheIBD);
@@ -0,0 +1,117 @@
+// Copyright (c) 2015 The Bitcoin XT developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "coins.h"
+#include "random.h"
+#include "txdb.h"
+#include "util.h"
+#include "utiltime.h"
+
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <boost/scoped_ptr.hpp>
+
+/** Transactions in the benchmark UTXO set. */
+static const int COINSDB_TXS = 20000;
+/** Transactions with one output spent, and new transactions, per flush. */
+static const int COINSDB_SPENDS_PER_FLUSH = 2000;
+static const int COINSDB_NEW_PER_FLUSH = 200;
+
+/**
+ * An on-disk coin database in a temporary data directory, filled with
+ * transactions of 1 to 40 outputs. The LevelDB cache is kept small so that
+ * reads reflect how much of the set fits in a given -dbcache.
+ */
+struct CoinsDBSetup
+{
+    boost::filesystem::path pathTemp;
+    boost::scoped_ptr<CCoinsViewDB> db;
+    std::vector<uint256> txids;
+
+    CoinsDBSetup(int nLayout)
+    {
+        pathTemp = GetTempPath() / strprintf("bench_bitcoin_%lu_%i", (unsigned long)GetTime(), (int)GetRand(100000));
+        boost::filesystem::create_directories(pathTemp);
+        mapArgs["-datadir"] = pathTemp.string();
+        ClearDatadirCache();
+        db.reset(new CCoinsViewDB(1 << 20, false, true, nLayout));
+
+        CCoinsViewCache view(db.get());
+        for (int i = 0; i < COINSDB_TXS; i++)
+            AddTx(view);
+        view.SetBestBlock(GetRandHash());
+        view.Flush();
+    }
+
+    ~CoinsDBSetup()
+    {
+        db.reset();
+        boost::filesystem::remove_all(pathTemp);
+        mapArgs.erase("-datadir");
+        ClearDatadirCache();
+    }
+
+    void AddTx(CCoinsViewCache& view)
+    {
+        uint256 txid = GetRandHash();
+        CCoinsModifier coins = view.ModifyCoins(txid);
+        coins->nVersion = 1;
+        coins->nHeight = 1 + insecure_rand() % 300000;
+        coins->vout.resize(1 + insecure_rand() % 40);
+        for (size_t i = 0; i < coins->vout.size(); i++) {
+            coins->vout[i].nValue = 1 + insecure_rand() % 100000000;
+            coins->vout[i].scriptPubKey = CScript() << OP_DUP << OP_HASH160 << ToByteVector(GetRandHash()) << OP_EQUALVERIFY << OP_CHECKSIG;
+        }
+        txids.push_back(txid);
+    }
+
+    /** Spend one output of some transactions and add new ones, as connecting blocks does. */
+    void SpendAndFlush()
+    {
+        CCoinsViewCache view(db.get());
+        for (int i = 0; i < COINSDB_SPENDS_PER_FLUSH; i++) {
+            const uint256& txid = txids[insecure_rand() % txids.size()];
+            const CCoins* coins = view.AccessCoins(txid);
+            if (coins && !coins->IsPruned())
+                view.ModifyCoins(txid)->Spend(insecure_rand() % coins->vout.size());
+        }
+        for (int i = 0; i < COINSDB_NEW_PER_FLUSH; i++)
+            AddTx(view);
+        view.Flush();
+    }
+
+    void Fetch()
+    {
+        CCoins coins;
+        for (int i = 0; i < COINSDB_SPENDS_PER_FLUSH; i++)
+            db->GetCoins(txids[insecure_rand() % txids.size()], coins);
+    }
+};
+
+static void CoinsDBFlush(benchmark::State& state, int nLayout)
+{
+    CoinsDBSetup setup(nLayout);
+    while (state.KeepRunning())
+        setup.SpendAndFlush();
+}
+
+static void CoinsDBFetch(benchmark::State& state, int nLayout)
+{
+    CoinsDBSetup setup(nLayout);
+    while (state.KeepRunning())
+        setup.Fetch();
+}
+
+static void CoinsDBFlush_PerTxid(benchmark::State& state) { CoinsDBFlush(state, COINS_DB_PER_TXID); }
+static void CoinsDBFlush_PerOutpoint(benchmark::State& state) { CoinsDBFlush(state, COINS_DB_PER_OUTPOINT); }
+static void CoinsDBFetch_PerTxid(benchmark::State& state) { CoinsDBFetch(state, COINS_DB_PER_TXID); }
+static void CoinsDBFetch_PerOutpoint(benchmark::State& state) { CoinsDBFetch(state, COINS_DB_PER_OUTPOINT); }
+
+BENCHMARK(CoinsDBFlush_PerTxid);
+BENCHMARK(CoinsDBFlush_PerOutpoint);
+BENCHMARK(CoinsDBFetch_PerTxid);
+BENCHMARK(CoinsDBFetch_PerOutpoint);
@@ -0,0 +1,217 @@
+// Copyright (c) 2015 The Bitcoin XT developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "chain.h"
+#include "coins.h"
+#include "consensus/validation.h"
+#include "key.h"
+#include "keystore.h"
+#include "main.h"
+#include "random.h"
+#include "script/sign.h"
+#include "script/standard.h"
+#include "txdb.h"
+#include "util.h"
+#include "utiltime.h"
+
+#include <boost/filesystem.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread.hpp>
+
+/** Serialized size of the benchmark block; timings are therefore per MB. */
+static const size_t BENCH_BLOCK_SIZE = 1000000;
+
+/**
+ * A block of pay-to-pubkey-hash transactions filling BENCH_BLOCK_SIZE, with
+ * the coins it spends. Every other transaction spends an output of the one
+ * before it, so a good part of the block depends on earlier transactions.
+ */
+struct ConnectBlockSetup
+{
+    CCoinsView coinsDummy;
+    CCoinsViewCache coins;
+    CBlock block;
+    uint256 hashPrev;
+    CBlockIndex indexPrev;
+    CBlockIndex index;
+
+    ConnectBlockSetup() : coins(&coinsDummy)
+    {
+        const int nHeight = 200;
+        CBasicKeyStore keystore;
+        CKey key;
+        key.MakeNewKey(true);
+        keystore.AddKey(key);
+        CScript scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
+
+        CMutableTransaction coinbase;
+        coinbase.vin.resize(1);
+        coinbase.vin[0].scriptSig = CScript() << nHeight << OP_0;
+        coinbase.vout.resize(1);
+        coinbase.vout[0].scriptPubKey = scriptPubKey;
+        coinbase.vout[0].nValue = 0;
+        block.vtx.push_back(coinbase);
+        block.nTime = GetTime();
+
+        // The transaction count grows to three bytes once past 252 transactions.
+        size_t nSize = ::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION) + 2;
+        CTransaction txPrev;
+        for (int i = 0; ; i++) {
+            CTransaction txFrom = txPrev;
+            if (i % 2 == 0) {
+                // Spend a coin confirmed well before the block.
+                CMutableTransaction funding;
+                funding.vin.resize(1);
+                funding.vin[0].prevout = COutPoint(GetRandHash(), 0);
+                funding.vout.resize(1);
+                funding.vout[0].scriptPubKey = scriptPubKey;
+                funding.vout[0].nValue = 50 * COIN;
+                txFrom = funding;
+                coins.ModifyCoins(txFrom.GetHash())->FromTx(txFrom, 1);
+            }
+
+            CMutableTransaction tx;
+            tx.vin.resize(1);
+            tx.vin[0].prevout = COutPoint(txFrom.GetHash(), txFrom.vout.size() - 1);
+            CAmount nValue = txFrom.vout.back().nValue - 1000;
+            tx.vout.resize(2);
+            tx.vout[0].scriptPubKey = scriptPubKey;
+            tx.vout[0].nValue = nValue / 2;
+            tx.vout[1].scriptPubKey = scriptPubKey;
+            tx.vout[1].nValue = nValue - nValue / 2;
+            SignSignature(keystore, txFrom, tx, 0);
+
+            size_t nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+            if (nSize + nTxSize > BENCH_BLOCK_SIZE)
+                break;
+            nSize += nTxSize;
+            block.vtx.push_back(tx);
+            txPrev = tx;
+        }
+        block.hashMerkleRoot = block.BuildMerkleTree();
+
+        hashPrev = GetRandHash();
+        coins.SetBestBlock(hashPrev);
+        indexPrev.phashBlock = &hashPrev;
+        indexPrev.nHeight = nHeight - 1;
+        index.pprev = &indexPrev;
+        index.nHeight = nHeight;
+        index.nTime = block.nTime;
+    }
+
+    void Run(benchmark::State& state)
+    {
+        while (state.KeepRunning()) {
+            CCoinsViewCache view(&coins);
+            CValidationState validationState;
+            LOCK(cs_main);
+            bool fOk = ConnectBlock(block, validationState, &index, view, true);
+            assert(fOk);
+        }
+    }
+};
+
+/**
+ * The same block, with the coins it spends in an on-disk coin database
+ * (in a temporary data directory) and none of them cached: every coin
+ * ConnectBlock needs has to be read from LevelDB, as after a flush.
+ */
+struct ConnectBlockColdSetup : public ConnectBlockSetup
+{
+    boost::filesystem::path pathTemp;
+    boost::scoped_ptr<CCoinsViewDB> db;
+
+    ConnectBlockColdSetup()
+    {
+        pathTemp = GetTempPath() / strprintf("bench_bitcoin_%lu_%i", (unsigned long)GetTime(), (int)GetRand(100000));
+        boost::filesystem::create_directories(pathTemp);
+        mapArgs["-datadir"] = pathTemp.string();
+        ClearDatadirCache();
+        db.reset(new CCoinsViewDB(1 << 20, false, true));
+        coins.SetBackend(*db);
+        coins.Flush();
+    }
+
+    ~ConnectBlockColdSetup()
+    {
+        db.reset();
+        boost::filesystem::remove_all(pathTemp);
+        mapArgs.erase("-datadir");
+        ClearDatadirCache();
+    }
+
+    void Run(benchmark::State& state)
+    {
+        while (state.KeepRunning()) {
+            CCoinsViewCache tip(db.get());
+            CCoinsViewCache view(&tip);
+            CValidationState validationState;
+            LOCK(cs_main);
+            bool fOk = ConnectBlock(block, validationState, &index, view, true);
+            assert(fOk);
+        }
+    }
+};
+
+/** Script check threads, and coin read threads if fCoinsRead, for as many cores as there are. */
+static void StartCheckThreads(boost::thread_group& threadGroup, bool fCoinsRead)
+{
+    nScriptCheckThreads = std::max(2, std::min(MAX_SCRIPTCHECK_THREADS, (int)boost::thread::hardware_concurrency()));
+    for (int i = 0; i < nScriptCheckThreads - 1; i++) {
+        threadGroup.create_thread(&ThreadScriptCheck);
+        threadGroup.create_thread(&ThreadTxInputsCheck);
+        if (fCoinsRead)
+            threadGroup.create_thread(&ThreadCoinsRead);
+    }
+}
+
+static void StopCheckThreads(boost::thread_group& threadGroup)
+{
+    threadGroup.interrupt_all();
+    threadGroup.join_all();
+    nScriptCheckThreads = 0;
+}
+
+static void ConnectBlockSerial(benchmark::State& state)
+{
+    ConnectBlockSetup setup;
+    nScriptCheckThreads = 0;
+    setup.Run(state);
+}
+
+static void ConnectBlockParallel(benchmark::State& state)
+{
+    ConnectBlockSetup setup;
+    boost::thread_group threadGroup;
+    StartCheckThreads(threadGroup, false);
+    setup.Run(state);
+    StopCheckThreads(threadGroup);
+}
+
+/** Without coin read threads, the coins are read one at a time */
+static void ConnectBlockColdCache(benchmark::State& state)
+{
+    ConnectBlockColdSetup setup;
+    boost::thread_group threadGroup;
+    StartCheckThreads(threadGroup, false);
+    setup.Run(state);
+    StopCheckThreads(threadGroup);
+}
+
+/** The coins are read several at a time, on the coin read threads */
+static void ConnectBlockColdCachePrefetch(benchmark::State& state)
+{
+    ConnectBlockColdSetup setup;
+    boost::thread_group threadGroup;
+    StartCheckThreads(threadGroup, true);
+    setup.Run(state);
+    StopCheckThreads(threadGroup);
+}
+
+BENCHMARK(ConnectBlockSerial);
+BENCHMARK(ConnectBlockParallel);
+BENCHMARK(ConnectBlockColdCache);
+BENCHMARK(ConnectBlockColdCachePrefetch);
@@ -0,0 +1,69 @@
+// Copyright (c) 2015 The Bitcoin XT developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "crypto/sha256.h"
+#include "primitives/block.h"
+#include "random.h"
+
+#include <vector>
+
+/**
+ * SHA256 timings for each implementation SHA256AutoDetect can select. On a
+ * CPU lacking an extension the corresponding benchmark measures the fallback.
+ */
+
+static void SHA256Impl(benchmark::State& state, int nImpl)
+{
+    SHA256AutoDetect(nImpl);
+    std::vector<unsigned char> in(1000000, 0);
+    unsigned char hash[CSHA256::OUTPUT_SIZE];
+    while (state.KeepRunning())
+        CSHA256().Write(&in[0], in.size()).Finalize(hash);
+    SHA256AutoDetect();
+}
+
+static void SHA256D64Impl(benchmark::State& state, int nImpl)
+{
+    SHA256AutoDetect(nImpl);
+    std::vector<unsigned char> in(64 * 1024);
+    GetRandBytes(&in[0], in.size());
+    std::vector<unsigned char> out(32 * 1024);
+    while (state.KeepRunning())
+        SHA256D64(&out[0], &in[0], 1024);
+    SHA256AutoDetect();
+}
+
+static void SHA256_1M_Standard(benchmark::State& state) { SHA256Impl(state, 0); }
+static void SHA256_1M_SHANI(benchmark::State& state) { SHA256Impl(state, SHA256_IMPL_SHANI); }
+
+static void SHA256D64_1024_Standard(benchmark::State& state) { SHA256D64Impl(state, 0); }
+static void SHA256D64_1024_SSE41(benchmark::State& state) { SHA256D64Impl(state, SHA256_IMPL_SSE41); }
+static void SHA256D64_1024_AVX2(benchmark::State& state) { SHA256D64Impl(state, SHA256_IMPL_AVX2); }
+static void SHA256D64_1024_SHANI(benchmark::State& state) { SHA256D64Impl(state, SHA256_IMPL_SHANI); }
+static void SHA256D64_1024_Best(benchmark::State& state) { SHA256D64Impl(state, SHA256_IMPL_ALL); }
+
+/** Merkle root of a block with 2000 transactions, using the best implementation. */
+static void MerkleRoot(benchmark::State& state)
+{
+    CBlock block;
+    block.vtx.resize(2000);
+    for (size_t i = 0; i < block.vtx.size(); i++) {
+        CMutableTransaction tx;
+        tx.nLockTime = i;
+        block.vtx[i] = tx;
+    }
+    while (state.KeepRunning())
+        block.BuildMerkleTree();
+}
+
+BENCHMARK(SHA256_1M_Standard);
+BENCHMARK(SHA256_1M_SHANI);
+BENCHMARK(SHA256D64_1024_Standard);
+BENCHMARK(SHA256D64_1024_SSE41);
+BENCHMARK(SHA256D64_1024_AVX2);
+BENCHMARK(SHA256D64_1024_SHANI);
+BENCHMARK(SHA256D64_1024_Best);
+BENCHMARK(MerkleRoot);
@@ -0,0 +1,105 @@
+// Copyright (c) 2015 The Bitcoin XT developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "consensus/validation.h"
+#include "main.h"
+#include "random.h"
+#include "streams.h"
+#include "version.h"
+
+#include <assert.h>
+
+/** Serialized size of the benchmark block; timings are therefore per MB. */
+static const size_t BENCH_BLOCK_SIZE = 1000000;
+
+static std::vector<unsigned char> RandomBytes(size_t nSize)
+{
+    std::vector<unsigned char> vch(nSize);
+    for (size_t i = 0; i < nSize; i++)
+        vch[i] = insecure_rand();
+    return vch;
+}
+
+/**
+ * A block filled with the kinds of transactions found in mainnet blocks:
+ * mostly pay-to-pubkey-hash spends with one or two inputs and two outputs,
+ * every fifth a 2-of-3 multisig pay-to-script-hash spend, and every
+ * fiftieth a consolidation of twenty inputs. Signatures and keys are
+ * random bytes of the right sizes; only the layout matters here.
+ */
+static CBlock MakeMainnetStyleBlock()
+{
+    CBlock block;
+    CMutableTransaction coinbase;
+    coinbase.vin.resize(1);
+    coinbase.vin[0].scriptSig = CScript() << 400000 << RandomBytes(20);
+    coinbase.vout.resize(1);
+    coinbase.vout[0].scriptPubKey = CScript() << OP_DUP << OP_HASH160 << RandomBytes(20) << OP_EQUALVERIFY << OP_CHECKSIG;
+    coinbase.vout[0].nValue = 25 * COIN;
+    block.vtx.push_back(coinbase);
+
+    size_t nSize = ::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION) + 2;
+    for (int i = 0; ; i++) {
+        CMutableTransaction tx;
+        size_t nInputs = i % 50 == 0 ? 20 : 1 + i % 2;
+        tx.vin.resize(nInputs);
+        for (size_t j = 0; j < nInputs; j++) {
+            tx.vin[j].prevout = COutPoint(GetRandHash(), insecure_rand() % 4);
+            if (i % 5 == 0) {
+                CScript redeemScript = CScript() << OP_2 << RandomBytes(33) << RandomBytes(33) << RandomBytes(33) << OP_3 << OP_CHECKMULTISIG;
+                tx.vin[j].scriptSig = CScript() << OP_0 << RandomBytes(72) << RandomBytes(72) << ToByteVector(redeemScript);
+            } else {
+                tx.vin[j].scriptSig = CScript() << RandomBytes(72) << RandomBytes(33);
+            }
+        }
+        tx.vout.resize(2);
+        for (size_t j = 0; j < tx.vout.size(); j++) {
+            tx.vout[j].nValue = insecure_rand() % COIN;
+            if (i % 5 == 0 && j == 0)
+                tx.vout[j].scriptPubKey = CScript() << OP_HASH160 << RandomBytes(20) << OP_EQUAL;
+            else
+                tx.vout[j].scriptPubKey = CScript() << OP_DUP << OP_HASH160 << RandomBytes(20) << OP_EQUALVERIFY << OP_CHECKSIG;
+        }
+        size_t nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+        if (nSize + nTxSize > BENCH_BLOCK_SIZE)
+            break;
+        nSize += nTxSize;
+        block.vtx.push_back(tx);
+    }
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    return block;
+}
+
+/** Deserialize a block of about 1 MB, as received from a peer or read from disk. */
+static void DeserializeBlock(benchmark::State& state)
+{
+    CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
+    ssBlock << MakeMainnetStyleBlock();
+    while (state.KeepRunning()) {
+        CDataStream ss(ssBlock.begin(), ssBlock.end(), SER_NETWORK, PROTOCOL_VERSION);
+        CBlock block;
+        ss >> block;
+        assert(ss.empty());
+    }
+}
+
+/** Deserialize the block and run the context-free checks, as done before relaying it. */
+static void DeserializeAndCheckBlock(benchmark::State& state)
+{
+    CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
+    ssBlock << MakeMainnetStyleBlock();
+    while (state.KeepRunning()) {
+        CDataStream ss(ssBlock.begin(), ssBlock.end(), SER_NETWORK, PROTOCOL_VERSION);
+        CBlock block;
+        ss >> block;
+        CValidationState validationState;
+        bool fChecked = CheckBlock(block, validationState, false, true);
+        assert(fChecked);
+    }
+}
+
+BENCHMARK(DeserializeBlock);
+BENCHMARK(DeserializeAndCheckBlock);
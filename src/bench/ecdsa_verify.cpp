@@ -0,0 +1,57 @@
+// Copyright (c) 2015 The Bitcoin XT developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "ecwrapper.h"
+#include "key.h"
+#include "pubkey.h"
+#include "random.h"
+
+#include <vector>
+
+/**
+ * Signature verifications per second, through OpenSSL the way CPubKey used
+ * to verify, and through the shared libsecp256k1 context it uses now.
+ */
+
+static void SignRandom(CPubKey& pubkey, uint256& hash, std::vector<unsigned char>& vchSig)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    pubkey = key.GetPubKey();
+    hash = GetRandHash();
+    bool ret = key.Sign(hash, vchSig);
+    assert(ret);
+}
+
+static void ECDSAVerify_OpenSSL(benchmark::State& state)
+{
+    CPubKey pubkey;
+    uint256 hash;
+    std::vector<unsigned char> vchSig;
+    SignRandom(pubkey, hash, vchSig);
+
+    while (state.KeepRunning()) {
+        CECKey key;
+        bool ret = key.SetPubKey(pubkey.begin(), pubkey.size()) && key.Verify(hash, vchSig);
+        assert(ret);
+    }
+}
+
+static void ECDSAVerify_secp256k1(benchmark::State& state)
+{
+    CPubKey pubkey;
+    uint256 hash;
+    std::vector<unsigned char> vchSig;
+    SignRandom(pubkey, hash, vchSig);
+
+    while (state.KeepRunning()) {
+        bool ret = pubkey.Verify(hash, vchSig);
+        assert(ret);
+    }
+}
+
+BENCHMARK(ECDSAVerify_OpenSSL);
+BENCHMARK(ECDSAVerify_secp256k1);
@@ -0,0 +1,68 @@
+// Copyright (c) 2015 The Bitcoin XT developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "random.h"
+#include "txmempool.h"
+
+#include <list>
+
+/**
+ * A transaction spending prevout, paying nFee. One in four spends an
+ * output of the previous transaction instead, so the pool holds chains
+ * of dependent transactions too.
+ */
+static CTransaction SpamTx(const COutPoint& prevout, CAmount nFee)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = prevout;
+    tx.vin[0].scriptSig = CScript() << OP_1;
+    tx.vout.resize(2);
+    for (int i = 0; i < 2; i++) {
+        tx.vout[i].scriptPubKey = CScript() << OP_TRUE;
+        tx.vout[i].nValue = 10 * COIN - nFee;
+    }
+    return tx;
+}
+
+/**
+ * Keep a pool of nTx transactions at its size limit while transactions
+ * paying random fees keep arriving: each new one is added and the pool
+ * trimmed back, evicting the lowest fee rate packages.
+ */
+static void MempoolEviction(benchmark::State& state, int nTx)
+{
+    CTxMemPool pool(CFeeRate(1000));
+    std::list<CTransaction> removed;
+
+    COutPoint prevout;
+    int64_t nTime = 0;
+    for (int i = 0; i < nTx; i++) {
+        bool fChain = !prevout.IsNull() && GetRand(4) == 0;
+        CAmount nFee = 1000 + GetRand(50000);
+        CTransaction tx = SpamTx(fChain ? prevout : COutPoint(GetRandHash(), 0), nFee);
+        pool.addUnchecked(tx.GetHash(), CTxMemPoolEntry(tx, nFee, nTime++, 0.0, 1));
+        prevout = COutPoint(tx.GetHash(), 1);
+    }
+    const size_t nLimit = pool.GetTotalTxSize();
+
+    while (state.KeepRunning()) {
+        bool fChain = GetRand(4) == 0 && pool.exists(prevout.hash);
+        CAmount nFee = 1000 + GetRand(50000);
+        CTransaction tx = SpamTx(fChain ? prevout : COutPoint(GetRandHash(), 0), nFee);
+        pool.addUnchecked(tx.GetHash(), CTxMemPoolEntry(tx, nFee, nTime++, 0.0, 1));
+        prevout = COutPoint(tx.GetHash(), 1);
+
+        pool.TrimToSize(nLimit, removed);
+        removed.clear();
+    }
+}
+
+static void MempoolEviction_10k(benchmark::State& state) { MempoolEviction(state, 10000); }
+static void MempoolEviction_100k(benchmark::State& state) { MempoolEviction(state, 100000); }
+
+BENCHMARK(MempoolEviction_10k);
+BENCHMARK(MempoolEviction_100k);
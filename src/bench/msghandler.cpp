@@ -0,0 +1,122 @@
+// Copyright (c) 2015 The Bitcoin XT developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "chainparams.h"
+#include "main.h"
+#include "net.h"
+#include "protocol.h"
+#include "streams.h"
+#include "tinyformat.h"
+
+#include <assert.h>
+
+#include <boost/foreach.hpp>
+#include <boost/thread.hpp>
+
+/**
+ * Pings handled per iteration, spread evenly over the peers, so the time per
+ * iteration is the inverse of the message throughput.
+ */
+static const int BENCH_PINGS = 4096;
+
+static bool HasPendingMessages(CNode* pnode)
+{
+    LOCK(pnode->cs_vRecvMsg);
+    return !pnode->vRecvMsg.empty();
+}
+
+static void DiscardReceived(SOCKET hSocket)
+{
+    char buf[65536];
+    while (recv(hSocket, buf, sizeof(buf), MSG_DONTWAIT) > 0);
+}
+
+/**
+ * Feed pings from nPeers connected peers to nThreads message handler
+ * threads, the way the socket thread would, and wait until they are all
+ * answered. Each peer is a local socket pair, so replies are really sent.
+ */
+static void MessageHandler(benchmark::State& state, int nPeers, int nThreads)
+{
+    RegisterNodeSignals(GetNodeSignals());
+
+    std::vector<CNode*> vPeers;
+    std::vector<SOCKET> vRemote;
+    for (int i = 0; i < nPeers; i++) {
+        int sockets[2];
+        int ret = socketpair(AF_UNIX, SOCK_STREAM, 0, sockets);
+        assert(ret == 0);
+        vRemote.push_back(sockets[1]);
+        CNode* pnode = new CNode(sockets[0], CAddress(CService(strprintf("10.%d.%d.1", i / 256, i % 256), 8333), NODE_NETWORK));
+        pnode->nVersion = PROTOCOL_VERSION;
+        pnode->fClient = true;
+        vPeers.push_back(pnode);
+    }
+    {
+        LOCK(cs_vNodes);
+        vNodes.insert(vNodes.end(), vPeers.begin(), vPeers.end());
+    }
+
+    CDataStream ping(SER_NETWORK, PROTOCOL_VERSION);
+    ping << CMessageHeader(Params().MessageStart(), "ping", 0);
+    ping << (uint64_t)1;
+    CNetMessage::FinalizeHeader(ping);
+
+    boost::thread_group handlers;
+    for (int i = 0; i < nThreads; i++)
+        handlers.create_thread(boost::bind(&ThreadMessageHandler, i));
+
+    while (state.KeepRunning()) {
+        for (int n = 0; n < BENCH_PINGS / nPeers; n++) {
+            BOOST_FOREACH(CNode* pnode, vPeers) {
+                LOCK(pnode->cs_vRecvMsg);
+                pnode->ReceiveMsgBytes(&ping[0], ping.size());
+            }
+        }
+        BOOST_FOREACH(CNode* pnode, vPeers) {
+            while (HasPendingMessages(pnode))
+                boost::this_thread::yield();
+        }
+        // The replies are written straight to the sockets unless they are
+        // full; no socket thread sends what is left queued.
+        BOOST_FOREACH(SOCKET hSocket, vRemote)
+            DiscardReceived(hSocket);
+        BOOST_FOREACH(CNode* pnode, vPeers) {
+            LOCK(pnode->cs_vSend);
+            pnode->vSendMsg.clear();
+            pnode->nSendSize = 0;
+            pnode->nSendOffset = 0;
+        }
+    }
+
+    handlers.interrupt_all();
+    handlers.join_all();
+
+    {
+        LOCK(cs_vNodes);
+        vNodes.erase(vNodes.end() - nPeers, vNodes.end());
+    }
+    BOOST_FOREACH(CNode* pnode, vPeers)
+        delete pnode;
+    BOOST_FOREACH(SOCKET hSocket, vRemote)
+        CloseSocket(hSocket);
+
+    UnregisterNodeSignals(GetNodeSignals());
+}
+
+static void MessageHandler_1Peer_1Thread(benchmark::State& state) { MessageHandler(state, 1, 1); }
+static void MessageHandler_1Peer_4Threads(benchmark::State& state) { MessageHandler(state, 1, 4); }
+static void MessageHandler_16Peers_1Thread(benchmark::State& state) { MessageHandler(state, 16, 1); }
+static void MessageHandler_16Peers_4Threads(benchmark::State& state) { MessageHandler(state, 16, 4); }
+static void MessageHandler_256Peers_1Thread(benchmark::State& state) { MessageHandler(state, 256, 1); }
+static void MessageHandler_256Peers_4Threads(benchmark::State& state) { MessageHandler(state, 256, 4); }
+
+BENCHMARK(MessageHandler_1Peer_1Thread);
+BENCHMARK(MessageHandler_1Peer_4Threads);
+BENCHMARK(MessageHandler_16Peers_1Thread);
+BENCHMARK(MessageHandler_16Peers_4Threads);
+BENCHMARK(MessageHandler_256Peers_1Thread);
+BENCHMARK(MessageHandler_256Peers_4Threads);
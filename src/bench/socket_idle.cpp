@@ -0,0 +1,97 @@
+// Copyright (c) 2015 The Bitcoin XT developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "net.h"
+#include "util.h"
+#include "utiltime.h"
+
+#include <assert.h>
+#include <iostream>
+#include <pthread.h>
+#include <time.h>
+
+#include <boost/foreach.hpp>
+#include <boost/thread.hpp>
+
+/** Nanoseconds of CPU time used by a thread so far */
+static int64_t ThreadCPUTime(boost::thread& thread)
+{
+    clockid_t clock;
+    struct timespec ts;
+    if (pthread_getcpuclockid(thread.native_handle(), &clock) != 0 || clock_gettime(clock, &ts) != 0)
+        return 0;
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static size_t CountNodes()
+{
+    LOCK(cs_vNodes);
+    return vNodes.size();
+}
+
+/**
+ * Open nPeers loopback connections to a socket handler thread waiting with
+ * strMode, and keep them idle. Each iteration is 100ms of idling; what
+ * matters is the CPU time the socket handler spends meanwhile, printed per
+ * peer after the usual results.
+ */
+static void SocketIdle(benchmark::State& state, const std::string& strMode, int nPeers, unsigned short nPort)
+{
+    RaiseFileDescriptorLimit(2 * nPeers + 100);
+    nMaxConnections = nPeers + 16; // Room for all of them inbound
+    mapArgs["-socketevents"] = strMode;
+
+    CService addrBind("127.0.0.1", nPort);
+    std::string strError;
+    if (!BindListenPort(addrBind, strError)) {
+        std::cerr << "SocketIdle: " << strError << "\n";
+        return;
+    }
+    boost::thread handler(&ThreadSocketHandler);
+
+    struct sockaddr_storage sockaddr;
+    socklen_t len = sizeof(sockaddr);
+    addrBind.GetSockAddr((struct sockaddr*)&sockaddr, &len);
+    std::vector<SOCKET> vClients;
+    for (int i = 0; i < nPeers; i++) {
+        SOCKET hSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (hSocket == INVALID_SOCKET)
+            break;
+        if (connect(hSocket, (struct sockaddr*)&sockaddr, len) != 0) {
+            CloseSocket(hSocket);
+            break;
+        }
+        vClients.push_back(hSocket);
+    }
+    assert((int)vClients.size() == nPeers);
+    while (CountNodes() < vClients.size())
+        MilliSleep(10);
+
+    int64_t nCPUStart = ThreadCPUTime(handler);
+    int64_t nStart = GetTimeMicros();
+    while (state.KeepRunning())
+        MilliSleep(100);
+    int64_t nCPU = ThreadCPUTime(handler) - nCPUStart;
+    int64_t nElapsed = GetTimeMicros() - nStart;
+    std::cout << strprintf("%s: %.3f us CPU per idle peer per second\n", strMode,
+                           nCPU / 1000.0 / nPeers / (nElapsed / 1000000.0));
+
+    BOOST_FOREACH (SOCKET hSocket, vClients)
+        CloseSocket(hSocket);
+    while (CountNodes() > 0)
+        MilliSleep(10);
+    handler.interrupt();
+    handler.join();
+    mapArgs.erase("-socketevents");
+}
+
+static void SocketIdle_Select_400Peers(benchmark::State& state) { SocketIdle(state, "select", 400, 28411); }
+static void SocketIdle_Epoll_400Peers(benchmark::State& state) { SocketIdle(state, "epoll", 400, 28412); }
+static void SocketIdle_Epoll_4000Peers(benchmark::State& state) { SocketIdle(state, "epoll", 4000, 28413); }
+
+BENCHMARK(SocketIdle_Select_400Peers);
+BENCHMARK(SocketIdle_Epoll_400Peers);
+BENCHMARK(SocketIdle_Epoll_4000Peers);
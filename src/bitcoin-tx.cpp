@@ -9,6 +9,7 @@
 #include "core_io.h"
 #include "keystore.h"
 #include "primitives/transaction.h"
+#include "pubkey.h"
 #include "script/script.h"
 #include "script/sign.h"
 #include "univalue/univalue.h"
@@ -446,6 +447,8 @@ static void MutateTxSign(CMutableTransaction& tx, const string& flagStr)
 
 class Secp256k1Init
 {
+    ECCVerifyHandle globalVerifyHandle;
+
 public:
     Secp256k1Init() { ECC_Start(); }
     ~Secp256k1Init() { ECC_Stop(); }
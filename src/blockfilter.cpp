@@ -0,0 +1,287 @@
+// Copyright (c) 2015 The Bitcoin XT developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfilter.h"
+
+#include "crypto/common.h"
+#include "hash.h"
+#include "primitives/block.h"
+#include "script/script.h"
+#include "streams.h"
+#include "undo.h"
+#include "version.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+#include <boost/foreach.hpp>
+
+/** Parameters of the basic filter, from BIP 158 */
+static const uint8_t BASIC_FILTER_P = 19;
+static const uint32_t BASIC_FILTER_M = 784931;
+
+/** (x * n) >> 64: maps a 64-bit hash uniformly onto [0, n) without a division. */
+static uint64_t MapIntoRange(uint64_t x, uint64_t n)
+{
+    uint64_t x_hi = x >> 32, x_lo = x & 0xFFFFFFFF;
+    uint64_t n_hi = n >> 32, n_lo = n & 0xFFFFFFFF;
+
+    uint64_t ac = x_hi * n_hi;
+    uint64_t ad = x_hi * n_lo;
+    uint64_t bc = x_lo * n_hi;
+    uint64_t bd = x_lo * n_lo;
+
+    uint64_t mid34 = (bd >> 32) + (bc & 0xFFFFFFFF) + (ad & 0xFFFFFFFF);
+    return ac + (bc >> 32) + (ad >> 32) + (mid34 >> 32);
+}
+
+namespace {
+
+void AppendCompactSize(std::vector<unsigned char>& vch, uint64_t nSize)
+{
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    WriteCompactSize(stream, nSize);
+    vch.insert(vch.end(), stream.begin(), stream.end());
+}
+
+/** Appends bits to a byte vector, most significant bit first. */
+class CBitWriter
+{
+public:
+    explicit CBitWriter(std::vector<unsigned char>& vchIn) : vch(vchIn), nBuffer(0), nBits(0) {}
+
+    void Write(uint64_t data, int nCount)
+    {
+        while (nCount > 0) {
+            int nTake = std::min(8 - nBits, nCount);
+            unsigned char bits = (data >> (nCount - nTake)) & ((1 << nTake) - 1);
+            nBuffer |= bits << (8 - nBits - nTake);
+            nBits += nTake;
+            nCount -= nTake;
+            if (nBits == 8)
+                Flush();
+        }
+    }
+
+    /** Write out the last, partly filled byte. */
+    void Flush()
+    {
+        if (nBits == 0)
+            return;
+        vch.push_back(nBuffer);
+        nBuffer = 0;
+        nBits = 0;
+    }
+
+private:
+    std::vector<unsigned char>& vch;
+    unsigned char nBuffer;
+    int nBits; //!< Bits used in nBuffer
+};
+
+/** Reads bits written by CBitWriter. */
+class CBitReader
+{
+public:
+    CBitReader(const unsigned char* pbeginIn, const unsigned char* pendIn) : p(pbeginIn), pend(pendIn), nBitsLeft(0) {}
+
+    uint64_t Read(int nCount)
+    {
+        uint64_t data = 0;
+        while (nCount > 0) {
+            if (nBitsLeft == 0) {
+                if (p == pend)
+                    throw std::ios_base::failure("CBitReader::Read(): end of data");
+                nBitsLeft = 8;
+                p++;
+            }
+            int nTake = std::min(nBitsLeft, nCount);
+            data = (data << nTake) | ((p[-1] >> (nBitsLeft - nTake)) & ((1 << nTake) - 1));
+            nBitsLeft -= nTake;
+            nCount -= nTake;
+        }
+        return data;
+    }
+
+private:
+    const unsigned char* p;
+    const unsigned char* pend;
+    int nBitsLeft; //!< Bits of p[-1] not read yet
+};
+
+void GolombRiceEncode(CBitWriter& writer, uint8_t P, uint64_t x)
+{
+    // The quotient in unary, as that many ones and a zero.
+    uint64_t q = x >> P;
+    while (q > 0) {
+        int nBits = q <= 64 ? (int)q : 64;
+        writer.Write(~0ULL, nBits);
+        q -= nBits;
+    }
+    writer.Write(0, 1);
+    writer.Write(x, P);
+}
+
+uint64_t GolombRiceDecode(CBitReader& reader, uint8_t P)
+{
+    uint64_t q = 0;
+    while (reader.Read(1) == 1)
+        q++;
+    uint64_t r = reader.Read(P);
+    return (q << P) + r;
+}
+
+} // anon namespace
+
+GCSFilter::GCSFilter(const Params& paramsIn) : params(paramsIn), N(0), F(0)
+{
+    AppendCompactSize(vEncoded, 0);
+}
+
+GCSFilter::GCSFilter(const Params& paramsIn, const std::vector<unsigned char>& vEncodedIn) :
+    params(paramsIn), vEncoded(vEncodedIn)
+{
+    CDataStream stream(vEncoded, SER_NETWORK, PROTOCOL_VERSION);
+    uint64_t nElements = ReadCompactSize(stream);
+    N = (uint32_t)nElements;
+    if (N != nElements)
+        throw std::ios_base::failure("N must be less than 2^32");
+    F = (uint64_t)N * params.M;
+
+    // Check that all N elements can be read.
+    const unsigned char* pbegin = vEncoded.empty() ? NULL : &vEncoded[0];
+    CBitReader reader(pbegin + (vEncoded.size() - stream.size()), pbegin + vEncoded.size());
+    for (uint32_t i = 0; i < N; i++)
+        GolombRiceDecode(reader, params.P);
+}
+
+GCSFilter::GCSFilter(const Params& paramsIn, const ElementSet& elements) : params(paramsIn)
+{
+    N = (uint32_t)elements.size();
+    if (N != elements.size())
+        throw std::invalid_argument("N must be less than 2^32");
+    F = (uint64_t)N * params.M;
+
+    AppendCompactSize(vEncoded, N);
+    if (elements.empty())
+        return;
+
+    CBitWriter writer(vEncoded);
+    uint64_t nLast = 0;
+    std::vector<uint64_t> vHashed = BuildHashedSet(elements);
+    BOOST_FOREACH(uint64_t value, vHashed) {
+        GolombRiceEncode(writer, params.P, value - nLast);
+        nLast = value;
+    }
+    writer.Flush();
+}
+
+uint64_t GCSFilter::HashToRange(const Element& element) const
+{
+    uint64_t hash = CSipHasher(params.k0, params.k1).Write(element.empty() ? NULL : &element[0], element.size()).Finalize();
+    return MapIntoRange(hash, F);
+}
+
+std::vector<uint64_t> GCSFilter::BuildHashedSet(const ElementSet& elements) const
+{
+    std::vector<uint64_t> vHashed;
+    vHashed.reserve(elements.size());
+    BOOST_FOREACH(const Element& element, elements)
+        vHashed.push_back(HashToRange(element));
+    std::sort(vHashed.begin(), vHashed.end());
+    return vHashed;
+}
+
+bool GCSFilter::MatchInternal(const uint64_t* pElementHashes, size_t nSize) const
+{
+    CDataStream stream(vEncoded, SER_NETWORK, PROTOCOL_VERSION);
+    ReadCompactSize(stream);
+    const unsigned char* pbegin = &vEncoded[0];
+    CBitReader reader(pbegin + (vEncoded.size() - stream.size()), pbegin + vEncoded.size());
+
+    // Walk the sorted filter and the sorted queries side by side.
+    uint64_t value = 0;
+    size_t j = 0;
+    for (uint32_t i = 0; i < N; i++) {
+        value += GolombRiceDecode(reader, params.P);
+        while (true) {
+            if (j == nSize)
+                return false;
+            if (pElementHashes[j] == value)
+                return true;
+            if (pElementHashes[j] > value)
+                break;
+            j++;
+        }
+    }
+    return false;
+}
+
+bool GCSFilter::Match(const Element& element) const
+{
+    if (N == 0)
+        return false;
+    uint64_t query = HashToRange(element);
+    return MatchInternal(&query, 1);
+}
+
+bool GCSFilter::MatchAny(const ElementSet& elements) const
+{
+    if (N == 0 || elements.empty())
+        return false;
+    std::vector<uint64_t> vQueries = BuildHashedSet(elements);
+    return MatchInternal(&vQueries[0], vQueries.size());
+}
+
+GCSFilter::Params CBlockFilter::GetParams(BlockFilterType filterType, const uint256& hashBlock)
+{
+    if (filterType != BASIC_FILTER)
+        throw std::invalid_argument("unknown block filter type");
+    return GCSFilter::Params(ReadLE64(hashBlock.begin()), ReadLE64(hashBlock.begin() + 8),
+        BASIC_FILTER_P, BASIC_FILTER_M);
+}
+
+CBlockFilter::CBlockFilter(BlockFilterType filterTypeIn, const CBlock& block, const CBlockUndo& blockundo) :
+    filterType(filterTypeIn), hashBlock(block.GetHash())
+{
+    GCSFilter::ElementSet elements;
+    BOOST_FOREACH(const CTransaction& tx, block.vtx) {
+        BOOST_FOREACH(const CTxOut& txout, tx.vout) {
+            const CScript& script = txout.scriptPubKey;
+            if (script.empty() || script[0] == OP_RETURN)
+                continue;
+            elements.insert(GCSFilter::Element(script.begin(), script.end()));
+        }
+    }
+    BOOST_FOREACH(const CTxUndo& txundo, blockundo.vtxundo) {
+        BOOST_FOREACH(const CTxInUndo& txinundo, txundo.vprevout) {
+            const CScript& script = txinundo.txout.scriptPubKey;
+            if (script.empty())
+                continue;
+            elements.insert(GCSFilter::Element(script.begin(), script.end()));
+        }
+    }
+    filter = GCSFilter(GetParams(filterType, hashBlock), elements);
+}
+
+CBlockFilter::CBlockFilter(BlockFilterType filterTypeIn, const uint256& hashBlockIn, const std::vector<unsigned char>& vFilter) :
+    filterType(filterTypeIn), hashBlock(hashBlockIn), filter(GetParams(filterTypeIn, hashBlockIn), vFilter)
+{
+}
+
+uint256 CBlockFilter::GetHash() const
+{
+    const std::vector<unsigned char>& vFilter = GetEncodedFilter();
+    return Hash(vFilter.begin(), vFilter.end());
+}
+
+uint256 CBlockFilter::ComputeHeader(const uint256& hashPrevHeader) const
+{
+    return ComputeBlockFilterHeader(GetHash(), hashPrevHeader);
+}
+
+uint256 ComputeBlockFilterHeader(const uint256& hashFilter, const uint256& hashPrevHeader)
+{
+    return Hash(hashFilter.begin(), hashFilter.end(), hashPrevHeader.begin(), hashPrevHeader.end());
+}
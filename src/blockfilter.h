@@ -0,0 +1,147 @@
+// Copyright (c) 2015 The Bitcoin XT developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKFILTER_H
+#define BITCOIN_BLOCKFILTER_H
+
+#include "serialize.h"
+#include "uint256.h"
+
+#include <stdint.h>
+#include <set>
+#include <vector>
+
+class CBlock;
+class CBlockUndo;
+
+/** Default for -blockfilterindex */
+static const bool DEFAULT_BLOCKFILTERINDEX = false;
+
+/** Most filters served for one "getcfilters" request */
+static const unsigned int MAX_GETCFILTERS_SIZE = 1000;
+/** Most filter hashes served for one "getcfheaders" request */
+static const unsigned int MAX_GETCFHEADERS_SIZE = 2000;
+
+/**
+ * A Golomb-coded set: a compact, probabilistic set of byte strings, as
+ * described in BIP 158.
+ *
+ * Each of the N elements is hashed with SipHash to a number below N * M,
+ * the numbers are sorted, and the differences between neighbours are
+ * written with Golomb-Rice coding, P bits of remainder each. Testing a set
+ * of elements against the filter hashes them the same way and walks both
+ * sorted lists at once. An element that is not in the set matches with a
+ * probability of about 1/M.
+ */
+class GCSFilter
+{
+public:
+    typedef std::vector<unsigned char> Element;
+    typedef std::set<Element> ElementSet;
+
+    struct Params {
+        uint64_t k0;
+        uint64_t k1;
+        uint8_t P;  //!< Golomb-Rice coding parameter
+        uint32_t M; //!< Inverse false positive rate
+
+        Params(uint64_t k0In = 0, uint64_t k1In = 0, uint8_t PIn = 0, uint32_t MIn = 1) :
+            k0(k0In), k1(k1In), P(PIn), M(MIn) {}
+    };
+
+    /** An empty filter */
+    GCSFilter(const Params& params = Params());
+
+    /** Decode a filter; throws std::ios_base::failure if it is malformed. */
+    GCSFilter(const Params& params, const std::vector<unsigned char>& vEncoded);
+
+    /** Build the filter of a set of elements. */
+    GCSFilter(const Params& params, const ElementSet& elements);
+
+    uint32_t GetN() const { return N; }
+    const Params& GetParams() const { return params; }
+    const std::vector<unsigned char>& GetEncoded() const { return vEncoded; }
+
+    /** Whether the element may be in the set (false positives possible). */
+    bool Match(const Element& element) const;
+
+    /** Whether any of the elements may be in the set, in one pass over the filter. */
+    bool MatchAny(const ElementSet& elements) const;
+
+private:
+    Params params;
+    uint32_t N;
+    uint64_t F; //!< Range of the element hashes, N * M
+    std::vector<unsigned char> vEncoded;
+
+    uint64_t HashToRange(const Element& element) const;
+    std::vector<uint64_t> BuildHashedSet(const ElementSet& elements) const;
+    bool MatchInternal(const uint64_t* pElementHashes, size_t nSize) const;
+};
+
+enum BlockFilterType {
+    //! Output scripts of the block and scripts of the outputs it spends (BIP 158)
+    BASIC_FILTER = 0,
+};
+
+/**
+ * The filter of a block for light clients: its key is derived from the
+ * block hash. A basic filter holds every output script of the block, but
+ * for empty and OP_RETURN ones, and the scripts of all outputs it spends,
+ * taken from the undo data.
+ */
+class CBlockFilter
+{
+public:
+    CBlockFilter() : filterType(BASIC_FILTER) {}
+
+    /** Build the filter of a block being connected. */
+    CBlockFilter(BlockFilterType filterType, const CBlock& block, const CBlockUndo& blockundo);
+
+    /** Decode a filter; throws std::ios_base::failure if it is malformed. */
+    CBlockFilter(BlockFilterType filterType, const uint256& hashBlock, const std::vector<unsigned char>& vFilter);
+
+    BlockFilterType GetFilterType() const { return filterType; }
+    const uint256& GetBlockHash() const { return hashBlock; }
+    const GCSFilter& GetFilter() const { return filter; }
+    const std::vector<unsigned char>& GetEncodedFilter() const { return filter.GetEncoded(); }
+
+    /** Double SHA-256 of the encoded filter */
+    uint256 GetHash() const;
+
+    /** Header committing to this filter and to the headers of all filters before it */
+    uint256 ComputeHeader(const uint256& hashPrevHeader) const;
+
+private:
+    BlockFilterType filterType;
+    uint256 hashBlock;
+    GCSFilter filter;
+
+    static GCSFilter::Params GetParams(BlockFilterType filterType, const uint256& hashBlock);
+};
+
+/** Header of a filter with the given hash, following the header hashPrevHeader */
+uint256 ComputeBlockFilterHeader(const uint256& hashFilter, const uint256& hashPrevHeader);
+
+/** A block filter as kept in the block tree database, by block hash */
+class CDiskBlockFilter
+{
+public:
+    std::vector<unsigned char> vFilter;
+    uint256 hashHeader;
+
+    CDiskBlockFilter() {}
+    CDiskBlockFilter(const std::vector<unsigned char>& vFilterIn, const uint256& hashHeaderIn) :
+        vFilter(vFilterIn), hashHeader(hashHeaderIn) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(vFilter);
+        READWRITE(hashHeader);
+    }
+};
+
+#endif // BITCOIN_BLOCKFILTER_H
@@ -0,0 +1,183 @@
+// Copyright (c) 2015 The Bitcoin XT developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockimport.h"
+
+#include "chainparams.h"
+#include "consensus/validation.h"
+#include "main.h"
+#include "util.h"
+#include "utiltime.h"
+
+#include <boost/bind.hpp>
+
+CBlockImportPipeline::CBlockImportPipeline(FILE* fileIn, uint64_t nMaxBlockSizeIn, int nThreads) :
+    nMaxBlockSize(nMaxBlockSizeIn), nBytesQueued(0), fEof(false), fStop(false),
+    nBytesLoaded(0), nWaitTime(0)
+{
+    if (fileIn)
+        FileAdviseSequential(fileIn);
+
+    // This takes over fileIn and calls fclose() on it in the CBufferedFile destructor
+    pfile.reset(new CBufferedFile(fileIn, 2*nMaxBlockSize, nMaxBlockSize+8, SER_DISK, CLIENT_VERSION));
+
+    threads.create_thread(boost::bind(&CBlockImportPipeline::ThreadRead, this));
+    for (int i = 0; i < std::max(nThreads, 1); i++)
+        threads.create_thread(boost::bind(&CBlockImportPipeline::ThreadCheck, this));
+}
+
+CBlockImportPipeline::~CBlockImportPipeline()
+{
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        fStop = true;
+    }
+    condRead.notify_all();
+    condCheck.notify_all();
+    threads.interrupt_all();
+    threads.join_all();
+}
+
+bool CBlockImportPipeline::Enqueue(const boost::shared_ptr<CImportedBlock>& pblock)
+{
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        // Always let one block through, however large
+        while (!fStop && nBytesQueued > 0 && nBytesQueued + pblock->nSize > MAX_IMPORT_READAHEAD)
+            condRead.wait(lock);
+        if (fStop)
+            return false;
+        queueRead.push_back(pblock);
+        queueOrdered.push_back(pblock);
+        nBytesQueued += pblock->nSize;
+    }
+    condCheck.notify_one();
+    return true;
+}
+
+void CBlockImportPipeline::ThreadRead()
+{
+    RenameThread("bitcoin-loadblk-read");
+    try {
+        CBufferedFile& blkdat = *pfile;
+        uint64_t nRewind = blkdat.GetPos();
+        while (!blkdat.eof()) {
+            boost::this_thread::interruption_point();
+
+            blkdat.SetPos(nRewind);
+            nRewind++; // start one byte further next time, in case of failure
+            blkdat.SetLimit(); // remove former limit
+            unsigned int nSize = 0;
+            try {
+                // locate a header
+                unsigned char buf[MESSAGE_START_SIZE];
+                blkdat.FindByte(Params().MessageStart()[0]);
+                nRewind = blkdat.GetPos()+1;
+                blkdat >> FLATDATA(buf);
+                if (memcmp(buf, Params().MessageStart(), MESSAGE_START_SIZE))
+                    continue;
+                // read size
+                blkdat >> nSize;
+                if (nSize < 80 || nSize > nMaxBlockSize)
+                    continue;
+            } catch (const std::exception&) {
+                // no valid block header found; don't complain
+                break;
+            }
+            boost::shared_ptr<CImportedBlock> pblock(new CImportedBlock());
+            try {
+                // read the block, to be parsed by a check thread
+                uint64_t nBlockPos = blkdat.GetPos();
+                blkdat.SetLimit(nBlockPos + nSize);
+                pblock->nPos = nBlockPos;
+                pblock->nSize = nSize;
+                pblock->ssData.resize(nSize);
+                blkdat.read(&pblock->ssData[0], nSize);
+                nRewind = blkdat.GetPos();
+            } catch (const std::exception& e) {
+                LogPrintf("%s: Deserialize or I/O error - %s\n", __func__, e.what());
+                continue;
+            }
+            if (!Enqueue(pblock))
+                break;
+        }
+    } catch (const boost::thread_interrupted&) {
+        // Stopped by the destructor
+    } catch (const std::exception& e) {
+        boost::unique_lock<boost::mutex> lock(cs);
+        strError = e.what();
+    }
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        fEof = true;
+    }
+    condCheck.notify_all();
+    condReady.notify_all();
+}
+
+void CBlockImportPipeline::ThreadCheck()
+{
+    RenameThread("bitcoin-loadblk-check");
+    while (true) {
+        boost::shared_ptr<CImportedBlock> pblock;
+        {
+            boost::unique_lock<boost::mutex> lock(cs);
+            while (!fStop && !fEof && queueRead.empty())
+                condCheck.wait(lock);
+            if (fStop || queueRead.empty())
+                return;
+            pblock = queueRead.front();
+            queueRead.pop_front();
+        }
+
+        try {
+            pblock->ssData >> pblock->block;
+            pblock->hash = pblock->block.GetHash();
+            pblock->fParsed = true;
+        } catch (const std::exception& e) {
+            LogPrintf("%s: Deserialize or I/O error - %s\n", __func__, e.what());
+        }
+        // The result is kept in the block; a block failing here will fail
+        // the same way when the importer processes it.
+        if (pblock->fParsed) {
+            CValidationState state;
+            CheckBlock(pblock->block, state);
+        }
+
+        bool fOldest;
+        {
+            boost::unique_lock<boost::mutex> lock(cs);
+            pblock->fReady = true;
+            fOldest = queueOrdered.front() == pblock;
+        }
+        if (fOldest)
+            condReady.notify_all();
+    }
+}
+
+bool CBlockImportPipeline::Next(boost::shared_ptr<CImportedBlock>& pblock)
+{
+    int64_t nStart = GetTimeMicros();
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        while (queueOrdered.empty() ? !fEof : !queueOrdered.front()->fReady)
+            condReady.wait(lock);
+        nWaitTime += GetTimeMicros() - nStart;
+        if (queueOrdered.empty())
+            return false;
+        pblock = queueOrdered.front();
+        queueOrdered.pop_front();
+        nBytesQueued -= pblock->nSize;
+        nBytesLoaded += pblock->nSize;
+    }
+    condRead.notify_one();
+    return true;
+}
+
+bool CBlockImportPipeline::Failed(std::string& strErrorOut) const
+{
+    boost::unique_lock<boost::mutex> lock(cs);
+    strErrorOut = strError;
+    return !strError.empty();
+}
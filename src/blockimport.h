@@ -0,0 +1,95 @@
+// Copyright (c) 2015 The Bitcoin XT developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKIMPORT_H
+#define BITCOIN_BLOCKIMPORT_H
+
+#include "clientversion.h"
+#include "primitives/block.h"
+#include "streams.h"
+
+#include <deque>
+#include <stdio.h>
+
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+
+/** Most bytes of block data read ahead of the block being connected */
+static const uint64_t MAX_IMPORT_READAHEAD = 64 * 1000 * 1000;
+/** Maximum number of threads parsing and checking blocks during an import */
+static const int MAX_IMPORT_CHECK_THREADS = 8;
+
+/** A block found in a block file, parsed and checked ahead of being connected. */
+struct CImportedBlock
+{
+    uint64_t nPos; //! Offset of the serialized block in the file
+    unsigned int nSize;
+    CDataStream ssData; //! The serialized block
+    CBlock block;
+    uint256 hash;
+    bool fParsed; //! Whether block and hash are set
+    bool fReady; //! Whether a check thread is done with it
+
+    CImportedBlock() : nPos(0), nSize(0), ssData(SER_DISK, CLIENT_VERSION), fParsed(false), fReady(false) {}
+};
+
+/**
+ * Reads the blocks in a block file ahead of whoever imports them. One
+ * thread scans the file for block records and reads them; a pool of
+ * threads deserializes and hashes them and runs CheckBlock(), which marks
+ * the blocks as checked. What is left for the importer is the part that
+ * has to be serial: storing and connecting the blocks in file order.
+ *
+ * Readahead is bounded by MAX_IMPORT_READAHEAD. A record that fails to
+ * deserialize is skipped whole, along with anything it overlaps.
+ */
+class CBlockImportPipeline
+{
+public:
+    /** Start reading fileIn, which is closed by the pipeline when done. */
+    CBlockImportPipeline(FILE* fileIn, uint64_t nMaxBlockSize, int nThreads);
+    ~CBlockImportPipeline();
+
+    /**
+     * Wait for the next block record in file order. Returns false once the
+     * file is exhausted. Records that could not be deserialized are
+     * returned with fParsed false.
+     */
+    bool Next(boost::shared_ptr<CImportedBlock>& pblock);
+
+    //! Whether reading stopped on an I/O error, described by strError
+    bool Failed(std::string& strError) const;
+
+    //! Bytes of block data handed out by Next()
+    uint64_t GetBytesLoaded() const { return nBytesLoaded; }
+    //! Time spent in Next() waiting for the readers, in microseconds
+    int64_t GetWaitTime() const { return nWaitTime; }
+
+private:
+    boost::scoped_ptr<CBufferedFile> pfile;
+    const uint64_t nMaxBlockSize;
+
+    mutable boost::mutex cs;
+    boost::condition_variable condRead; //! Readahead has room again
+    boost::condition_variable condCheck; //! Blocks read for the check threads
+    boost::condition_variable condReady; //! The oldest block is checked
+    std::deque<boost::shared_ptr<CImportedBlock> > queueRead; //! Waiting for a check thread
+    std::deque<boost::shared_ptr<CImportedBlock> > queueOrdered; //! Everything not returned yet
+    uint64_t nBytesQueued;
+    bool fEof;
+    bool fStop;
+    std::string strError;
+
+    uint64_t nBytesLoaded;
+    int64_t nWaitTime;
+
+    boost::thread_group threads;
+
+    void ThreadRead();
+    void ThreadCheck();
+    bool Enqueue(const boost::shared_ptr<CImportedBlock>& pblock);
+};
+
+#endif // BITCOIN_BLOCKIMPORT_H
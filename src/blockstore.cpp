@@ -0,0 +1,198 @@
+// Copyright (c) 2015 The Bitcoin XT developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockstore.h"
+
+#include "main.h"
+#include "util.h"
+
+#include <algorithm>
+#include <string.h>
+
+#include <boost/filesystem.hpp>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+CBlockFileStore blockFileStore(MAX_MAPPED_BLOCK_FILES);
+
+CMappedBlockFile::~CMappedBlockFile()
+{
+#ifndef WIN32
+    munmap((void*)pbegin, nSize);
+#endif
+}
+
+void CMappedBlockFile::WillNeed(size_t nPos, size_t nLength) const
+{
+#if !defined(WIN32) && defined(MADV_WILLNEED)
+    if (nPos >= nSize)
+        return;
+    nLength = std::min(nLength, nSize - nPos);
+    static const size_t nPageSize = sysconf(_SC_PAGESIZE);
+    size_t nStart = nPos - nPos % nPageSize;
+    madvise((void*)(pbegin + nStart), nPos + nLength - nStart, MADV_WILLNEED);
+#endif
+}
+
+/** Map the whole file read-only. NULL if it's empty or can't be mapped. */
+static boost::shared_ptr<const CMappedBlockFile> MapBlockFile(const CDiskBlockPos& pos, const char* prefix)
+{
+#ifdef WIN32
+    return boost::shared_ptr<const CMappedBlockFile>();
+#else
+    boost::filesystem::path path = GetBlockPosFilename(pos, prefix);
+    int fd = open(path.string().c_str(), O_RDONLY);
+    if (fd == -1)
+        return boost::shared_ptr<const CMappedBlockFile>();
+
+    void* p = MAP_FAILED;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+        p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd); // the mapping stays valid
+    if (p == MAP_FAILED) {
+        LogPrintf("Unable to map %s\n", path.string());
+        return boost::shared_ptr<const CMappedBlockFile>();
+    }
+    return boost::shared_ptr<const CMappedBlockFile>(new CMappedBlockFile((const char*)p, st.st_size));
+#endif
+}
+
+CBlockFileStore::CBlockFileStore(size_t nMaxFilesIn) : nMaxFiles(nMaxFilesIn), nUseCounter(0)
+{
+}
+
+boost::shared_ptr<const CMappedBlockFile> CBlockFileStore::Map(const CDiskBlockPos& pos, const char* prefix)
+{
+    if (pos.IsNull())
+        return boost::shared_ptr<const CMappedBlockFile>();
+
+    LOCK(cs);
+    std::pair<std::string, int> key(prefix, pos.nFile);
+    map_type::iterator it = mapFiles.find(key);
+    if (it == mapFiles.end() || pos.nPos >= it->second.pfile->size()) {
+        // Not mapped yet, or the file grew since
+        boost::shared_ptr<const CMappedBlockFile> pfile = MapBlockFile(pos, prefix);
+        if (!pfile) {
+            if (it != mapFiles.end())
+                mapFiles.erase(it);
+            return pfile;
+        }
+        if (it == mapFiles.end()) {
+            if (mapFiles.size() >= nMaxFiles) {
+                map_type::iterator itOldest = mapFiles.begin();
+                for (map_type::iterator mi = mapFiles.begin(); mi != mapFiles.end(); ++mi)
+                    if (mi->second.nLastUsed < itOldest->second.nLastUsed)
+                        itOldest = mi;
+                mapFiles.erase(itOldest);
+            }
+            it = mapFiles.insert(std::make_pair(key, CEntry())).first;
+        }
+        it->second.pfile = pfile;
+        it->second.nLastPos = pos.nPos;
+        it->second.nAdvisedEnd = 0;
+    }
+
+    CEntry& entry = it->second;
+    entry.nLastUsed = ++nUseCounter;
+
+    // A read a little past the previous one is taken as a sequential scan
+    // (rescan, reindex, a peer downloading the chain), and the file is
+    // read ahead of it.
+    if (pos.nPos > entry.nLastPos && pos.nPos - entry.nLastPos <= BLOCKFILE_READAHEAD_SIZE &&
+        entry.nAdvisedEnd < pos.nPos + BLOCKFILE_READAHEAD_SIZE / 2) {
+        unsigned int nStart = std::max(pos.nPos, entry.nAdvisedEnd);
+        entry.pfile->WillNeed(nStart, pos.nPos + BLOCKFILE_READAHEAD_SIZE - nStart);
+        entry.nAdvisedEnd = pos.nPos + BLOCKFILE_READAHEAD_SIZE;
+    }
+    entry.nLastPos = pos.nPos;
+
+    return entry.pfile;
+}
+
+void CBlockFileStore::Forget(int nFile)
+{
+    LOCK(cs);
+    mapFiles.erase(std::make_pair(std::string("blk"), nFile));
+    mapFiles.erase(std::make_pair(std::string("rev"), nFile));
+}
+
+void CBlockFileStore::Clear()
+{
+    LOCK(cs);
+    mapFiles.clear();
+}
+
+size_t CBlockFileStore::GetMappedCount() const
+{
+    LOCK(cs);
+    return mapFiles.size();
+}
+
+CBlockFileReader::CBlockFileReader(CBlockFileStore& store, const CDiskBlockPos& pos, const char* prefixIn, int nTypeIn, int nVersionIn) :
+    nType(nTypeIn), nVersion(nVersionIn), nFile(pos.nFile), prefix(prefixIn), pcur(NULL), pend(NULL), file(NULL)
+{
+    pmapped = store.Map(pos, prefix);
+    if (pmapped) {
+        boost::system::error_code ec;
+        uint64_t nFileSize = boost::filesystem::file_size(GetBlockPosFilename(pos, prefix), ec);
+        if (ec)
+            nFileSize = 0;
+        pend = pmapped->begin() + std::min((uint64_t)pmapped->size(), nFileSize);
+        pcur = pmapped->begin() + pos.nPos;
+        if (pcur >= pend)
+            pmapped.reset();
+    }
+    if (!pmapped)
+        file = OpenDiskFile(pos, prefix, true);
+}
+
+CBlockFileReader::~CBlockFileReader()
+{
+    if (file)
+        fclose(file);
+}
+
+void CBlockFileReader::Unmap()
+{
+    CDiskBlockPos pos(nFile, pcur - pmapped->begin());
+    pmapped.reset();
+    file = OpenDiskFile(pos, prefix, true);
+}
+
+CBlockFileReader& CBlockFileReader::read(char* pch, size_t nSize)
+{
+    if (pmapped && nSize > (size_t)(pend - pcur))
+        Unmap();
+    if (pmapped) {
+        memcpy(pch, pcur, nSize);
+        pcur += nSize;
+    } else {
+        if (!file)
+            throw std::ios_base::failure("CBlockFileReader::read: file is not open");
+        if (fread(pch, 1, nSize, file) != nSize)
+            throw std::ios_base::failure(feof(file) ? "CBlockFileReader::read: end of file" : "CBlockFileReader::read: fread failed");
+    }
+    return (*this);
+}
+
+CBlockFileReader& CBlockFileReader::ignore(size_t nSize)
+{
+    if (pmapped && nSize > (size_t)(pend - pcur))
+        Unmap();
+    if (pmapped) {
+        pcur += nSize;
+    } else {
+        if (!file)
+            throw std::ios_base::failure("CBlockFileReader::ignore: file is not open");
+        if (fseek(file, nSize, SEEK_CUR))
+            throw std::ios_base::failure("CBlockFileReader::ignore: fseek failed");
+    }
+    return (*this);
+}
@@ -0,0 +1,152 @@
+// Copyright (c) 2015 The Bitcoin XT developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKSTORE_H
+#define BITCOIN_BLOCKSTORE_H
+
+#include "chain.h"
+#include "serialize.h"
+#include "sync.h"
+
+#include <ios>
+#include <map>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <utility>
+
+#include <boost/shared_ptr.hpp>
+
+/** Bytes ahead of a sequential reader that the OS is asked to read in */
+static const unsigned int BLOCKFILE_READAHEAD_SIZE = 0x400000; // 4 MiB
+/** Most block and undo files kept mapped at once */
+static const unsigned int MAX_MAPPED_BLOCK_FILES = sizeof(void*) >= 8 ? 32 : 8;
+
+/** A blk?????.dat or rev?????.dat file mapped read-only into memory */
+class CMappedBlockFile
+{
+private:
+    // Disallow copies
+    CMappedBlockFile(const CMappedBlockFile&);
+    CMappedBlockFile& operator=(const CMappedBlockFile&);
+
+    const char* pbegin;
+    size_t nSize;
+
+public:
+    CMappedBlockFile(const char* pbeginIn, size_t nSizeIn) : pbegin(pbeginIn), nSize(nSizeIn) {}
+    ~CMappedBlockFile();
+
+    const char* begin() const { return pbegin; }
+    const char* end() const { return pbegin + nSize; }
+    size_t size() const { return nSize; }
+
+    /** Ask the OS to read in [nPos, nPos + nLength) ahead of use */
+    void WillNeed(size_t nPos, size_t nLength) const;
+};
+
+/**
+ * Keeps block and undo files mapped, so that reading a block doesn't cost
+ * an fopen(), an fseek() and copies through stdio buffers. The least
+ * recently used mappings are dropped beyond nMaxFiles.
+ *
+ * Whoever resizes or deletes a file must call Forget() for it. A mapping
+ * is also redone when asked for a position past its end, as files grow.
+ * Readers hold on to the mapping they got, so dropping one never pulls
+ * data from under a reader.
+ */
+class CBlockFileStore
+{
+private:
+    struct CEntry
+    {
+        boost::shared_ptr<const CMappedBlockFile> pfile;
+        uint64_t nLastUsed;
+        unsigned int nLastPos; //! Position of the last read, to spot sequential reads
+        unsigned int nAdvisedEnd; //! End of the range already handed to WillNeed()
+    };
+    typedef std::map<std::pair<std::string, int>, CEntry> map_type;
+
+    mutable CCriticalSection cs;
+    map_type mapFiles;
+    size_t nMaxFiles;
+    uint64_t nUseCounter;
+
+public:
+    explicit CBlockFileStore(size_t nMaxFilesIn);
+
+    /**
+     * The mapping of the file holding pos, or NULL if it can't be mapped
+     * (or mmap isn't available here). Sequential reads through a file get
+     * it read ahead of them.
+     */
+    boost::shared_ptr<const CMappedBlockFile> Map(const CDiskBlockPos& pos, const char* prefix);
+    /** Drop the mappings of the blk and rev files number nFile */
+    void Forget(int nFile);
+    void Clear();
+
+    size_t GetMappedCount() const;
+};
+
+extern CBlockFileStore blockFileStore;
+
+/**
+ * Deserializes from a block or undo file starting at a position, reading
+ * from the file's mapping in a CBlockFileStore when it has one and through
+ * stdio otherwise. Reads past the end throw, as with CAutoFile.
+ *
+ * Touching a mapping past the end of its file raises SIGBUS rather than
+ * failing, so the mapping is only read up to the size the file has when
+ * the reader is made. Anything further (a file truncated behind our back,
+ * or grown since it was mapped) is read through stdio instead.
+ */
+class CBlockFileReader
+{
+private:
+    // Disallow copies
+    CBlockFileReader(const CBlockFileReader&);
+    CBlockFileReader& operator=(const CBlockFileReader&);
+
+    int nType;
+    int nVersion;
+
+    int nFile;
+    const char* prefix;
+    boost::shared_ptr<const CMappedBlockFile> pmapped;
+    const char* pcur;
+    const char* pend; //! End of what the file held when checked
+    FILE* file;
+
+    /** Carry on from the current position through stdio */
+    void Unmap();
+
+public:
+    CBlockFileReader(CBlockFileStore& store, const CDiskBlockPos& pos, const char* prefix, int nTypeIn, int nVersionIn);
+    ~CBlockFileReader();
+
+    /** Return true if the file could be neither mapped nor opened */
+    bool IsNull() const { return !pmapped && !file; }
+    bool IsMapped() const { return !!pmapped; }
+
+    //
+    // Stream subset
+    //
+    int GetType() const { return nType; }
+    int GetVersion() const { return nVersion; }
+
+    CBlockFileReader& read(char* pch, size_t nSize);
+    CBlockFileReader& ignore(size_t nSize);
+
+    template<typename T>
+    CBlockFileReader& operator>>(T& obj)
+    {
+        // Unserialize from this stream
+        if (IsNull())
+            throw std::ios_base::failure("CBlockFileReader::operator>>: file is not open");
+        ::Unserialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+};
+
+#endif // BITCOIN_BLOCKSTORE_H
@@ -5,13 +5,14 @@
 #include "bloom.h"
 
 #include "primitives/transaction.h"
-#include "hash.h"
+#include "crypto/common.h"
 #include "script/script.h"
 #include "script/standard.h"
 #include "streams.h"
 
 #include <math.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <boost/foreach.hpp>
 
@@ -20,6 +21,43 @@
 
 using namespace std;
 
+/** The data pushes of script, up to the first invalid opcode */
+static vector<CMurmurHash3Data> ScriptPushes(const CScript& script)
+{
+    vector<CMurmurHash3Data> vPushes;
+    CScript::const_iterator pc = script.begin();
+    vector<unsigned char> data;
+    while (pc < script.end())
+    {
+        opcodetype opcode;
+        if (!script.GetOp(pc, opcode, data))
+            break;
+        if (data.size() != 0)
+            vPushes.push_back(CMurmurHash3Data(data));
+    }
+    return vPushes;
+}
+
+CBloomTxElements::CBloomTxElements(const CTransaction& txIn) :
+    tx(txIn), hash(txIn.GetHash().begin(), txIn.GetHash().end())
+{
+    vOutputPushes.reserve(tx.vout.size());
+    BOOST_FOREACH(const CTxOut& txout, tx.vout)
+        vOutputPushes.push_back(ScriptPushes(txout.scriptPubKey));
+
+    vPrevouts.reserve(tx.vin.size());
+    vInputPushes.reserve(tx.vin.size());
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    {
+        // Serialized as CDataStream << COutPoint would
+        unsigned char prevout[36];
+        memcpy(prevout, txin.prevout.hash.begin(), 32);
+        WriteLE32(prevout + 32, txin.prevout.n);
+        vPrevouts.push_back(CMurmurHash3Data(prevout, prevout + 36));
+        vInputPushes.push_back(ScriptPushes(txin.scriptSig));
+    }
+}
+
 CBloomFilter::CBloomFilter(unsigned int nElements, double nFPRate, unsigned int nTweakIn, unsigned char nFlagsIn) :
     /**
      * The ideal size for a bloom filter with a given number of elements and false positive rate is:
@@ -70,6 +108,28 @@ void CBloomFilter::insert(const vector<unsigned char>& vKey)
     isEmpty = false;
 }
 
+void CBloomFilter::insert(const CMurmurHash3Data& element)
+{
+    if (isFull)
+        return;
+    const unsigned int nBits = vData.size() * 8;
+    uint32_t vSeeds[MURMURHASH3_LANES];
+    uint32_t vHashes[MURMURHASH3_LANES];
+    for (unsigned int i = 0; i < nHashFuncs; i += MURMURHASH3_LANES)
+    {
+        unsigned int nCount = min(nHashFuncs - i, MURMURHASH3_LANES);
+        for (unsigned int j = 0; j < nCount; j++)
+            vSeeds[j] = (i + j) * 0xFBA4C795 + nTweak;
+        element.Hash(vSeeds, vHashes, nCount);
+        for (unsigned int j = 0; j < nCount; j++)
+        {
+            unsigned int nIndex = vHashes[j] % nBits;
+            vData[nIndex >> 3] |= (1 << (7 & nIndex));
+        }
+    }
+    isEmpty = false;
+}
+
 void CBloomFilter::insert(const COutPoint& outpoint)
 {
     CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
@@ -114,6 +174,33 @@ bool CBloomFilter::contains(const uint256& hash) const
     return contains(data);
 }
 
+bool CBloomFilter::contains(const CMurmurHash3Data& element) const
+{
+    if (isFull)
+        return true;
+    if (isEmpty)
+        return false;
+    // Hash functions are tried a batch at a time: most elements are not in
+    // the filter and fail one of the first few.
+    const unsigned int nBits = vData.size() * 8;
+    uint32_t vSeeds[MURMURHASH3_LANES];
+    uint32_t vHashes[MURMURHASH3_LANES];
+    for (unsigned int i = 0; i < nHashFuncs; i += MURMURHASH3_LANES)
+    {
+        unsigned int nCount = min(nHashFuncs - i, MURMURHASH3_LANES);
+        for (unsigned int j = 0; j < nCount; j++)
+            vSeeds[j] = (i + j) * 0xFBA4C795 + nTweak;
+        element.Hash(vSeeds, vHashes, nCount);
+        for (unsigned int j = 0; j < nCount; j++)
+        {
+            unsigned int nIndex = vHashes[j] % nBits;
+            if (!(vData[nIndex >> 3] & (1 << (7 & nIndex))))
+                return false;
+        }
+    }
+    return true;
+}
+
 void CBloomFilter::clear()
 {
     vData.assign(vData.size(),0);
@@ -127,6 +214,15 @@ bool CBloomFilter::IsWithinSizeConstraints() const
 }
 
 bool CBloomFilter::IsRelevantAndUpdate(const CTransaction& tx)
+{
+    if (isFull)
+        return true;
+    if (isEmpty)
+        return false;
+    return IsRelevantAndUpdate(CBloomTxElements(tx));
+}
+
+bool CBloomFilter::IsRelevantAndUpdate(const CBloomTxElements& elements)
 {
     bool fFound = false;
     // Match if the filter contains the hash of tx
@@ -135,8 +231,9 @@ bool CBloomFilter::IsRelevantAndUpdate(const CTransaction& tx)
         return true;
     if (isEmpty)
         return false;
+    const CTransaction& tx = elements.tx;
     const uint256& hash = tx.GetHash();
-    if (contains(hash))
+    if (contains(elements.hash))
         fFound = true;
 
     for (unsigned int i = 0; i < tx.vout.size(); i++)
@@ -146,14 +243,9 @@ bool CBloomFilter::IsRelevantAndUpdate(const CTransaction& tx)
         // If this matches, also add the specific output that was matched.
         // This means clients don't have to update the filter themselves when a new relevant tx 
         // is discovered in order to find spending transactions, which avoids round-tripping and race conditions.
-        CScript::const_iterator pc = txout.scriptPubKey.begin();
-        vector<unsigned char> data;
-        while (pc < txout.scriptPubKey.end())
+        BOOST_FOREACH(const CMurmurHash3Data& data, elements.vOutputPushes[i])
         {
-            opcodetype opcode;
-            if (!txout.scriptPubKey.GetOp(pc, opcode, data))
-                break;
-            if (data.size() != 0 && contains(data))
+            if (contains(data))
             {
                 fFound = true;
                 if ((nFlags & BLOOM_UPDATE_MASK) == BLOOM_UPDATE_ALL)
@@ -174,21 +266,16 @@ bool CBloomFilter::IsRelevantAndUpdate(const CTransaction& tx)
     if (fFound)
         return true;
 
-    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    for (unsigned int i = 0; i < tx.vin.size(); i++)
     {
         // Match if the filter contains an outpoint tx spends
-        if (contains(txin.prevout))
+        if (contains(elements.vPrevouts[i]))
             return true;
 
         // Match if the filter contains any arbitrary script data element in any scriptSig in tx
-        CScript::const_iterator pc = txin.scriptSig.begin();
-        vector<unsigned char> data;
-        while (pc < txin.scriptSig.end())
+        BOOST_FOREACH(const CMurmurHash3Data& data, elements.vInputPushes[i])
         {
-            opcodetype opcode;
-            if (!txin.scriptSig.GetOp(pc, opcode, data))
-                break;
-            if (data.size() != 0 && contains(data))
+            if (contains(data))
                 return true;
         }
     }
@@ -220,26 +307,46 @@ CRollingBloomFilter::CRollingBloomFilter(unsigned int nElements, double fpRate,
     nInsertions = 0;
 }
 
-void CRollingBloomFilter::insert(const std::vector<unsigned char>& vKey)
+void CRollingBloomFilter::insert(const CMurmurHash3Data& element)
 {
     if (nInsertions == 0) {
         b1.clear();
     } else if (nInsertions == nBloomSize / 2) {
         b2.clear();
     }
-    b1.insert(vKey);
-    b2.insert(vKey);
+    b1.insert(element);
+    b2.insert(element);
     if (++nInsertions == nBloomSize) {
         nInsertions = 0;
     }
 }
 
-bool CRollingBloomFilter::contains(const std::vector<unsigned char>& vKey) const
+void CRollingBloomFilter::insert(const std::vector<unsigned char>& vKey)
+{
+    insert(CMurmurHash3Data(vKey));
+}
+
+void CRollingBloomFilter::insert(const uint256& hash)
+{
+    insert(CMurmurHash3Data(hash.begin(), hash.end()));
+}
+
+bool CRollingBloomFilter::contains(const CMurmurHash3Data& element) const
 {
     if (nInsertions < nBloomSize / 2) {
-        return b2.contains(vKey);
+        return b2.contains(element);
     }
-    return b1.contains(vKey);
+    return b1.contains(element);
+}
+
+bool CRollingBloomFilter::contains(const std::vector<unsigned char>& vKey) const
+{
+    return contains(CMurmurHash3Data(vKey));
+}
+
+bool CRollingBloomFilter::contains(const uint256& hash) const
+{
+    return contains(CMurmurHash3Data(hash.begin(), hash.end()));
 }
 
 void CRollingBloomFilter::clear()
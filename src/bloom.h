@@ -5,6 +5,7 @@
 #ifndef BITCOIN_BLOOM_H
 #define BITCOIN_BLOOM_H
 
+#include "hash.h"
 #include "serialize.h"
 
 #include <vector>
@@ -30,6 +31,27 @@ enum bloomflags
     BLOOM_UPDATE_MASK = 3,
 };
 
+/**
+ * The data elements of a transaction that IsRelevantAndUpdate matches bloom
+ * filters against, extracted from the transaction and prepared for hashing
+ * once, however many filters it is matched against. Refers to the
+ * transaction, which must outlive it.
+ */
+class CBloomTxElements
+{
+public:
+    const CTransaction& tx;
+    CMurmurHash3Data hash;
+    //! The data pushed by each output's scriptPubKey
+    std::vector<std::vector<CMurmurHash3Data> > vOutputPushes;
+    //! Each input's prevout, serialized
+    std::vector<CMurmurHash3Data> vPrevouts;
+    //! The data pushed by each input's scriptSig
+    std::vector<std::vector<CMurmurHash3Data> > vInputPushes;
+
+    explicit CBloomTxElements(const CTransaction& txIn);
+};
+
 /**
  * BloomFilter is a probabilistic filter which SPV clients provide
  * so that we can filter the transactions we send them.
@@ -83,10 +105,12 @@ public:
     void insert(const std::vector<unsigned char>& vKey);
     void insert(const COutPoint& outpoint);
     void insert(const uint256& hash);
+    void insert(const CMurmurHash3Data& element);
 
     bool contains(const std::vector<unsigned char>& vKey) const;
     bool contains(const COutPoint& outpoint) const;
     bool contains(const uint256& hash) const;
+    bool contains(const CMurmurHash3Data& element) const;
 
     void clear();
 
@@ -96,6 +120,8 @@ public:
 
     //! Also adds any outputs which match the filter to the filter (to match their spending txes)
     bool IsRelevantAndUpdate(const CTransaction& tx);
+    //! The same, for a transaction whose elements are prepared already, to match it against many filters
+    bool IsRelevantAndUpdate(const CBloomTxElements& elements);
 
     //! Checks for empty and full filters to avoid wasting cpu
     void UpdateEmptyFull();
@@ -114,11 +140,17 @@ public:
     CRollingBloomFilter(unsigned int nElements, double nFPRate, unsigned int nTweak);
 
     void insert(const std::vector<unsigned char>& vKey);
+    void insert(const uint256& hash);
     bool contains(const std::vector<unsigned char>& vKey) const;
+    bool contains(const uint256& hash) const;
 
     void clear();
 
 private:
+    // Both filters share their tweak, so an element is prepared once for them
+    void insert(const CMurmurHash3Data& element);
+    bool contains(const CMurmurHash3Data& element) const;
+
     unsigned int nBloomSize;
     unsigned int nInsertions;
     CBloomFilter b1, b2;
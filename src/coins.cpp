@@ -4,11 +4,15 @@
 
 #include "coins.h"
 
+#include "arith_uint256.h"
+#include "hash.h"
 #include "memusage.h"
 #include "random.h"
 
 #include <assert.h>
 
+#include <algorithm>
+
 /**
  * calculate number of bytes for the bitmask, and its number of non-zero bytes
  * each bit in the bitmask represents the availability of one output, but the
@@ -41,11 +45,47 @@ bool CCoins::Spend(uint32_t nPos)
     return true;
 }
 
+static arith_uint256 TxOutHash(const COutPoint &outpoint, const CTxOut &txout)
+{
+    CHashWriter ss(SER_GETHASH, 0);
+    ss << outpoint << txout;
+    return UintToArith256(ss.GetHash());
+}
+
+void CTxOutSetStats::AddTxOut(const COutPoint &outpoint, const CTxOut &txout)
+{
+    nTxOuts++;
+    nTotalAmount += txout.nValue;
+    nSerializedSize += ::GetSerializeSize(outpoint, SER_GETHASH, 0) + ::GetSerializeSize(txout, SER_GETHASH, 0);
+    hashTxOuts = ArithToUint256(UintToArith256(hashTxOuts) + TxOutHash(outpoint, txout));
+}
+
+void CTxOutSetStats::RemoveTxOut(const COutPoint &outpoint, const CTxOut &txout)
+{
+    nTxOuts--;
+    nTotalAmount -= txout.nValue;
+    nSerializedSize -= ::GetSerializeSize(outpoint, SER_GETHASH, 0) + ::GetSerializeSize(txout, SER_GETHASH, 0);
+    hashTxOuts = ArithToUint256(UintToArith256(hashTxOuts) - TxOutHash(outpoint, txout));
+}
+
+CTxOutSetStats& CTxOutSetStats::operator+=(const CTxOutSetStats &other)
+{
+    nTxOuts += other.nTxOuts;
+    nTotalAmount += other.nTotalAmount;
+    nSerializedSize += other.nSerializedSize;
+    hashTxOuts = ArithToUint256(UintToArith256(hashTxOuts) + UintToArith256(other.hashTxOuts));
+    return *this;
+}
+
 bool CCoinsView::GetCoins(const uint256 &txid, CCoins &coins) const { return false; }
 bool CCoinsView::HaveCoins(const uint256 &txid) const { return false; }
 uint256 CCoinsView::GetBestBlock() const { return uint256(); }
 bool CCoinsView::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) { return false; }
 bool CCoinsView::GetStats(CCoinsStats &stats) const { return false; }
+void CCoinsView::BatchRead(std::vector<CCoinsLookup> &vLookups) const {
+    BOOST_FOREACH(CCoinsLookup &lookup, vLookups)
+        lookup.fFound = GetCoins(lookup.txid, lookup.coins);
+}
 
 
 CCoinsViewBacked::CCoinsViewBacked(CCoinsView *viewIn) : base(viewIn) { }
@@ -55,6 +95,7 @@ uint256 CCoinsViewBacked::GetBestBlock() const { return base->GetBestBlock(); }
 void CCoinsViewBacked::SetBackend(CCoinsView &viewIn) { base = &viewIn; }
 bool CCoinsViewBacked::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) { return base->BatchWrite(mapCoins, hashBlock); }
 bool CCoinsViewBacked::GetStats(CCoinsStats &stats) const { return base->GetStats(stats); }
+void CCoinsViewBacked::BatchRead(std::vector<CCoinsLookup> &vLookups) const { base->BatchRead(vLookups); }
 
 CCoinsKeyHasher::CCoinsKeyHasher() : salt(GetRandHash()) {}
 
@@ -76,8 +117,11 @@ CCoinsMap::const_iterator CCoinsViewCache::FetchCoins(const uint256 &txid) const
     CCoins tmp;
     if (!base->GetCoins(txid, tmp))
         return cacheCoins.end();
+    // The view below may have grown vout past its size while reading it.
+    tmp.ShrinkToFit();
     CCoinsMap::iterator ret = cacheCoins.insert(std::make_pair(txid, CCoinsCacheEntry())).first;
     tmp.swap(ret->second.coins);
+    ret->second.nMaxOutputs = ret->second.coins.vout.size();
     if (ret->second.coins.IsPruned()) {
         // The parent only has an empty entry for this txid; we can consider our
         // version as fresh.
@@ -87,6 +131,61 @@ CCoinsMap::const_iterator CCoinsViewCache::FetchCoins(const uint256 &txid) const
     return ret;
 }
 
+void CCoinsViewCache::FetchCoinsBatch(const std::vector<uint256> &vTxid, bool fCacheMissing) const {
+    std::vector<uint256> vMissing;
+    BOOST_FOREACH(const uint256 &txid, vTxid) {
+        if (!cacheCoins.count(txid))
+            vMissing.push_back(txid);
+    }
+    if (vMissing.empty())
+        return;
+    std::sort(vMissing.begin(), vMissing.end());
+    vMissing.erase(std::unique(vMissing.begin(), vMissing.end()), vMissing.end());
+
+    std::vector<CCoinsLookup> vLookups;
+    vLookups.reserve(vMissing.size());
+    BOOST_FOREACH(const uint256 &txid, vMissing)
+        vLookups.push_back(CCoinsLookup(txid));
+    base->BatchRead(vLookups);
+
+    BOOST_FOREACH(CCoinsLookup &lookup, vLookups) {
+        if (!lookup.fFound && !fCacheMissing)
+            continue;
+        CCoinsMap::iterator ret = cacheCoins.insert(std::make_pair(lookup.txid, CCoinsCacheEntry())).first;
+        if (!lookup.fFound) {
+            // Not in the parent either: an empty entry, as ModifyCoins would create.
+            ret->second.flags = CCoinsCacheEntry::FRESH;
+            continue;
+        }
+        lookup.coins.ShrinkToFit();
+        lookup.coins.swap(ret->second.coins);
+        ret->second.nMaxOutputs = ret->second.coins.vout.size();
+        if (ret->second.coins.IsPruned())
+            ret->second.flags = CCoinsCacheEntry::FRESH;
+        cachedCoinsUsage += memusage::DynamicUsage(ret->second.coins);
+    }
+}
+
+void CCoinsViewCache::Prefetch(const std::vector<uint256> &vTxid) {
+    FetchCoinsBatch(vTxid, true);
+}
+
+void CCoinsViewCache::BatchRead(std::vector<CCoinsLookup> &vLookups) const {
+    // Whatever our child asks for ends up in this cache, as with GetCoins.
+    std::vector<uint256> vTxid;
+    vTxid.reserve(vLookups.size());
+    BOOST_FOREACH(const CCoinsLookup &lookup, vLookups)
+        vTxid.push_back(lookup.txid);
+    FetchCoinsBatch(vTxid, false);
+
+    BOOST_FOREACH(CCoinsLookup &lookup, vLookups) {
+        CCoinsMap::const_iterator it = cacheCoins.find(lookup.txid);
+        lookup.fFound = it != cacheCoins.end();
+        if (lookup.fFound)
+            lookup.coins = it->second.coins;
+    }
+}
+
 bool CCoinsViewCache::GetCoins(const uint256 &txid, CCoins &coins) const {
     CCoinsMap::const_iterator it = FetchCoins(txid);
     if (it != cacheCoins.end()) {
@@ -108,7 +207,10 @@ CCoinsModifier CCoinsViewCache::ModifyCoins(const uint256 &txid) {
         } else if (ret.first->second.coins.IsPruned()) {
             // The parent view only has a pruned entry for this; mark it as fresh.
             ret.first->second.flags = CCoinsCacheEntry::FRESH;
+        } else {
+            ret.first->second.coins.ShrinkToFit();
         }
+        ret.first->second.nMaxOutputs = ret.first->second.coins.vout.size();
     } else {
         cachedCoinUsage = memusage::DynamicUsage(ret.first->second.coins);
     }
@@ -161,6 +263,7 @@ bool CCoinsViewCache::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlockIn
                     entry.coins.swap(it->second.coins);
                     cachedCoinsUsage += memusage::DynamicUsage(entry.coins);
                     entry.flags = CCoinsCacheEntry::DIRTY | CCoinsCacheEntry::FRESH;
+                    entry.nMaxOutputs = it->second.nMaxOutputs;
                 }
             } else {
                 if ((itUs->second.flags & CCoinsCacheEntry::FRESH) && it->second.coins.IsPruned()) {
@@ -175,6 +278,10 @@ bool CCoinsViewCache::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlockIn
                     itUs->second.coins.swap(it->second.coins);
                     cachedCoinsUsage += memusage::DynamicUsage(itUs->second.coins);
                     itUs->second.flags |= CCoinsCacheEntry::DIRTY;
+                    // All outputs of an entry that was fresh in the child are new to us.
+                    if (it->second.flags & (CCoinsCacheEntry::FRESH | CCoinsCacheEntry::ADDED))
+                        itUs->second.flags |= CCoinsCacheEntry::ADDED;
+                    itUs->second.nMaxOutputs = std::max(itUs->second.nMaxOutputs, it->second.nMaxOutputs);
                 }
             }
         }
@@ -246,15 +353,49 @@ double CCoinsViewCache::GetPriority(const CTransaction &tx, int nHeight) const
     return tx.ComputePriority(dResult);
 }
 
-CCoinsModifier::CCoinsModifier(CCoinsViewCache& cache_, CCoinsMap::iterator it_, size_t usage) : cache(cache_), it(it_), cachedCoinUsage(usage) {
+CCoinsModifier::CCoinsModifier(CCoinsViewCache& cache_, CCoinsMap::iterator it_, size_t usage) : cache(cache_), it(it_), cachedCoinUsage(usage), nUnspentBefore(0), nHeightBefore(0) {
     assert(!cache.hasModifier);
     cache.hasModifier = true;
+    // Fresh entries are written whole anyway.
+    fTrackAdded = !(it->second.flags & (CCoinsCacheEntry::FRESH | CCoinsCacheEntry::ADDED));
+    if (fTrackAdded) {
+        const CCoins& coins = it->second.coins;
+        nHeightBefore = coins.nHeight;
+        if (coins.vout.size() > 64)
+            vUnspentBefore.resize(coins.vout.size());
+        for (size_t i = 0; i < coins.vout.size(); i++) {
+            if (coins.vout[i].IsNull())
+                continue;
+            if (i < 64)
+                nUnspentBefore |= (uint64_t)1 << i;
+            else
+                vUnspentBefore[i] = true;
+        }
+    }
+}
+
+bool CCoinsModifier::WasUnspent(size_t n) const {
+    if (n < 64)
+        return (nUnspentBefore >> n) & 1;
+    return n < vUnspentBefore.size() && vUnspentBefore[n];
 }
 
 CCoinsModifier::~CCoinsModifier()
 {
     assert(cache.hasModifier);
     cache.hasModifier = false;
+    // Outputs spent here may still be in the parent until the next flush.
+    it->second.nMaxOutputs = std::max<uint32_t>(it->second.nMaxOutputs, it->second.coins.vout.size());
+    // Undoing a spend adds an output back; replacing a duplicate transaction
+    // changes its height. An unspent output is never changed in place.
+    if (fTrackAdded) {
+        const CCoins& coins = it->second.coins;
+        bool fAdded = !coins.IsPruned() && coins.nHeight != nHeightBefore;
+        for (size_t i = 0; i < coins.vout.size() && !fAdded; i++)
+            fAdded = !coins.vout[i].IsNull() && !WasUnspent(i);
+        if (fAdded)
+            it->second.flags |= CCoinsCacheEntry::ADDED;
+    }
     it->second.coins.Cleanup();
     cache.cachedCoinsUsage -= cachedCoinUsage; // Subtract the old usage
     if ((it->second.flags & CCoinsCacheEntry::FRESH) && it->second.coins.IsPruned()) {
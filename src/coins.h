@@ -9,11 +9,14 @@
 #include "compressor.h"
 #include "memusage.h"
 #include "serialize.h"
+#include "support/allocators/pooled.h"
 #include "uint256.h"
 
 #include <assert.h>
 #include <stdint.h>
 
+#include <functional>
+
 #include <boost/foreach.hpp>
 #include <boost/unordered_map.hpp>
 
@@ -116,6 +119,12 @@ public:
             std::vector<CTxOut>().swap(vout);
     }
 
+    //! give back the memory of vout beyond its size, as left by Cleanup and by growing it
+    void ShrinkToFit() {
+        if (vout.capacity() > vout.size())
+            std::vector<CTxOut>(vout).swap(vout);
+    }
+
     void ClearUnspendable() {
         BOOST_FOREACH(CTxOut &txout, vout) {
             if (txout.scriptPubKey.IsUnspendable())
@@ -257,7 +266,7 @@ public:
     size_t DynamicMemoryUsage() const {
         size_t ret = memusage::DynamicUsage(vout);
         BOOST_FOREACH(const CTxOut &out, vout) {
-            const std::vector<unsigned char> *script = &out.scriptPubKey;
+            const CScriptBase *script = &out.scriptPubKey;
             ret += memusage::DynamicUsage(*script);
         }
         return ret;
@@ -286,16 +295,77 @@ struct CCoinsCacheEntry
 {
     CCoins coins; // The actual cached data.
     unsigned char flags;
+    /**
+     * The most outputs coins has had since it was fetched from the parent
+     * view. The parent has no output at or past this index, so together with
+     * ADDED a per-output database can tell what to write without reading.
+     */
+    uint32_t nMaxOutputs;
 
     enum Flags {
         DIRTY = (1 << 0), // This cache entry is potentially different from the version in the parent view.
         FRESH = (1 << 1), // The parent view does not have this entry (or it is pruned).
+        ADDED = (1 << 2), // Outputs may have been added or replaced since this entry was fetched, not just spent.
     };
 
-    CCoinsCacheEntry() : coins(), flags(0) {}
+    CCoinsCacheEntry() : coins(), flags(0), nMaxOutputs(0) {}
 };
 
-typedef boost::unordered_map<uint256, CCoinsCacheEntry, CCoinsKeyHasher> CCoinsMap;
+/**
+ * The nodes of a coin cache are allocated from a pool: with tens of millions
+ * of entries in a large cache, malloc's per-allocation overhead would
+ * otherwise take a good part of -dbcache.
+ */
+typedef boost::unordered_map<uint256, CCoinsCacheEntry, CCoinsKeyHasher, std::equal_to<uint256>,
+    pooled_allocator<std::pair<const uint256, CCoinsCacheEntry> > > CCoinsMap;
+
+/**
+ * Statistics of a set of unspent outputs that can be kept up to date one
+ * output at a time: how many outputs there are, their total value and size,
+ * and a hash of the set. The hash is the sum, modulo 2^256, of a hash of
+ * each output and its outpoint; it does not depend on the order in which
+ * outputs were added, and removing an output subtracts its hash again.
+ *
+ * The changes a block makes can be gathered in a CTxOutSetStats of their
+ * own (where the counts may be negative) and added to those of the set.
+ *
+ * The hash is for telling whether two sets are the same (on two nodes, or
+ * kept up to date and computed from scratch), not a commitment that holds
+ * against someone picking outputs to collide: a sum of hashes is much easier
+ * to collide than the hashes are.
+ */
+struct CTxOutSetStats
+{
+    int64_t nTxOuts;
+    CAmount nTotalAmount;
+    //! Serialized size of the outputs with their outpoints, whatever the layout on disk
+    int64_t nSerializedSize;
+    uint256 hashTxOuts;
+
+    CTxOutSetStats() : nTxOuts(0), nTotalAmount(0), nSerializedSize(0) {}
+
+    void AddTxOut(const COutPoint &outpoint, const CTxOut &txout);
+    void RemoveTxOut(const COutPoint &outpoint, const CTxOut &txout);
+    CTxOutSetStats& operator+=(const CTxOutSetStats &other);
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(nTxOuts);
+        READWRITE(nTotalAmount);
+        READWRITE(nSerializedSize);
+        READWRITE(hashTxOuts);
+    }
+
+    friend bool operator==(const CTxOutSetStats &a, const CTxOutSetStats &b) {
+        return a.nTxOuts == b.nTxOuts && a.nTotalAmount == b.nTotalAmount &&
+               a.nSerializedSize == b.nSerializedSize && a.hashTxOuts == b.hashTxOuts;
+    }
+    friend bool operator!=(const CTxOutSetStats &a, const CTxOutSetStats &b) {
+        return !(a == b);
+    }
+};
 
 struct CCoinsStats
 {
@@ -306,10 +376,23 @@ struct CCoinsStats
     uint64_t nSerializedSize;
     uint256 hashSerialized;
     CAmount nTotalAmount;
+    //! The same set, as CTxOutSetStats
+    CTxOutSetStats txouts;
 
     CCoinsStats() : nHeight(0), nTransactions(0), nTransactionOutputs(0), nSerializedSize(0), nTotalAmount(0) {}
 };
 
+/** One txid of a CCoinsView::BatchRead, and what was found for it */
+struct CCoinsLookup
+{
+    uint256 txid;
+    CCoins coins;
+    bool fFound;
+
+    CCoinsLookup() : fFound(false) {}
+    explicit CCoinsLookup(const uint256 &txidIn) : txid(txidIn), fFound(false) {}
+};
+
 
 /** Abstract view on the open txout dataset. */
 class CCoinsView
@@ -332,6 +415,10 @@ public:
     //! Calculate statistics about the unspent transaction output set
     virtual bool GetStats(CCoinsStats &stats) const;
 
+    //! Look up several txids at once, as GetCoins would, setting fFound and
+    //! coins of each. Views that can do the lookups concurrently override this.
+    virtual void BatchRead(std::vector<CCoinsLookup> &vLookups) const;
+
     //! As we use CCoinsViews polymorphically, have a virtual destructor
     virtual ~CCoinsView() {}
 };
@@ -351,6 +438,7 @@ public:
     void SetBackend(CCoinsView &viewIn);
     bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock);
     bool GetStats(CCoinsStats &stats) const;
+    void BatchRead(std::vector<CCoinsLookup> &vLookups) const;
 };
 
 
@@ -367,6 +455,14 @@ private:
     CCoinsViewCache& cache;
     CCoinsMap::iterator it;
     size_t cachedCoinUsage; // Cached memory usage of the CCoins object before modification
+    // Which outputs were unspent before modification (the first 64 in the
+    // mask, all of them in the vector if there are more), to tell if any
+    // were added. Only kept for entries that are not yet FRESH or ADDED.
+    bool fTrackAdded;
+    uint64_t nUnspentBefore;
+    std::vector<bool> vUnspentBefore;
+    int nHeightBefore;
+    bool WasUnspent(size_t n) const;
     CCoinsModifier(CCoinsViewCache& cache_, CCoinsMap::iterator it_, size_t usage);
 
 public:
@@ -404,6 +500,16 @@ public:
     uint256 GetBestBlock() const;
     void SetBestBlock(const uint256 &hashBlock);
     bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock);
+    void BatchRead(std::vector<CCoinsLookup> &vLookups) const;
+
+    /**
+     * Bring the given txids into the cache, reading whatever is missing from
+     * the base view in a single BatchRead. Txids the base view does not have
+     * are remembered as empty entries, so that looking them up again (as the
+     * BIP30 check and ModifyCoins do for the txids of a new block) does not
+     * go back to the base view.
+     */
+    void Prefetch(const std::vector<uint256> &vTxid);
 
     /**
      * Return a pointer to CCoins in the cache, or NULL if not found. This is
@@ -455,6 +561,7 @@ public:
 private:
     CCoinsMap::iterator FetchCoins(const uint256 &txid);
     CCoinsMap::const_iterator FetchCoins(const uint256 &txid) const;
+    void FetchCoinsBatch(const std::vector<uint256> &vTxid, bool fCacheMissing) const;
 
     /**
      * By making the copy constructor private, we prevent accidentally using it when one intends to create a cache on top of a base cache.
@@ -0,0 +1,272 @@
+// Copyright (c) 2015 The Bitcoin XT developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "coinsflush.h"
+
+#include "init.h"
+#include "txdb.h"
+#include "ui_interface.h"
+#include "util.h"
+#include "utiltime.h"
+
+#include <boost/bind.hpp>
+#include <boost/foreach.hpp>
+
+CCoinsViewFlusher::CCoinsViewFlusher(CCoinsViewDB* dbIn, bool fAsyncIn) :
+    db(dbIn), fAsync(fAsyncIn), fPending(false), fFailed(false), fStop(false),
+    nWrites(0), nLastWriteTime(0), nTotalWriteTime(0), fSaveStats(false)
+{
+    if (fAsync)
+        thread = boost::thread(boost::bind(&CCoinsViewFlusher::ThreadWrite, this));
+}
+
+CCoinsViewFlusher::~CCoinsViewFlusher()
+{
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        fStop = true;
+    }
+    condPending.notify_all();
+    // The writer finishes what it has before stopping.
+    if (thread.joinable())
+        thread.join();
+}
+
+bool CCoinsViewFlusher::GetCoins(const uint256 &txid, CCoins &coins) const
+{
+    boost::unique_lock<boost::mutex> lock(cs);
+    if (fPending) {
+        CCoinsMap::const_iterator it = mapPending.find(txid);
+        if (it != mapPending.end()) {
+            // Pruned entries are about to be erased from the database.
+            if (it->second.coins.IsPruned())
+                return false;
+            coins = it->second.coins;
+            return true;
+        }
+    }
+    return db->GetCoins(txid, coins);
+}
+
+bool CCoinsViewFlusher::HaveCoins(const uint256 &txid) const
+{
+    boost::unique_lock<boost::mutex> lock(cs);
+    if (fPending) {
+        CCoinsMap::const_iterator it = mapPending.find(txid);
+        if (it != mapPending.end())
+            return !it->second.coins.IsPruned();
+    }
+    return db->HaveCoins(txid);
+}
+
+uint256 CCoinsViewFlusher::GetBestBlock() const
+{
+    boost::unique_lock<boost::mutex> lock(cs);
+    if (fPending && !hashPending.IsNull())
+        return hashPending;
+    return db->GetBestBlock();
+}
+
+bool CCoinsViewFlusher::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock)
+{
+    boost::unique_lock<boost::mutex> lock(cs);
+    if (!WaitLocked(lock))
+        return false;
+
+    if (!fAsync) {
+        lock.unlock();
+        bool fOk = Write(mapCoins, hashBlock);
+        // The writer let go of the entries
+        ReleaseMemory();
+        return fOk;
+    }
+
+    // Take the whole map rather than copying the dirty entries out of it:
+    // the others are the same as in the database, and are skipped by the
+    // writer. The previous snapshot is done, so mapCoins gets an empty map.
+    mapPending.swap(mapCoins);
+    hashPending = hashBlock;
+    fPending = true;
+    lock.unlock();
+    condPending.notify_one();
+    return true;
+}
+
+bool CCoinsViewFlusher::GetStats(CCoinsStats &stats) const
+{
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        if (!WaitLocked(lock))
+            return false;
+    }
+    return db->GetStats(stats);
+}
+
+void CCoinsViewFlusher::BatchRead(std::vector<CCoinsLookup> &vLookups) const
+{
+    boost::unique_lock<boost::mutex> lock(cs);
+    std::vector<CCoinsLookup> vRead;
+    std::vector<size_t> vIndex;
+    for (size_t i = 0; i < vLookups.size(); i++) {
+        CCoinsLookup& lookup = vLookups[i];
+        if (fPending) {
+            CCoinsMap::const_iterator it = mapPending.find(lookup.txid);
+            if (it != mapPending.end()) {
+                lookup.fFound = !it->second.coins.IsPruned();
+                if (lookup.fFound)
+                    lookup.coins = it->second.coins;
+                continue;
+            }
+        }
+        vIndex.push_back(i);
+    }
+    if (vIndex.size() == vLookups.size()) {
+        db->BatchRead(vLookups);
+        return;
+    }
+
+    vRead.reserve(vIndex.size());
+    BOOST_FOREACH(size_t i, vIndex)
+        vRead.push_back(CCoinsLookup(vLookups[i].txid));
+    db->BatchRead(vRead);
+    for (size_t j = 0; j < vIndex.size(); j++) {
+        vLookups[vIndex[j]].fFound = vRead[j].fFound;
+        vLookups[vIndex[j]].coins.swap(vRead[j].coins);
+    }
+}
+
+bool CCoinsViewFlusher::Wait()
+{
+    boost::unique_lock<boost::mutex> lock(cs);
+    return WaitLocked(lock);
+}
+
+void CCoinsViewFlusher::SaveTxOutSetStats(const uint256& hashBlock, const CTxOutSetStats& statsIn)
+{
+    boost::unique_lock<boost::mutex> lock(cs);
+    fSaveStats = true;
+    hashStats = hashBlock;
+    stats = statsIn;
+}
+
+bool CCoinsViewFlusher::WaitLocked(boost::unique_lock<boost::mutex>& lock) const
+{
+    while (fPending && !fFailed)
+        condDone.wait(lock);
+    return !fFailed;
+}
+
+bool CCoinsViewFlusher::IsWriting() const
+{
+    boost::unique_lock<boost::mutex> lock(cs);
+    return fPending;
+}
+
+uint64_t CCoinsViewFlusher::GetWriteCount() const
+{
+    boost::unique_lock<boost::mutex> lock(cs);
+    return nWrites;
+}
+
+int64_t CCoinsViewFlusher::GetLastWriteTime() const
+{
+    boost::unique_lock<boost::mutex> lock(cs);
+    return nLastWriteTime;
+}
+
+int64_t CCoinsViewFlusher::GetTotalWriteTime() const
+{
+    boost::unique_lock<boost::mutex> lock(cs);
+    return nTotalWriteTime;
+}
+
+bool CCoinsViewFlusher::Write(CCoinsMap& mapCoins, const uint256& hashBlock)
+{
+    int64_t nStart = GetTimeMicros();
+    size_t nCount = mapCoins.size();
+    bool fOk;
+    try {
+        // Written from the caller's thread, the entries can be let go of
+        // as they are added to the batch.
+        if (fAsync)
+            fOk = db->WriteCoins(mapCoins, hashBlock);
+        else
+            fOk = db->BatchWrite(mapCoins, hashBlock);
+    } catch (const std::runtime_error& e) {
+        fOk = error("%s: %s", __func__, e.what());
+    }
+    int64_t nTime = GetTimeMicros() - nStart;
+
+    boost::unique_lock<boost::mutex> lock(cs);
+    if (fOk && fSaveStats && hashStats == hashBlock) {
+        // Only ever used for the best block of the database, so it doesn't
+        // matter that this isn't written in the same batch as the coins.
+        fSaveStats = false;
+        CTxOutSetStats statsWritten = stats;
+        lock.unlock();
+        try {
+            if (!db->WriteTxOutSetStats(hashBlock, statsWritten))
+                LogPrintf("%s: failed to save the UTXO set statistics\n", __func__);
+        } catch (const std::runtime_error& e) {
+            LogPrintf("%s: failed to save the UTXO set statistics: %s\n", __func__, e.what());
+        }
+        lock.lock();
+    }
+    nWrites++;
+    nLastWriteTime = nTime;
+    nTotalWriteTime += nTime;
+    LogPrint("bench", "- Write coin database%s: %.2fms (%u transactions) [%.2fs]\n", fAsync ? " in background" : "",
+        nTime * 0.001, (unsigned int)nCount, nTotalWriteTime * 0.000001);
+    return fOk;
+}
+
+void CCoinsViewFlusher::ReleaseMemory()
+{
+    // The cache's nodes come from a pool that keeps what is freed; a flush
+    // is when most of them are, so it is when they are worth giving back.
+    int64_t nStart = GetTimeMicros();
+    size_t nReleased = ReleasePooledMemory();
+    LogPrint("bench", "- Release coin cache memory: %.2fms (%u kB)\n", (GetTimeMicros() - nStart) * 0.001, (unsigned int)(nReleased / 1024));
+}
+
+void CCoinsViewFlusher::ThreadWrite()
+{
+    RenameThread("bitcoin-coinsflush");
+    boost::unique_lock<boost::mutex> lock(cs);
+    while (true) {
+        while (!fStop && !fPending)
+            condPending.wait(lock);
+        if (!fPending)
+            return;
+
+        // Nobody changes the snapshot while it is pending, so it can be
+        // written without holding the lock; readers only look things up.
+        lock.unlock();
+        bool fOk = Write(mapPending, hashPending);
+        lock.lock();
+
+        if (!fOk) {
+            // Keep the snapshot, so that reads still see it: blocks
+            // connected since build on it. Nothing else is written, and
+            // the node shuts down before anything relies on it being on
+            // disk; the database is left at the previous write.
+            fFailed = true;
+            condDone.notify_all();
+            lock.unlock();
+            uiInterface.ThreadSafeMessageBox(_("Error writing to the coin database, shutting down."), "", CClientUIInterface::MSG_ERROR);
+            StartShutdown();
+            return;
+        }
+        CCoinsMap mapWritten;
+        mapWritten.swap(mapPending);
+        fPending = false;
+        condDone.notify_all();
+
+        // Free the entries without blocking the readers.
+        lock.unlock();
+        mapWritten.clear();
+        ReleaseMemory();
+        lock.lock();
+    }
+}
@@ -0,0 +1,106 @@
+// Copyright (c) 2015 The Bitcoin XT developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_COINSFLUSH_H
+#define BITCOIN_COINSFLUSH_H
+
+#include "coins.h"
+
+#include <boost/thread.hpp>
+
+class CCoinsViewDB;
+
+/** Default for -asyncflush */
+static const bool DEFAULT_ASYNC_FLUSH = true;
+
+/**
+ * Writes flushed coin cache entries to the coin database from a thread of
+ * its own, so that whoever flushes (holding cs_main) does not wait for
+ * LevelDB.
+ *
+ * BatchWrite takes the entries it is given as a snapshot (swapping the
+ * map, so this is cheap however large the cache), and returns as soon as
+ * the writer thread has been told about them. Until the snapshot has been
+ * committed, reads are answered from it first, so the view always looks as
+ * if the write was already done. Only one snapshot is
+ * in flight: a BatchWrite that comes while the previous one is still being
+ * written waits for it.
+ *
+ * The snapshot and the best block it was flushed at go to the database in
+ * a single batch, so after a crash the database holds either the previous
+ * flush or this one, and its best block tells which. Blocks connected
+ * since then are connected again on startup, as for any unclean shutdown.
+ *
+ * While a write is in flight the snapshot is held in addition to the
+ * cache that keeps filling up, so the cache is flushed at half of its
+ * budget (see IsAsync). If a write fails, the snapshot stays readable, no
+ * more writes are done and the node is shut down.
+ */
+class CCoinsViewFlusher : public CCoinsView
+{
+public:
+    /** Write to db, from a thread of our own if fAsync. */
+    CCoinsViewFlusher(CCoinsViewDB* db, bool fAsync);
+    ~CCoinsViewFlusher();
+
+    bool GetCoins(const uint256 &txid, CCoins &coins) const;
+    bool HaveCoins(const uint256 &txid) const;
+    uint256 GetBestBlock() const;
+    bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock);
+    bool GetStats(CCoinsStats &stats) const;
+    void BatchRead(std::vector<CCoinsLookup> &vLookups) const;
+
+    /**
+     * Wait until nothing is left to write. Returns false (without waiting)
+     * if a write failed; the failure is also reported by the next
+     * BatchWrite.
+     */
+    bool Wait();
+
+    /**
+     * Save stats, the output statistics of the UTXO set at hashBlock, to
+     * the database once the coins at hashBlock have been written there.
+     */
+    void SaveTxOutSetStats(const uint256& hashBlock, const CTxOutSetStats& stats);
+
+    //! Whether writes are done in the background, so that a flushed cache
+    //! is still held while the next one fills up
+    bool IsAsync() const { return fAsync; }
+    //! Whether a snapshot is being written
+    bool IsWriting() const;
+    //! Number of writes done
+    uint64_t GetWriteCount() const;
+    //! How long the last write took, in microseconds
+    int64_t GetLastWriteTime() const;
+    //! Time spent writing since startup, in microseconds
+    int64_t GetTotalWriteTime() const;
+
+private:
+    CCoinsViewDB* db;
+    const bool fAsync;
+
+    mutable boost::mutex cs;
+    boost::condition_variable condPending; //! A snapshot is waiting for the writer
+    mutable boost::condition_variable condDone; //! The snapshot has been written
+    CCoinsMap mapPending; //! Entries being written, not committed yet
+    uint256 hashPending;
+    bool fPending;
+    bool fFailed;
+    bool fStop;
+    uint64_t nWrites;
+    int64_t nLastWriteTime;
+    int64_t nTotalWriteTime;
+    bool fSaveStats;
+    uint256 hashStats;
+    CTxOutSetStats stats;
+
+    boost::thread thread;
+
+    void ThreadWrite();
+    bool Write(CCoinsMap& mapCoins, const uint256& hashBlock);
+    bool WaitLocked(boost::unique_lock<boost::mutex>& lock) const;
+    void ReleaseMemory();
+};
+
+#endif // BITCOIN_COINSFLUSH_H
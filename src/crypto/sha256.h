@@ -7,6 +7,7 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <string>
 
 /** A hasher class for SHA-256. */
 class CSHA256
@@ -25,4 +26,25 @@ public:
     CSHA256& Reset();
 };
 
+/** SHA-256 implementations that SHA256AutoDetect may choose from, as a bit mask. */
+enum
+{
+    SHA256_IMPL_SSE41 = (1 << 0),
+    SHA256_IMPL_AVX2 = (1 << 1),
+    SHA256_IMPL_SHANI = (1 << 2),
+    SHA256_IMPL_ALL = SHA256_IMPL_SSE41 | SHA256_IMPL_AVX2 | SHA256_IMPL_SHANI,
+};
+
+/** Autodetect the best available SHA256 implementation, limited to the ones
+ *  in nAllowed. Returns a description of the implementation in use.
+ */
+std::string SHA256AutoDetect(int nAllowed = SHA256_IMPL_ALL);
+
+/** Compute multiple double-SHA256's of 64-byte blobs.
+ *  output:  pointer to a blocks*32 byte output buffer
+ *  input:   pointer to a blocks*64 byte input buffer
+ *  blocks:  the number of hashes to compute.
+ */
+void SHA256D64(unsigned char* output, const unsigned char* input, size_t blocks);
+
 #endif // BITCOIN_CRYPTO_SHA256_H
@@ -72,6 +72,142 @@ unsigned int MurmurHash3(unsigned int nHashSeed, const std::vector<unsigned char
     return h1;
 }
 
+static inline uint32_t MurmurHash3MixBlock(uint32_t k1)
+{
+    k1 *= 0xcc9e2d51;
+    k1 = ROTL32(k1, 15);
+    k1 *= 0x1b873593;
+    return k1;
+}
+
+CMurmurHash3Data::CMurmurHash3Data(const unsigned char* pbegin, const unsigned char* pend) :
+    nSize(pend - pbegin), fTail((pend - pbegin) & 3)
+{
+    vBlocks.reserve((nSize + 3) / 4);
+    for (; pend - pbegin >= 4; pbegin += 4)
+        vBlocks.push_back(MurmurHash3MixBlock(ReadLE32(pbegin)));
+    if (fTail) {
+        uint32_t k1 = 0;
+        for (int i = pend - pbegin - 1; i >= 0; i--)
+            k1 = (k1 << 8) | pbegin[i];
+        vBlocks.push_back(MurmurHash3MixBlock(k1));
+    }
+}
+
+CMurmurHash3Data::CMurmurHash3Data(const std::vector<unsigned char>& vData)
+{
+    const unsigned char* pbegin = vData.empty() ? NULL : &vData[0];
+    *this = CMurmurHash3Data(pbegin, pbegin + vData.size());
+}
+
+uint32_t CMurmurHash3Data::Hash(uint32_t nSeed) const
+{
+    uint32_t nHash;
+    Hash(&nSeed, &nHash, 1);
+    return nHash;
+}
+
+void CMurmurHash3Data::Hash(const uint32_t* pSeeds, uint32_t* pHashes, unsigned int nCount) const
+{
+    const size_t nBlocks = vBlocks.size() - (fTail ? 1 : 0);
+    for (unsigned int i = 0; i < nCount; i += MURMURHASH3_LANES) {
+        // The same operations for every lane, so that the compiler can
+        // keep the lanes in one vector register.
+        uint32_t h[MURMURHASH3_LANES];
+        for (unsigned int l = 0; l < MURMURHASH3_LANES; l++)
+            h[l] = i + l < nCount ? pSeeds[i + l] : 0;
+
+        for (size_t j = 0; j < nBlocks; j++) {
+            const uint32_t k1 = vBlocks[j];
+            for (unsigned int l = 0; l < MURMURHASH3_LANES; l++) {
+                h[l] ^= k1;
+                h[l] = ROTL32(h[l], 13);
+                h[l] = h[l] * 5 + 0xe6546b64;
+            }
+        }
+        const uint32_t k1 = fTail ? vBlocks.back() : 0;
+        for (unsigned int l = 0; l < MURMURHASH3_LANES; l++) {
+            h[l] ^= k1;
+            h[l] ^= nSize;
+            h[l] ^= h[l] >> 16;
+            h[l] *= 0x85ebca6b;
+            h[l] ^= h[l] >> 13;
+            h[l] *= 0xc2b2ae35;
+            h[l] ^= h[l] >> 16;
+        }
+
+        for (unsigned int l = 0; l < MURMURHASH3_LANES && i + l < nCount; l++)
+            pHashes[i + l] = h[l];
+    }
+}
+
+#define ROTL(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND do { \
+    v0 += v1; v1 = ROTL(v1, 13); v1 ^= v0; \
+    v0 = ROTL(v0, 32); \
+    v2 += v3; v3 = ROTL(v3, 16); v3 ^= v2; \
+    v0 += v3; v3 = ROTL(v3, 21); v3 ^= v0; \
+    v2 += v1; v1 = ROTL(v1, 17); v1 ^= v2; \
+    v2 = ROTL(v2, 32); \
+} while (0)
+
+CSipHasher::CSipHasher(uint64_t k0, uint64_t k1)
+{
+    v[0] = 0x736f6d6570736575ULL ^ k0;
+    v[1] = 0x646f72616e646f6dULL ^ k1;
+    v[2] = 0x6c7967656e657261ULL ^ k0;
+    v[3] = 0x7465646279746573ULL ^ k1;
+    count = 0;
+    tmp = 0;
+}
+
+CSipHasher& CSipHasher::Write(const unsigned char* data, size_t size)
+{
+    uint64_t v0 = v[0], v1 = v[1], v2 = v[2], v3 = v[3];
+    uint64_t t = tmp;
+    int c = count;
+
+    while (size--) {
+        t |= ((uint64_t)(*(data++))) << (8 * (c % 8));
+        c++;
+        if ((c & 7) == 0) {
+            v3 ^= t;
+            SIPROUND;
+            SIPROUND;
+            v0 ^= t;
+            t = 0;
+        }
+    }
+
+    v[0] = v0;
+    v[1] = v1;
+    v[2] = v2;
+    v[3] = v3;
+    count = c;
+    tmp = t;
+
+    return *this;
+}
+
+uint64_t CSipHasher::Finalize() const
+{
+    uint64_t v0 = v[0], v1 = v[1], v2 = v[2], v3 = v[3];
+
+    uint64_t t = tmp | (((uint64_t)count) << 56);
+
+    v3 ^= t;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= t;
+    v2 ^= 0xFF;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
 void BIP32Hash(const ChainCode &chainCode, unsigned int nChild, unsigned char header, const unsigned char data[32], unsigned char output[64])
 {
     unsigned char num[4];
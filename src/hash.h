@@ -166,6 +166,49 @@ uint256 SerializeHash(const T& obj, int nType=SER_GETHASH, int nVersion=PROTOCOL
 
 unsigned int MurmurHash3(unsigned int nHashSeed, const std::vector<unsigned char>& vDataToHash);
 
+/** Seeds CMurmurHash3Data::Hash works on side by side */
+static const unsigned int MURMURHASH3_LANES = 4;
+
+/**
+ * Data prepared to be hashed with MurmurHash3 under many seeds, as bloom
+ * filters do. Mixing the data's blocks does not depend on the seed, so it
+ * is done once here; hashing is then a short chain of operations per block
+ * and seed, run for MURMURHASH3_LANES seeds at a time.
+ */
+class CMurmurHash3Data
+{
+private:
+    std::vector<uint32_t> vBlocks; //! Mixed blocks, the partial block last
+    uint32_t nSize;
+    bool fTail; //! Whether the last block is a partial one
+
+public:
+    CMurmurHash3Data(const unsigned char* pbegin, const unsigned char* pend);
+    explicit CMurmurHash3Data(const std::vector<unsigned char>& vData);
+
+    /** MurmurHash3(nSeed, data) */
+    uint32_t Hash(uint32_t nSeed) const;
+    /** MurmurHash3 of the data under nCount seeds */
+    void Hash(const uint32_t* pSeeds, uint32_t* pHashes, unsigned int nCount) const;
+};
+
+/** SipHash-2-4, a keyed 64-bit hash. */
+class CSipHasher
+{
+private:
+    uint64_t v[4];
+    uint64_t tmp;
+    int count;
+
+public:
+    /** Construct a SipHash calculator initialized with 128-bit key (k0, k1) */
+    CSipHasher(uint64_t k0, uint64_t k1);
+    /** Hash arbitrary bytes. */
+    CSipHasher& Write(const unsigned char* data, size_t size);
+    /** Compute the 64-bit SipHash-2-4 of the data written so far. The object remains untouched. */
+    uint64_t Finalize() const;
+};
+
 void BIP32Hash(const ChainCode &chainCode, unsigned int nChild, unsigned char header, const unsigned char data[32], unsigned char output[64]);
 
 #endif // BITCOIN_HASH_H
@@ -11,17 +11,26 @@
 
 #include "addrman.h"
 #include "amount.h"
+#include "blockfilter.h"
 #include "checkpoints.h"
 #include "compat/sanity.h"
+#include "coinsflush.h"
 #include "consensus/validation.h"
+#include "crypto/sha256.h"
 #include "key.h"
 #include "main.h"
 #include "miner.h"
 #include "net.h"
+#include "pubkey.h"
+#include "rawblockcache.h"
+#include "relaycache.h"
 #include "rpcserver.h"
+#include "script/sigcache.h"
 #include "script/standard.h"
 #include "scheduler.h"
+#include "thinblock.h"
 #include "txdb.h"
+#include "txoutsetstats.h"
 #include "ui_interface.h"
 #include "util.h"
 #include "utilmoneystr.h"
@@ -44,6 +53,7 @@
 #include <boost/filesystem.hpp>
 #include <boost/function.hpp>
 #include <boost/interprocess/sync/file_lock.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <boost/thread.hpp>
 #include <openssl/crypto.h>
 
@@ -132,11 +142,22 @@ public:
             abort();
         }
     }
+    void BatchRead(std::vector<CCoinsLookup> &vLookups) const {
+        try {
+            CCoinsViewBacked::BatchRead(vLookups);
+        } catch(const std::runtime_error& e) {
+            // Same as for GetCoins.
+            uiInterface.ThreadSafeMessageBox(_("Error reading from database, shutting down."), "", CClientUIInterface::MSG_ERROR);
+            LogPrintf("Error reading from database: %s\n", e.what());
+            abort();
+        }
+    }
     // Writes do not need similar protection, as failure to write is handled by the caller.
 };
 
 static CCoinsViewDB *pcoinsdbview = NULL;
 static CCoinsViewErrorCatcher *pcoinscatcher = NULL;
+static boost::scoped_ptr<ECCVerifyHandle> globalVerifyHandle;
 
 void Shutdown()
 {
@@ -181,6 +202,8 @@ void Shutdown()
         pcoinsTip = NULL;
         delete pcoinscatcher;
         pcoinscatcher = NULL;
+        delete pcoinsflusher;
+        pcoinsflusher = NULL;
         delete pcoinsdbview;
         pcoinsdbview = NULL;
         delete pblocktree;
@@ -202,6 +225,7 @@ void Shutdown()
     delete pwalletMain;
     pwalletMain = NULL;
 #endif
+    globalVerifyHandle.reset();
     ECC_Stop();
     LogPrintf("%s: done\n", __func__);
 }
@@ -269,9 +293,13 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-?", _("This help message"));
     strUsage += HelpMessageOpt("-alerts", strprintf(_("Receive and display P2P network alerts (default: %u)"), DEFAULT_ALERTS));
     strUsage += HelpMessageOpt("-alertnotify=<cmd>", _("Execute command when a relevant alert is received or we see a really long fork (%s in cmd is replaced by message)"));
+    strUsage += HelpMessageOpt("-asyncflush", strprintf(_("Write the coin cache to disk in the background while blocks keep being connected. The cache then gets half of its share of -dbcache, the write in progress the other half (default: %u)"), DEFAULT_ASYNC_FLUSH));
+    strUsage += HelpMessageOpt("-blockfilterindex", strprintf(_("Maintain a compact filter of every block and serve the filters to light clients (default: %u)"), DEFAULT_BLOCKFILTERINDEX));
     strUsage += HelpMessageOpt("-blocknotify=<cmd>", _("Execute command when the best block changes (%s in cmd is replaced by block hash)"));
     strUsage += HelpMessageOpt("-checkblocks=<n>", strprintf(_("How many blocks to check at startup (default: %u, 0 = all)"), 288));
     strUsage += HelpMessageOpt("-checklevel=<n>", strprintf(_("How thorough the block verification of -checkblocks is (0-4, default: %u)"), 3));
+    strUsage += HelpMessageOpt("-coinsdblayout=<layout>", strprintf(_("Store the coin database with one record per transaction (txid) or per unspent output (outpoint). "
+        "Selecting outpoint upgrades an existing database, which cannot be undone (default: %s)"), "txid"));
     strUsage += HelpMessageOpt("-conf=<file>", strprintf(_("Specify configuration file (default: %s)"), "bitcoin.conf"));
     if (mode == HMM_BITCOIND)
     {
@@ -303,6 +331,7 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-banscore=<n>", strprintf(_("Threshold for disconnecting misbehaving peers (default: %u)"), 100));
     strUsage += HelpMessageOpt("-bantime=<n>", strprintf(_("Number of seconds to keep misbehaving peers from reconnecting (default: %u)"), 86400));
     strUsage += HelpMessageOpt("-bind=<addr>", _("Bind to given address and always listen on it. Use [host]:port notation for IPv6"));
+    strUsage += HelpMessageOpt("-blockservecache=<n>", strprintf(_("Keep up to <n> MiB of recently requested blocks ready to send to peers (default: %u)"), DEFAULT_BLOCK_SERVE_CACHE));
     strUsage += HelpMessageOpt("-connect=<ip>", _("Connect only to the specified node(s)"));
     strUsage += HelpMessageOpt("-disableipprio", _("Disable connection prioritization by IP address group if node runs out of available connections"));
     strUsage += HelpMessageOpt("-discover", _("Discover own IP addresses (default: 1 when listening and no -externalip or -proxy)"));
@@ -313,8 +342,11 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-listen", _("Accept connections from outside (default: 1 if no -proxy or -connect)"));
     strUsage += HelpMessageOpt("-maxconnections=<n>", strprintf(_("Maintain at most <n> connections to peers (default: %u)"), 125));
     strUsage += HelpMessageOpt("-maxreceivebuffer=<n>", strprintf(_("Maximum per-connection receive buffer, <n>*1000 bytes (default: %u)"), 5000));
+    strUsage += HelpMessageOpt("-maxrelaycache=<n>", strprintf(_("Keep up to <n> MiB of recently relayed transactions ready to send to peers (default: %u)"), DEFAULT_MAX_RELAY_CACHE));
     strUsage += HelpMessageOpt("-maxsendbuffer=<n>", strprintf(_("Maximum per-connection send buffer, <n>*1000 bytes (default: %u)"), 1000));
-    strUsage += HelpMessageOpt("-maxmempooltx=<n>", ("Maximum number of transactions in memory pool (default: enough to fill about 25 blocks)"));
+    strUsage += HelpMessageOpt("-msghandlers=<n>", strprintf(_("Number of threads processing peer messages (1 to %d, default: one per core, up to %d)"), MAX_MESSAGE_HANDLER_THREADS, DEFAULT_MESSAGE_HANDLER_THREADS));
+    strUsage += HelpMessageOpt("-maxmempool=<n>", _("Keep the transaction memory pool below <n> megabytes, 0 for no limit (default: enough to fill about 25 blocks)"));
+    strUsage += HelpMessageOpt("-mempoolexpiry=<n>", strprintf(_("Do not keep transactions in the memory pool longer than <n> hours (default: %u)"), DEFAULT_MEMPOOL_EXPIRY));
     strUsage += HelpMessageOpt("-onion=<ip:port>", strprintf(_("Use separate SOCKS5 proxy to reach peers via Tor hidden services (default: %s)"), "-proxy"));
     strUsage += HelpMessageOpt("-onlynet=<net>", _("Only connect to nodes in network <net> (ipv4, ipv6 or onion)"));
     strUsage += HelpMessageOpt("-permitbaremultisig", strprintf(_("Relay non-P2SH multisig (default: %u)"), 1));
@@ -322,6 +354,8 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-proxy=<ip:port>", _("Connect through SOCKS5 proxy"));
     strUsage += HelpMessageOpt("-proxyrandomize", strprintf(_("Randomize credentials for every proxy connection. This enables Tor stream isolation (default: %u)"), 1));
     strUsage += HelpMessageOpt("-seednode=<ip>", _("Connect to a node to retrieve peer addresses, and disconnect"));
+    strUsage += HelpMessageOpt("-socketevents=<mode>", strprintf(_("Wait for socket events with <mode>: epoll (Linux only, not limited to %u connections) or select (default: %s)"), FD_SETSIZE, DEFAULT_SOCKET_EVENTS));
+    strUsage += HelpMessageOpt("-use-thin-blocks", strprintf(_("Download and relay new blocks as thin blocks, rebuilt from the memory pool (default: %u)"), DEFAULT_USE_THIN_BLOCKS));
     strUsage += HelpMessageOpt("-timeout=<n>", strprintf(_("Specify connection timeout in milliseconds (minimum: 1, default: %d)"), DEFAULT_CONNECT_TIMEOUT));
 #ifdef USE_UPNP
 #if USE_UPNP
@@ -372,7 +406,7 @@ std::string HelpMessage(HelpMessageMode mode)
         strUsage += HelpMessageOpt("-flushwallet", strprintf("Run a thread to flush wallet periodically (default: %u)", 1));
         strUsage += HelpMessageOpt("-stopafterblockimport", strprintf("Stop running after importing blocks from disk (default: %u)", 0));
     }
-    string debugCategories = "addrman, alert, bench, coindb, db, lock, rand, rpc, selectcoins, mempool, net, proxy, prune"; // Don't translate these and qt below
+    string debugCategories = "addrman, alert, bench, coindb, db, lock, rand, rpc, selectcoins, mempool, net, proxy, prune, thin"; // Don't translate these and qt below
     if (mode == HMM_BITCOIN_QT)
         debugCategories += ", qt";
     strUsage += HelpMessageOpt("-debug=<category>", strprintf(_("Output debugging information (default: %u, supplying <category> is optional)"), 0) + ". " +
@@ -386,9 +420,14 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-logtimestamps", strprintf(_("Prepend debug output with timestamp (default: %u)"), 1));
     if (showDebug)
     {
+        strUsage += HelpMessageOpt("-limitancestorcount=<n>", strprintf("Do not accept transactions if number of in-mempool ancestors is <n> or more (default: %u)", DEFAULT_ANCESTOR_LIMIT));
+        strUsage += HelpMessageOpt("-limitancestorsize=<n>", strprintf("Do not accept transactions whose size with all in-mempool ancestors exceeds <n> kilobytes (default: %u)", DEFAULT_ANCESTOR_SIZE_LIMIT));
+        strUsage += HelpMessageOpt("-limitdescendantcount=<n>", strprintf("Do not accept transactions if any ancestor would have <n> or more in-mempool descendants (default: %u)", DEFAULT_DESCENDANT_LIMIT));
+        strUsage += HelpMessageOpt("-limitdescendantsize=<n>", strprintf("Do not accept transactions if any ancestor would have more than <n> kilobytes of in-mempool descendants (default: %u).", DEFAULT_DESCENDANT_SIZE_LIMIT));
         strUsage += HelpMessageOpt("-limitfreerelay=<n>", strprintf("Continuously rate-limit free transactions to <n>*1000 bytes per minute (default: %u)", 15));
         strUsage += HelpMessageOpt("-relaypriority", strprintf("Require high priority for relaying free or low-fee transactions (default: %u)", 1));
-        strUsage += HelpMessageOpt("-maxsigcachesize=<n>", strprintf("Limit size of signature cache to <n> entries (default: %u)", 50000));
+        strUsage += HelpMessageOpt("-maxsigcachesize=<n>", "Limit size of signature cache to <n> entries (deprecated, use -sigcachesize)");
+        strUsage += HelpMessageOpt("-sigcachesize=<n>", strprintf("Limit size of signature cache to <n> MiB (default: %u)", DEFAULT_SIG_CACHE_SIZE));
     }
     strUsage += HelpMessageOpt("-minrelaytxfee=<amt>", strprintf(_("Fees (in BTC/Kb) smaller than this are considered zero fee for relaying (default: %s)"), FormatMoney(::minRelayTxFee.GetFeePerK())));
     strUsage += HelpMessageOpt("-printtoconsole", _("Send trace/debug info to console instead of debug.log file"));
@@ -526,6 +565,7 @@ void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
     // -reindex
     if (fReindex) {
         CImportingNow imp;
+        int64_t nStart = GetTimeMillis();
         int nFile = 0;
         while (true) {
             CDiskBlockPos pos(nFile, 0);
@@ -540,7 +580,13 @@ void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
         }
         pblocktree->WriteReindexing(false);
         fReindex = false;
-        LogPrintf("Reindexing finished\n");
+        int nHeight;
+        {
+            LOCK(cs_main);
+            nHeight = chainActive.Height();
+        }
+        LogPrintf("Reindexing finished: %d block files, height %d, in %ds\n",
+                  nFile, nHeight, (GetTimeMillis() - nStart) / 1000);
         // To avoid ending up in a situation without genesis block, re-try initializing (no-op if reindexing worked):
         InitBlockIndex();
     }
@@ -731,8 +777,18 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
 
     // Make sure enough file descriptors are available
     int nBind = std::max((int)mapArgs.count("-bind") + (int)mapArgs.count("-whitebind"), 1);
+    std::string strSocketEvents = GetArg("-socketevents", DEFAULT_SOCKET_EVENTS);
+    if (strSocketEvents != "select" && strSocketEvents != "epoll")
+        return InitError(strprintf(_("Unknown -socketevents mode: '%s'"), strSocketEvents));
+#ifndef HAVE_SYS_EPOLL_H
+    if (strSocketEvents == "epoll")
+        return InitError(_("-socketevents=epoll is not supported on this platform"));
+#endif
     nMaxConnections = GetArg("-maxconnections", 125);
-    nMaxConnections = std::max(std::min(nMaxConnections, (int)(FD_SETSIZE - nBind - MIN_CORE_FILEDESCRIPTORS)), 0);
+    // select() can't wait on file descriptors beyond FD_SETSIZE
+    if (!UseSocketEventsEpoll())
+        nMaxConnections = std::max(std::min(nMaxConnections, (int)(FD_SETSIZE - nBind - MIN_CORE_FILEDESCRIPTORS)), 0);
+    nMaxConnections = std::max(nMaxConnections, 0);
     int nFD = RaiseFileDescriptorLimit(nMaxConnections + MIN_CORE_FILEDESCRIPTORS);
     if (nFD < MIN_CORE_FILEDESCRIPTORS)
         return InitError(_("Not enough file descriptors available."));
@@ -882,8 +938,12 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
 
     // ********************************************************* Step 4: application initialization: dir lock, daemonize, pidfile, debug log
 
+    // Pick the fastest SHA256 implementation this CPU supports
+    std::string strSHA256Impl = SHA256AutoDetect();
+
     // Initialize elliptic curve code
     ECC_Start();
+    globalVerifyHandle.reset(new ECCVerifyHandle());
 
     // Sanity check
     if (!InitSanityCheck())
@@ -916,6 +976,7 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     LogPrintf("\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n");
     LogPrintf("Bitcoin XT version %s (%s)\n", FormatFullVersion(), CLIENT_DATE);
     LogPrintf("Using OpenSSL version %s\n", SSLeay_version(SSLEAY_VERSION));
+    LogPrintf("Using the '%s' SHA256 implementation\n", strSHA256Impl);
 #ifdef ENABLE_WALLET
     LogPrintf("Using BerkeleyDB version %s\n", DbEnv::version(0, 0, 0));
 #endif
@@ -927,10 +988,15 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     LogPrintf("Using at most %i connections (%i file descriptors available)\n", nMaxConnections, nFD);
     std::ostringstream strErrors;
 
+    InitSignatureCache();
+
     LogPrintf("Using %u threads for script verification\n", nScriptCheckThreads);
     if (nScriptCheckThreads) {
-        for (int i=0; i<nScriptCheckThreads-1; i++)
+        for (int i=0; i<nScriptCheckThreads-1; i++) {
             threadGroup.create_thread(&ThreadScriptCheck);
+            threadGroup.create_thread(&ThreadTxInputsCheck);
+            threadGroup.create_thread(&ThreadCoinsRead);
+        }
     }
 
     // Start the lightweight task scheduler thread
@@ -1031,6 +1097,16 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     fDiscover = GetBoolArg("-discover", true);
     fNameLookup = GetBoolArg("-dns", true);
 
+    if (!GetBoolArg("-use-thin-blocks", DEFAULT_USE_THIN_BLOCKS))
+        nLocalServices &= ~NODE_THIN;
+
+    // A -blockfilterindex that does not match the block database is refused below.
+    if (GetBoolArg("-blockfilterindex", DEFAULT_BLOCKFILTERINDEX))
+        nLocalServices |= NODE_COMPACT_FILTERS;
+
+    rawBlockCache.SetMaxBytes((size_t)std::max(GetArg("-blockservecache", DEFAULT_BLOCK_SERVE_CACHE), (int64_t)0) << 20);
+    relayCache.SetMaxUsage((size_t)std::max(GetArg("-maxrelaycache", DEFAULT_MAX_RELAY_CACHE), (int64_t)0) << 20);
+
     bool fBound = false;
     if (fListen) {
         if (mapArgs.count("-bind") || mapArgs.count("-whitebind")) {
@@ -1102,6 +1178,15 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
         }
     }
 
+    int nCoinsDBLayout;
+    std::string strCoinsDBLayout = GetArg("-coinsdblayout", "txid");
+    if (strCoinsDBLayout == "outpoint")
+        nCoinsDBLayout = COINS_DB_PER_OUTPOINT;
+    else if (strCoinsDBLayout == "txid")
+        nCoinsDBLayout = COINS_DB_PER_TXID;
+    else
+        return InitError(strprintf(_("Unknown coin database layout '%s'"), strCoinsDBLayout));
+
     // cache size calculations
     int64_t nTotalCache = (GetArg("-dbcache", nDefaultDbCache) << 20);
     nTotalCache = std::max(nTotalCache, nMinDbCache << 20); // total cache cannot be less than nMinDbCache
@@ -1130,13 +1215,27 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
             try {
                 UnloadBlockIndex();
                 delete pcoinsTip;
-                delete pcoinsdbview;
                 delete pcoinscatcher;
+                delete pcoinsflusher;
+                delete pcoinsdbview;
                 delete pblocktree;
 
                 pblocktree = new CBlockTreeDB(nBlockTreeDBCache, false, fReindex);
-                pcoinsdbview = new CCoinsViewDB(nCoinDBCache, false, fReindex);
-                pcoinscatcher = new CCoinsViewErrorCatcher(pcoinsdbview);
+                pcoinsdbview = new CCoinsViewDB(nCoinDBCache, false, fReindex, nCoinsDBLayout);
+                // An interrupted upgrade has to be completed whatever layout is asked for now.
+                if (pcoinsdbview->GetLayout() == COINS_DB_UPGRADING ||
+                    (nCoinsDBLayout == COINS_DB_PER_OUTPOINT && pcoinsdbview->GetLayout() != COINS_DB_PER_OUTPOINT)) {
+                    if (pcoinsdbview->GetLayout() == COINS_DB_UPGRADING)
+                        LogPrintf("Resuming interrupted coins database upgrade\n");
+                    uiInterface.InitMessage(_("Upgrading coins database..."));
+                    if (!pcoinsdbview->Upgrade()) {
+                        strLoadError = _("Error upgrading coins database");
+                        break;
+                    }
+                }
+                LogPrintf("Coin database stores one record per %s\n", pcoinsdbview->GetLayout() == COINS_DB_PER_OUTPOINT ? "unspent output" : "transaction");
+                pcoinsflusher = new CCoinsViewFlusher(pcoinsdbview, GetBoolArg("-asyncflush", DEFAULT_ASYNC_FLUSH));
+                pcoinscatcher = new CCoinsViewErrorCatcher(pcoinsflusher);
                 pcoinsTip = new CCoinsViewCache(pcoinscatcher);
 
                 if (fReindex) {
@@ -1168,6 +1267,12 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
                     break;
                 }
 
+                // Check for changed -blockfilterindex state
+                if (fBlockFilterIndex != GetBoolArg("-blockfilterindex", DEFAULT_BLOCKFILTERINDEX)) {
+                    strLoadError = _("You need to rebuild the database using -reindex to change -blockfilterindex");
+                    break;
+                }
+
                 // Check for changed -prune state.  What we are concerned about is a user who has pruned blocks
                 // in the past, but is now trying to run unpruned.
                 if (fHavePruned && !fPruneMode) {
@@ -1180,7 +1285,7 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
                     LogPrintf("Prune: pruned datadir may not have more than %d blocks; -checkblocks=%d may fail\n",
                         MIN_BLOCKS_TO_KEEP, GetArg("-checkblocks", 288));
                 }
-                if (!CVerifyDB().VerifyDB(pcoinsdbview, GetArg("-checklevel", 3),
+                if (!CVerifyDB().VerifyDB(pcoinsflusher, GetArg("-checklevel", 3),
                               GetArg("-checkblocks", 288))) {
                     strLoadError = _("Corrupted block database detected");
                     break;
@@ -1384,6 +1489,16 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     if (mapArgs.count("-blocknotify"))
         uiInterface.NotifyBlockTip.connect(BlockNotifyCallback);
 
+    // Start keeping track of the UTXO set statistics while the coin database
+    // is still at the tip
+    const leveldb::Snapshot* snapshotTxOutSetStats;
+    {
+        LOCK(cs_main);
+        snapshotTxOutSetStats = InitTxOutSetStats(pcoinsdbview);
+    }
+    if (snapshotTxOutSetStats)
+        threadGroup.create_thread(boost::bind(&ThreadTxOutSetStats, pcoinsdbview, snapshotTxOutSetStats));
+
     uiInterface.InitMessage(_("Activating best chain..."));
     // scan for better chains in the block chain database, that are not yet connected in the active best chain
     CValidationState state;
@@ -1431,6 +1546,11 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
                                          boost::ref(cs_main), boost::cref(pindexBestHeader), nPowTargetSpacing);
     scheduler.scheduleEvery(f, nPowTargetSpacing);
 
+    // Keep the template getblocktemplate hands out up to date
+    RegisterValidationInterface(&liveBlockTemplate);
+    threadGroup.create_thread(boost::bind(&TraceThread<boost::function<void()> >, "blocktemplate",
+        boost::function<void()>(boost::bind(&CLiveBlockTemplate::ThreadUpdate, &liveBlockTemplate))));
+
 #ifdef ENABLE_WALLET
     // Generate coins in the background
     if (pwalletMain)
@@ -95,6 +95,20 @@ public:
         return (level > cutoff) ? level : 0;
     }
 
+    // Return the number of milliseconds until more than cutoff tokens are available, 0 if they already are
+    int64_t msUntilAvailable(int64_t cutoff = 0)
+    {
+        if (fill == LONG_LONG_MAX)
+            return 0; // shaping is off
+        fillIt();
+        if (level > cutoff)
+            return 0;
+        if (fill <= 0)
+            return LONG_LONG_MAX;
+        int64_t ms = ((cutoff + 1 - level) * 1000 + fill - 1) / fill;
+        return (ms > 100) ? ms : 100; // the bucket is filled at most every 100ms
+    }
+
     // Try to use amt tokens.  Returns TRUE if the tokens were consumed, false otherwise
     bool try_leak(int64_t amt)
     {
@@ -8,16 +8,24 @@
 #include "addrman.h"
 #include "alert.h"
 #include "arith_uint256.h"
+#include "blockfilter.h"
+#include "blockimport.h"
+#include "blockstore.h"
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "checkqueue.h"
+#include "coinsflush.h"
 #include "consensus/validation.h"
 #include "init.h"
 #include "merkleblock.h"
 #include "net.h"
 #include "pow.h"
+#include "rawblockcache.h"
+#include "relaycache.h"
+#include "thinblock.h"
 #include "txdb.h"
 #include "txmempool.h"
+#include "txoutsetstats.h"
 #include "ui_interface.h"
 #include "undo.h"
 #include "util.h"
@@ -32,6 +40,7 @@
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include <boost/math/distributions/poisson.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/thread.hpp>
 
 using namespace std;
@@ -56,6 +65,7 @@ int nScriptCheckThreads = 0;
 bool fImporting = false;
 bool fReindex = false;
 bool fTxIndex = false;
+bool fBlockFilterIndex = false;
 bool fHavePruned = false;
 bool fPruneMode = false;
 bool fIsBareMultisigStd = true;
@@ -171,7 +181,9 @@ namespace {
         bool fValidatedHeaders;  //! Whether this block has validated headers at the time of request.
         int64_t nTimeDisconnect; //! The timeout for this block request (for disconnecting a slow peer)
     };
-    map<uint256, pair<NodeId, list<QueuedBlock>::iterator> > mapBlocksInFlight;
+    /** The requests for each block in flight, at most MAX_BLOCK_REQUESTS of them. */
+    typedef multimap<uint256, pair<NodeId, list<QueuedBlock>::iterator> > BlocksInFlightMap;
+    BlocksInFlightMap mapBlocksInFlight;
 
     /** Number of blocks in flight with validated headers. */
     int nQueuedValidatedHeaders = 0;
@@ -243,8 +255,24 @@ struct CNodeState {
     list<QueuedBlock> vBlocksInFlight;
     int nBlocksInFlight;
     int nBlocksInFlightValidHeaders;
+    //! How many blocks we keep in flight from this peer, sized by its download speed.
+    int nBlocksInTransitMax;
+    //! Blocks we asked this peer for that it delivered, and their size.
+    int nBlocksDownloaded;
+    uint64_t nBlockBytesDownloaded;
+    //! Blocks we asked this peer for that another peer delivered first.
+    int nBlocksTakenOver;
+    //! Moving averages of the time this peer takes to deliver a block (in microseconds) and of their size, or 0.
+    int64_t nAvgBlockTime;
+    int64_t nAvgBlockSize;
+    //! When this peer last delivered a block we asked for (in microseconds), or 0.
+    int64_t nLastBlockReceived;
     //! Whether we consider this a preferred download peer.
     bool fPreferredDownload;
+    //! Thin block from this peer waiting for the transactions we asked for with "getthintx".
+    boost::shared_ptr<CThinBlockBuilder> thinBlockBuilder;
+    //! The last MAX_THIN_BLOCKS_SENT thin blocks we sent this peer and it did not yet ask transactions for.
+    std::list<uint256> listThinBlocksSent;
 
     CNodeState() {
         fCurrentlyConnected = false;
@@ -257,6 +285,13 @@ struct CNodeState {
         nStallingSince = 0;
         nBlocksInFlight = 0;
         nBlocksInFlightValidHeaders = 0;
+        nBlocksInTransitMax = DEFAULT_BLOCKS_IN_TRANSIT_PER_PEER;
+        nBlocksDownloaded = 0;
+        nBlockBytesDownloaded = 0;
+        nBlocksTakenOver = 0;
+        nAvgBlockTime = 0;
+        nAvgBlockSize = 0;
+        nLastBlockReceived = 0;
         fPreferredDownload = false;
     }
 };
@@ -345,6 +380,17 @@ void InitializeNode(NodeId nodeid, const CNode *pnode) {
     NodeStatePtr::insert(nodeid, pnode);
 }
 
+// Requires cs_main.
+// Returns the request for hash from nodeid, or mapBlocksInFlight.end().
+BlocksInFlightMap::iterator FindBlockInFlight(const uint256& hash, NodeId nodeid) {
+    std::pair<BlocksInFlightMap::iterator, BlocksInFlightMap::iterator> range = mapBlocksInFlight.equal_range(hash);
+    for (BlocksInFlightMap::iterator it = range.first; it != range.second; ++it) {
+        if (it->second.first == nodeid)
+            return it;
+    }
+    return mapBlocksInFlight.end();
+}
+
 void FinalizeNode(NodeId nodeid) {
     LOCK(cs_main);
     NodeStatePtr state(nodeid);
@@ -357,7 +403,7 @@ void FinalizeNode(NodeId nodeid) {
     }
 
     BOOST_FOREACH(const QueuedBlock& entry, state->vBlocksInFlight)
-        mapBlocksInFlight.erase(entry.hash);
+        mapBlocksInFlight.erase(FindBlockInFlight(entry.hash, nodeid));
     EraseOrphansFor(nodeid);
     nPreferredDownload -= state->fPreferredDownload;
 
@@ -365,29 +411,68 @@ void FinalizeNode(NodeId nodeid) {
 }
 
 // Requires cs_main.
-// Returns a bool indicating whether we requested this block.
-bool MarkBlockAsReceived(const uint256& hash) {
+void RemoveBlockRequest(BlocksInFlightMap::iterator itInFlight) {
+    NodeStatePtr state(itInFlight->second.first);
+    nQueuedValidatedHeaders -= itInFlight->second.second->fValidatedHeaders;
+    state->nBlocksInFlightValidHeaders -= itInFlight->second.second->fValidatedHeaders;
+    state->vBlocksInFlight.erase(itInFlight->second.second);
+    state->nBlocksInFlight--;
+    state->nStallingSince = 0;
+    mapBlocksInFlight.erase(itInFlight);
+}
+
+/**
+ * Account for the time a peer took on a block we asked it for, from when
+ * it was requested or the peer's previous block arrived, whichever is later:
+ * with several blocks in flight, a peer delivers one at a time. The time
+ * a peer had a block that another peer delivered first is only a lower
+ * bound, so it only counts if it makes the peer look slower.
+ */
+static void UpdateBlockDownloadTime(NodeStatePtr& state, const QueuedBlock& queued, int64_t nNow, bool fDelivered) {
+    int64_t nBlockTime = std::max<int64_t>(nNow - std::max(queued.nTime, state->nLastBlockReceived), 1);
+    if (!fDelivered && nBlockTime <= state->nAvgBlockTime)
+        return;
+    state->nAvgBlockTime = state->nAvgBlockTime ? (state->nAvgBlockTime * 7 + nBlockTime) / 8 : nBlockTime;
+}
+
+// Requires cs_main.
+// Returns a bool indicating whether we requested this block. nodeid is the
+// peer that delivered it, if any, and nSize its serialized size.
+bool MarkBlockAsReceived(const uint256& hash, NodeId nodeid = -1, unsigned int nSize = 0) {
     AssertLockHeld(cs_main);
-    map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hash);
-    if (itInFlight != mapBlocksInFlight.end()) {
-        NodeStatePtr state(itInFlight->second.first);
-        nQueuedValidatedHeaders -= itInFlight->second.second->fValidatedHeaders;
-        state->nBlocksInFlightValidHeaders -= itInFlight->second.second->fValidatedHeaders;
-        state->vBlocksInFlight.erase(itInFlight->second.second);
-        state->nBlocksInFlight--;
-        state->nStallingSince = 0;
-        mapBlocksInFlight.erase(itInFlight);
-        return true;
+    std::pair<BlocksInFlightMap::iterator, BlocksInFlightMap::iterator> range = mapBlocksInFlight.equal_range(hash);
+    if (range.first == range.second)
+        return false;
+
+    int64_t nNow = GetTimeMicros();
+    while (range.first != range.second) {
+        BlocksInFlightMap::iterator itInFlight = range.first++;
+        if (nodeid != -1) {
+            NodeStatePtr state(itInFlight->second.first);
+            bool fDelivered = itInFlight->second.first == nodeid;
+            UpdateBlockDownloadTime(state, *itInFlight->second.second, nNow, fDelivered);
+            if (fDelivered) {
+                state->nBlocksDownloaded++;
+                state->nBlockBytesDownloaded += nSize;
+                state->nAvgBlockSize = state->nAvgBlockSize ? (state->nAvgBlockSize * 7 + nSize) / 8 : nSize;
+                state->nLastBlockReceived = nNow;
+            } else {
+                state->nBlocksTakenOver++;
+            }
+        }
+        RemoveBlockRequest(itInFlight);
     }
-    return false;
+    return true;
 }
 
 // Requires cs_main.
 void MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, const Consensus::Params& consensusParams, CBlockIndex *pindex = NULL) {
     AssertLockHeld(cs_main);
 
-    // Make sure it's not listed somewhere already.
-    MarkBlockAsReceived(hash);
+    // Make sure it's not listed for this peer already.
+    BlocksInFlightMap::iterator itOld = FindBlockInFlight(hash, nodeid);
+    if (itOld != mapBlocksInFlight.end())
+        RemoveBlockRequest(itOld);
 
     NodeStatePtr state(nodeid);
     assert(!state.IsNull());
@@ -398,7 +483,60 @@ void MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, const Consensus::Pa
     list<QueuedBlock>::iterator it = state->vBlocksInFlight.insert(state->vBlocksInFlight.end(), newentry);
     state->nBlocksInFlight++;
     state->nBlocksInFlightValidHeaders += newentry.fValidatedHeaders;
-    mapBlocksInFlight[hash] = std::make_pair(nodeid, it);
+    mapBlocksInFlight.insert(std::make_pair(hash, std::make_pair(nodeid, it)));
+}
+
+/**
+ * How many blocks to keep in flight from a peer that delivers one every
+ * nBlockTime microseconds and has a round trip time of nPingTime
+ * microseconds: enough for BLOCK_DOWNLOAD_TARGET_TIME seconds after a
+ * request reaches it.
+ */
+static int GetBlocksInTransitMax(int64_t nBlockTime, int64_t nPingTime) {
+    if (nBlockTime <= 0)
+        return DEFAULT_BLOCKS_IN_TRANSIT_PER_PEER;
+    int64_t nBlocks = (BLOCK_DOWNLOAD_TARGET_TIME * 1000000 + std::max<int64_t>(nPingTime, 0)) / nBlockTime;
+    return std::max<int64_t>(MIN_BLOCKS_IN_TRANSIT_PER_PEER, std::min<int64_t>(nBlocks, MAX_BLOCKS_IN_TRANSIT_PER_PEER));
+}
+
+/**
+ * Whether a block we wait for from another peer should be requested from
+ * nodeid as well. Close to the tip, that is any block the other peer did
+ * not deliver within BLOCK_REDUNDANT_FETCH_TIMEOUT, as fetching it twice
+ * costs little and waiting holds up the tip. Otherwise it is only when
+ * nodeid has nothing else to fetch, the peers the block is in flight from
+ * have been on it for BLOCK_STALLING_TIMEOUT, and nodeid has proven at
+ * least twice as fast as them, counting the time they have taken so far.
+ */
+static bool CanFetchRedundantly(const uint256& hash, NodeId nodeid, const NodeStatePtr& state, bool fNearTip, int64_t nNow) {
+    std::pair<BlocksInFlightMap::iterator, BlocksInFlightMap::iterator> range = mapBlocksInFlight.equal_range(hash);
+    int nRequests = 0;
+    for (BlocksInFlightMap::iterator it = range.first; it != range.second; ++it) {
+        if (it->second.first == nodeid)
+            return false;
+        if (++nRequests >= MAX_BLOCK_REQUESTS)
+            return false;
+        if (fNearTip) {
+            if (it->second.second->nTime > nNow - 1000000 * BLOCK_REDUNDANT_FETCH_TIMEOUT)
+                return false;
+        } else {
+            NodeStatePtr other(it->second.first);
+            int64_t nOtherTime = std::max(other->nAvgBlockTime, nNow - std::max(it->second.second->nTime, other->nLastBlockReceived));
+            if (nOtherTime < 1000000 * BLOCK_STALLING_TIMEOUT || state->nAvgBlockTime == 0 || state->nAvgBlockTime * 2 > nOtherTime)
+                return false;
+        }
+    }
+    return nRequests > 0;
+}
+
+/** Add the blocks of vWaiting that nodeid, having nothing else to fetch, should fetch as well to vBlocks, until it has count entries. */
+static void FetchWaitingBlocks(const std::vector<CBlockIndex*>& vWaiting, NodeId nodeid, const NodeStatePtr& state, unsigned int count, std::vector<CBlockIndex*>& vBlocks, int64_t nNow) {
+    BOOST_FOREACH(CBlockIndex* pindex, vWaiting) {
+        if (vBlocks.size() >= count)
+            return;
+        if (CanFetchRedundantly(pindex->GetBlockHash(), nodeid, state, false, nNow))
+            vBlocks.push_back(pindex);
+    }
 }
 
 /** Check whether the last unknown block a peer advertized is not yet known. */
@@ -485,6 +623,10 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBl
         return;
 
     std::vector<CBlockIndex*> vToFetch;
+    // Blocks in flight from other peers only, that we may fetch too.
+    std::vector<CBlockIndex*> vWaiting;
+    bool fNearTip = !IsInitialBlockDownload();
+    int64_t nNow = GetTimeMicros();
     CBlockIndex *pindexWalk = state->pindexLastCommonBlock;
     // Never fetch further than the best block we know the peer has, or more than BLOCK_DOWNLOAD_WINDOW + 1 beyond the last
     // linked block we have in common with this peer. The +1 is so we can detect stalling, namely if we would be able to
@@ -523,6 +665,9 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBl
                     if (vBlocks.size() == 0 && waitingfor != nodeid) {
                         // We aren't able to fetch anything, but we would be if the download window was one larger.
                         nodeStaller = waitingfor;
+                        // Rather than only waiting for the blocks that hold the window up, fetch them
+                        // from this peer too if it is faster than the peers they were asked from.
+                        FetchWaitingBlocks(vWaiting, nodeid, state, count, vBlocks, nNow);
                     }
                     return;
                 }
@@ -530,12 +675,28 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBl
                 if (vBlocks.size() == count) {
                     return;
                 }
-            } else if (waitingfor == -1) {
-                // This is the first already-in-flight block.
-                waitingfor = mapBlocksInFlight[pindex->GetBlockHash()].first;
+            } else {
+                bool fOurs = FindBlockInFlight(pindex->GetBlockHash(), nodeid) != mapBlocksInFlight.end();
+                if (waitingfor == -1) {
+                    // This is the first already-in-flight block.
+                    waitingfor = fOurs ? nodeid : mapBlocksInFlight.find(pindex->GetBlockHash())->second.first;
+                }
+                if (fNearTip && CanFetchRedundantly(pindex->GetBlockHash(), nodeid, state, true, nNow)) {
+                    vBlocks.push_back(pindex);
+                    if (vBlocks.size() == count) {
+                        return;
+                    }
+                } else if (!fOurs && vWaiting.size() < count) {
+                    vWaiting.push_back(pindex);
+                }
             }
         }
     }
+
+    // Everything the peer has is downloaded or in flight. Blocks others are
+    // slow to deliver may still be fetched from it.
+    if (vBlocks.size() == 0)
+        FetchWaitingBlocks(vWaiting, nodeid, state, count, vBlocks, nNow);
 }
 
 } // anon namespace
@@ -551,6 +712,12 @@ bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats) {
         if (queue.pindex)
             stats.vHeightInFlight.push_back(queue.pindex->nHeight);
     }
+    stats.nBlocksInTransitMax = state->nBlocksInTransitMax;
+    stats.nBlocksDownloaded = state->nBlocksDownloaded;
+    stats.nBlockBytesDownloaded = state->nBlockBytesDownloaded;
+    stats.nBlocksTakenOver = state->nBlocksTakenOver;
+    stats.nBlockDownloadTime = state->nAvgBlockTime;
+    stats.nBlockDownloadRate = state->nAvgBlockTime ? state->nAvgBlockSize * 1000000 / state->nAvgBlockTime : 0;
     return true;
 }
 
@@ -590,6 +757,8 @@ CBlockIndex* FindForkInGlobalIndex(const CChain& chain, const CBlockLocator& loc
 }
 
 CCoinsViewCache *pcoinsTip = NULL;
+CCoinsViewFlusher *pcoinsflusher = NULL;
+CTxOutSetStatsTracker txoutsetstats;
 CBlockTreeDB *pblocktree = NULL;
 
 //////////////////////////////////////////////////////////////////////////////
@@ -847,7 +1016,8 @@ unsigned int GetLegacySigOpCount(const CTransaction& tx)
     return nSigOps;
 }
 
-unsigned int GetP2SHSigOpCount(const CTransaction& tx, const CCoinsViewCache& inputs)
+template <typename CoinsView>
+static unsigned int CountP2SHSigOps(const CTransaction& tx, const CoinsView& inputs)
 {
     if (tx.IsCoinBase())
         return 0;
@@ -862,6 +1032,11 @@ unsigned int GetP2SHSigOpCount(const CTransaction& tx, const CCoinsViewCache& in
     return nSigOps;
 }
 
+unsigned int GetP2SHSigOpCount(const CTransaction& tx, const CCoinsViewCache& inputs)
+{
+    return CountP2SHSigOps(tx, inputs);
+}
+
 
 
 
@@ -1001,6 +1176,32 @@ static bool RespendRelayExceeded(const CTransaction& doubleSpend)
     return false;
 }
 
+uint64_t GetMaxMempoolSize()
+{
+    // Default: 25-blocks-worth of transactions
+    int64_t maxBlockSize = Params().GetConsensus().MaxBlockSize(GetAdjustedTime(), sizeForkTime.load());
+    int64_t nMaxMempool = GetArg("-maxmempool", std::max((int64_t)1, 25 * maxBlockSize / 1000000));
+    return nMaxMempool > 0 ? nMaxMempool * 1000000 : 0;
+}
+
+/**
+ * Expire old transactions and trim the pool to its size limit, letting the
+ * wallet know about everything that was removed.
+ */
+static void LimitMempoolSize(CTxMemPool& pool, size_t nLimit, int64_t nAge)
+{
+    list<CTransaction> removed;
+    int nExpired = pool.Expire(GetTime() - nAge, removed);
+    if (nExpired != 0)
+        LogPrint("mempool", "Expired %i transactions from the memory pool\n", nExpired);
+
+    pool.TrimToSize(nLimit, removed);
+    BOOST_FOREACH(const CTransaction& tx, removed) {
+        LogPrint("mempool", "mempool full, evicted %s\n", tx.GetHash().ToString());
+        SyncWithWallets(tx, NULL, false);
+    }
+}
+
 bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
                         bool* pfMissingInputs, bool fRejectAbsurdFee)
 {
@@ -1071,6 +1272,13 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
         CCoinsViewMemPool viewMemPool(pcoinsTip, pool);
         view.SetBackend(viewMemPool);
 
+        // Look the transaction and its inputs up at once, so that what has
+        // to come from the coin database is read in one batch.
+        std::vector<uint256> vPrefetch(1, hash);
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            vPrefetch.push_back(txin.prevout.hash);
+        view.Prefetch(vPrefetch);
+
         // do we already have it?
         if (view.HaveCoins(hash))
             return false;
@@ -1131,6 +1339,14 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
                                       hash.ToString(), nFees, txMinFee),
                              REJECT_INSUFFICIENTFEE, "insufficient fee");
 
+        // Once the pool has had to evict, require more than what was evicted
+        const uint64_t nMaxMempool = GetMaxMempoolSize();
+        CAmount mempoolRejectFee = nMaxMempool ? pool.GetMinFee(nMaxMempool).GetFee(nSize) : 0;
+        if (fLimitFree && mempoolRejectFee > 0 && nFees < mempoolRejectFee)
+            return state.DoS(0, error("AcceptToMemoryPool: mempool min fee not met %s, %d < %d",
+                                      hash.ToString(), nFees, mempoolRejectFee),
+                             REJECT_INSUFFICIENTFEE, "mempool min fee not met");
+
         // Require that free transactions have sufficient priority to be mined in the next block.
         if (GetBoolArg("-relaypriority", true) && nFees < ::minRelayTxFee.GetFee(nSize) && !AllowFree(view.GetPriority(tx, chainActive.Height() + 1))) {
             return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "insufficient priority");
@@ -1158,6 +1374,21 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
                          hash.ToString(),
                          nFees, ::minRelayTxFee.GetFee(nSize) * 10000);
 
+        // Keep chains of unconfirmed transactions short: block assembly and
+        // TrimToSize() walk a transaction's ancestors or descendants.
+        {
+            LOCK(pool.cs);
+            std::set<uint256> setAncestors;
+            std::string errString;
+            if (!pool.CalculateMemPoolAncestors(tx, nSize, setAncestors,
+                    GetArg("-limitancestorcount", DEFAULT_ANCESTOR_LIMIT),
+                    GetArg("-limitancestorsize", DEFAULT_ANCESTOR_SIZE_LIMIT) * 1000,
+                    GetArg("-limitdescendantcount", DEFAULT_DESCENDANT_LIMIT),
+                    GetArg("-limitdescendantsize", DEFAULT_DESCENDANT_SIZE_LIMIT) * 1000, errString))
+                return state.DoS(0, error("AcceptToMemoryPool: %s %s", hash.ToString(), errString),
+                                 REJECT_NONSTANDARD, "too-long-mempool-chain");
+        }
+
         // Check against previous transactions
         // This is done last to help prevent CPU exhaustion denial-of-service attacks.
         if (!CheckInputs(tx, state, view, true, STANDARD_SCRIPT_VERIFY_FLAGS, true, NULL))
@@ -1191,50 +1422,17 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
         }
         else
         {
-            // Default max mempool #tx: 25-blocks-worth of 500-byte transactions:
-            int64_t nDefaultMax = 25 * (int64_t)(maxBlockSize / 500);
-            int64_t nMaxPoolTx = GetArg("-maxmempooltx", nDefaultMax);
-
-            if (nMaxPoolTx <= 0) { // Zero or negative: don't limit
-                pool.addUnchecked(hash, entry, !IsInitialBlockDownload());
-            }
             // fLimitFree is false when transactions are submitted from the wallet
             // code or RPC send commands. We always want to add them to the pool,
             // and want to prioritise them so they're never evicted:
-            else if (!fLimitFree) {
-                pool.addUnchecked(hash, entry, !IsInitialBlockDownload());
-                CAmount unused;
-                pool.PrioritiseTransaction(hash, hash.ToString(), AllowFreeThreshold(), unused);
-            }
-            // Mempool not full:
-            else if ((int64_t)pool.size() < nMaxPoolTx) {
-                pool.addUnchecked(hash, entry, !IsInitialBlockDownload());
-            }
-            else { // Mempool full...
-                static int64_t lastEstimate = 0; // Only call estimateFee every 10 minutes
-                static CFeeRate highFee;
-                if (entry.GetTime()-lastEstimate > 600) {
-                    lastEstimate = entry.GetTime();
-                    highFee = pool.estimateFee(2);
-                }
-                if (dPriority < AllowFreeThreshold() && CFeeRate(nFees, nSize) < highFee) {
-                    // Low-priority, low-fee: dropped immediately
-                    LogPrint("mempool", "mempool full, dropped %s\n", hash.ToString());
-                    SyncWithWallets(tx, NULL, false); // Let wallet know it exists
-                    return false;
-                }
-                // High enough priority/fee: add to pool, we'll evict somebody below
-                pool.addUnchecked(hash, entry, !IsInitialBlockDownload());
-            }
-            if (nMaxPoolTx > 0 && (int64_t)pool.size() > nMaxPoolTx) {
-                list<CTransaction> evicted;
-                pool.evictRandom(evicted);
-                BOOST_FOREACH(const CTransaction &etx, evicted) {
-                    LogPrint("mempool", "mempool full, evicted %s\n", etx.GetHash().ToString());
-                    SyncWithWallets(etx, NULL, false);
-                }
+            if (!fLimitFree && nMaxMempool > 0)
+                pool.PrioritiseTransaction(hash, hash.ToString(), AllowFreeThreshold(), 0);
+            pool.addUnchecked(hash, entry, !IsInitialBlockDownload());
+
+            if (nMaxMempool > 0) {
+                LimitMempoolSize(pool, nMaxMempool, GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
                 if (!pool.exists(hash))
-                    return false;
+                    return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "mempool full");
             }
         }
     }
@@ -1260,13 +1458,13 @@ bool GetTransaction(const uint256 &hash, CTransaction &txOut, uint256 &hashBlock
         if (fTxIndex) {
             CDiskTxPos postx;
             if (pblocktree->ReadTxIndex(hash, postx)) {
-                CAutoFile file(OpenBlockFile(postx, true), SER_DISK, CLIENT_VERSION);
+                CBlockFileReader file(blockFileStore, postx, "blk", SER_DISK, CLIENT_VERSION);
                 if (file.IsNull())
                     return error("%s: OpenBlockFile failed", __func__);
                 CBlockHeader header;
                 try {
                     file >> header;
-                    fseek(file.Get(), postx.nTxOffset, SEEK_CUR);
+                    file.ignore(postx.nTxOffset);
                     file >> txOut;
                 } catch (const std::exception& e) {
                     return error("%s: Deserialize or I/O error - %s", __func__, e.what());
@@ -1343,7 +1541,7 @@ bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos)
     block.SetNull();
 
     // Open history file to read
-    CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
+    CBlockFileReader filein(blockFileStore, pos, "blk", SER_DISK, CLIENT_VERSION);
     if (filein.IsNull())
         return error("ReadBlockFromDisk: OpenBlockFile failed for %s", pos.ToString());
 
@@ -1372,6 +1570,62 @@ bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex)
     return true;
 }
 
+bool ReadRawBlockFromDisk(CDataStream& ss, const CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& messageStart)
+{
+    if (pos.nPos < MESSAGE_START_SIZE + sizeof(unsigned int))
+        return error("%s: No room for a block record at %s", __func__, pos.ToString());
+
+    // Open history file at the record header, which comes right before the block
+    CDiskBlockPos posRecord(pos.nFile, pos.nPos - MESSAGE_START_SIZE - sizeof(unsigned int));
+    CBlockFileReader filein(blockFileStore, posRecord, "blk", SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull())
+        return error("%s: OpenBlockFile failed for %s", __func__, pos.ToString());
+
+    try {
+        CMessageHeader::MessageStartChars pchMessageStart;
+        unsigned int nSize;
+        filein >> FLATDATA(pchMessageStart) >> nSize;
+        if (memcmp(pchMessageStart, messageStart, MESSAGE_START_SIZE) != 0)
+            return error("%s: No block record at %s", __func__, pos.ToString());
+        if (nSize < 80 || nSize > Params().GetConsensus().MaxBlockSize(GetAdjustedTime() + 2 * 60 * 60, sizeForkTime.load()))
+            return error("%s: Bad block size %u at %s", __func__, nSize, pos.ToString());
+
+        size_t nStart = ss.size();
+        ss.resize(nStart + nSize);
+        filein.read(&ss[nStart], nSize);
+    }
+    catch (const std::exception& e) {
+        return error("%s: I/O error - %s at %s", __func__, e.what(), pos.ToString());
+    }
+    return true;
+}
+
+CSerializeDataRef GetBlockMessage(const uint256& hash, const CDiskBlockPos& pos)
+{
+    CSerializeDataRef pcached = rawBlockCache.Get(hash);
+    if (pcached)
+        return pcached;
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << CMessageHeader(Params().MessageStart(), "block", 0);
+    if (!ReadRawBlockFromDisk(ss, pos, Params().MessageStart()))
+        return CSerializeDataRef();
+
+    // The block hash is the hash of the 80 byte header. Its proof of work
+    // was checked before the block was stored.
+    const char* pheader = &ss[CMessageHeader::HEADER_SIZE];
+    if (Hash(pheader, pheader + 80) != hash) {
+        error("%s: Block at %s isn't %s", __func__, pos.ToString(), hash.ToString());
+        return CSerializeDataRef();
+    }
+
+    CNetMessage::FinalizeHeader(ss);
+    boost::shared_ptr<CSerializeData> pmsg(new CSerializeData());
+    ss.GetAndClear(*pmsg);
+    rawBlockCache.Insert(hash, pmsg);
+    return pmsg;
+}
+
 CAmount GetBlockSubsidy(int nHeight, const Consensus::Params& consensusParams)
 {
     int halvings = nHeight / consensusParams.nSubsidyHalvingInterval;
@@ -1573,7 +1827,7 @@ bool CScriptCheck::operator()() {
         return false; // Don't do any more checks if already past limits
 
     const CScript &scriptSig = ptxTo->vin[nIn].scriptSig;
-    CachingTransactionSignatureChecker checker(ptxTo, nIn, cacheStore);
+    CachingTransactionSignatureChecker checker(ptxTo, nIn, cacheStore, txdata.get());
     if (!VerifyScript(scriptSig, scriptPubKey, nFlags, checker, &error)) {
         return ::error("CScriptCheck(): %s:%d VerifySignature failed: %s", ptxTo->GetHash().ToString(), nIn, ScriptErrorString(error));
     }
@@ -1585,7 +1839,13 @@ bool CScriptCheck::operator()() {
     return true;
 }
 
-bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsViewCache &inputs, bool fScriptChecks, unsigned int flags, bool cacheStore, BlockValidationResourceTracker* resourceTracker, std::vector<CScriptCheck> *pvChecks)
+/**
+ * The body of CheckInputs, for any view providing the read-only coin accessors
+ * of CCoinsViewCache (AccessCoins and HaveInputs). nSpendHeight is the height
+ * of the block the transaction is to be included in.
+ */
+template <typename CoinsView>
+static bool CheckTxInputs(const CTransaction& tx, CValidationState &state, const CoinsView &inputs, int nSpendHeight, bool fScriptChecks, unsigned int flags, bool cacheStore, BlockValidationResourceTracker* resourceTracker, std::vector<CScriptCheck> *pvChecks)
 {
     if (!tx.IsCoinBase())
     {
@@ -1597,10 +1857,6 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsVi
         if (!inputs.HaveInputs(tx))
             return state.Invalid(error("CheckInputs(): %s inputs unavailable", tx.GetHash().ToString()));
 
-        // While checking, GetBestBlock() refers to the parent block.
-        // This is also true for mempool checks.
-        CBlockIndex *pindexPrev = mapBlockIndex.find(inputs.GetBestBlock())->second;
-        int nSpendHeight = pindexPrev->nHeight + 1;
         CAmount nValueIn = 0;
         CAmount nFees = 0;
         for (unsigned int i = 0; i < tx.vin.size(); i++)
@@ -1648,13 +1904,18 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsVi
         // before the last block chain checkpoint. This is safe because block merkle hashes are
         // still computed and checked, and any change will be caught at the next checkpoint.
         if (fScriptChecks) {
+            // Only worth it when there's more than one input to share it
+            boost::shared_ptr<const PrecomputedTransactionData> txdata;
+            if (tx.vin.size() > 1)
+                txdata.reset(new PrecomputedTransactionData(tx));
+
             for (unsigned int i = 0; i < tx.vin.size(); i++) {
                 const COutPoint &prevout = tx.vin[i].prevout;
                 const CCoins* coins = inputs.AccessCoins(prevout.hash);
                 assert(coins);
 
                 // Verify signature
-                CScriptCheck check(resourceTracker, *coins, tx, i, flags, cacheStore);
+                CScriptCheck check(resourceTracker, *coins, tx, i, flags, cacheStore, txdata);
                 if (pvChecks) {
                     pvChecks->push_back(CScriptCheck());
                     check.swap(pvChecks->back());
@@ -1667,7 +1928,7 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsVi
                         // avoid splitting the network between upgraded and
                         // non-upgraded nodes.
                         CScriptCheck check(NULL, *coins, tx, i,
-                                flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, cacheStore);
+                                flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, cacheStore, txdata);
                         if (check())
                             return state.Invalid(false, REJECT_NONSTANDARD, strprintf("non-mandatory-script-verify-flag (%s)", ScriptErrorString(check.GetScriptError())));
                     }
@@ -1687,6 +1948,18 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsVi
     return true;
 }
 
+bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsViewCache &inputs, bool fScriptChecks, unsigned int flags, bool cacheStore, BlockValidationResourceTracker* resourceTracker, std::vector<CScriptCheck> *pvChecks)
+{
+    int nSpendHeight = 0;
+    if (!tx.IsCoinBase()) {
+        // While checking, GetBestBlock() refers to the parent block.
+        // This is also true for mempool checks.
+        CBlockIndex *pindexPrev = mapBlockIndex.find(inputs.GetBestBlock())->second;
+        nSpendHeight = pindexPrev->nHeight + 1;
+    }
+    return CheckTxInputs(tx, state, inputs, nSpendHeight, fScriptChecks, flags, cacheStore, resourceTracker, pvChecks);
+}
+
 namespace {
 
 bool UndoWriteToDisk(const CBlockUndo& blockundo, CDiskBlockPos& pos, const uint256& hashBlock, const CMessageHeader::MessageStartChars& messageStart)
@@ -1719,7 +1992,7 @@ bool UndoWriteToDisk(const CBlockUndo& blockundo, CDiskBlockPos& pos, const uint
 bool UndoReadFromDisk(CBlockUndo& blockundo, const CDiskBlockPos& pos, const uint256& hashBlock)
 {
     // Open history file to read
-    CAutoFile filein(OpenUndoFile(pos, true), SER_DISK, CLIENT_VERSION);
+    CBlockFileReader filein(blockFileStore, pos, "rev", SER_DISK, CLIENT_VERSION);
     if (filein.IsNull())
         return error("%s: OpenBlockFile failed", __func__);
 
@@ -1796,7 +2069,7 @@ static bool ApplyTxInUndo(const CTxInUndo& undo, CCoinsViewCache& view, const CO
     return fClean;
 }
 
-bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, bool* pfClean)
+bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, bool* pfClean, CTxOutSetStats* pstats)
 {
     assert(pindex->GetBlockHash() == view.GetBestBlock());
 
@@ -1836,6 +2109,12 @@ bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex
             fClean = fClean && error("DisconnectBlock(): added transaction mismatch? database corrupted");
 
         // remove outputs
+        if (pstats) {
+            for (unsigned int n = 0; n < outsBlock.vout.size(); n++) {
+                if (!outsBlock.vout[n].IsNull())
+                    pstats->RemoveTxOut(COutPoint(hash, n), outsBlock.vout[n]);
+            }
+        }
         outs->Clear();
         }
 
@@ -1849,6 +2128,8 @@ bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex
                 const CTxInUndo &undo = txundo.vprevout[j];
                 if (!ApplyTxInUndo(undo, view, out))
                     fClean = false;
+                if (pstats)
+                    pstats->AddTxOut(out, undo.txout);
             }
         }
     }
@@ -1885,6 +2166,10 @@ void static FlushBlockFile(bool fFinalize = false)
         FileCommit(fileOld);
         fclose(fileOld);
     }
+
+    // The files may have shrunk
+    if (fFinalize)
+        blockFileStore.Forget(nLastBlockFile);
 }
 
 bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigned int nAddSize);
@@ -1896,6 +2181,218 @@ void ThreadScriptCheck() {
     scriptcheckqueue.Thread();
 }
 
+namespace {
+
+/**
+ * The coins spent by the transactions of a block, looked up once before the
+ * block is connected so that the inputs of its transactions can be checked
+ * concurrently. Outputs of transactions in the block itself are served as if
+ * confirmed at the height of the block; everything else comes from the view,
+ * which must not be modified while this is in use.
+ *
+ * This knows nothing about the order of the transactions, so it doesn't
+ * catch double spends within the block or spends of outputs created later in
+ * it. ConnectBlock still applies the transactions in order and catches those
+ * with HaveInputs.
+ */
+class CBlockInputs
+{
+private:
+    //! Coins of the transactions in the block that other transactions in it spend
+    std::vector<CCoins> vBlockCoins;
+    boost::unordered_map<uint256, const CCoins*, CCoinsKeyHasher> mapCoins;
+
+public:
+    CBlockInputs(const CBlock& block, int nHeight, const CCoinsViewCache& view);
+
+    const CCoins* AccessCoins(const uint256& txid) const;
+    bool HaveInputs(const CTransaction& tx) const;
+    const CTxOut& GetOutputFor(const CTxIn& input) const;
+    CAmount GetValueIn(const CTransaction& tx) const;
+};
+
+CBlockInputs::CBlockInputs(const CBlock& block, int nHeight, const CCoinsViewCache& view)
+{
+    std::map<uint256, size_t> mapBlockTx;
+    for (size_t i = 0; i < block.vtx.size(); i++)
+        mapBlockTx[block.vtx[i].GetHash()] = i;
+
+    // Reserve up front; mapCoins points into vBlockCoins.
+    vBlockCoins.reserve(block.vtx.size());
+    for (size_t i = 1; i < block.vtx.size(); i++) {
+        BOOST_FOREACH(const CTxIn& txin, block.vtx[i].vin) {
+            const uint256& hash = txin.prevout.hash;
+            if (mapCoins.count(hash))
+                continue;
+            std::map<uint256, size_t>::const_iterator it = mapBlockTx.find(hash);
+            if (it != mapBlockTx.end()) {
+                vBlockCoins.push_back(CCoins(block.vtx[it->second], nHeight));
+                mapCoins[hash] = &vBlockCoins.back();
+            } else {
+                // Pulls the coins into the view's cache if it doesn't have them yet.
+                mapCoins[hash] = view.AccessCoins(hash);
+            }
+        }
+    }
+}
+
+const CCoins* CBlockInputs::AccessCoins(const uint256& txid) const
+{
+    boost::unordered_map<uint256, const CCoins*, CCoinsKeyHasher>::const_iterator it = mapCoins.find(txid);
+    return it == mapCoins.end() ? NULL : it->second;
+}
+
+bool CBlockInputs::HaveInputs(const CTransaction& tx) const
+{
+    if (!tx.IsCoinBase()) {
+        BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+            const CCoins* coins = AccessCoins(txin.prevout.hash);
+            if (!coins || !coins->IsAvailable(txin.prevout.n))
+                return false;
+        }
+    }
+    return true;
+}
+
+const CTxOut& CBlockInputs::GetOutputFor(const CTxIn& input) const
+{
+    const CCoins* coins = AccessCoins(input.prevout.hash);
+    assert(coins && coins->IsAvailable(input.prevout.n));
+    return coins->vout[input.prevout.n];
+}
+
+CAmount CBlockInputs::GetValueIn(const CTransaction& tx) const
+{
+    if (tx.IsCoinBase())
+        return 0;
+
+    CAmount nResult = 0;
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        nResult += GetOutputFor(txin).nValue;
+    return nResult;
+}
+
+/** Outcome of a CTxInputsCheck, read by ConnectBlock once the queue is done. */
+struct CTxInputsResult
+{
+    CValidationState state;
+    CAmount nFee;
+    unsigned int nP2SHSigOps;
+
+    CTxInputsResult() : nFee(0), nP2SHSigOps(0) {}
+};
+
+/**
+ * Closure representing the contextual checks of one transaction of a block:
+ * input availability, coinbase maturity, amounts and P2SH sigops. Its script
+ * checks are handed to the script check queue straight away, so signature
+ * verification overlaps with the checks of the remaining transactions.
+ */
+class CTxInputsCheck
+{
+private:
+    const CBlockInputs* inputs;
+    const CTransaction* ptx;
+    CTxInputsResult* result;
+    CCheckQueue<CScriptCheck>* pscriptqueue;
+    BlockValidationResourceTracker* resourceTracker;
+    int nSpendHeight;
+    unsigned int nFlags;
+    bool fStrictPayToScriptHash;
+
+public:
+    CTxInputsCheck() : inputs(NULL), ptx(NULL), result(NULL), pscriptqueue(NULL), resourceTracker(NULL),
+                       nSpendHeight(0), nFlags(0), fStrictPayToScriptHash(false) {}
+    CTxInputsCheck(const CBlockInputs& inputsIn, const CTransaction& txIn, CTxInputsResult& resultIn,
+                   CCheckQueue<CScriptCheck>* pscriptqueueIn, BlockValidationResourceTracker* resourceTrackerIn,
+                   int nSpendHeightIn, unsigned int nFlagsIn, bool fStrictPayToScriptHashIn) :
+        inputs(&inputsIn), ptx(&txIn), result(&resultIn), pscriptqueue(pscriptqueueIn), resourceTracker(resourceTrackerIn),
+        nSpendHeight(nSpendHeightIn), nFlags(nFlagsIn), fStrictPayToScriptHash(fStrictPayToScriptHashIn) {}
+
+    bool operator()();
+
+    void swap(CTxInputsCheck& check) {
+        std::swap(inputs, check.inputs);
+        std::swap(ptx, check.ptx);
+        std::swap(result, check.result);
+        std::swap(pscriptqueue, check.pscriptqueue);
+        std::swap(resourceTracker, check.resourceTracker);
+        std::swap(nSpendHeight, check.nSpendHeight);
+        std::swap(nFlags, check.nFlags);
+        std::swap(fStrictPayToScriptHash, check.fStrictPayToScriptHash);
+    }
+};
+
+bool CTxInputsCheck::operator()()
+{
+    const CTransaction& tx = *ptx;
+    if (!inputs->HaveInputs(tx))
+        return result->state.DoS(100, error("ConnectBlock(): inputs missing/spent"),
+                                 REJECT_INVALID, "bad-txns-inputs-missingorspent");
+
+    if (fStrictPayToScriptHash)
+        result->nP2SHSigOps = CountP2SHSigOps(tx, *inputs);
+
+    // Without a script queue (before the last checkpoint) no script checks are created.
+    std::vector<CScriptCheck> vChecks;
+    if (!CheckTxInputs(tx, result->state, *inputs, nSpendHeight, pscriptqueue != NULL, nFlags, false,
+                       resourceTracker, &vChecks))
+        return false;
+    result->nFee = inputs->GetValueIn(tx) - tx.GetValueOut();
+
+    if (pscriptqueue)
+        pscriptqueue->Add(vChecks);
+    return true;
+}
+
+} // anon namespace
+
+static CCheckQueue<CTxInputsCheck> txinputscheckqueue(16);
+
+void ThreadTxInputsCheck() {
+    RenameThread("bitcoin-txinputs");
+    txinputscheckqueue.Thread();
+}
+
+/**
+ * Check the inputs of all transactions of a block against the coins it spends
+ * on the script check threads, queueing their script checks on pscriptqueue.
+ * On success the fees and P2SH sigops of the block are added to nFees and
+ * nSigOps; on failure state holds the error of the first failed transaction.
+ */
+static bool CheckBlockInputs(const CBlock& block, CValidationState& state, const CCoinsViewCache& view, int nSpendHeight,
+                             unsigned int flags, bool fStrictPayToScriptHash, CCheckQueue<CScriptCheck>* pscriptqueue,
+                             BlockValidationResourceTracker* resourceTracker, CAmount& nFees, unsigned int& nSigOps)
+{
+    CBlockInputs inputs(block, nSpendHeight, view);
+    std::vector<CTxInputsResult> vResults(block.vtx.size());
+
+    CCheckQueueControl<CTxInputsCheck> control(&txinputscheckqueue);
+    std::vector<CTxInputsCheck> vChecks(block.vtx.size() - 1);
+    for (size_t i = 1; i < block.vtx.size(); i++) {
+        CTxInputsCheck check(inputs, block.vtx[i], vResults[i], pscriptqueue, resourceTracker,
+                             nSpendHeight, flags, fStrictPayToScriptHash);
+        check.swap(vChecks[i - 1]);
+    }
+    control.Add(vChecks);
+
+    if (!control.Wait()) {
+        for (size_t i = 1; i < vResults.size(); i++) {
+            if (!vResults[i].state.IsValid()) {
+                state = vResults[i].state;
+                return false;
+            }
+        }
+        return state.DoS(100, false);
+    }
+
+    for (size_t i = 1; i < vResults.size(); i++) {
+        nFees += vResults[i].nFee;
+        nSigOps += vResults[i].nP2SHSigOps;
+    }
+    return true;
+}
+
 //
 // Called periodically asynchronously; alerts if it smells like
 // we're being fed a bad chain (blocks being generated much
@@ -1958,6 +2455,7 @@ void PartitionCheck(bool (*initialDownloadCheck)(), CCriticalSection& cs, const
     }
 }
 
+static int64_t nTimePrefetch = 0;
 static int64_t nTimeVerify = 0;
 static int64_t nTimeConnect = 0;
 static int64_t nTimeIndex = 0;
@@ -1970,7 +2468,26 @@ static bool DidBlockTriggerSizeFork(const CBlock &block, const CBlockIndex *pind
            IsSuperMajority(SIZE_FORK_VERSION, pindex, chainparams.GetConsensus().ActivateSizeForkMajority(), chainparams.GetConsensus(), true /* use bitmask */);
 }
 
-bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, bool fJustCheck)
+/**
+ * Build the filter of a block being connected and add it, with its header,
+ * to the block filter index. The header chains on from that of the previous
+ * block, which was indexed when that block was connected.
+ */
+static bool WriteBlockFilter(const CBlock& block, const CBlockUndo& blockundo, const CBlockIndex* pindex)
+{
+    uint256 hashPrevHeader;
+    if (pindex->pprev) {
+        CDiskBlockFilter prevFilter;
+        if (!pblocktree->ReadBlockFilter(pindex->pprev->GetBlockHash(), prevFilter))
+            return error("%s: no filter for block %s", __func__, pindex->pprev->GetBlockHash().ToString());
+        hashPrevHeader = prevFilter.hashHeader;
+    }
+    CBlockFilter filter(BASIC_FILTER, block, blockundo);
+    return pblocktree->WriteBlockFilter(filter.GetBlockHash(),
+        CDiskBlockFilter(filter.GetEncodedFilter(), filter.ComputeHeader(hashPrevHeader)));
+}
+
+bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, bool fJustCheck, CTxOutSetStats* pstats)
 {
     const CChainParams& chainparams = Params();
     AssertLockHeld(cs_main);
@@ -1985,13 +2502,34 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     // Special case for the genesis block, skipping connection of its transactions
     // (its coinbase is unspendable)
     if (block.GetHash() == chainparams.GetConsensus().hashGenesisBlock) {
-        if (!fJustCheck)
+        if (!fJustCheck) {
+            if (fBlockFilterIndex && !WriteBlockFilter(block, CBlockUndo(), pindex))
+                return AbortNode(state, "Failed to write block filter");
             view.SetBestBlock(pindex->GetBlockHash());
+        }
         return true;
     }
 
     bool fScriptChecks = (!fCheckpointsEnabled || pindex->nHeight >= Checkpoints::GetTotalBlocksEstimate(chainparams.Checkpoints()));
 
+    // Bring the coins the block spends, and its own txids (for the BIP30
+    // check below and for adding its outputs), into the view up front: the
+    // ones not cached are then read from the coin database in one batch,
+    // several at a time, rather than one by one as each is needed.
+    int64_t nTimePrefetchStart = GetTimeMicros();
+    std::vector<uint256> vPrefetch;
+    vPrefetch.reserve(block.vtx.size() * 3);
+    BOOST_FOREACH(const CTransaction& tx, block.vtx) {
+        vPrefetch.push_back(tx.GetHash());
+        if (!tx.IsCoinBase()) {
+            BOOST_FOREACH(const CTxIn& txin, tx.vin)
+                vPrefetch.push_back(txin.prevout.hash);
+        }
+    }
+    view.Prefetch(vPrefetch);
+    int64_t nTimePrefetchEnd = GetTimeMicros(); nTimePrefetch += nTimePrefetchEnd - nTimePrefetchStart;
+    LogPrint("bench", "      - Prefetch coins: %.2fms [%.2fs]\n", 0.001 * (nTimePrefetchEnd - nTimePrefetchStart), nTimePrefetch * 0.000001);
+
     // Do not allow blocks that contain transactions which 'overwrite' older transactions,
     // unless those are already completely spent.
     // If such overwrites are allowed, coinbases and transactions depending upon those
@@ -2050,6 +2588,20 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     std::vector<std::pair<uint256, CDiskTxPos> > vPos;
     vPos.reserve(block.vtx.size());
     blockundo.vtxundo.reserve(block.vtx.size() - 1);
+
+    // With script check threads around, check the inputs of all transactions
+    // in parallel first, feeding the script check queue as we go; what is left
+    // for the loop below is applying the transactions to the view in order.
+    // The two blocks violating BIP30 keep to the serial code.
+    bool fParallelInputs = nScriptCheckThreads && fEnforceBIP30;
+    if (fParallelInputs) {
+        if (!CheckBlockInputs(block, state, view, pindex->nHeight, flags, fStrictPayToScriptHash,
+                              fScriptChecks ? &scriptcheckqueue : NULL, &resourceTracker, nFees, nSigOps))
+            return false;
+        int64_t nTimeInputs = GetTimeMicros();
+        LogPrint("bench", "      - Check inputs: %.2fms\n", 0.001 * (nTimeInputs - nTimeStart));
+    }
+
     for (unsigned int i = 0; i < block.vtx.size(); i++)
     {
         const CTransaction &tx = block.vtx[i];
@@ -2065,7 +2617,10 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
             if (!view.HaveInputs(tx))
                 return state.DoS(100, error("ConnectBlock(): inputs missing/spent"),
                                  REJECT_INVALID, "bad-txns-inputs-missingorspent");
+        }
 
+        if (!tx.IsCoinBase() && !fParallelInputs)
+        {
             if (fStrictPayToScriptHash)
             {
                 // Add in sigops done by pay-to-script-hash inputs;
@@ -2080,18 +2635,40 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
             nFees += view.GetValueIn(tx)-tx.GetValueOut();
 
             std::vector<CScriptCheck> vChecks;
-            if (!CheckInputs(tx, state, view, fScriptChecks, flags, false,
-                             &resourceTracker, nScriptCheckThreads ? &vChecks : NULL))
+            if (!CheckTxInputs(tx, state, view, pindex->nHeight, fScriptChecks, flags, false,
+                               &resourceTracker, nScriptCheckThreads ? &vChecks : NULL))
                 return false;
             control.Add(vChecks);
         }
 
+        // The two blocks violating BIP30 replace the unspent outputs of an
+        // earlier coinbase.
+        if (pstats && !fEnforceBIP30) {
+            const CCoins* coins = view.AccessCoins(tx.GetHash());
+            for (unsigned int n = 0; coins && n < coins->vout.size(); n++) {
+                if (!coins->vout[n].IsNull())
+                    pstats->RemoveTxOut(COutPoint(tx.GetHash(), n), coins->vout[n]);
+            }
+        }
+
         CTxUndo undoDummy;
         if (i > 0) {
             blockundo.vtxundo.push_back(CTxUndo());
         }
         UpdateCoins(tx, state, view, i == 0 ? undoDummy : blockundo.vtxundo.back(), pindex->nHeight);
 
+        if (pstats) {
+            if (i > 0) {
+                const CTxUndo& txundo = blockundo.vtxundo.back();
+                for (unsigned int j = 0; j < tx.vin.size(); j++)
+                    pstats->RemoveTxOut(tx.vin[j].prevout, txundo.vprevout[j].txout);
+            }
+            for (unsigned int n = 0; n < tx.vout.size(); n++) {
+                if (!tx.vout[n].scriptPubKey.IsUnspendable())
+                    pstats->AddTxOut(COutPoint(tx.GetHash(), n), tx.vout[n]);
+            }
+        }
+
         vPos.push_back(std::make_pair(tx.GetHash(), pos));
         pos.nTxOffset += ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
     }
@@ -2136,6 +2713,9 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         if (!pblocktree->WriteTxIndex(vPos))
             return AbortNode(state, "Failed to write transaction index");
 
+    if (fBlockFilterIndex && !WriteBlockFilter(block, blockundo, pindex))
+        return AbortNode(state, "Failed to write block filter");
+
     // add this block to the view's block chain
     view.SetBestBlock(pindex->GetBlockHash());
 
@@ -2179,6 +2759,7 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode) {
     static int64_t nLastWrite = 0;
     static int64_t nLastFlush = 0;
     static int64_t nLastSetChain = 0;
+    static int64_t nTimeFlushCoins = 0;
     std::set<int> setFilesToPrune;
     bool fFlushForPrune = false;
     try {
@@ -2205,10 +2786,13 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode) {
         nLastSetChain = nNow;
     }
     size_t cacheSize = pcoinsTip->DynamicMemoryUsage();
+    // While the last flush is written in the background the cache fills up
+    // again, so they share the budget.
+    size_t cacheLimit = pcoinsflusher && pcoinsflusher->IsAsync() ? nCoinCacheUsage / 2 : nCoinCacheUsage;
     // The cache is large and close to the limit, but we have time now (not in the middle of a block processing).
-    bool fCacheLarge = mode == FLUSH_STATE_PERIODIC && cacheSize * (10.0/9) > nCoinCacheUsage;
+    bool fCacheLarge = mode == FLUSH_STATE_PERIODIC && cacheSize * (10.0/9) > cacheLimit;
     // The cache is over the limit, we have to write now.
-    bool fCacheCritical = mode == FLUSH_STATE_IF_NEEDED && cacheSize > nCoinCacheUsage;
+    bool fCacheCritical = mode == FLUSH_STATE_IF_NEEDED && cacheSize > cacheLimit;
     // It's been a while since we wrote the block index to disk. Do this frequently, so we don't need to redownload after a crash.
     bool fPeriodicWrite = mode == FLUSH_STATE_PERIODIC && nNow > nLastWrite + (int64_t)DATABASE_WRITE_INTERVAL * 1000000;
     // It's been very long since we flushed the cache. Do this infrequently, to optimize cache usage.
@@ -2255,8 +2839,25 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode) {
         if (!CheckDiskSpace(128 * 2 * 2 * pcoinsTip->GetCacheSize()))
             return state.Error("out of disk space");
         // Flush the chainstate (which may refer to block index entries).
+        // With -asyncflush this only hands the cache to the writer thread;
+        // the database's best block moves once it is written.
+        int64_t nFlushStart = GetTimeMicros();
+        unsigned int nFlushed = pcoinsTip->GetCacheSize();
+        // Save the UTXO set statistics with it, so that they needn't be
+        // computed again on the next startup, even after a crash.
+        CTxOutSetStats statsTip;
+        uint256 hashStats;
+        int nStatsHeight;
+        if (pcoinsflusher && txoutsetstats.Get(statsTip, hashStats, nStatsHeight) && hashStats == pcoinsTip->GetBestBlock())
+            pcoinsflusher->SaveTxOutSetStats(hashStats, statsTip);
         if (!pcoinsTip->Flush())
             return AbortNode(state, "Failed to write to coin database");
+        // Shutting down and pruning need the chainstate on disk.
+        if (pcoinsflusher && (mode == FLUSH_STATE_ALWAYS || fFlushForPrune) && !pcoinsflusher->Wait())
+            return AbortNode(state, "Failed to write to coin database");
+        int64_t nFlushTime = GetTimeMicros() - nFlushStart;
+        nTimeFlushCoins += nFlushTime;
+        LogPrint("bench", "  - Flush coins cache: %.2fms holding cs_main (%u transactions) [%.2fs]\n", nFlushTime * 0.001, nFlushed, nTimeFlushCoins * 0.000001);
         nLastFlush = nNow;
     }
     if ((mode == FLUSH_STATE_ALWAYS || mode == FLUSH_STATE_PERIODIC) && nNow > nLastSetChain + (int64_t)DATABASE_WRITE_INTERVAL * 1000000) {
@@ -2334,9 +2935,11 @@ bool static DisconnectTip(CValidationState &state) {
     int64_t nStart = GetTimeMicros();
     {
         CCoinsViewCache view(pcoinsTip);
-        if (!DisconnectBlock(block, state, pindexDelete, view))
+        CTxOutSetStats statsDelta;
+        if (!DisconnectBlock(block, state, pindexDelete, view, NULL, &statsDelta))
             return error("DisconnectTip(): DisconnectBlock %s failed", pindexDelete->GetBlockHash().ToString());
         assert(view.Flush());
+        txoutsetstats.Update(statsDelta, pindexDelete->pprev);
     }
     LogPrint("bench", "- Disconnect block: %.2fms\n", (GetTimeMicros() - nStart) * 0.001);
     // Write the chain state to disk, if necessary.
@@ -2398,7 +3001,8 @@ bool static ConnectTip(CValidationState &state, CBlockIndex *pindexNew, CBlock *
     {
         CCoinsViewCache view(pcoinsTip);
         CInv inv(MSG_BLOCK, pindexNew->GetBlockHash());
-        bool rv = ConnectBlock(*pblock, state, pindexNew, view);
+        CTxOutSetStats statsDelta;
+        bool rv = ConnectBlock(*pblock, state, pindexNew, view, false, &statsDelta);
         GetMainSignals().BlockChecked(*pblock, state);
         if (!rv) {
             if (state.IsInvalid())
@@ -2409,6 +3013,7 @@ bool static ConnectTip(CValidationState &state, CBlockIndex *pindexNew, CBlock *
         nTime3 = GetTimeMicros(); nTimeConnectTotal += nTime3 - nTime2;
         LogPrint("bench", "  - Connect total: %.2fms [%.2fs]\n", (nTime3 - nTime2) * 0.001, nTimeConnectTotal * 0.000001);
         assert(view.Flush());
+        txoutsetstats.Update(statsDelta, pindexNew);
     }
     int64_t nTime4 = GetTimeMicros(); nTimeFlush += nTime4 - nTime3;
     LogPrint("bench", "  - Flush: %.2fms [%.2fs]\n", (nTime4 - nTime3) * 0.001, nTimeFlush * 0.000001);
@@ -2823,6 +3428,7 @@ bool FindBlockPos(CValidationState &state, CDiskBlockPos &pos, unsigned int nAdd
                     LogPrintf("Pre-allocating up to position 0x%x in blk%05u.dat\n", nNewChunks * BLOCKFILE_CHUNK_SIZE, pos.nFile);
                     AllocateFileRange(file, pos.nPos, nNewChunks * BLOCKFILE_CHUNK_SIZE - pos.nPos);
                     fclose(file);
+                    blockFileStore.Forget(pos.nFile);
                 }
             }
             else
@@ -2856,6 +3462,7 @@ bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigne
                 LogPrintf("Pre-allocating up to position 0x%x in rev%05u.dat\n", nNewChunks * UNDOFILE_CHUNK_SIZE, pos.nFile);
                 AllocateFileRange(file, pos.nPos, nNewChunks * UNDOFILE_CHUNK_SIZE - pos.nPos);
                 fclose(file);
+                blockFileStore.Forget(pos.nFile);
             }
         }
         else
@@ -2884,6 +3491,9 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
 {
     // These are checks that are independent of context.
 
+    if (block.fChecked)
+        return true;
+
     // Check that the header is valid (particularly PoW).  This is mostly
     // redundant with the call in AcceptBlockHeader.
     if (!CheckBlockHeader(block, state, fCheckPOW))
@@ -2940,6 +3550,10 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
         return state.DoS(100, error("CheckBlock(): out-of-bounds SigOpCount"),
                          REJECT_INVALID, "bad-blk-sigops", true);
 
+    // Don't check it again when it is accepted and connected
+    if (fCheckPOW && fCheckMerkleRoot)
+        block.fChecked = true;
+
     return true;
 }
 
@@ -3138,7 +3752,8 @@ bool ProcessNewBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, bool
 
     {
         LOCK(cs_main);
-        bool fRequested = MarkBlockAsReceived(pblock->GetHash());
+        bool fRequested = MarkBlockAsReceived(pblock->GetHash(), pfrom ? pfrom->GetId() : -1,
+                                              ::GetSerializeSize(*pblock, SER_NETWORK, PROTOCOL_VERSION));
         fRequested |= fForceProcessing;
         if (!checked) {
             return error("%s: CheckBlock FAILED", __func__);
@@ -3238,6 +3853,7 @@ void UnlinkPrunedFiles(std::set<int>& setFilesToPrune)
         CDiskBlockPos pos(*it, 0);
         boost::filesystem::remove(GetBlockPosFilename(pos, "blk"));
         boost::filesystem::remove(GetBlockPosFilename(pos, "rev"));
+        blockFileStore.Forget(*it);
         LogPrintf("Prune: %s deleted blk/rev (%05u)\n", __func__, *it);
     }
 }
@@ -3460,6 +4076,10 @@ bool static LoadBlockIndexDB()
     pblocktree->ReadFlag("txindex", fTxIndex);
     LogPrintf("%s: transaction index %s\n", __func__, fTxIndex ? "enabled" : "disabled");
 
+    // Check whether we have a block filter index
+    pblocktree->ReadFlag("blockfilterindex", fBlockFilterIndex);
+    LogPrintf("%s: block filter index %s\n", __func__, fBlockFilterIndex ? "enabled" : "disabled");
+
     // Load pointer to end of best chain
     BlockMap::iterator it = mapBlockIndex.find(pcoinsTip->GetBestBlock());
     if (it == mapBlockIndex.end())
@@ -3613,6 +4233,8 @@ bool InitBlockIndex() {
     // Use the provided setting for -txindex in the new database
     fTxIndex = GetBoolArg("-txindex", false);
     pblocktree->WriteFlag("txindex", fTxIndex);
+    fBlockFilterIndex = GetBoolArg("-blockfilterindex", DEFAULT_BLOCKFILTERINDEX);
+    pblocktree->WriteFlag("blockfilterindex", fBlockFilterIndex);
     LogPrintf("Initializing databases...\n");
 
     // Only add the genesis block if not reindexing (in which case we reuse the one already on disk)
@@ -3653,98 +4275,81 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
 
     int nLoaded = 0;
     try {
-        // This takes over fileIn and calls fclose() on it in the CBufferedFile destructor
+        // Blocks are read, parsed and checked ahead on other threads; this
+        // one stores and connects them in file order.
         uint64_t nMaxBlocksize = chainparams.GetConsensus().MaxBlockSize(GetAdjustedTime(), sizeForkTime.load());
-        CBufferedFile blkdat(fileIn, 2*nMaxBlocksize, nMaxBlocksize+8, SER_DISK, CLIENT_VERSION);
-        uint64_t nRewind = blkdat.GetPos();
-        while (!blkdat.eof()) {
+        int nThreads = std::min((int)boost::thread::hardware_concurrency() - 1, MAX_IMPORT_CHECK_THREADS);
+        CBlockImportPipeline pipeline(fileIn, nMaxBlocksize, nThreads);
+        boost::shared_ptr<CImportedBlock> pimported;
+        while (pipeline.Next(pimported)) {
             boost::this_thread::interruption_point();
-
-            blkdat.SetPos(nRewind);
-            nRewind++; // start one byte further next time, in case of failure
-            blkdat.SetLimit(); // remove former limit
-            unsigned int nSize = 0;
-            try {
-                // locate a header
-                unsigned char buf[MESSAGE_START_SIZE];
-                blkdat.FindByte(Params().MessageStart()[0]);
-                nRewind = blkdat.GetPos()+1;
-                blkdat >> FLATDATA(buf);
-                if (memcmp(buf, Params().MessageStart(), MESSAGE_START_SIZE))
-                    continue;
-                // read size
-                blkdat >> nSize;
-                if (nSize < 80 || nSize > nMaxBlocksize)
-                    continue;
-            } catch (const std::exception&) {
-                // no valid block header found; don't complain
-                break;
-            }
-            try {
-                // read block
-                uint64_t nBlockPos = blkdat.GetPos();
+            if (!pimported->fParsed)
+                continue;
+            if (dbp)
+                dbp->nPos = pimported->nPos;
+            CBlock& block = pimported->block;
+            const uint256& hash = pimported->hash;
+
+            // detect out of order blocks, and store them for later
+            if (hash != chainparams.GetConsensus().hashGenesisBlock && mapBlockIndex.find(block.hashPrevBlock) == mapBlockIndex.end()) {
+                LogPrint("reindex", "%s: Out of order block %s, parent %s not known\n", __func__, hash.ToString(),
+                        block.hashPrevBlock.ToString());
                 if (dbp)
-                    dbp->nPos = nBlockPos;
-                blkdat.SetLimit(nBlockPos + nSize);
-                blkdat.SetPos(nBlockPos);
-                CBlock block;
-                blkdat >> block;
-                nRewind = blkdat.GetPos();
-
-                // detect out of order blocks, and store them for later
-                uint256 hash = block.GetHash();
-                if (hash != chainparams.GetConsensus().hashGenesisBlock && mapBlockIndex.find(block.hashPrevBlock) == mapBlockIndex.end()) {
-                    LogPrint("reindex", "%s: Out of order block %s, parent %s not known\n", __func__, hash.ToString(),
-                            block.hashPrevBlock.ToString());
-                    if (dbp)
-                        mapBlocksUnknownParent.insert(std::make_pair(block.hashPrevBlock, *dbp));
-                    continue;
-                }
+                    mapBlocksUnknownParent.insert(std::make_pair(block.hashPrevBlock, *dbp));
+                continue;
+            }
 
-                // process in case the block isn't known yet
-                if (mapBlockIndex.count(hash) == 0 || (mapBlockIndex[hash]->nStatus & BLOCK_HAVE_DATA) == 0) {
-                    CValidationState state;
-                    if (ProcessNewBlock(state, NULL, &block, true, dbp))
-                        nLoaded++;
-                    if (state.IsError())
-                        break;
-                } else if (hash != chainparams.GetConsensus().hashGenesisBlock && mapBlockIndex[hash]->nHeight % 1000 == 0) {
-                    LogPrintf("Block Import: already had block %s at height %d\n", hash.ToString(), mapBlockIndex[hash]->nHeight);
-                }
+            // process in case the block isn't known yet
+            if (mapBlockIndex.count(hash) == 0 || (mapBlockIndex[hash]->nStatus & BLOCK_HAVE_DATA) == 0) {
+                CValidationState state;
+                if (ProcessNewBlock(state, NULL, &block, true, dbp))
+                    nLoaded++;
+                if (state.IsError())
+                    break;
+            } else if (hash != chainparams.GetConsensus().hashGenesisBlock && mapBlockIndex[hash]->nHeight % 1000 == 0) {
+                LogPrintf("Block Import: already had block %s at height %d\n", hash.ToString(), mapBlockIndex[hash]->nHeight);
+            }
 
-                // Recursively process earlier encountered successors of this block
-                deque<uint256> queue;
-                queue.push_back(hash);
-                while (!queue.empty()) {
-                    uint256 head = queue.front();
-                    queue.pop_front();
-                    std::pair<std::multimap<uint256, CDiskBlockPos>::iterator, std::multimap<uint256, CDiskBlockPos>::iterator> range = mapBlocksUnknownParent.equal_range(head);
-                    while (range.first != range.second) {
-                        std::multimap<uint256, CDiskBlockPos>::iterator it = range.first;
-                        if (ReadBlockFromDisk(block, it->second))
+            // Recursively process earlier encountered successors of this block
+            deque<uint256> queue;
+            queue.push_back(hash);
+            while (!queue.empty()) {
+                uint256 head = queue.front();
+                queue.pop_front();
+                std::pair<std::multimap<uint256, CDiskBlockPos>::iterator, std::multimap<uint256, CDiskBlockPos>::iterator> range = mapBlocksUnknownParent.equal_range(head);
+                while (range.first != range.second) {
+                    std::multimap<uint256, CDiskBlockPos>::iterator it = range.first;
+                    CBlock blockChild;
+                    if (ReadBlockFromDisk(blockChild, it->second))
+                    {
+                        LogPrintf("%s: Processing out of order child %s of %s\n", __func__, blockChild.GetHash().ToString(),
+                                head.ToString());
+                        CValidationState dummy;
+                        if (ProcessNewBlock(dummy, NULL, &blockChild, true, &it->second))
                         {
-                            LogPrintf("%s: Processing out of order child %s of %s\n", __func__, block.GetHash().ToString(),
-                                    head.ToString());
-                            CValidationState dummy;
-                            if (ProcessNewBlock(dummy, NULL, &block, true, &it->second))
-                            {
-                                nLoaded++;
-                                queue.push_back(block.GetHash());
-                            }
+                            nLoaded++;
+                            queue.push_back(blockChild.GetHash());
                         }
-                        range.first++;
-                        mapBlocksUnknownParent.erase(it);
                     }
+                    range.first++;
+                    mapBlocksUnknownParent.erase(it);
                 }
-            } catch (const std::exception& e) {
-                LogPrintf("%s: Deserialize or I/O error - %s", __func__, e.what());
             }
         }
+
+        std::string strError;
+        if (pipeline.Failed(strError))
+            AbortNode(std::string("System error: ") + strError);
+
+        if (nLoaded > 0) {
+            int64_t nElapsed = std::max(GetTimeMillis() - nStart, (int64_t)1);
+            LogPrintf("Loaded %i blocks from external file in %dms (%.1f blocks/s, %.2f MB/s, %dms waiting for blocks to be read and checked)\n",
+                      nLoaded, nElapsed, nLoaded * 1000.0 / nElapsed, pipeline.GetBytesLoaded() / 1000.0 / nElapsed,
+                      pipeline.GetWaitTime() / 1000);
+        }
     } catch (const std::runtime_error& e) {
         AbortNode(std::string("System error: ") + e.what());
     }
-    if (nLoaded > 0)
-        LogPrintf("Loaded %i blocks from external file in %dms\n", nLoaded, GetTimeMillis() - nStart);
     return nLoaded > 0;
 }
 
@@ -4018,7 +4623,7 @@ static std::map<std::string, size_t> maxMessageSizes = boost::assign::map_list_o
 bool static SanityCheckMessage(CNode* peer, const CNetMessage& msg)
 {
     const std::string& strCommand = msg.hdr.GetCommand();
-    if (strCommand == "block") {
+    if (strCommand == "block" || strCommand == "thintx") {
         uint64_t maxSize = Params().GetConsensus().MaxBlockSize(GetAdjustedTime() + 2 * 60 * 60, sizeForkTime.load());
         if (msg.hdr.nMessageSize > maxSize) {
             LogPrint("net", "Oversized %s message from peer=%i\n", SanitizeString(strCommand), peer->GetId());
@@ -4063,8 +4668,6 @@ void static ProcessGetData(CNode* pfrom)
 
     vector<CInv> vNotFound;
 
-    LOCK(cs_main);
-
     while (it != pfrom->vRecvGetData.end()) {
         // Don't bother if send buffer is too full to respond anyway
         if (pfrom->nSendSize >= SendBufferSize())
@@ -4075,37 +4678,70 @@ void static ProcessGetData(CNode* pfrom)
             boost::this_thread::interruption_point();
             it++;
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_THIN_BLOCK)
             {
+                // Only the decision whether to serve the block needs cs_main;
+                // reading it from disk and sending it are done without.
                 bool send = false;
-                BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
-                if (mi != mapBlockIndex.end())
+                CDiskBlockPos pos;
+                uint256 hashTip;
                 {
-                    if (chainActive.Contains(mi->second)) {
-                        send = true;
-                    } else {
-                        static const int nOneMonth = 30 * 24 * 60 * 60;
-                        // To prevent fingerprinting attacks, only send blocks outside of the active
-                        // chain if they are valid, and no more than a month older (both in time, and in
-                        // best equivalent proof of work) than the best header chain we know about.
-                        send = mi->second->IsValid(BLOCK_VALID_SCRIPTS) && (pindexBestHeader != NULL) &&
-                            (pindexBestHeader->GetBlockTime() - mi->second->GetBlockTime() < nOneMonth) &&
-                            (GetBlockProofEquivalentTime(*pindexBestHeader, *mi->second, *pindexBestHeader, Params().GetConsensus()) < nOneMonth);
-                        if (!send) {
-                            LogPrintf("%s: ignoring request from peer=%i for old block that isn't in the main chain\n", __func__, pfrom->GetId());
+                    LOCK(cs_main);
+                    BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
+                    if (mi != mapBlockIndex.end())
+                    {
+                        if (chainActive.Contains(mi->second)) {
+                            send = true;
+                        } else {
+                            static const int nOneMonth = 30 * 24 * 60 * 60;
+                            // To prevent fingerprinting attacks, only send blocks outside of the active
+                            // chain if they are valid, and no more than a month older (both in time, and in
+                            // best equivalent proof of work) than the best header chain we know about.
+                            send = mi->second->IsValid(BLOCK_VALID_SCRIPTS) && (pindexBestHeader != NULL) &&
+                                (pindexBestHeader->GetBlockTime() - mi->second->GetBlockTime() < nOneMonth) &&
+                                (GetBlockProofEquivalentTime(*pindexBestHeader, *mi->second, *pindexBestHeader, Params().GetConsensus()) < nOneMonth);
+                            if (!send) {
+                                LogPrintf("%s: ignoring request from peer=%i for old block that isn't in the main chain\n", __func__, pfrom->GetId());
+                            }
                         }
+                        // Pruned nodes may have deleted the block, so check whether
+                        // it's available before trying to send.
+                        send = send && (mi->second->nStatus & BLOCK_HAVE_DATA);
+                        if (send)
+                            pos = mi->second->GetBlockPos();
                     }
+                    if (send && inv.hash == pfrom->hashContinue)
+                        hashTip = chainActive.Tip()->GetBlockHash();
                 }
-                // Pruned nodes may have deleted the block, so check whether
-                // it's available before trying to send.
-                if (send && (mi->second->nStatus & BLOCK_HAVE_DATA))
+                if (send && inv.type == MSG_BLOCK)
                 {
-                    // Send block from disk
+                    // Send the block as stored on disk, without deserializing
+                    // it. It may have been pruned since cs_main was released.
+                    CSerializeDataRef pmsg = GetBlockMessage(inv.hash, pos);
+                    if (!pmsg) {
+                        LogPrintf("%s: could not load block %s requested by peer=%d\n", __func__, inv.hash.ToString(), pfrom->GetId());
+                        break;
+                    }
+                    pfrom->PushSerializedMessage("block", pmsg);
+                }
+                else if (send)
+                {
+                    // Send block from disk. The block may have been pruned
+                    // since cs_main was released.
                     CBlock block;
-                    if (!ReadBlockFromDisk(block, (*mi).second))
-                        assert(!"cannot load block from disk");
-                    if (inv.type == MSG_BLOCK)
-                        pfrom->PushMessage("block", block);
+                    if (!ReadBlockFromDisk(block, pos) || block.GetHash() != inv.hash) {
+                        LogPrintf("%s: could not load block %s requested by peer=%d\n", __func__, inv.hash.ToString(), pfrom->GetId());
+                        break;
+                    }
+                    if (inv.type == MSG_THIN_BLOCK)
+                    {
+                        pfrom->PushMessage("thinblock", CThinBlock(block));
+                        thinBlockStats.Sent();
+                        NodeStatePtr state(pfrom->GetId());
+                        state->listThinBlocksSent.push_back(inv.hash);
+                        if (state->listThinBlocksSent.size() > MAX_THIN_BLOCKS_SENT)
+                            state->listThinBlocksSent.pop_front();
+                    }
                     else // MSG_FILTERED_BLOCK)
                     {
                         LOCK(pfrom->cs_filter);
@@ -4120,58 +4756,52 @@ void static ProcessGetData(CNode* pfrom)
                             // Thus, the protocol spec specified allows for us to provide duplicate txn here,
                             // however we MUST always provide at least what the remote peer needs
                             typedef std::pair<unsigned int, uint256> PairType;
-                            BOOST_FOREACH(PairType& pair, merkleBlock.vMatchedTxn)
-                                if (!pfrom->setInventoryKnown.count(CInv(MSG_TX, pair.second)))
+                            BOOST_FOREACH(PairType& pair, merkleBlock.vMatchedTxn) {
+                                bool fKnown;
+                                {
+                                    LOCK(pfrom->cs_inventory);
+                                    fKnown = pfrom->filterInventoryKnown.contains(pair.second);
+                                }
+                                if (!fKnown)
                                     pfrom->PushMessage("tx", block.vtx[pair.first]);
+                            }
                         }
                         // else
                             // no response
                     }
+                }
 
-                    // Trigger the peer node to send a getblocks request for the next batch of inventory
-                    if (inv.hash == pfrom->hashContinue)
-                    {
-                        // Bypass PushInventory, this must send even if redundant,
-                        // and we want it right after the last block so they don't
-                        // wait for other stuff first.
-                        vector<CInv> vInv;
-                        vInv.push_back(CInv(MSG_BLOCK, chainActive.Tip()->GetBlockHash()));
-                        pfrom->PushMessage("inv", vInv);
-                        pfrom->hashContinue.SetNull();
-                    }
+                // Trigger the peer node to send a getblocks request for the next batch of inventory
+                if (!hashTip.IsNull())
+                {
+                    // Bypass PushInventory, this must send even if redundant,
+                    // and we want it right after the last block so they don't
+                    // wait for other stuff first.
+                    vector<CInv> vInv;
+                    vInv.push_back(CInv(MSG_BLOCK, hashTip));
+                    pfrom->PushMessage("inv", vInv);
+                    pfrom->hashContinue.SetNull();
                 }
             }
             else if (inv.IsKnownType())
             {
-                // Send stream from relay memory
-                bool pushed = false;
-                {
-                    LOCK(cs_mapRelay);
-                    map<CInv, CDataStream>::iterator mi = mapRelay.find(inv);
-                    if (mi != mapRelay.end()) {
-                        pfrom->PushMessage(inv.GetCommand(), (*mi).second);
-                        pushed = true;
-                    }
-                }
-                if (!pushed && inv.type == MSG_TX) {
+                // Send the message from relay memory, shared with other peers
+                CSerializeDataRef pmsg = relayCache.Get(inv);
+                if (!pmsg && inv.type == MSG_TX) {
                     CTransaction tx;
-                    if (mempool.lookup(inv.hash, tx)) {
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                        ss.reserve(1000);
-                        ss << tx;
-                        pfrom->PushMessage("tx", ss);
-                        pushed = true;
-                    }
+                    if (mempool.lookup(inv.hash, tx))
+                        pmsg = MakeTxMessage(tx);
                 }
-                if (!pushed) {
+                if (pmsg)
+                    pfrom->PushSerializedMessage(inv.GetCommand(), pmsg);
+                else
                     vNotFound.push_back(inv);
-                }
             }
 
             // Track requests for our stuff.
             GetMainSignals().Inventory(inv.hash);
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_THIN_BLOCK)
                 break;
         }
     }
@@ -4210,7 +4840,7 @@ struct CCoin {
     }
 };
 
-bool ProcessGetUTXOs(const vector<COutPoint> &vOutPoints, bool fCheckMemPool, vector<unsigned char> *result, vector<CCoin> *resultCoins)
+bool ProcessGetUTXOs(const vector<COutPoint> &vOutPoints, bool fCheckMemPool, vector<unsigned char> *result, vector<CCoin> *resultCoins, int *pnHeight, uint256 *phashTip)
 {
     // Defined by BIP 64.
     //
@@ -4229,6 +4859,9 @@ bool ProcessGetUTXOs(const vector<COutPoint> &vOutPoints, bool fCheckMemPool, ve
     // can request the creating block via hash.
     //
     // IMPORTANT: Clients expect ordering to be preserved!
+    //
+    // The chain height and tip the answer corresponds to are returned in
+    // pnHeight and phashTip, so the reply can be built without cs_main.
     if (vOutPoints.size() > MAX_INV_SZ)
         return error("message getutxos size() = %u", vOutPoints.size());
 
@@ -4240,6 +4873,8 @@ bool ProcessGetUTXOs(const vector<COutPoint> &vOutPoints, bool fCheckMemPool, ve
     boost::dynamic_bitset<unsigned char> hits(vOutPoints.size());
     {
         LOCK2(cs_main, mempool.cs);
+        *pnHeight = chainActive.Height();
+        *phashTip = chainActive.Tip()->GetBlockHash();
         CCoinsViewMemPool cvMemPool(pcoinsTip, mempool);
         CCoinsView* baseView;
         if (fCheckMemPool)
@@ -4279,6 +4914,88 @@ bool ProcessGetUTXOs(const vector<COutPoint> &vOutPoints, bool fCheckMemPool, ve
 }
 
 
+/**
+ * Find the blocks a "getcfilters" or "getcfheaders" request (BIP 157) is
+ * for: those from height nStartHeight up to the block hashStop, along the
+ * chain that ends there, at most nMaxBlocks of them. The hash of the block
+ * before the first one (null for the genesis block) goes to hashPrev.
+ * Returns false if the request is not one we can answer.
+ */
+static bool GetBlockFilterRange(uint8_t nFilterType, uint32_t nStartHeight, const uint256& hashStop,
+                                unsigned int nMaxBlocks, vector<uint256>& vHashes, uint256& hashPrev)
+{
+    if (!(nLocalServices & NODE_COMPACT_FILTERS) || nFilterType != BASIC_FILTER)
+        return error("block filters of type %d are not served", nFilterType);
+
+    LOCK(cs_main);
+    BlockMap::const_iterator it = mapBlockIndex.find(hashStop);
+    // Blocks are indexed once they have been connected (the genesis block
+    // is connected without being marked as having valid scripts).
+    if (it == mapBlockIndex.end() || !(chainActive.Contains(it->second) || it->second->IsValid(BLOCK_VALID_SCRIPTS)))
+        return error("block filters requested up to unknown block %s", hashStop.ToString());
+    const CBlockIndex* pindexStop = it->second;
+    if ((int64_t)nStartHeight > pindexStop->nHeight || pindexStop->nHeight - nStartHeight >= nMaxBlocks)
+        return error("block filters requested from height %u to %d", nStartHeight, pindexStop->nHeight);
+
+    vHashes.resize(pindexStop->nHeight - nStartHeight + 1);
+    const CBlockIndex* pindex = pindexStop;
+    for (size_t i = vHashes.size(); i > 0; i--) {
+        vHashes[i - 1] = pindex->GetBlockHash();
+        pindex = pindex->pprev;
+    }
+    hashPrev = pindex ? pindex->GetBlockHash() : uint256();
+    return true;
+}
+
+
+/** Whether blocks should be fetched from this peer as thin blocks. */
+static bool UseThinBlocks(const CNode* pnode)
+{
+    return (nLocalServices & NODE_THIN) && (pnode->nServices & NODE_THIN) && !IsStealthMode();
+}
+
+/** Give up on rebuilding a thin block and ask the peer for the full block. Requires cs_main. */
+static void RequestFullBlock(CNode* pfrom, const uint256& hash)
+{
+    AssertLockHeld(cs_main);
+    LogPrint("thin", "falling back to full block %s peer=%d\n", hash.ToString(), pfrom->id);
+    thinBlockStats.Fallback();
+    NodeStatePtr(pfrom->GetId())->thinBlockBuilder.reset();
+    vector<CInv> vGetData(1, CInv(MSG_BLOCK, hash));
+    pfrom->PushMessage("getdata", vGetData);
+}
+
+/** Take the block out of a complete builder, or fall back to the full block. Requires cs_main. */
+static bool FinishThinBlock(CNode* pfrom, CThinBlockBuilder& builder, CBlock& block)
+{
+    AssertLockHeld(cs_main);
+    uint256 hash = builder.GetHash();
+    if (!builder.Finish(block)) {
+        RequestFullBlock(pfrom, hash);
+        return false;
+    }
+    thinBlockStats.Reconstructed(::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION));
+    LogPrint("thin", "reconstructed block %s from thinblock peer=%d\n", hash.ToString(), pfrom->id);
+    return true;
+}
+
+/** Hand a block received from a peer to validation, and punish the peer if it is invalid. */
+static void ProcessBlockFromPeer(CNode* pfrom, CBlock& block)
+{
+    CValidationState state;
+    // Process all blocks from whitelisted peers, even if not requested.
+    ProcessNewBlock(state, pfrom, &block, pfrom->fWhitelisted, NULL);
+    int nDoS;
+    if (state.IsInvalid(nDoS)) {
+        pfrom->PushMessage("reject", string("block"), state.GetRejectCode(),
+                           state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), block.GetHash());
+        if (nDoS > 0) {
+            LOCK(cs_main);
+            Misbehaving(pfrom->GetId(), nDoS);
+        }
+    }
+}
+
 bool ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t nTimeReceived)
 {
     const CChainParams& chainparams = Params();
@@ -4551,8 +5268,8 @@ bool ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t
                     pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), inv.hash);
                     NodeStatePtr nodestate(pfrom->GetId());
                     if (chainActive.Tip()->GetBlockTime() > GetAdjustedTime() - chainparams.GetConsensus().nPowTargetSpacing * 20 &&
-                        nodestate->nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
-                        vToFetch.push_back(inv);
+                        nodestate->nBlocksInFlight < nodestate->nBlocksInTransitMax) {
+                        vToFetch.push_back(CInv(UseThinBlocks(pfrom) ? MSG_THIN_BLOCK : MSG_BLOCK, inv.hash));
                         // Mark block as in flight already, even though the actual "getdata" message only goes out
                         // later (within the same cs_main lock, though).
                         MarkBlockAsInFlight(pfrom->GetId(), inv.hash, chainparams.GetConsensus());
@@ -4638,38 +5355,41 @@ bool ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t
         uint256 hashStop;
         vRecv >> locator >> hashStop;
 
-        LOCK(cs_main);
-
-        if (IsInitialBlockDownload())
-            return true;
-
-        CBlockIndex* pindex = NULL;
-        if (locator.IsNull())
-        {
-            // If locator is null, return the hashStop block
-            BlockMap::iterator mi = mapBlockIndex.find(hashStop);
-            if (mi == mapBlockIndex.end())
-                return true;
-            pindex = (*mi).second;
-        }
-        else
-        {
-            // Find the last block the caller has in the main chain
-            pindex = FindForkInGlobalIndex(chainActive, locator);
-            if (pindex)
-                pindex = chainActive.Next(pindex);
-        }
-
         // we must use CBlocks, as CBlockHeaders won't include the 0x00 nTx count at the end
         vector<CBlock> vHeaders;
-        int nLimit = MAX_HEADERS_RESULTS;
-        LogPrint("net", "getheaders %d to %s from peer=%d\n", (pindex ? pindex->nHeight : -1), hashStop.ToString(), pfrom->id);
-        for (; pindex; pindex = chainActive.Next(pindex))
         {
-            vHeaders.push_back(pindex->GetBlockHeader());
-            if (--nLimit <= 0 || pindex->GetBlockHash() == hashStop)
-                break;
+            LOCK(cs_main);
+
+            if (IsInitialBlockDownload())
+                return true;
+
+            CBlockIndex* pindex = NULL;
+            if (locator.IsNull())
+            {
+                // If locator is null, return the hashStop block
+                BlockMap::iterator mi = mapBlockIndex.find(hashStop);
+                if (mi == mapBlockIndex.end())
+                    return true;
+                pindex = (*mi).second;
+            }
+            else
+            {
+                // Find the last block the caller has in the main chain
+                pindex = FindForkInGlobalIndex(chainActive, locator);
+                if (pindex)
+                    pindex = chainActive.Next(pindex);
+            }
+
+            int nLimit = MAX_HEADERS_RESULTS;
+            LogPrint("net", "getheaders %d to %s from peer=%d\n", (pindex ? pindex->nHeight : -1), hashStop.ToString(), pfrom->id);
+            for (; pindex; pindex = chainActive.Next(pindex))
+            {
+                vHeaders.push_back(pindex->GetBlockHeader());
+                if (--nLimit <= 0 || pindex->GetBlockHash() == hashStop)
+                    break;
+            }
         }
+        // Serializing and queueing the reply doesn't need cs_main
         pfrom->PushMessage("headers", vHeaders);
     }
 
@@ -4684,14 +5404,72 @@ bool ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t
 
             vector<unsigned char> bitmap;
             vector<CCoin> outs;
-            if (ProcessGetUTXOs(vOutPoints, fCheckMemPool, &bitmap, &outs))
-                pfrom->PushMessage("utxos", chainActive.Height(), chainActive.Tip()->GetBlockHash(), bitmap, outs);
+            int nHeight;
+            uint256 hashTip;
+            if (ProcessGetUTXOs(vOutPoints, fCheckMemPool, &bitmap, &outs, &nHeight, &hashTip))
+                pfrom->PushMessage("utxos", nHeight, hashTip, bitmap, outs);
             else
                 Misbehaving(pfrom->GetId(), 20);
         }
     }
 
 
+    else if (strCommand == "getcfilters")
+    {
+        uint8_t nFilterType;
+        uint32_t nStartHeight;
+        uint256 hashStop;
+        vRecv >> nFilterType >> nStartHeight >> hashStop;
+
+        vector<uint256> vHashes;
+        uint256 hashPrev;
+        if (GetBlockFilterRange(nFilterType, nStartHeight, hashStop, MAX_GETCFILTERS_SIZE, vHashes, hashPrev)) {
+            // Filters do not change once written, so they are read without cs_main.
+            BOOST_FOREACH(const uint256& hash, vHashes) {
+                CDiskBlockFilter filter;
+                if (!pblocktree->ReadBlockFilter(hash, filter)) {
+                    LogPrintf("%s: no filter for block %s\n", __func__, hash.ToString());
+                    break;
+                }
+                pfrom->PushMessage("cfilter", nFilterType, hash, filter.vFilter);
+            }
+        } else {
+            Misbehaving(pfrom->GetId(), 20);
+        }
+    }
+
+
+    else if (strCommand == "getcfheaders")
+    {
+        uint8_t nFilterType;
+        uint32_t nStartHeight;
+        uint256 hashStop;
+        vRecv >> nFilterType >> nStartHeight >> hashStop;
+
+        vector<uint256> vHashes;
+        uint256 hashPrev;
+        if (GetBlockFilterRange(nFilterType, nStartHeight, hashStop, MAX_GETCFHEADERS_SIZE, vHashes, hashPrev)) {
+            // The client checks the filter hashes against the header chain it
+            // was given: header = Hash(filter hash, previous header).
+            CDiskBlockFilter filter;
+            bool fOk = hashPrev.IsNull() || pblocktree->ReadBlockFilter(hashPrev, filter);
+            uint256 hashPrevHeader = filter.hashHeader;
+            vector<uint256> vFilterHashes;
+            vFilterHashes.reserve(vHashes.size());
+            for (size_t i = 0; fOk && i < vHashes.size(); i++) {
+                fOk = pblocktree->ReadBlockFilter(vHashes[i], filter);
+                vFilterHashes.push_back(Hash(filter.vFilter.begin(), filter.vFilter.end()));
+            }
+            if (fOk)
+                pfrom->PushMessage("cfheaders", nFilterType, hashStop, hashPrevHeader, vFilterHashes);
+            else
+                LogPrintf("%s: missing block filters up to block %s\n", __func__, hashStop.ToString());
+        } else {
+            Misbehaving(pfrom->GetId(), 20);
+        }
+    }
+
+
     else if (strCommand == "tx")
     {
         vector<uint256> vWorkQueue;
@@ -4865,19 +5643,153 @@ bool ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t
 
         pfrom->AddInventoryKnown(inv);
 
-        CValidationState state;
-        // Process all blocks from whitelisted peers, even if not requested.
-        ProcessNewBlock(state, pfrom, &block, pfrom->fWhitelisted, NULL);
-        int nDoS;
-        if (state.IsInvalid(nDoS)) {
-            pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
-                               state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
-            if (nDoS > 0) {
-                LOCK(cs_main);
-                Misbehaving(pfrom->GetId(), nDoS);
+        ProcessBlockFromPeer(pfrom, block);
+    }
+
+
+    else if (strCommand == "thinblock" && !fImporting && !fReindex) // Ignore blocks received while importing
+    {
+        size_t nBytes = vRecv.size();
+        CThinBlock thinBlock;
+        vRecv >> thinBlock;
+
+        CInv inv(MSG_BLOCK, thinBlock.header.GetHash());
+        LogPrint("thin", "received thinblock %s (%u txs) peer=%d\n", inv.hash.ToString(), thinBlock.vShortTxIDs.size(), pfrom->id);
+
+        pfrom->AddInventoryKnown(inv);
+
+        CBlock block;
+        bool fComplete = false;
+        {
+            LOCK(cs_main);
+
+            // Only rebuild blocks we asked this peer for, so nobody can make
+            // us scan the memory pool by pushing unrequested thin blocks.
+            if (FindBlockInFlight(inv.hash, pfrom->GetId()) == mapBlocksInFlight.end()) {
+                LogPrint("thin", "ignoring unrequested thinblock %s peer=%d\n", inv.hash.ToString(), pfrom->id);
+                return true;
+            }
+
+            CValidationState state;
+            if (!CheckBlockHeader(thinBlock.header, state)) {
+                int nDoS;
+                if (state.IsInvalid(nDoS) && nDoS > 0)
+                    Misbehaving(pfrom->GetId(), nDoS);
+                return error("invalid thinblock header received");
+            }
+
+            boost::shared_ptr<CThinBlockBuilder> builder(new CThinBlockBuilder(thinBlock));
+            builder->FillFromMempool(mempool);
+            for (map<uint256, COrphanTx>::iterator mi = mapOrphanTransactions.begin(); mi != mapOrphanTransactions.end() && builder->GetMissingCount() > 0; ++mi)
+                builder->AddTransaction(mi->second.tx);
+
+            size_t nPrefilled = std::min(thinBlock.vPrefilledTx.size(), builder->GetTxCount());
+            thinBlockStats.Received(builder->GetTxCount() - nPrefilled, builder->GetFromPoolCount(),
+                                    builder->IsFailed() ? 0 : builder->GetMissingCount(), nBytes);
+            LogPrint("thin", "thinblock %s: %u of %u transactions found locally, %u missing peer=%d\n", inv.hash.ToString(),
+                     builder->GetFromPoolCount(), builder->GetTxCount() - nPrefilled, builder->GetMissingCount(), pfrom->id);
+
+            if (builder->IsFailed()) {
+                RequestFullBlock(pfrom, inv.hash);
+            } else if (builder->IsComplete()) {
+                fComplete = FinishThinBlock(pfrom, *builder, block);
+            } else {
+                CThinBlockTxRequest req;
+                req.blockhash = inv.hash;
+                req.vIndexes = builder->GetMissing();
+                NodeStatePtr(pfrom->GetId())->thinBlockBuilder = builder;
+                pfrom->PushMessage("getthintx", req);
+            }
+        }
+
+        if (fComplete)
+            ProcessBlockFromPeer(pfrom, block);
+    }
+
+
+    else if (strCommand == "getthintx")
+    {
+        CThinBlockTxRequest req;
+        vRecv >> req;
+
+        LOCK(cs_main);
+
+        // Only follow-ups to a thin block we recently sent this peer, and
+        // only one for each, so a peer cannot make us send transactions of
+        // any block over and over.
+        {
+            NodeStatePtr state(pfrom->GetId());
+            std::list<uint256>::iterator it = std::find(state->listThinBlocksSent.begin(), state->listThinBlocksSent.end(), req.blockhash);
+            if (it == state->listThinBlocksSent.end()) {
+                LogPrint("thin", "ignoring getthintx for unsent thin block %s peer=%d\n", req.blockhash.ToString(), pfrom->id);
+                return true;
             }
+            state->listThinBlocksSent.erase(it);
+        }
+
+        // The block may have been pruned since.
+        BlockMap::iterator mi = mapBlockIndex.find(req.blockhash);
+        if (mi == mapBlockIndex.end() || !(mi->second->nStatus & BLOCK_HAVE_DATA)) {
+            LogPrint("thin", "ignoring getthintx for unavailable block %s peer=%d\n", req.blockhash.ToString(), pfrom->id);
+            return true;
         }
 
+        CBlock block;
+        if (!ReadBlockFromDisk(block, mi->second))
+            assert(!"cannot load block from disk");
+
+        // Indexes must be strictly ascending, so each transaction is sent at
+        // most once and the reply is never larger than the block.
+        if (req.vIndexes.size() > block.vtx.size()) {
+            Misbehaving(pfrom->GetId(), 100);
+            return error("getthintx with %u indexes for block %s of %u transactions", req.vIndexes.size(), req.blockhash.ToString(), block.vtx.size());
+        }
+        CThinBlockTx resp;
+        resp.blockhash = req.blockhash;
+        resp.vtx.reserve(req.vIndexes.size());
+        for (size_t i = 0; i < req.vIndexes.size(); i++) {
+            uint32_t nIndex = req.vIndexes[i];
+            if (nIndex >= block.vtx.size() || (i > 0 && nIndex <= req.vIndexes[i - 1])) {
+                Misbehaving(pfrom->GetId(), 100);
+                return error("getthintx index %u out of range or out of order for block %s", nIndex, req.blockhash.ToString());
+            }
+            resp.vtx.push_back(block.vtx[nIndex]);
+        }
+        pfrom->PushMessage("thintx", resp);
+    }
+
+
+    else if (strCommand == "thintx" && !fImporting && !fReindex)
+    {
+        size_t nBytes = vRecv.size();
+        CThinBlockTx resp;
+        vRecv >> resp;
+
+        CBlock block;
+        bool fComplete = false;
+        {
+            LOCK(cs_main);
+
+            boost::shared_ptr<CThinBlockBuilder> builder;
+            {
+                NodeStatePtr state(pfrom->GetId());
+                if (state->thinBlockBuilder && state->thinBlockBuilder->GetHash() == resp.blockhash) {
+                    builder = state->thinBlockBuilder;
+                    state->thinBlockBuilder.reset();
+                }
+            }
+            if (!builder) {
+                LogPrint("thin", "ignoring unrequested thintx for %s peer=%d\n", resp.blockhash.ToString(), pfrom->id);
+                return true;
+            }
+
+            thinBlockStats.ReceivedTx(nBytes);
+            builder->AddRequestedTransactions(resp.vtx);
+            fComplete = FinishThinBlock(pfrom, *builder, block);
+        }
+
+        if (fComplete)
+            ProcessBlockFromPeer(pfrom, block);
     }
 
 
@@ -4888,7 +5800,10 @@ bool ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t
     // the getaddr message mitigates the attack.
     else if ((strCommand == "getaddr") && (pfrom->fInbound))
     {
-        pfrom->vAddrToSend.clear();
+        {
+            LOCK(pfrom->cs_vAddrToSend);
+            pfrom->vAddrToSend.clear();
+        }
         vector<CAddress> vAddr = addrman.GetAddr();
         BOOST_FOREACH(const CAddress &addr, vAddr)
             pfrom->PushAddress(addr);
@@ -5005,12 +5920,20 @@ bool ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t
         vRecv >> alert;
 
         uint256 alertHash = alert.GetHash();
-        if (pfrom->setKnown.count(alertHash) == 0)
+        bool fKnown;
+        {
+            LOCK(pfrom->cs_inventory);
+            fKnown = pfrom->setKnown.count(alertHash);
+        }
+        if (!fKnown)
         {
             if (alert.ProcessAlert(Params().AlertKey()))
             {
                 // Relay
-                pfrom->setKnown.insert(alertHash);
+                {
+                    LOCK(pfrom->cs_inventory);
+                    pfrom->setKnown.insert(alertHash);
+                }
                 {
                     LOCK(cs_vNodes);
                     BOOST_FOREACH(CNode* pnode, vNodes)
@@ -5284,8 +6207,10 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             BOOST_FOREACH(CNode* pnode, vNodes)
             {
                 // Periodically clear addrKnown to allow refresh broadcasts
-                if (nLastRebroadcast)
+                if (nLastRebroadcast) {
+                    LOCK(pnode->cs_vAddrToSend);
                     pnode->addrKnown.clear();
+                }
 
                 // Rebroadcast our address
                 AdvertizeLocal(pnode);
@@ -5299,25 +6224,29 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         //
         if (fSendTrickle)
         {
+            // Other peers' threads push addresses to this node, so take
+            // them out under the lock and send them after.
+            vector<CAddress> vAddrToSend;
             vector<CAddress> vAddr;
-            vAddr.reserve(pto->vAddrToSend.size());
-            BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
             {
-                if (!pto->addrKnown.contains(addr.GetKey()))
+                LOCK(pto->cs_vAddrToSend);
+                vAddrToSend.swap(pto->vAddrToSend);
+                vAddr.reserve(vAddrToSend.size());
+                BOOST_FOREACH(const CAddress& addr, vAddrToSend)
                 {
-                    pto->addrKnown.insert(addr.GetKey());
-                    vAddr.push_back(addr);
-                    // receiver rejects addr messages larger than 1000
-                    if (vAddr.size() >= 1000)
+                    if (!pto->addrKnown.contains(addr.GetKey()))
                     {
-                        pto->PushMessage("addr", vAddr);
-                        vAddr.clear();
+                        pto->addrKnown.insert(addr.GetKey());
+                        vAddr.push_back(addr);
                     }
                 }
             }
-            pto->vAddrToSend.clear();
-            if (!vAddr.empty())
-                pto->PushMessage("addr", vAddr);
+            // receiver rejects addr messages larger than 1000
+            for (size_t i = 0; i < vAddr.size(); i += 1000)
+            {
+                vector<CAddress> vBatch(vAddr.begin() + i, vAddr.begin() + std::min(i + 1000, vAddr.size()));
+                pto->PushMessage("addr", vBatch);
+            }
         }
 
         NodeStatePtr statePtr(pto->GetId());
@@ -5366,53 +6295,73 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         //
         // Message: inventory
         //
+        // Blocks are announced as soon as possible. Transactions are
+        // announced in batches, at times that are Poisson distributed and
+        // independent for each peer, so that the order in which peers hear
+        // of a transaction tells little about where it came from. A batch
+        // holds at most INVENTORY_BROADCAST_MAX transactions; the rest wait
+        // for the next one.
+        int64_t nNow = GetTimeMicros();
+        bool fSendTxs = pto->fWhitelisted;
+        if (pto->nNextInvSend < nNow) {
+            fSendTxs = true;
+            pto->nNextInvSend = PoissonNextSend(nNow, pto->fInbound ? INVENTORY_BROADCAST_INTERVAL : INVENTORY_BROADCAST_INTERVAL / 2);
+        }
         vector<CInv> vInv;
-        vector<CInv> vInvWait;
+        vector<CInv> vInvTx;
         {
             LOCK(pto->cs_inventory);
-            vInv.reserve(pto->vInventoryToSend.size());
-            vInvWait.reserve(pto->vInventoryToSend.size());
+            vector<CInv> vInvWait;
             BOOST_FOREACH(const CInv& inv, pto->vInventoryToSend)
             {
-                if (pto->setInventoryKnown.count(inv))
+                if (pto->filterInventoryKnown.contains(inv.hash))
                     continue;
-
-                // trickle out tx inv to protect privacy
-                if (inv.type == MSG_TX && !fSendTrickle)
-                {
-                    // 1/4 of tx invs blast to all immediately
-                    static uint256 hashSalt;
-                    if (hashSalt.IsNull())
-                        hashSalt = GetRandHash();
-                    uint256 hashRand = ArithToUint256(UintToArith256(inv.hash) ^ UintToArith256(hashSalt));
-                    hashRand = Hash(BEGIN(hashRand), END(hashRand));
-                    bool fTrickleWait = ((UintToArith256(hashRand) & 3) != 0);
-
-                    if (fTrickleWait)
-                    {
-                        vInvWait.push_back(inv);
-                        continue;
-                    }
-                }
-
-                // returns true if wasn't already contained in the set
-                if (pto->setInventoryKnown.insert(inv).second)
-                {
+                if (inv.type != MSG_TX) {
+                    pto->filterInventoryKnown.insert(inv.hash);
                     vInv.push_back(inv);
-                    if (vInv.size() >= 1000)
-                    {
-                        pto->PushMessage("inv", vInv);
-                        vInv.clear();
-                    }
-                }
+                } else if (fSendTxs)
+                    vInvTx.push_back(inv);
+                else
+                    vInvWait.push_back(inv);
+            }
+            pto->vInventoryToSend.swap(vInvWait);
+        }
+        if (!vInvTx.empty()) {
+            // Transactions mined or dropped since they were queued are not
+            // announced, the peer could not get them from us. The memory pool
+            // is locked before cs_inventory elsewhere, so this is checked
+            // with the transactions out of the queue.
+            vector<CInv> vInvSend;
+            vector<CInv> vInvWait;
+            BOOST_FOREACH(const CInv& inv, vInvTx)
+            {
+                if (vInvSend.size() >= INVENTORY_BROADCAST_MAX)
+                    vInvWait.push_back(inv);
+                else if (mempool.exists(inv.hash) || relayCache.Exists(inv))
+                    vInvSend.push_back(inv);
+            }
+
+            LOCK(pto->cs_inventory);
+            pto->vInventoryToSend.insert(pto->vInventoryToSend.begin(), vInvWait.begin(), vInvWait.end());
+            BOOST_FOREACH(const CInv& inv, vInvSend)
+            {
+                // The peer may have announced it meanwhile
+                if (pto->filterInventoryKnown.contains(inv.hash))
+                    continue;
+                pto->filterInventoryKnown.insert(inv.hash);
+                vInv.push_back(inv);
             }
-            pto->vInventoryToSend = vInvWait;
         }
-        if (!vInv.empty())
-            pto->PushMessage("inv", vInv);
+        // receiver rejects inv messages larger than MAX_INV_SZ, keep to 1000
+        for (size_t i = 0; i < vInv.size(); i += 1000)
+        {
+            vector<CInv> vBatch(vInv.begin() + i, vInv.begin() + std::min(i + 1000, vInv.size()));
+            pto->PushMessage("inv", vBatch);
+            pto->nInvSent += vBatch.size();
+            pto->nInvBytesSent += CMessageHeader::HEADER_SIZE + ::GetSerializeSize(vBatch, SER_NETWORK, PROTOCOL_VERSION);
+        }
 
         // Detect whether we're stalling
-        int64_t nNow = GetTimeMicros();
         if (!pto->fDisconnect && statePtr->nStallingSince && statePtr->nStallingSince < nNow - 1000000 * BLOCK_STALLING_TIMEOUT) {
             // Stalling only triggers when the block download window cannot move. During normal steady state,
             // the download window should be much larger than the to-be-downloaded set of blocks, so disconnection
@@ -5447,12 +6396,15 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         // Message: getdata (blocks)
         //
         vector<CInv> vGetData;
-        if (!pto->fDisconnect && !pto->fClient && (fFetch || !IsInitialBlockDownload()) && statePtr->nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+        statePtr->nBlocksInTransitMax = GetBlocksInTransitMax(statePtr->nAvgBlockTime, pto->nPingUsecTime);
+        if (!pto->fDisconnect && !pto->fClient && (fFetch || !IsInitialBlockDownload()) && statePtr->nBlocksInFlight < statePtr->nBlocksInTransitMax) {
             vector<CBlockIndex*> vToDownload;
             NodeId staller = -1;
-            FindNextBlocksToDownload(pto->GetId(), MAX_BLOCKS_IN_TRANSIT_PER_PEER - statePtr->nBlocksInFlight, vToDownload, staller);
+            FindNextBlocksToDownload(pto->GetId(), statePtr->nBlocksInTransitMax - statePtr->nBlocksInFlight, vToDownload, staller);
+            // Thin blocks only pay off for blocks built from transactions we have seen.
+            int nBlockType = (!IsInitialBlockDownload() && UseThinBlocks(pto)) ? MSG_THIN_BLOCK : MSG_BLOCK;
             BOOST_FOREACH(CBlockIndex *pindex, vToDownload) {
-                vGetData.push_back(CInv(MSG_BLOCK, pindex->GetBlockHash()));
+                vGetData.push_back(CInv(nBlockType, pindex->GetBlockHash()));
                 MarkBlockAsInFlight(pto->GetId(), pindex->GetBlockHash(), consensusParams, pindex);
                 LogPrint("net", "Requesting block %s (%d) peer=%d\n", pindex->GetBlockHash().ToString(),
                     pindex->nHeight, pto->id);
@@ -35,14 +35,17 @@
 #include <utility>
 #include <vector>
 
+#include <boost/shared_ptr.hpp>
 #include <boost/unordered_map.hpp>
 
 class BlockValidationResourceTracker;
 class CBlockIndex;
 class CBlockTreeDB;
+class CCoinsViewFlusher;
 class CBloomFilter;
 class CInv;
 class CScriptCheck;
+class CTxOutSetStatsTracker;
 class CValidationInterface;
 class CValidationState;
 
@@ -61,6 +64,16 @@ static const unsigned int MAX_STANDARD_TX_SIZE = 100000;
 static const unsigned int MAX_P2SH_SIGOPS = 15;
 /** The maximum number of sigops we're willing to relay/mine in a single tx */
 static const unsigned int MAX_STANDARD_TX_SIGOPS = MAX_STANDARD_TX_SIZE/25; // one sigop per 25 bytes
+/** Default for -mempoolexpiry, expiration time for mempool transactions in hours */
+static const unsigned int DEFAULT_MEMPOOL_EXPIRY = 72;
+/** Default for -limitancestorcount, max number of in-mempool ancestors */
+static const unsigned int DEFAULT_ANCESTOR_LIMIT = 25;
+/** Default for -limitancestorsize, maximum kilobytes of tx + all in-mempool ancestors */
+static const unsigned int DEFAULT_ANCESTOR_SIZE_LIMIT = 101;
+/** Default for -limitdescendantcount, max number of in-mempool descendants */
+static const unsigned int DEFAULT_DESCENDANT_LIMIT = 25;
+/** Default for -limitdescendantsize, maximum kilobytes of in-mempool descendants */
+static const unsigned int DEFAULT_DESCENDANT_SIZE_LIMIT = 101;
 /** Default for -maxorphantx, maximum number of orphan transactions kept in memory */
 static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS = 100;
 /** Minimum number of max-sized blocks in blk?????.dat files */
@@ -73,8 +86,17 @@ static const unsigned int UNDOFILE_CHUNK_SIZE = 0x100000; // 1 MiB
 static const int MAX_SCRIPTCHECK_THREADS = 16;
 /** -par default (number of script-checking threads, 0 = auto) */
 static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
-/** Number of blocks that can be requested at any given time from a single peer. */
-static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
+/** Number of blocks that can be requested at any given time from a single peer, until its download speed is measured. */
+static const int DEFAULT_BLOCKS_IN_TRANSIT_PER_PEER = 16;
+/** Bounds of the number of blocks in flight from a single peer, which is sized by its download speed. */
+static const int MIN_BLOCKS_IN_TRANSIT_PER_PEER = 2;
+static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 128;
+/** Seconds of downloading, on top of the round trip time, that the blocks in flight from a peer should cover. */
+static const unsigned int BLOCK_DOWNLOAD_TARGET_TIME = 5;
+/** Maximum number of peers a block is requested from at the same time. */
+static const int MAX_BLOCK_REQUESTS = 2;
+/** Timeout in seconds after which a block close to the tip is also requested from another peer. */
+static const unsigned int BLOCK_REDUNDANT_FETCH_TIMEOUT = 2;
 /** Timeout in seconds during which a peer must stall block download progress before being disconnected. */
 static const unsigned int BLOCK_STALLING_TIMEOUT = 2;
 /** Number of headers sent in one getheaders result. We rely on the assumption that if a peer sends
@@ -113,6 +135,8 @@ extern bool fImporting;
 extern bool fReindex;
 extern int nScriptCheckThreads;
 extern bool fTxIndex;
+/** Whether compact block filters are kept for light clients (-blockfilterindex) */
+extern bool fBlockFilterIndex;
 extern bool fIsBareMultisigStd;
 extern bool fCheckBlockIndex;
 extern bool fCheckpointsEnabled;
@@ -169,6 +193,8 @@ void UnregisterNodeSignals(CNodeSignals& nodeSignals);
 bool ProcessNewBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, bool fForceProcessing, CDiskBlockPos *dbp);
 /** Check whether enough disk space is available for an incoming block */
 bool CheckDiskSpace(uint64_t nAdditionalBytes = 0);
+/** Open a block or undo file, named by prefix, at pos */
+FILE* OpenDiskFile(const CDiskBlockPos &pos, const char *prefix, bool fReadOnly);
 /** Open a block file (blk?????.dat) */
 FILE* OpenBlockFile(const CDiskBlockPos &pos, bool fReadOnly = false);
 /** Open an undo file (rev?????.dat) */
@@ -191,11 +217,14 @@ bool ProcessMessage(CNode* pfrom, std::string strCommand, CDataStream& vRecv, in
  * Send queued protocol messages to be sent to a give node.
  *
  * @param[in]   pto             The node which we are sending messages to.
- * @param[in]   fSendTrickle    When true send the trickled data, otherwise trickle the data until true.
+ * @param[in]   fSendTrickle    When true send the trickled addresses, otherwise trickle them until true.
+ *                              Transactions are announced on a schedule of their own for each node.
  */
 bool SendMessages(CNode* pto, bool fSendTrickle);
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/** Run an instance of the thread checking the inputs of block transactions */
+void ThreadTxInputsCheck();
 /** Try to detect Partition (network isolation) attacks against us */
 void PartitionCheck(bool (*initialDownloadCheck)(), CCriticalSection& cs, const CBlockIndex *const &bestHeader, int64_t nPowTargetSpacing);
 /** Check whether we are doing an initial block download (synchronizing from disk or network) */
@@ -241,6 +270,8 @@ void FlushStateToDisk();
 /** Prune block files and flush state to disk. */
 void PruneAndFlush();
 
+/** The -maxmempool limit in bytes, or 0 if the memory pool is not limited */
+uint64_t GetMaxMempoolSize();
 /** (try to) add transaction to memory pool **/
 bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
                         bool* pfMissingInputs, bool fRejectAbsurdFee=false);
@@ -251,6 +282,12 @@ struct CNodeStateStats {
     int nSyncHeight;
     int nCommonHeight;
     std::vector<int> vHeightInFlight;
+    int nBlocksInTransitMax;
+    int nBlocksDownloaded;
+    uint64_t nBlockBytesDownloaded;
+    int nBlocksTakenOver;
+    int64_t nBlockDownloadTime; //! Average microseconds per block, or 0 if not measured
+    int64_t nBlockDownloadRate; //! Average bytes per second, or 0 if not measured
 };
 
 struct CDiskTxPos : public CDiskBlockPos
@@ -386,6 +423,8 @@ public:
         LOCK(cs);
         return nSighashBytes;
     }
+    uint64_t GetMaxSigOps() const { return nMaxSigops; }
+    uint64_t GetMaxSighashBytes() const { return nMaxSighashBytes; }
 };
 
 /** 
@@ -398,6 +437,7 @@ private:
     BlockValidationResourceTracker* resourceTracker;
     CScript scriptPubKey;
     const CTransaction *ptxTo;
+    boost::shared_ptr<const PrecomputedTransactionData> txdata; //! Shared by the checks of all inputs of ptxTo
     unsigned int nIn;
     unsigned int nFlags;
     bool cacheStore;
@@ -405,9 +445,10 @@ private:
 
 public:
     CScriptCheck(): resourceTracker(NULL), ptxTo(0), nIn(0), nFlags(0), cacheStore(false), error(SCRIPT_ERR_UNKNOWN_ERROR) {}
-    CScriptCheck(BlockValidationResourceTracker* resourceTrackerIn, const CCoins& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, bool cacheIn) :
+    CScriptCheck(BlockValidationResourceTracker* resourceTrackerIn, const CCoins& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, bool cacheIn,
+                 const boost::shared_ptr<const PrecomputedTransactionData>& txdataIn = boost::shared_ptr<const PrecomputedTransactionData>()) :
         resourceTracker(resourceTrackerIn), scriptPubKey(txFromIn.vout[txToIn.vin[nInIn].prevout.n].scriptPubKey),
-        ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), cacheStore(cacheIn), error(SCRIPT_ERR_UNKNOWN_ERROR) { }
+        ptxTo(&txToIn), txdata(txdataIn), nIn(nInIn), nFlags(nFlagsIn), cacheStore(cacheIn), error(SCRIPT_ERR_UNKNOWN_ERROR) { }
 
     bool operator()();
 
@@ -415,6 +456,7 @@ public:
         std::swap(resourceTracker, check.resourceTracker);
         scriptPubKey.swap(check.scriptPubKey);
         std::swap(ptxTo, check.ptxTo);
+        txdata.swap(check.txdata);
         std::swap(nIn, check.nIn);
         std::swap(nFlags, check.nFlags);
         std::swap(cacheStore, check.cacheStore);
@@ -428,6 +470,14 @@ public:
 /** Functions for disk access for blocks */
 bool WriteBlockToDisk(CBlock& block, CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& messageStart);
 bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos);
+/** Append the block stored at pos to ss as is, without deserializing it */
+bool ReadRawBlockFromDisk(CDataStream& ss, const CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& messageStart);
+/**
+ * The "block" message for the block with hash stored at pos, ready to send.
+ * Taken from rawBlockCache, or read from disk and added to it. NULL if the
+ * block can't be read.
+ */
+CSerializeDataRef GetBlockMessage(const uint256& hash, const CDiskBlockPos& pos);
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex);
 
 
@@ -436,11 +486,13 @@ bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex);
 /** Undo the effects of this block (with given index) on the UTXO set represented by coins.
  *  In case pfClean is provided, operation will try to be tolerant about errors, and *pfClean
  *  will be true if no problems were found. Otherwise, the return value will be false in case
- *  of problems. Note that in any case, coins may be modified. */
-bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& coins, bool* pfClean = NULL);
+ *  of problems. Note that in any case, coins may be modified. The outputs removed and restored
+ *  are added to pstats, if given. */
+bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& coins, bool* pfClean = NULL, CTxOutSetStats* pstats = NULL);
 
-/** Apply the effects of this block (with given index) on the UTXO set represented by coins */
-bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& coins, bool fJustCheck = false);
+/** Apply the effects of this block (with given index) on the UTXO set represented by coins.
+ *  The outputs spent and created are added to pstats, if given. */
+bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& coins, bool fJustCheck = false, CTxOutSetStats* pstats = NULL);
 
 /** Context-independent validity checks */
 bool CheckBlockHeader(const CBlockHeader& block, CValidationState& state, bool fCheckPOW = true);
@@ -536,6 +588,12 @@ extern CChain chainActive;
 /** Global variable that points to the active CCoinsView (protected by cs_main) */
 extern CCoinsViewCache *pcoinsTip;
 
+/** Global variable that points to the writer behind pcoinsTip, if any (protected by cs_main) */
+extern CCoinsViewFlusher *pcoinsflusher;
+
+/** Output statistics of the UTXO set at the tip, kept up to date as blocks are connected and disconnected */
+extern CTxOutSetStatsTracker txoutsetstats;
+
 /** Global variable that points to the active block tree (protected by cs_main) */
 extern CBlockTreeDB *pblocktree;
 
@@ -5,6 +5,9 @@
 #ifndef BITCOIN_MEMUSAGE_H
 #define BITCOIN_MEMUSAGE_H
 
+#include "prevector.h"
+#include "support/allocators/pooled.h"
+
 #include <stdlib.h>
 
 #include <map>
@@ -28,10 +31,12 @@ static size_t MallocUsage(size_t alloc);
  *  do the recursion themselves, or use more efficient caching + updating on modification.
  */
 template<typename X> static size_t DynamicUsage(const std::vector<X>& v);
+template<unsigned int N, typename X, typename S, typename D> static size_t DynamicUsage(const prevector<N, X, S, D>& v);
 template<typename X> static size_t DynamicUsage(const std::set<X>& s);
 template<typename X, typename Y> static size_t DynamicUsage(const std::map<X, Y>& m);
 template<typename X, typename Y> static size_t DynamicUsage(const boost::unordered_set<X, Y>& s);
 template<typename X, typename Y, typename Z> static size_t DynamicUsage(const boost::unordered_map<X, Y, Z>& s);
+template<typename X, typename Y, typename Z> static size_t DynamicUsage(const boost::unordered_map<X, Y, Z, std::equal_to<X>, pooled_allocator<std::pair<const X, Y> > >& s);
 template<typename X> static size_t DynamicUsage(const X& x);
 
 static inline size_t MallocUsage(size_t alloc)
@@ -65,6 +70,13 @@ static inline size_t DynamicUsage(const std::vector<X>& v)
     return MallocUsage(v.capacity() * sizeof(X));
 }
 
+template<unsigned int N, typename X, typename S, typename D>
+static inline size_t DynamicUsage(const prevector<N, X, S, D>& v)
+{
+    // Nothing is allocated while the elements fit in the prevector itself
+    return v.allocated_memory() ? MallocUsage(v.allocated_memory()) : 0;
+}
+
 template<typename X>
 static inline size_t DynamicUsage(const std::set<X>& s)
 {
@@ -98,6 +110,13 @@ static inline size_t DynamicUsage(const boost::unordered_map<X, Y, Z>& m)
     return MallocUsage(sizeof(boost_unordered_node<std::pair<const X, Y> >)) * m.size() + MallocUsage(sizeof(void*) * m.bucket_count());
 }
 
+template<typename X, typename Y, typename Z>
+static inline size_t DynamicUsage(const boost::unordered_map<X, Y, Z, std::equal_to<X>, pooled_allocator<std::pair<const X, Y> > >& m)
+{
+    // Nodes come from a pool, without malloc's overhead
+    return sizeof(boost_unordered_node<std::pair<const X, Y> >) * m.size() + MallocUsage(sizeof(void*) * m.bucket_count());
+}
+
 // Dispatch to class method as fallback
 
 template<typename X>
@@ -21,6 +21,7 @@
 #include "wallet/wallet.h"
 #endif
 
+#include <boost/scoped_ptr.hpp>
 #include <boost/thread.hpp>
 #include <boost/tuple/tuple.hpp>
 
@@ -31,348 +32,576 @@ using namespace std;
 // BitcoinMiner
 //
 
+uint64_t nLastBlockTx = 0;
+uint64_t nLastBlockSize = 0;
+
 //
 // Unconfirmed transactions in the memory pool often depend on other
-// transactions in the memory pool. When we select transactions from the
-// pool, we select by highest priority or fee rate, so we might consider
-// transactions that depend on transactions that aren't yet in the block.
-// The COrphan class keeps track of these 'temporary orphans' while
-// CreateBlock is figuring out which transactions to include.
+// transactions in the memory pool, and can only go into a block after
+// them. The mempool keeps, for every transaction, the size and fees of the
+// package made of it and all its unconfirmed ancestors, and blocks are
+// filled package by package, best ancestor fee rate first. That way a
+// child paying a high fee pulls in its low-fee parents.
+//
+// Once some of a transaction's ancestors are in the block, only the rest
+// of its package remains to be paid for. CPackageScore holds those reduced
+// totals while the block is being assembled.
 //
-class COrphan
+namespace {
+
+struct CPackageScore
 {
-public:
-    const CTransaction* ptx;
-    set<uint256> setDependsOn;
-    CFeeRate feeRate;
-    double dPriority;
+    uint256 hash;
+    uint64_t nSizeWithAncestors;
+    CAmount nModFeesWithAncestors;
 
-    COrphan(const CTransaction* ptxIn) : ptx(ptxIn), feeRate(0), dPriority(0)
+    CPackageScore(const CTxMemPoolEntry& entry) :
+        hash(entry.GetTx().GetHash()),
+        nSizeWithAncestors(entry.GetSizeWithAncestors()),
+        nModFeesWithAncestors(entry.GetModFeesWithAncestors()) { }
+
+    bool operator<(const CPackageScore& other) const
     {
+        // Highest ancestor fee rate first
+        double f1 = (double)nModFeesWithAncestors * other.nSizeWithAncestors;
+        double f2 = (double)other.nModFeesWithAncestors * nSizeWithAncestors;
+        if (f1 == f2)
+            return hash < other.hash;
+        return f1 > f2;
     }
 };
 
-uint64_t nLastBlockTx = 0;
-uint64_t nLastBlockSize = 0;
+/** Ancestors have fewer ancestors than their descendants. */
+struct CompareEntryByAncestorCount
+{
+    bool operator()(const CTxMemPoolEntry* a, const CTxMemPoolEntry* b) const
+    {
+        return a->GetCountWithAncestors() < b->GetCountWithAncestors();
+    }
+};
 
 // We want to sort transactions by priority and fee rate, so:
-typedef boost::tuple<double, CFeeRate, const CTransaction*> TxPriority;
+typedef boost::tuple<double, CFeeRate, const CTxMemPoolEntry*> TxPriority;
 class TxPriorityCompare
 {
-    bool byFee;
-
 public:
-    TxPriorityCompare(bool _byFee) : byFee(_byFee) { }
-
     bool operator()(const TxPriority& a, const TxPriority& b)
     {
-        if (byFee)
-        {
-            if (a.get<1>() == b.get<1>())
-                return a.get<0>() < b.get<0>();
+        if (a.get<0>() == b.get<0>())
             return a.get<1>() < b.get<1>();
-        }
-        else
-        {
-            if (a.get<0>() == b.get<0>())
-                return a.get<1>() < b.get<1>();
-            return a.get<0>() < b.get<0>();
-        }
+        return a.get<0>() < b.get<0>();
     }
 };
 
-void UpdateTime(CBlockHeader* pblock, const Consensus::Params& consensusParams, const CBlockIndex* pindexPrev)
+/** The block being assembled and what has been spent to fill it. */
+class CBlockBuilder
 {
-    pblock->nTime = std::max(pindexPrev->GetMedianTimePast()+1, GetAdjustedTime());
+public:
+    enum Result {
+        ADDED,
+        FAILED, //! the package doesn't fit or isn't valid; try others
+        FULL,   //! the block hit its signature checking limits
+    };
+
+    CBlockTemplate& blocktemplate;
+    const CChainParams& chainparams;
+    CCoinsViewCache& view;
+    BlockValidationResourceTracker& resourceTracker;
+    int nHeight;
+    uint64_t nBlockTime;
+    uint64_t nBlockMaxSize;
+
+    uint64_t nBlockSize;
+    uint64_t nBlockTx;
+    int nBlockSigOps;
+    CAmount nFees;
+    std::set<uint256> setInBlock;
+    //! Fee rate of the last package selected by fee, the lowest of them
+    CFeeRate rateLowest;
+    bool fPrintPriority;
+
+    CBlockBuilder(CBlockTemplate& blocktemplateIn, const CChainParams& chainparamsIn, CCoinsViewCache& viewIn,
+                  BlockValidationResourceTracker& resourceTrackerIn, int nHeightIn, uint64_t nBlockMaxSizeIn) :
+        blocktemplate(blocktemplateIn), chainparams(chainparamsIn), view(viewIn), resourceTracker(resourceTrackerIn),
+        nHeight(nHeightIn), nBlockTime(blocktemplateIn.block.GetBlockTime()), nBlockMaxSize(nBlockMaxSizeIn),
+        nBlockSize(1000), nBlockTx(0), nBlockSigOps(100), nFees(0)
+    {
+        fPrintPriority = GetBoolArg("-printpriority", false);
+    }
 
-    // Updating time can change work required on testnet:
-    if (consensusParams.fPowAllowMinDifficultyBlocks)
-        pblock->nBits = GetNextWorkRequired(pindexPrev, pblock, consensusParams);
-}
+    /**
+     * Add the transactions of vPackage, in order, if all of them fit and are
+     * valid, or none of them.
+     */
+    Result AddPackage(const std::vector<const CTxMemPoolEntry*>& vPackage)
+    {
+        const uint64_t nMaxSigOps = chainparams.GetConsensus().MaxBlockLegacySigops(nBlockTime, sizeForkTime.load());
+        // A single transaction is checked in full before it spends anything,
+        // so only packages need a view to throw away on failure.
+        boost::scoped_ptr<CCoinsViewCache> pviewPackage;
+        if (vPackage.size() > 1)
+            pviewPackage.reset(new CCoinsViewCache(&view));
+        CCoinsViewCache& viewPackage = pviewPackage ? *pviewPackage : view;
+        // Likewise the package is charged against what is left of the
+        // block's limits, and only counts towards them once it is added.
+        BlockValidationResourceTracker packageTracker(
+            resourceTracker.GetMaxSigOps() - std::min(resourceTracker.GetSigOps(), resourceTracker.GetMaxSigOps()),
+            resourceTracker.GetMaxSighashBytes() - std::min(resourceTracker.GetSighashBytes(), resourceTracker.GetMaxSighashBytes()));
+        std::vector<CAmount> vTxFees;
+        std::vector<int64_t> vTxSigOps;
+        uint64_t nPackageSize = 0;
+        int nPackageSigOps = 0;
+        BOOST_FOREACH(const CTxMemPoolEntry* pentry, vPackage)
+        {
+            const CTransaction& tx = pentry->GetTx();
+            nPackageSize += pentry->GetTxSize();
+            if (nBlockSize + nPackageSize >= nBlockMaxSize)
+                return FAILED;
+            if (!IsFinalTx(tx, nHeight, blocktemplate.block.nTime))
+                return FAILED;
 
-CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
-{
-    const CChainParams& chainparams = Params();
-    // Create new block
-    auto_ptr<CBlockTemplate> pblocktemplate(new CBlockTemplate());
-    if(!pblocktemplate.get())
-        return NULL;
-    CBlock *pblock = &pblocktemplate->block; // pointer for convenience
+            // Legacy limits on sigOps:
+            unsigned int nTxSigOps = GetLegacySigOpCount(tx);
+            if (nBlockSigOps + nPackageSigOps + nTxSigOps >= nMaxSigOps)
+                return FAILED;
 
-    uint64_t maxAccurateSigops = chainparams.GetConsensus().MaxBlockAccurateSigops(pblock->GetBlockTime(), sizeForkTime.load());
-    uint64_t maxSighashBytes = chainparams.GetConsensus().MaxBlockSighashBytes(pblock->GetBlockTime(), sizeForkTime.load());
-    BlockValidationResourceTracker resourceTracker(maxAccurateSigops, maxSighashBytes);
+            if (!viewPackage.HaveInputs(tx))
+                return FAILED;
 
-    // -regtest only: allow overriding block.nVersion with
-    // -blockversion=N to test forking scenarios
-    if (Params().MineBlocksOnDemand())
-        pblock->nVersion = GetArg("-blockversion", pblock->nVersion);
+            CAmount nTxFees = viewPackage.GetValueIn(tx)-tx.GetValueOut();
 
-    // Create coinbase tx
-    CMutableTransaction txNew;
-    txNew.vin.resize(1);
-    txNew.vin[0].prevout.SetNull();
-    txNew.vout.resize(1);
-    txNew.vout[0].scriptPubKey = scriptPubKeyIn;
+            nTxSigOps += GetP2SHSigOpCount(tx, viewPackage);
+            if (nBlockSigOps + nPackageSigOps + nTxSigOps >= nMaxSigOps)
+                return FAILED;
 
-    // Add dummy coinbase tx as first transaction
-    pblock->vtx.push_back(CTransaction());
-    pblocktemplate->vTxFees.push_back(-1); // updated at end
-    pblocktemplate->vTxSigOps.push_back(-1); // updated at end
+            // Note that flags: we don't want to set mempool/IsStandard()
+            // policy here, but we still have to ensure that the block we
+            // create only contains transactions that are valid in new blocks.
+            CValidationState state;
+            if (!CheckInputs(tx, state, viewPackage, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true, &packageTracker))
+            {
+                // If CheckInputs fails because adding the transaction would hit
+                // per-block limits on sigops or sighash bytes, stop building the block
+                // right away. It is _possible_ we have another transaction in the mempool
+                // that wouldn't trigger the limits, but that case isn't worth optimizing
+                // for, because those limits are very difficult to hit with a mempool full of
+                // transactions that pass the IsStandard() test.
+                if (!packageTracker.IsWithinLimits())
+                    return FULL;
+                // If CheckInputs fails for some other reason,
+                // continue to consider other transactions for inclusion
+                // in this block. This should almost never happen-- it
+                // could theoretically happen if a timelocked transaction
+                // entered the mempool after the lock time, but then the
+                // blockchain re-orgs to a more-work chain with a lower
+                // height or time.
+                return FAILED;
+            }
 
-    // Collect memory pool transactions into the block
-    CAmount nFees = 0;
+            UpdateCoins(tx, state, viewPackage, nHeight);
+            vTxFees.push_back(nTxFees);
+            vTxSigOps.push_back(nTxSigOps);
+            nPackageSigOps += nTxSigOps;
+        }
 
-    {
-        LOCK2(cs_main, mempool.cs);
-        CBlockIndex* pindexPrev = chainActive.Tip();
-        const int nHeight = pindexPrev->nHeight + 1;
-        pblock->nTime = GetAdjustedTime();
-        CCoinsViewCache view(pcoinsTip);
-
-        UpdateTime(pblock, Params().GetConsensus(), pindexPrev);
-        uint64_t nBlockTime = pblock->GetBlockTime();
-
-        uint64_t nConsensusMaxSize = chainparams.GetConsensus().MaxBlockSize(nBlockTime, sizeForkTime.load());
-        // Largest block you're willing to create, defaults to being the biggest possible.
-        // Miners can adjust downwards if they wish to throttle their blocks, for instance, to work around
-        // high orphan rates or other scaling problems.
-        uint64_t nBlockMaxSize = (uint64_t) GetArg("-blockmaxsize", nConsensusMaxSize);
-        // Limit to betweeen 1K and MAX_BLOCK_SIZE-1K for sanity:
-        nBlockMaxSize = std::max((uint64_t)1000,
-                                 std::min(nConsensusMaxSize-1000, nBlockMaxSize));
-
-        // How much of the block should be dedicated to high-priority transactions,
-        // included regardless of the fees they pay. This is to help people who want
-        // to make free transactions and don't mind waiting a while: coin age stands
-        // in for the monetary value of the fee. Defaults to an arbitrary 5% of the
-        // current max block size.
-        uint64_t nBlockPrioritySize = (uint64_t) GetArg("-blockprioritysize", nBlockMaxSize / DEFAULT_BLOCK_PRIORITY_SIZE_FRAC);
-        nBlockPrioritySize = std::min(nBlockMaxSize, nBlockPrioritySize);
-
-        // Minimum block size you want to create; block will be filled with free transactions
-        // until there are no more or the block reaches this size:
-        uint64_t nBlockMinSize = GetArg("-blockminsize", DEFAULT_BLOCK_MIN_SIZE);
-        nBlockMinSize = std::min(nBlockMaxSize, nBlockMinSize);
-
-        // Priority order to process transactions
-        list<COrphan> vOrphan; // list memory doesn't move
-        map<uint256, vector<COrphan*> > mapDependers;
-        bool fPrintPriority = GetBoolArg("-printpriority", false);
-
-        // This vector will be sorted into a priority queue:
-        vector<TxPriority> vecPriority;
-        vecPriority.reserve(mempool.mapTx.size());
-        for (map<uint256, CTxMemPoolEntry>::iterator mi = mempool.mapTx.begin();
-             mi != mempool.mapTx.end(); ++mi)
+        // Added
+        if (pviewPackage)
+            pviewPackage->Flush();
+        resourceTracker.Update(vPackage.back()->GetTx().GetHash(), packageTracker.GetSigOps(), packageTracker.GetSighashBytes());
+        for (size_t i = 0; i < vPackage.size(); i++)
         {
-            const CTransaction& tx = mi->second.GetTx();
-            if (tx.IsCoinBase() || !IsFinalTx(tx, nHeight, pblock->nTime))
-                continue;
+            const CTxMemPoolEntry& entry = *vPackage[i];
+            blocktemplate.block.vtx.push_back(entry.GetTx());
+            blocktemplate.vTxFees.push_back(vTxFees[i]);
+            blocktemplate.vTxSigOps.push_back(vTxSigOps[i]);
+            nBlockSize += entry.GetTxSize();
+            ++nBlockTx;
+            nBlockSigOps += vTxSigOps[i];
+            nFees += vTxFees[i];
+            setInBlock.insert(entry.GetTx().GetHash());
 
-            COrphan* porphan = NULL;
-            double dPriority = 0;
-            CAmount nTotalIn = 0;
-            bool fMissingInputs = false;
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            if (fPrintPriority)
             {
-                // Read prev transaction
-                if (!view.HaveCoins(txin.prevout.hash))
-                {
-                    // This should never happen; all transactions in the memory
-                    // pool should connect to either transactions in the chain
-                    // or other transactions in the memory pool.
-                    if (!mempool.mapTx.count(txin.prevout.hash))
-                    {
-                        LogPrintf("ERROR: mempool transaction missing input\n");
-                        if (fDebug) assert("mempool transaction missing input" == 0);
-                        fMissingInputs = true;
-                        if (porphan)
-                            vOrphan.pop_back();
-                        break;
-                    }
+                double dPriority = entry.GetPriority(nHeight);
+                CAmount nFeeDelta = 0;
+                mempool.ApplyDeltas(entry.GetTx().GetHash(), dPriority, nFeeDelta);
+                LogPrintf("priority %.1f fee %s txid %s\n",
+                    dPriority, CFeeRate(entry.GetModifiedFee(), entry.GetTxSize()).ToString(), entry.GetTx().GetHash().ToString());
+            }
+        }
+        return ADDED;
+    }
 
-                    // Has to wait for dependencies
-                    if (!porphan)
-                    {
-                        // Use list for automatic deletion
-                        vOrphan.push_back(COrphan(&tx));
-                        porphan = &vOrphan.back();
-                    }
-                    mapDependers[txin.prevout.hash].push_back(porphan);
-                    porphan->setDependsOn.insert(txin.prevout.hash);
-                    nTotalIn += mempool.mapTx[txin.prevout.hash].GetTx().vout[txin.prevout.n].nValue;
-                    continue;
-                }
-                const CCoins* coins = view.AccessCoins(txin.prevout.hash);
-                assert(coins);
+    /** Whether all the in-mempool parents of tx are already in the block. */
+    bool HasParentsInBlock(const CTransaction& tx, uint256& hashMissing) const
+    {
+        BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+            if (mempool.mapTx.count(txin.prevout.hash) && !setInBlock.count(txin.prevout.hash)) {
+                hashMissing = txin.prevout.hash;
+                return false;
+            }
+        }
+        return true;
+    }
+};
 
-                CAmount nValueIn = coins->vout[txin.prevout.n].nValue;
-                nTotalIn += nValueIn;
+/**
+ * Fill the space reserved for high-priority transactions, which are
+ * included regardless of the fees they pay.
+ */
+void AddPriorityTxs(CBlockBuilder& builder, uint64_t nBlockPrioritySize)
+{
+    if (nBlockPrioritySize == 0)
+        return;
 
-                int nConf = nHeight - coins->nHeight;
+    // This vector will be sorted into a priority queue:
+    std::vector<TxPriority> vecPriority;
+    vecPriority.reserve(mempool.mapTx.size());
+    for (CTxMemPool::indexed_transaction_set::const_iterator mi = mempool.mapTx.begin();
+         mi != mempool.mapTx.end(); ++mi)
+    {
+        double dPriority = mi->GetPriority(builder.nHeight);
+        CAmount nFeeDelta = 0;
+        mempool.ApplyDeltas(mi->GetTx().GetHash(), dPriority, nFeeDelta);
+        vecPriority.push_back(TxPriority(dPriority, CFeeRate(mi->GetModifiedFee(), mi->GetTxSize()), &*mi));
+    }
 
-                dPriority += (double)nValueIn * nConf;
-            }
-            if (fMissingInputs) continue;
+    TxPriorityCompare comparer;
+    std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
 
-            // Priority is sum(valuein * age) / modified_txsize
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            dPriority = tx.ComputePriority(dPriority, nTxSize);
+    // Transactions waiting for a parent to be included
+    std::map<uint256, std::vector<TxPriority> > mapWaiting;
+
+    while (!vecPriority.empty())
+    {
+        // Take highest priority transaction off the priority queue:
+        TxPriority item = vecPriority.front();
+        std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
+        vecPriority.pop_back();
+
+        const CTxMemPoolEntry& entry = *item.get<2>();
+
+        // Prioritise by fee once past the priority size or we run out of high-priority
+        // transactions:
+        if (builder.nBlockSize + entry.GetTxSize() >= nBlockPrioritySize || !AllowFree(item.get<0>()))
+            break;
+
+        uint256 hashMissing;
+        if (!builder.HasParentsInBlock(entry.GetTx(), hashMissing)) {
+            mapWaiting[hashMissing].push_back(item);
+            continue;
+        }
+
+        CBlockBuilder::Result result = builder.AddPackage(std::vector<const CTxMemPoolEntry*>(1, &entry));
+        if (result == CBlockBuilder::FULL)
+            break;
+        if (result != CBlockBuilder::ADDED)
+            continue;
+
+        // Transactions that were waiting for this one can be tried again
+        std::map<uint256, std::vector<TxPriority> >::iterator it = mapWaiting.find(entry.GetTx().GetHash());
+        if (it != mapWaiting.end()) {
+            BOOST_FOREACH(const TxPriority& waiting, it->second) {
+                vecPriority.push_back(waiting);
+                std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
+            }
+            mapWaiting.erase(it);
+        }
+    }
+}
 
-            uint256 hash = tx.GetHash();
-            mempool.ApplyDeltas(hash, dPriority, nTotalIn);
+/**
+ * Take a transaction that went into the block out of the packages of its
+ * descendants that didn't.
+ */
+void UpdatePackagesForAdded(const CTxMemPoolEntry& in, const std::set<uint256>& setInBlock,
+                            std::map<uint256, CPackageScore>& mapModified, std::set<CPackageScore>& setModified)
+{
+    std::set<uint256> setDescendants;
+    mempool.CalculateDescendants(in.GetTx().GetHash(), setDescendants);
+    BOOST_FOREACH(const uint256& hashDescendant, setDescendants) {
+        if (setInBlock.count(hashDescendant))
+            continue;
+        std::map<uint256, CPackageScore>::iterator it = mapModified.find(hashDescendant);
+        if (it == mapModified.end())
+            it = mapModified.insert(std::make_pair(hashDescendant, CPackageScore(*mempool.mapTx.find(hashDescendant)))).first;
+        else
+            setModified.erase(it->second);
+        it->second.nSizeWithAncestors -= in.GetTxSize();
+        it->second.nModFeesWithAncestors -= in.GetModifiedFee();
+        setModified.insert(it->second);
+    }
+}
 
-            CFeeRate feeRate(nTotalIn-tx.GetValueOut(), nTxSize);
+/** Give up on filling the block after this many packages in a row didn't fit */
+static const int MAX_CONSECUTIVE_FAILURES = 1000;
 
-            if (porphan)
-            {
-                porphan->dPriority = dPriority;
-                porphan->feeRate = feeRate;
+/**
+ * Fill the rest of the block with packages of transactions, in order of
+ * the fee rate of the transactions together with their ancestors.
+ */
+void AddPackageTxs(CBlockBuilder& builder, uint64_t nBlockMinSize)
+{
+    // The mempool keeps its entries sorted by ancestor fee rate already
+    typedef CTxMemPool::indexed_transaction_set::index<ancestor_score>::type::const_iterator byancestor_iter;
+    byancestor_iter mi = mempool.mapTx.get<ancestor_score>().begin();
+    const byancestor_iter miEnd = mempool.mapTx.get<ancestor_score>().end();
+
+    // Transactions with some of their ancestors in the block, by what is
+    // left of their package; they are taken from here instead of mapTx.
+    std::map<uint256, CPackageScore> mapModified;
+    std::set<CPackageScore> setModified;
+    std::set<uint256> setFailed;
+
+    // Ancestors already in the block (from the priority space) count as paid for
+    BOOST_FOREACH(const uint256& hash, builder.setInBlock)
+        UpdatePackagesForAdded(*mempool.mapTx.find(hash), builder.setInBlock, mapModified, setModified);
+
+    int nPackages = 0;
+    int nConsecutiveFailed = 0;
+    while (mi != miEnd || !setModified.empty())
+    {
+        // Skip entries that are already handled, or whose package changed
+        if (mi != miEnd) {
+            const uint256& hash = mi->GetTx().GetHash();
+            if (builder.setInBlock.count(hash) || mapModified.count(hash) || setFailed.count(hash)) {
+                ++mi;
+                continue;
             }
-            else
-                vecPriority.push_back(TxPriority(dPriority, feeRate, &mi->second.GetTx()));
         }
 
-        // Collect transactions into block
-        uint64_t nBlockSize = 1000;
-        uint64_t nBlockTx = 0;
-        int nBlockSigOps = 100;
-        bool fSortedByFee = (nBlockPrioritySize <= 0);
+        // Take the better of the best untouched and the best modified package
+        const CTxMemPoolEntry* pentry;
+        uint64_t nPackageSize;
+        CAmount nPackageFees;
+        bool fModified = mi == miEnd || (!setModified.empty() && *setModified.begin() < CPackageScore(*mi));
+        if (fModified) {
+            const CPackageScore& best = *setModified.begin();
+            pentry = &*mempool.mapTx.find(best.hash);
+            nPackageSize = best.nSizeWithAncestors;
+            nPackageFees = best.nModFeesWithAncestors;
+            setModified.erase(setModified.begin());
+            mapModified.erase(pentry->GetTx().GetHash());
+        } else {
+            pentry = &*mi;
+            nPackageSize = pentry->GetSizeWithAncestors();
+            nPackageFees = pentry->GetModFeesWithAncestors();
+            ++mi;
+        }
+        const uint256& hash = pentry->GetTx().GetHash();
+
+        // Everything left pays less than this; skip free transactions if
+        // we're past the minimum block size:
+        if (CFeeRate(nPackageFees, nPackageSize) < ::minRelayTxFee && builder.nBlockSize >= nBlockMinSize)
+            break;
+
+        if (builder.nBlockSize + nPackageSize >= builder.nBlockMaxSize) {
+            setFailed.insert(hash);
+            // Stop when the block is nearly full and nothing seems to fit
+            if (++nConsecutiveFailed > MAX_CONSECUTIVE_FAILURES && builder.nBlockSize > builder.nBlockMaxSize - 4000)
+                break;
+            continue;
+        }
 
-        TxPriorityCompare comparer(fSortedByFee);
-        std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
+        // The package: the transaction and its ancestors not yet in the block
+        std::vector<const CTxMemPoolEntry*> vPackage(1, pentry);
+        if (pentry->GetCountWithAncestors() > 1) {
+            std::set<uint256> setAncestors;
+            mempool.CalculateMemPoolAncestors(pentry->GetTx(), setAncestors);
+            BOOST_FOREACH(const uint256& hashAncestor, setAncestors) {
+                if (!builder.setInBlock.count(hashAncestor))
+                    vPackage.push_back(&*mempool.mapTx.find(hashAncestor));
+            }
+            std::sort(vPackage.begin(), vPackage.end(), CompareEntryByAncestorCount());
+        }
 
-        while (!vecPriority.empty())
-        {
-            // Take highest priority transaction off the priority queue:
-            double dPriority = vecPriority.front().get<0>();
-            CFeeRate feeRate = vecPriority.front().get<1>();
-            const CTransaction& tx = *(vecPriority.front().get<2>());
+        CBlockBuilder::Result result = builder.AddPackage(vPackage);
+        if (result == CBlockBuilder::FULL)
+            break;
+        if (result != CBlockBuilder::ADDED) {
+            setFailed.insert(hash);
+            ++nConsecutiveFailed;
+            continue;
+        }
+        nConsecutiveFailed = 0;
+        nPackages++;
+        builder.rateLowest = CFeeRate(nPackageFees, nPackageSize);
 
-            std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            vecPriority.pop_back();
+        BOOST_FOREACH(const CTxMemPoolEntry* pin, vPackage)
+            UpdatePackagesForAdded(*pin, builder.setInBlock, mapModified, setModified);
+    }
+    LogPrint("bench", "CreateNewBlock(): %d packages from %u transactions\n", nPackages, mempool.mapTx.size());
+}
 
-            // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            if (nBlockSize + nTxSize >= nBlockMaxSize)
-                continue;
+} // anon namespace
 
-            // Legacy limits on sigOps:
-            unsigned int nTxSigOps = GetLegacySigOpCount(tx);
-            if (nBlockSigOps + nTxSigOps >= chainparams.GetConsensus().MaxBlockLegacySigops(nBlockTime, sizeForkTime.load()))
-                continue;
+void UpdateTime(CBlockHeader* pblock, const Consensus::Params& consensusParams, const CBlockIndex* pindexPrev)
+{
+    pblock->nTime = std::max(pindexPrev->GetMedianTimePast()+1, GetAdjustedTime());
 
-            // Skip free transactions if we're past the minimum block size:
-            const uint256& hash = tx.GetHash();
-            double dPriorityDelta = 0;
-            CAmount nFeeDelta = 0;
-            mempool.ApplyDeltas(hash, dPriorityDelta, nFeeDelta);
-            if (fSortedByFee && (dPriorityDelta <= 0) && (nFeeDelta <= 0) && (feeRate < ::minRelayTxFee) && (nBlockSize + nTxSize >= nBlockMinSize))
-                continue;
+    // Updating time can change work required on testnet:
+    if (consensusParams.fPowAllowMinDifficultyBlocks)
+        pblock->nBits = GetNextWorkRequired(pindexPrev, pblock, consensusParams);
+}
 
-            // Prioritise by fee once past the priority size or we run out of high-priority
-            // transactions:
-            if (!fSortedByFee &&
-                ((nBlockSize + nTxSize >= nBlockPrioritySize) || !AllowFree(dPriority)))
-            {
-                fSortedByFee = true;
-                comparer = TxPriorityCompare(fSortedByFee);
-                std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            }
+/**
+ * A block template being filled, with the coins view and limits its
+ * transactions were checked against, so more can be added to it later.
+ * Only valid as long as the tip it was built on is. Requires cs_main and
+ * mempool.cs.
+ */
+class CBlockAssembly
+{
+public:
+    std::auto_ptr<CBlockTemplate> pblocktemplate;
+    CBlockIndex* pindexPrev;
+    CCoinsViewCache view;
+    BlockValidationResourceTracker resourceTracker;
+    boost::scoped_ptr<CBlockBuilder> pbuilder;
+    uint64_t nBlockMinSize;
+
+    /** Fill a new block on the current tip from the mempool */
+    CBlockAssembly(const CScript& scriptPubKeyIn);
+
+    /** Whether the transaction pays enough to be worth adding */
+    bool Wants(const CTxMemPoolEntry& entry) const;
+    /** Append a transaction whose mempool parents are all in the block already */
+    bool AddTransaction(const CTxMemPoolEntry& entry);
+    /** Whether a new template is likely to take in a transaction this one couldn't */
+    bool WorthRebuilding(const CTxMemPoolEntry& entry) const;
+
+private:
+    void UpdateCoinbase();
+};
 
-            if (!view.HaveInputs(tx))
-                continue;
+CBlockAssembly::CBlockAssembly(const CScript& scriptPubKeyIn) :
+    pblocktemplate(new CBlockTemplate()), pindexPrev(chainActive.Tip()), view(pcoinsTip),
+    resourceTracker(Params().GetConsensus().MaxBlockAccurateSigops(pblocktemplate->block.GetBlockTime(), sizeForkTime.load()),
+                    Params().GetConsensus().MaxBlockSighashBytes(pblocktemplate->block.GetBlockTime(), sizeForkTime.load()))
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(mempool.cs);
+    const CChainParams& chainparams = Params();
+    CBlock *pblock = &pblocktemplate->block; // pointer for convenience
 
-            CAmount nTxFees = view.GetValueIn(tx)-tx.GetValueOut();
+    // -regtest only: allow overriding block.nVersion with
+    // -blockversion=N to test forking scenarios
+    if (Params().MineBlocksOnDemand())
+        pblock->nVersion = GetArg("-blockversion", pblock->nVersion);
 
-            nTxSigOps += GetP2SHSigOpCount(tx, view);
-            if (nBlockSigOps + nTxSigOps >= chainparams.GetConsensus().MaxBlockLegacySigops(nBlockTime, sizeForkTime.load()))
-                continue;
+    // Create coinbase tx, completed once the fees are known
+    CMutableTransaction txNew;
+    txNew.vin.resize(1);
+    txNew.vin[0].prevout.SetNull();
+    txNew.vout.resize(1);
+    txNew.vout[0].scriptPubKey = scriptPubKeyIn;
+    pblock->vtx.push_back(txNew);
+    pblocktemplate->vTxFees.push_back(-1); // updated at end
+    pblocktemplate->vTxSigOps.push_back(-1); // updated at end
 
-            // Note that flags: we don't want to set mempool/IsStandard()
-            // policy here, but we still have to ensure that the block we
-            // create only contains transactions that are valid in new blocks.
-            CValidationState state;
-            if (!CheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true, &resourceTracker))
-            {
-                // If CheckInputs fails because adding the transaction would hit
-                // per-block limits on sigops or sighash bytes, stop building the block
-                // right away. It is _possible_ we have another transaction in the mempool
-                // that wouldn't trigger the limits, but that case isn't worth optimizing
-                // for, because those limits are very difficult to hit with a mempool full of
-                // transactions that pass the IsStandard() test.
-                if (!resourceTracker.IsWithinLimits())
-                    break; // stop before adding this transaction to the block
-                else
-                    // If CheckInputs fails for some other reason,
-                    // continue to consider other transactions for inclusion
-                    // in this block. This should almost never happen-- it
-                    // could theoretically happen if a timelocked transaction
-                    // entered the mempool after the lock time, but then the
-                    // blockchain re-orgs to a more-work chain with a lower
-                    // height or time.
-                    continue;
-            }
+    // Collect memory pool transactions into the block
+    const int nHeight = pindexPrev->nHeight + 1;
+    pblock->nTime = GetAdjustedTime();
+
+    UpdateTime(pblock, Params().GetConsensus(), pindexPrev);
+    uint64_t nBlockTime = pblock->GetBlockTime();
+
+    uint64_t nConsensusMaxSize = chainparams.GetConsensus().MaxBlockSize(nBlockTime, sizeForkTime.load());
+    // Largest block you're willing to create, defaults to being the biggest possible.
+    // Miners can adjust downwards if they wish to throttle their blocks, for instance, to work around
+    // high orphan rates or other scaling problems.
+    uint64_t nBlockMaxSize = (uint64_t) GetArg("-blockmaxsize", nConsensusMaxSize);
+    // Limit to betweeen 1K and MAX_BLOCK_SIZE-1K for sanity:
+    nBlockMaxSize = std::max((uint64_t)1000,
+                             std::min(nConsensusMaxSize-1000, nBlockMaxSize));
+
+    // How much of the block should be dedicated to high-priority transactions,
+    // included regardless of the fees they pay. This is to help people who want
+    // to make free transactions and don't mind waiting a while: coin age stands
+    // in for the monetary value of the fee. Defaults to an arbitrary 5% of the
+    // current max block size.
+    uint64_t nBlockPrioritySize = (uint64_t) GetArg("-blockprioritysize", nBlockMaxSize / DEFAULT_BLOCK_PRIORITY_SIZE_FRAC);
+    nBlockPrioritySize = std::min(nBlockMaxSize, nBlockPrioritySize);
+
+    // Minimum block size you want to create; block will be filled with free transactions
+    // until there are no more or the block reaches this size:
+    nBlockMinSize = GetArg("-blockminsize", DEFAULT_BLOCK_MIN_SIZE);
+    nBlockMinSize = std::min(nBlockMaxSize, nBlockMinSize);
+
+    int64_t nTimeStart = GetTimeMicros();
+    pbuilder.reset(new CBlockBuilder(*pblocktemplate, chainparams, view, resourceTracker, nHeight, nBlockMaxSize));
+    AddPriorityTxs(*pbuilder, nBlockPrioritySize);
+    AddPackageTxs(*pbuilder, nBlockMinSize);
+    LogPrint("bench", "CreateNewBlock(): selected %u transactions in %.2fms\n", pbuilder->nBlockTx, 0.001 * (GetTimeMicros() - nTimeStart));
+    LogPrintf("CreateNewBlock(): total size %u\n", pbuilder->nBlockSize);
+    UpdateCoinbase();
+
+    // Fill in header
+    pblock->hashPrevBlock  = pindexPrev->GetBlockHash();
+    UpdateTime(pblock, Params().GetConsensus(), pindexPrev);
+    pblock->nBits          = GetNextWorkRequired(pindexPrev, pblock, Params().GetConsensus());
+    pblock->nNonce         = 0;
+}
 
-            UpdateCoins(tx, state, view, nHeight);
+bool CBlockAssembly::Wants(const CTxMemPoolEntry& entry) const
+{
+    // The same cut-off as for packages: skip free transactions once past
+    // the minimum block size. Only transactions with all their ancestors in
+    // the block are added, so they are packages on their own.
+    return pbuilder->nBlockSize < nBlockMinSize ||
+        CFeeRate(entry.GetModifiedFee(), entry.GetTxSize()) >= ::minRelayTxFee;
+}
 
-            // Added
-            pblock->vtx.push_back(tx);
-            pblocktemplate->vTxFees.push_back(nTxFees);
-            pblocktemplate->vTxSigOps.push_back(nTxSigOps);
-            nBlockSize += nTxSize;
-            ++nBlockTx;
-            nBlockSigOps += nTxSigOps;
-            nFees += nTxFees;
+bool CBlockAssembly::AddTransaction(const CTxMemPoolEntry& entry)
+{
+    uint256 hashMissing;
+    if (pbuilder->setInBlock.count(entry.GetTx().GetHash()) ||
+        !pbuilder->HasParentsInBlock(entry.GetTx(), hashMissing))
+        return false;
+    if (pbuilder->AddPackage(std::vector<const CTxMemPoolEntry*>(1, &entry)) != CBlockBuilder::ADDED)
+        return false;
+    UpdateCoinbase();
+    return true;
+}
 
-            if (fPrintPriority)
-            {
-                LogPrintf("priority %.1f fee %s txid %s\n",
-                    dPriority, feeRate.ToString(), tx.GetHash().ToString());
-            }
+bool CBlockAssembly::WorthRebuilding(const CTxMemPoolEntry& entry) const
+{
+    // Counting all its mempool ancestors, as a new template would select it
+    const uint64_t nPackageSize = entry.GetSizeWithAncestors();
+    const CFeeRate ratePackage(entry.GetModFeesWithAncestors(), nPackageSize);
+    if (ratePackage < ::minRelayTxFee && pbuilder->nBlockSize >= nBlockMinSize)
+        return false;
+    // With room left, it was held back by parents that came in too late or
+    // didn't pay for themselves; with none, it has to outbid what got in.
+    if (pbuilder->nBlockSize + nPackageSize < pbuilder->nBlockMaxSize)
+        return true;
+    return ratePackage > pbuilder->rateLowest;
+}
 
-            // Add transactions that depend on this one to the priority queue
-            if (mapDependers.count(hash))
-            {
-                BOOST_FOREACH(COrphan* porphan, mapDependers[hash])
-                {
-                    if (!porphan->setDependsOn.empty())
-                    {
-                        porphan->setDependsOn.erase(hash);
-                        if (porphan->setDependsOn.empty())
-                        {
-                            vecPriority.push_back(TxPriority(porphan->dPriority, porphan->feeRate, porphan->ptx));
-                            std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
-                        }
-                    }
-                }
-            }
-        }
+void CBlockAssembly::UpdateCoinbase()
+{
+    const int nHeight = pindexPrev->nHeight + 1;
+    CMutableTransaction txCoinbase(pblocktemplate->block.vtx[0]);
+    txCoinbase.vout[0].nValue = pbuilder->nFees + GetBlockSubsidy(nHeight, Params().GetConsensus());
+    txCoinbase.vin[0].scriptSig = CScript() << nHeight << OP_0;
+    pblocktemplate->block.vtx[0] = txCoinbase;
+    pblocktemplate->vTxFees[0] = -pbuilder->nFees;
+    pblocktemplate->vTxSigOps[0] = GetLegacySigOpCount(pblocktemplate->block.vtx[0]);
+
+    nLastBlockTx = pbuilder->nBlockTx;
+    nLastBlockSize = pbuilder->nBlockSize;
+}
 
-        nLastBlockTx = nBlockTx;
-        nLastBlockSize = nBlockSize;
-        LogPrintf("CreateNewBlock(): total size %u\n", nBlockSize);
-
-        // Compute final coinbase transaction.
-        txNew.vout[0].nValue = nFees + GetBlockSubsidy(nHeight, chainparams.GetConsensus());
-        txNew.vin[0].scriptSig = CScript() << nHeight << OP_0;
-        pblock->vtx[0] = txNew;
-        pblocktemplate->vTxFees[0] = -nFees;
-
-        // Fill in header
-        pblock->hashPrevBlock  = pindexPrev->GetBlockHash();
-        UpdateTime(pblock, Params().GetConsensus(), pindexPrev);
-        pblock->nBits          = GetNextWorkRequired(pindexPrev, pblock, Params().GetConsensus());
-        pblock->nNonce         = 0;
-        pblocktemplate->vTxSigOps[0] = GetLegacySigOpCount(pblock->vtx[0]);
-
-        CValidationState state;
-        if (!TestBlockValidity(state, *pblock, pindexPrev, false, false))
-            throw std::runtime_error("CreateNewBlock(): TestBlockValidity failed");
-    }
+CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
+{
+    LOCK2(cs_main, mempool.cs);
+    CBlockAssembly assembly(scriptPubKeyIn);
+
+    CValidationState state;
+    if (!TestBlockValidity(state, assembly.pblocktemplate->block, assembly.pindexPrev, false, false))
+        throw std::runtime_error("CreateNewBlock(): TestBlockValidity failed");
 
-    return pblocktemplate.release();
+    return assembly.pblocktemplate.release();
 }
 
 void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce)
@@ -394,6 +623,163 @@ void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int&
     pblock->hashMerkleRoot = pblock->BuildMerkleTree();
 }
 
+CLiveBlockTemplate liveBlockTemplate;
+
+CLiveBlockTemplate::CLiveBlockTemplate() :
+    nTransactionsUpdated(0), fActive(false), fNewTip(false), fStale(false), nLastBuild(0), nLastRequest(0)
+{
+}
+
+CLiveBlockTemplate::~CLiveBlockTemplate()
+{
+}
+
+bool CLiveBlockTemplate::Rebuild()
+{
+    LOCK2(cs_main, mempool.cs);
+    boost::scoped_ptr<CBlockAssembly> pnew(new CBlockAssembly(CScript() << OP_TRUE));
+
+    CValidationState state;
+    if (!TestBlockValidity(state, pnew->pblocktemplate->block, pnew->pindexPrev, false, false))
+        return error("%s: TestBlockValidity failed: %s", __func__, state.GetRejectReason());
+
+    {
+        LOCK(cs);
+        passembly.swap(pnew);
+        psnapshot.reset();
+        nTransactionsUpdated = mempool.GetTransactionsUpdated();
+    }
+    boost::unique_lock<boost::mutex> lock(mutexUpdate);
+    nLastBuild = GetTime();
+    return true;
+}
+
+void CLiveBlockTemplate::RequestRebuild(bool fTip)
+{
+    boost::unique_lock<boost::mutex> lock(mutexUpdate);
+    if (fTip)
+        fNewTip = true;
+    else
+        fStale = true;
+    condUpdate.notify_one();
+}
+
+void CLiveBlockTemplate::SyncTransaction(const CTransaction& tx, const CBlock* pblock, bool fRespend)
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutexUpdate);
+        if (!fActive)
+            return;
+    }
+    if (pblock) {
+        // Confirmed in a new tip
+        RequestRebuild(true);
+        return;
+    }
+
+    LOCK2(cs_main, mempool.cs);
+    LOCK(cs);
+    if (!passembly || passembly->pindexPrev != chainActive.Tip()) {
+        // The tip changed, by a reorg if no block has been connected
+        RequestRebuild(true);
+        return;
+    }
+    CTxMemPool::indexed_transaction_set::const_iterator it = mempool.mapTx.find(tx.GetHash());
+    if (it == mempool.mapTx.end()) {
+        // Evicted or dropped. The template stays valid, but shouldn't keep it.
+        if (passembly->pbuilder->setInBlock.count(tx.GetHash()))
+            RequestRebuild(false);
+        return;
+    }
+    if (!passembly->Wants(*it))
+        return;
+    if (!passembly->AddTransaction(*it)) {
+        // Doesn't fit, or waits for parents. Rebuilding only helps if it
+        // would get into the new template.
+        if (passembly->WorthRebuilding(*it))
+            RequestRebuild(false);
+        return;
+    }
+    psnapshot.reset();
+    nTransactionsUpdated = mempool.GetTransactionsUpdated();
+}
+
+boost::shared_ptr<const CBlockTemplate> CLiveBlockTemplate::Get(unsigned int& nTransactionsUpdatedOut)
+{
+    AssertLockHeld(cs_main);
+    {
+        boost::unique_lock<boost::mutex> lock(mutexUpdate);
+        fActive = true;
+        nLastRequest = GetTime();
+    }
+    condUpdate.notify_one();
+    bool fCurrent;
+    {
+        LOCK(cs);
+        fCurrent = passembly && passembly->pindexPrev == chainActive.Tip();
+    }
+    if (!fCurrent && !Rebuild())
+        throw std::runtime_error("CLiveBlockTemplate::Get(): TestBlockValidity failed");
+
+    LOCK(cs);
+    if (!psnapshot)
+        psnapshot.reset(new CBlockTemplate(*passembly->pblocktemplate));
+    nTransactionsUpdatedOut = nTransactionsUpdated;
+    return psnapshot;
+}
+
+void CLiveBlockTemplate::ThreadUpdate()
+{
+    while (true) {
+        bool fTipOnly = false;
+        bool fIdle = false;
+        {
+            boost::unique_lock<boost::mutex> lock(mutexUpdate);
+            while (!fNewTip && !(fStale && GetTime() >= nLastBuild + LIVE_TEMPLATE_REFRESH_INTERVAL)) {
+                int64_t nIdleIn = nLastRequest + LIVE_TEMPLATE_IDLE_TIMEOUT - GetTime();
+                if (fActive && nIdleIn <= 0) {
+                    fIdle = true;
+                    break;
+                }
+                if (fStale)
+                    condUpdate.timed_wait(lock, boost::posix_time::seconds(1));
+                else if (fActive)
+                    condUpdate.timed_wait(lock, boost::posix_time::seconds(nIdleIn));
+                else
+                    condUpdate.wait(lock);
+            }
+            if (!fIdle) {
+                fTipOnly = !fStale;
+                fNewTip = fStale = false;
+            }
+        }
+
+        LOCK(cs_main);
+        if (fIdle) {
+            // Nobody asks for templates any more; stop updating it and let
+            // it go. Get() holds cs_main, so it can't be using it.
+            LOCK(cs);
+            {
+                boost::unique_lock<boost::mutex> lock(mutexUpdate);
+                if (GetTime() < nLastRequest + LIVE_TEMPLATE_IDLE_TIMEOUT)
+                    continue;
+                fActive = fNewTip = fStale = false;
+            }
+            passembly.reset();
+            psnapshot.reset();
+            LogPrint("rpc", "%s: no template requests for %ds, stopped updating it\n", __func__, LIVE_TEMPLATE_IDLE_TIMEOUT);
+            continue;
+        }
+        {
+            // A request may have built it for the new tip already
+            LOCK(cs);
+            if (fTipOnly && passembly && passembly->pindexPrev == chainActive.Tip())
+                continue;
+        }
+        Rebuild();
+    }
+}
+
 #ifdef ENABLE_WALLET
 //////////////////////////////////////////////////////////////////////////////
 //
@@ -7,9 +7,17 @@
 #define BITCOIN_MINER_H
 
 #include "primitives/block.h"
+#include "sync.h"
+#include "validationinterface.h"
 
 #include <stdint.h>
 
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+
+class CBlockAssembly;
 class CBlockIndex;
 class CReserveKey;
 class CScript;
@@ -32,4 +40,58 @@ CBlockTemplate* CreateNewBlockWithKey(CReserveKey& reservekey);
 void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce);
 void UpdateTime(CBlockHeader* pblock, const Consensus::Params& consensusParams, const CBlockIndex* pindexPrev);
 
+/** Minimum seconds between rebuilds of the live template for transactions it couldn't take in */
+static const int64_t LIVE_TEMPLATE_REFRESH_INTERVAL = 5;
+/** Seconds without a request after which the live template stops being kept up to date */
+static const int64_t LIVE_TEMPLATE_IDLE_TIMEOUT = 5 * 60;
+
+/**
+ * The block template getblocktemplate hands out. Instead of being rebuilt
+ * for every request, it is kept up to date: transactions entering the
+ * mempool are appended as they arrive, and a new template is built in the
+ * background and swapped in on a new tip, or when transactions left the
+ * mempool or couldn't be appended but would make it into a new one.
+ * Nothing is done until a template is asked for, and the template is let
+ * go of again once nobody has asked for one in LIVE_TEMPLATE_IDLE_TIMEOUT.
+ */
+class CLiveBlockTemplate : public CValidationInterface
+{
+private:
+    //! Guards the template being updated and the copy of it handed out
+    CCriticalSection cs;
+    boost::scoped_ptr<CBlockAssembly> passembly;
+    boost::shared_ptr<const CBlockTemplate> psnapshot;
+    unsigned int nTransactionsUpdated;
+
+    //! Guards the requests for a rebuild
+    boost::mutex mutexUpdate;
+    boost::condition_variable condUpdate;
+    bool fActive;
+    bool fNewTip;
+    bool fStale;
+    int64_t nLastBuild;
+    int64_t nLastRequest;
+
+    bool Rebuild();
+    void RequestRebuild(bool fTip);
+
+protected:
+    void SyncTransaction(const CTransaction& tx, const CBlock* pblock, bool fRespend);
+
+public:
+    CLiveBlockTemplate();
+    ~CLiveBlockTemplate();
+
+    /**
+     * The template for the current tip, and the mempool transaction update
+     * count it is current with. Built on the spot if there is none yet.
+     * Requires cs_main.
+     */
+    boost::shared_ptr<const CBlockTemplate> Get(unsigned int& nTransactionsUpdatedOut);
+    /** Rebuild the template in the background when needed, until interrupted */
+    void ThreadUpdate();
+};
+
+extern CLiveBlockTemplate liveBlockTemplate;
+
 #endif // BITCOIN_MINER_H
@@ -18,6 +18,9 @@
 #include "crypto/common.h"
 #include "ipgroups.h"
 #include "leakybucket.h"
+#include "relaycache.h"
+
+#include <math.h>
 
 #ifdef WIN32
 #include <string.h>
@@ -25,6 +28,11 @@
 #include <fcntl.h>
 #endif
 
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
 #ifdef USE_UPNP
 #include <miniupnpc/miniupnpc.h>
 #include <miniupnpc/miniwget.h>
@@ -33,6 +41,8 @@
 #endif
 
 #include <boost/filesystem.hpp>
+#include <boost/function.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <boost/thread.hpp>
 
 // Dump addresses to peers.dat every 15 minutes (900s)
@@ -73,7 +83,7 @@ struct ListenSocket
 //
 bool fDiscover = true;
 bool fListen = true;
-uint64_t nLocalServices = NODE_NETWORK | NODE_GETUTXO;
+uint64_t nLocalServices = NODE_NETWORK | NODE_GETUTXO | NODE_THIN;
 CCriticalSection cs_mapLocalHost;
 map<CNetAddr, LocalServiceInfo> mapLocalHost;
 static bool vfReachable[NET_MAX] = {};
@@ -87,9 +97,6 @@ bool fAddressesInitialized = false;
 
 vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
-map<CInv, CDataStream> mapRelay;
-deque<pair<int64_t, CInv> > vRelayExpiration;
-CCriticalSection cs_mapRelay;
 limitedmap<CInv, int64_t> mapAlreadyAskedFor(MAX_INV_SZ);
 
 static deque<string> vOneShots;
@@ -105,6 +112,7 @@ NodeId nLastNodeId = 0;
 CCriticalSection cs_nLastNodeId;
 
 static CSemaphore* semOutbound = NULL;
+boost::mutex messageHandlerMutex;
 boost::condition_variable messageHandlerCondition;
 
 // Signals for message handling
@@ -384,6 +392,7 @@ CNode* ConnectNode(CAddress addrConnect, const char* pszDest)
             LOCK(cs_vNodes);
             vNodes.push_back(pnode);
         }
+        WakeSocketHandler();
 
         pnode->nTimeConnected = GetTime();
 
@@ -505,7 +514,13 @@ void CNode::copyStats(CNodeStats& stats)
     X(nStartingHeight);
     X(nSendBytes);
     X(nRecvBytes);
+    X(nInvSent);
+    X(nInvBytesSent);
     X(fWhitelisted);
+    {
+        LOCK(cs_inventory);
+        stats.nInvQueued = vInventoryToSend.size();
+    }
 
     // It is common for nodes with good ping times to suddenly become lagged,
     // due to a new block arriving or other large transfer.
@@ -627,12 +642,18 @@ int CNetMessage::readData(const char* pch, unsigned int nBytes)
 
 
 // requires LOCK(cs_vSend)
-void SocketSendData(CNode* pnode)
+/**
+ * Send as much of the data queued for pnode as its socket and the send
+ * shaper take. Returns false if the socket would block (or failed), true if
+ * it may take more.
+ */
+bool SocketSendData(CNode* pnode)
 {
-    std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin();
+    bool fWouldBlock = false;
+    std::deque<CSerializeDataRef>::iterator it = pnode->vSendMsg.begin();
 
     while (it != pnode->vSendMsg.end()) {
-        const CSerializeData& data = *it;
+        const CSerializeData& data = **it;
         assert(data.size() > pnode->nSendOffset);
 
         int amt2Send = min((int64_t)(data.size() - pnode->nSendOffset), sendShaper.available(SEND_SHAPER_MIN_FRAG));
@@ -651,6 +672,7 @@ void SocketSendData(CNode* pnode)
                 it++;
             } else {
                 // could not send full message; stop sending more
+                fWouldBlock = nBytes < amt2Send;
                 break;
             }
             if (empty)
@@ -665,6 +687,7 @@ void SocketSendData(CNode* pnode)
                 }
             }
             // couldn't send anything at all
+            fWouldBlock = true;
             break;
         }
     }
@@ -674,71 +697,220 @@ void SocketSendData(CNode* pnode)
         assert(pnode->nSendSize == 0);
     }
     pnode->vSendMsg.erase(pnode->vSendMsg.begin(), it);
+    return !fWouldBlock;
+}
+
+/**
+ * Receive up to nMaxBytes from pnode's socket. Returns false if the socket
+ * has nothing more to give for now: it would block, a short read emptied
+ * it, or the connection is gone.
+ */
+static bool SocketRecvData(CNode* pnode, int64_t nMaxBytes)
+{
+    // max of min makes sure amt is in a range reasonable for buffer allocation
+    int64_t amt = max((int64_t)1, min(nMaxBytes, MAX_RECV_CHUNK));
+    char pchBuf[amt];
+    int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+    if (nBytes > 0) {
+        receiveShaper.leak(nBytes);
+        if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
+            pnode->CloseSocketDisconnect();
+        pnode->nLastRecv = GetTime();
+        pnode->nRecvBytes += nBytes;
+        pnode->RecordBytesRecv(nBytes);
+        return nBytes == amt;
+    } else if (nBytes == 0) {
+        // socket closed gracefully
+        if (!pnode->fDisconnect)
+            LogPrint("net", "socket closed\n");
+        pnode->CloseSocketDisconnect();
+    } else if (nBytes < 0) {
+        // error
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS) {
+            if (!pnode->fDisconnect)
+                LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
+            pnode->CloseSocketDisconnect();
+        }
+    }
+    return false;
 }
 
 static list<CNode*> vNodesDisconnected;
 
-void ThreadSocketHandler()
+/**
+ * Close the sockets of the nodes that are done and move them to
+ * vNodesDisconnected, and delete the disconnected nodes nobody uses any more.
+ */
+static void DisconnectNodes()
 {
-    unsigned int nPrevNodeCount = 0;
-    int progress; // This variable is incremented if something happens.  If it is zero at the bottom of the loop, we delay.  This solves spin loop issues where the select does not block but no bytes can be transferred (traffic shaping limited, for example).
-    while (true) {
-        progress = 0;
-        //
-        // Disconnect nodes
-        //
-        {
-            LOCK(cs_vNodes);
-            // Disconnect unused nodes
-            vector<CNode*> vNodesCopy = vNodes;
-            BOOST_FOREACH (CNode* pnode, vNodesCopy) {
-                if (pnode->fDisconnect ||
-                    (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty())) {
-                    // remove from vNodes
-                    vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
+    static unsigned int nPrevNodeCount = 0;
+    {
+        LOCK(cs_vNodes);
+        // Disconnect unused nodes
+        vector<CNode*> vNodesCopy = vNodes;
+        BOOST_FOREACH (CNode* pnode, vNodesCopy) {
+            if (pnode->fDisconnect ||
+                (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty())) {
+                // remove from vNodes
+                vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
 
-                    // release outbound grant (if any)
-                    pnode->grantOutbound.Release();
+                // release outbound grant (if any)
+                pnode->grantOutbound.Release();
 
-                    // close socket and cleanup
-                    pnode->CloseSocketDisconnect();
+                // close socket and cleanup
+                pnode->CloseSocketDisconnect();
 
-                    // hold in disconnected pool until all refs are released
-                    if (pnode->fNetworkNode || pnode->fInbound)
-                        pnode->Release();
-                    vNodesDisconnected.push_back(pnode);
-                }
+                // hold in disconnected pool until all refs are released
+                if (pnode->fNetworkNode || pnode->fInbound)
+                    pnode->Release();
+                vNodesDisconnected.push_back(pnode);
             }
         }
-        {
-            // Delete disconnected nodes
-            list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
-            BOOST_FOREACH (CNode* pnode, vNodesDisconnectedCopy) {
-                // wait until threads are done using it
-                if (pnode->GetRefCount() <= 0) {
-                    bool fDelete = false;
-                    {
-                        TRY_LOCK(pnode->cs_vSend, lockSend);
-                        if (lockSend) {
-                            TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                            if (lockRecv) {
-                                TRY_LOCK(pnode->cs_inventory, lockInv);
-                                if (lockInv)
-                                    fDelete = true;
-                            }
+    }
+    {
+        // Delete disconnected nodes
+        list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
+        BOOST_FOREACH (CNode* pnode, vNodesDisconnectedCopy) {
+            // wait until threads are done using it
+            if (pnode->GetRefCount() <= 0) {
+                bool fDelete = false;
+                {
+                    TRY_LOCK(pnode->cs_vSend, lockSend);
+                    if (lockSend) {
+                        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                        if (lockRecv) {
+                            TRY_LOCK(pnode->cs_inventory, lockInv);
+                            if (lockInv)
+                                fDelete = true;
                         }
                     }
-                    if (fDelete) {
-                        vNodesDisconnected.remove(pnode);
-                        delete pnode;
-                    }
+                }
+                if (fDelete) {
+                    vNodesDisconnected.remove(pnode);
+                    delete pnode;
                 }
             }
         }
-        if (vNodes.size() != nPrevNodeCount) {
-            nPrevNodeCount = vNodes.size();
-            uiInterface.NotifyNumConnectionsChanged(nPrevNodeCount);
+    }
+    if (vNodes.size() != nPrevNodeCount) {
+        nPrevNodeCount = vNodes.size();
+        uiInterface.NotifyNumConnectionsChanged(nPrevNodeCount);
+    }
+}
+
+/**
+ * Accept a connection waiting on hListenSocket, or refuse it. Returns false
+ * if there was none (or accept() failed). The new node, if any, is returned
+ * in pnodeNew.
+ */
+static bool AcceptConnection(const ListenSocket& hListenSocket, CNode*& pnodeNew)
+{
+    pnodeNew = NULL;
+    struct sockaddr_storage sockaddr;
+    socklen_t len = sizeof(sockaddr);
+    SOCKET hSocket = accept(hListenSocket.socket, (struct sockaddr*)&sockaddr, &len);
+    CAddress addr;
+    int nInbound = 0;
+
+    if (hSocket == INVALID_SOCKET) {
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK)
+            LogPrintf("socket error accept failed: %s\n", NetworkErrorString(nErr));
+        return false;
+    }
+
+    if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
+        LogPrintf("Warning: Unknown socket family\n");
+
+    bool whitelisted = hListenSocket.whitelisted || CNode::IsWhitelistedRange(addr);
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH (CNode* pnode, vNodes)
+            if (pnode->fInbound)
+                nInbound++;
+    }
+
+    if (nInbound >= nMaxConnections - MAX_OUTBOUND_CONNECTIONS) {
+        // Calculate the priority of the new IP to see if we should drop it immediately (normal) or kick
+        // one of the other peers out to make room for it.
+
+        // TODO: Lower the priority of an IP as it establishes more connections.
+        // The goal is to force an attacker to spread out in order to get lots of priority.
+
+        // See if this IP has static prio data from a group.
+        CIPGroupData ipgroup = FindGroupForIP(addr);
+
+        bool disconnected = false;
+        {
+            LOCK(cs_vNodes);
+            BOOST_FOREACH (CNode* n, vNodes) {
+                CIPGroupData ngroup = FindGroupForIP(n->addr);
+                int nodePriority = ngroup.priority;
+                if (nodePriority < ipgroup.priority) {
+                    LogPrintf("Connection slots exhausted, evicting peer %d with priority %d (group %s) to free up resources\n",
+                              n->id,
+                              nodePriority,
+                              ngroup.name == "" ? string("default") : ngroup.name);
+                    n->fDisconnect = true;
+                    disconnected = true;
+                    // Allow this socket through.
+                    break;
+                }
+            }
+        }
+
+        if (!disconnected) {
+            CloseSocket(hSocket);
+            LogPrintf("Connection slots exhausted, refusing inbound connection from %s\n", addr.ToString());
+            return true;
+        }
+    } else if (CNode::IsBanned(addr) && !whitelisted) {
+        LogPrintf("connection from %s dropped (banned)\n", addr.ToString());
+        CloseSocket(hSocket);
+        return true;
+    }
+
+    CNode* pnode = new CNode(hSocket, addr, "", true);
+    pnode->AddRef();
+    pnode->fWhitelisted = whitelisted;
+
+    {
+        LOCK(cs_vNodes);
+        vNodes.push_back(pnode);
+    }
+    pnodeNew = pnode;
+    return true;
+}
+
+/** Disconnect pnode if it has been quiet for too long. */
+static void InactivityCheck(CNode* pnode)
+{
+    int64_t nTime = GetTime();
+    if (nTime - pnode->nTimeConnected > 60) {
+        if (pnode->nLastRecv == 0 || pnode->nLastSend == 0) {
+            LogPrint("net", "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->id);
+            pnode->fDisconnect = true;
+        } else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL) {
+            LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
+            pnode->fDisconnect = true;
+        } else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90 * 60)) {
+            LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
+            pnode->fDisconnect = true;
+        } else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros()) {
+            LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
+            pnode->fDisconnect = true;
         }
+    }
+}
+
+/** The socket handler for systems without epoll, polling every socket with select(). */
+static void ThreadSocketHandlerSelect()
+{
+    int progress; // This variable is incremented if something happens.  If it is zero at the bottom of the loop, we delay.  This solves spin loop issues where the select does not block but no bytes can be transferred (traffic shaping limited, for example).
+    while (true) {
+        progress = 0;
+        DisconnectNodes();
 
         //
         // Find which sockets have data to receive
@@ -767,6 +939,13 @@ void ThreadSocketHandler()
             BOOST_FOREACH (CNode* pnode, vNodes) {
                 if (pnode->hSocket == INVALID_SOCKET)
                     continue;
+#ifndef WIN32
+                if (pnode->hSocket >= FD_SETSIZE) {
+                    // Can't be waited on with select()
+                    pnode->fDisconnect = true;
+                    continue;
+                }
+#endif
                 FD_SET(pnode->hSocket, &fdsetError);
                 hSocketMax = max(hSocketMax, pnode->hSocket);
                 have_fds = true;
@@ -826,81 +1005,8 @@ void ThreadSocketHandler()
         //
         BOOST_FOREACH (const ListenSocket& hListenSocket, vhListenSocket) {
             if (hListenSocket.socket != INVALID_SOCKET && FD_ISSET(hListenSocket.socket, &fdsetRecv)) {
-                struct sockaddr_storage sockaddr;
-                socklen_t len = sizeof(sockaddr);
-                SOCKET hSocket = accept(hListenSocket.socket, (struct sockaddr*)&sockaddr, &len);
-                CAddress addr;
-                int nInbound = 0;
-
-                if (hSocket != INVALID_SOCKET)
-                    if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
-                        LogPrintf("Warning: Unknown socket family\n");
-
-                bool whitelisted = hListenSocket.whitelisted || CNode::IsWhitelistedRange(addr);
-                {
-                    LOCK(cs_vNodes);
-                    BOOST_FOREACH (CNode* pnode, vNodes)
-                        if (pnode->fInbound)
-                            nInbound++;
-                }
-
-                bool shouldConnect = true;
-
-                if (hSocket == INVALID_SOCKET) {
-                    int nErr = WSAGetLastError();
-                    if (nErr != WSAEWOULDBLOCK)
-                        LogPrintf("socket error accept failed: %s\n", NetworkErrorString(nErr));
-                    shouldConnect = false;
-                } else if (nInbound >= nMaxConnections - MAX_OUTBOUND_CONNECTIONS) {
-                    // Calculate the priority of the new IP to see if we should drop it immediately (normal) or kick
-                    // one of the other peers out to make room for it.
-
-                    // TODO: Lower the priority of an IP as it establishes more connections.
-                    // The goal is to force an attacker to spread out in order to get lots of priority.
-
-                    // See if this IP has static prio data from a group.
-                    CIPGroupData ipgroup = FindGroupForIP(addr);
-
-                    bool disconnected = false;
-                    {
-                        LOCK(cs_vNodes);
-                        BOOST_FOREACH (CNode* n, vNodes) {
-                            CIPGroupData ngroup = FindGroupForIP(n->addr);
-                            int nodePriority = ngroup.priority;
-                            if (nodePriority < ipgroup.priority) {
-                                LogPrintf("Connection slots exhausted, evicting peer %d with priority %d (group %s) to free up resources\n",
-                                          n->id,
-                                          nodePriority,
-                                          ngroup.name == "" ? string("default") : ngroup.name);
-                                n->fDisconnect = true;
-                                disconnected = true;
-                                // Leave shouldConnect = true to allow this socket through.
-                                break;
-                            }
-                        }
-                    }
-
-                    if (!disconnected) {
-                        CloseSocket(hSocket);
-                        LogPrintf("Connection slots exhausted, refusing inbound connection from %s\n", addr.ToString());
-                        shouldConnect = false;
-                    }
-                } else if (CNode::IsBanned(addr) && !whitelisted) {
-                    LogPrintf("connection from %s dropped (banned)\n", addr.ToString());
-                    CloseSocket(hSocket);
-                    shouldConnect = false;
-                }
-
-                if (shouldConnect) {
-                    CNode* pnode = new CNode(hSocket, addr, "", true);
-                    pnode->AddRef();
-                    pnode->fWhitelisted = whitelisted;
-
-                    {
-                        LOCK(cs_vNodes);
-                        vNodes.push_back(pnode);
-                    }
-                }
+                CNode* pnodeNew;
+                AcceptConnection(hListenSocket, pnodeNew);
             }
         }
 
@@ -926,34 +1032,8 @@ void ThreadSocketHandler()
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
                 int64_t amt2Recv = receiveShaper.available(RECV_SHAPER_MIN_FRAG);
                 if (lockRecv && (amt2Recv > 0)) {
-                    {
-                        progress++;
-                        // max of min makes sure amt is in a range reasonable for buffer allocation
-                        int64_t amt = max((int64_t)1, min(amt2Recv, MAX_RECV_CHUNK));
-                        char pchBuf[amt];
-                        int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
-                        if (nBytes > 0) {
-                            receiveShaper.leak(nBytes);
-                            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
-                                pnode->CloseSocketDisconnect();
-                            pnode->nLastRecv = GetTime();
-                            pnode->nRecvBytes += nBytes;
-                            pnode->RecordBytesRecv(nBytes);
-                        } else if (nBytes == 0) {
-                            // socket closed gracefully
-                            if (!pnode->fDisconnect)
-                                LogPrint("net", "socket closed\n");
-                            pnode->CloseSocketDisconnect();
-                        } else if (nBytes < 0) {
-                            // error
-                            int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS) {
-                                if (!pnode->fDisconnect)
-                                    LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
-                                pnode->CloseSocketDisconnect();
-                            }
-                        }
-                    }
+                    progress++;
+                    SocketRecvData(pnode, amt2Recv);
                 }
             }
 
@@ -970,25 +1050,7 @@ void ThreadSocketHandler()
                 }
             }
 
-            //
-            // Inactivity checking
-            //
-            int64_t nTime = GetTime();
-            if (nTime - pnode->nTimeConnected > 60) {
-                if (pnode->nLastRecv == 0 || pnode->nLastSend == 0) {
-                    LogPrint("net", "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->id);
-                    pnode->fDisconnect = true;
-                } else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL) {
-                    LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
-                    pnode->fDisconnect = true;
-                } else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90 * 60)) {
-                    LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
-                    pnode->fDisconnect = true;
-                } else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros()) {
-                    LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
-                    pnode->fDisconnect = true;
-                }
-            }
+            InactivityCheck(pnode);
         }
         {
             LOCK(cs_vNodes);
@@ -1001,6 +1063,252 @@ void ThreadSocketHandler()
     }
 }
 
+#ifdef HAVE_SYS_EPOLL_H
+/** eventfd that WakeSocketHandler() writes to, to wake up the socket handler. Never closed. */
+static int nSocketHandlerWakeFd = -1;
+
+/** How often, in milliseconds, the epoll socket handler looks at all nodes */
+static const int SOCKET_SWEEP_INTERVAL = 100;
+/** How soon, in milliseconds, to retry a node that couldn't be served for a busy lock or a full receive buffer */
+static const int SOCKET_BUSY_RETRY = 50;
+
+/**
+ * epoll_event data of the listen sockets. The eventfd has 0 and nodes
+ * have their CNode*, which is never odd.
+ */
+static uint64_t ListenSocketEventData(size_t nListenSocket) { return ((uint64_t)nListenSocket << 1) | 1; }
+
+/** What ServiceSocket() left to do for a node */
+enum SocketService {
+    SOCKET_IDLE,        //! Nothing until the next epoll event
+    SOCKET_AGAIN,       //! More to do right away
+    SOCKET_BUSY,        //! A lock was busy or the receive buffer is full
+    SOCKET_RECV_SHAPED, //! Waiting for the receive shaper
+    SOCKET_SEND_SHAPED, //! Waiting for the send shaper
+};
+
+/**
+ * Send or receive one round for a node, as far as its readiness flags,
+ * buffers and the shapers allow. Queued data is sent before any more is
+ * received, like ThreadSocketHandlerSelect() does.
+ */
+static SocketService ServiceSocket(CNode* pnode)
+{
+    {
+        TRY_LOCK(pnode->cs_vSend, lockSend);
+        if (!lockSend)
+            return SOCKET_BUSY;
+        if (!pnode->vSendMsg.empty()) {
+            if (!pnode->fSendReady)
+                return SOCKET_IDLE;
+            if (!sendShaper.try_leak(0))
+                return SOCKET_SEND_SHAPED;
+            if (!SocketSendData(pnode))
+                pnode->fSendReady = false;
+            if (!pnode->vSendMsg.empty())
+                return pnode->fSendReady ? SOCKET_SEND_SHAPED : SOCKET_IDLE;
+        }
+    }
+
+    if (!pnode->fRecvReady || pnode->hSocket == INVALID_SOCKET)
+        return SOCKET_IDLE;
+    TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+    if (!lockRecv)
+        return SOCKET_BUSY;
+    if (!pnode->vRecvMsg.empty() && pnode->vRecvMsg.front().complete() && pnode->GetTotalRecvSize() > ReceiveFloodSize())
+        return SOCKET_BUSY; // Wait for the message handler to catch up
+    int64_t amt2Recv = receiveShaper.available(RECV_SHAPER_MIN_FRAG);
+    if (amt2Recv <= 0)
+        return SOCKET_RECV_SHAPED;
+    if (!SocketRecvData(pnode, amt2Recv)) {
+        pnode->fRecvReady = false;
+        return SOCKET_IDLE;
+    }
+    return SOCKET_AGAIN;
+}
+
+static bool RegisterSocket(int epollfd, CNode* pnode)
+{
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.ptr = pnode;
+    pnode->fSocketRegistered = true;
+    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, pnode->hSocket, &event) == 0)
+        return true;
+    LogPrintf("socket epoll_ctl failed: %s\n", NetworkErrorString(errno));
+    pnode->CloseSocketDisconnect();
+    return false;
+}
+
+/**
+ * The socket handler, waiting on epoll. Sockets are watched edge triggered:
+ * epoll reports when a socket becomes readable or writable, and the node's
+ * fRecvReady and fSendReady remember that until recv() or send() finds the
+ * socket exhausted. Nodes that could not be fully served, because a shaper
+ * ran dry, the receive buffer is full or a lock was busy, stay pending and
+ * are retried after a timeout that fits the cause. Anything that needs a
+ * look at every node (disconnects, timeouts, new outbound connections) is
+ * done every SOCKET_SWEEP_INTERVAL, so idle peers cost next to nothing.
+ *
+ * Returns false if epoll could not be set up.
+ */
+static bool ThreadSocketHandlerEpoll()
+{
+    int epollfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollfd < 0) {
+        LogPrintf("socket epoll_create1 failed: %s\n", NetworkErrorString(errno));
+        return false;
+    }
+
+    struct epoll_event event;
+    if (nSocketHandlerWakeFd < 0)
+        nSocketHandlerWakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    event.events = EPOLLIN;
+    event.data.u64 = 0;
+    if (nSocketHandlerWakeFd < 0 || epoll_ctl(epollfd, EPOLL_CTL_ADD, nSocketHandlerWakeFd, &event) != 0) {
+        LogPrintf("socket eventfd failed: %s\n", NetworkErrorString(errno));
+        close(epollfd);
+        return false;
+    }
+    for (size_t i = 0; i < vhListenSocket.size(); i++) {
+        event.events = EPOLLIN | EPOLLET;
+        event.data.u64 = ListenSocketEventData(i);
+        if (epoll_ctl(epollfd, EPOLL_CTL_ADD, vhListenSocket[i].socket, &event) != 0)
+            LogPrintf("socket epoll_ctl failed for listening socket: %s\n", NetworkErrorString(errno));
+    }
+
+    // Nodes waiting to be served, with a reference held
+    std::set<CNode*> setPending;
+    try {
+        std::vector<struct epoll_event> vEvents(256);
+        int64_t nNextSweep = 0;
+        int64_t nRetry = SOCKET_SWEEP_INTERVAL;
+        while (true) {
+            if (GetTimeMillis() >= nNextSweep) {
+                DisconnectNodes();
+                LOCK(cs_vNodes);
+                BOOST_FOREACH (CNode* pnode, vNodes) {
+                    if (pnode->hSocket == INVALID_SOCKET)
+                        continue;
+                    if (!pnode->fSocketRegistered && !RegisterSocket(epollfd, pnode))
+                        continue;
+                    InactivityCheck(pnode);
+                    // Data the send shaper held back when another thread queued it
+                    // doesn't come with an event; nSendSize is just a hint here.
+                    if (pnode->fSendReady && pnode->nSendSize > 0 && !setPending.count(pnode))
+                        setPending.insert(pnode->AddRef());
+                }
+                nNextSweep = GetTimeMillis() + SOCKET_SWEEP_INTERVAL;
+                if (!setPending.empty())
+                    nRetry = 0;
+            }
+
+            int nTimeout = std::max((int64_t)0, std::min(nRetry, nNextSweep - GetTimeMillis()));
+            int nEvents = epoll_wait(epollfd, &vEvents[0], vEvents.size(), nTimeout);
+            boost::this_thread::interruption_point();
+            if (nEvents < 0) {
+                if (errno != EINTR) {
+                    LogPrintf("socket epoll_wait error %s\n", NetworkErrorString(errno));
+                    MilliSleep(50);
+                }
+                nEvents = 0;
+            }
+
+            for (int i = 0; i < nEvents; i++) {
+                uint64_t data = vEvents[i].data.u64;
+                if (data == 0) {
+                    uint64_t nWakes;
+                    if (read(nSocketHandlerWakeFd, &nWakes, sizeof(nWakes)) < 0) {}
+                    nNextSweep = 0;
+                } else if (data & 1) {
+                    CNode* pnodeNew;
+                    while (AcceptConnection(vhListenSocket[data >> 1], pnodeNew))
+                        if (pnodeNew)
+                            RegisterSocket(epollfd, pnodeNew);
+                } else {
+                    CNode* pnode = (CNode*)vEvents[i].data.ptr;
+                    uint32_t events = vEvents[i].events;
+                    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                        pnode->fRecvReady = true;
+                    if (events & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+                        pnode->fSendReady = true;
+                    if (!setPending.count(pnode)) {
+                        LOCK(cs_vNodes);
+                        setPending.insert(pnode->AddRef());
+                    }
+                }
+            }
+
+            nRetry = SOCKET_SWEEP_INTERVAL;
+            std::vector<CNode*> vDone;
+            for (std::set<CNode*>::iterator it = setPending.begin(); it != setPending.end();) {
+                CNode* pnode = *it;
+                SocketService service = pnode->hSocket == INVALID_SOCKET ? SOCKET_IDLE : ServiceSocket(pnode);
+                if (service == SOCKET_IDLE) {
+                    vDone.push_back(pnode);
+                    setPending.erase(it++);
+                    continue;
+                }
+                if (service == SOCKET_AGAIN)
+                    nRetry = 0;
+                else if (service == SOCKET_BUSY)
+                    nRetry = std::min(nRetry, (int64_t)SOCKET_BUSY_RETRY);
+                else if (service == SOCKET_RECV_SHAPED)
+                    nRetry = std::min(nRetry, receiveShaper.msUntilAvailable(RECV_SHAPER_MIN_FRAG));
+                else if (service == SOCKET_SEND_SHAPED)
+                    nRetry = std::min(nRetry, sendShaper.msUntilAvailable(SEND_SHAPER_MIN_FRAG));
+                ++it;
+            }
+            if (!vDone.empty()) {
+                LOCK(cs_vNodes);
+                BOOST_FOREACH (CNode* pnode, vDone)
+                    pnode->Release();
+            }
+        }
+    } catch (const boost::thread_interrupted&) {
+        {
+            LOCK(cs_vNodes);
+            BOOST_FOREACH (CNode* pnode, setPending)
+                pnode->Release();
+        }
+        close(epollfd);
+        throw;
+    }
+    return true;
+}
+
+void WakeSocketHandler()
+{
+    if (nSocketHandlerWakeFd >= 0) {
+        uint64_t nWake = 1;
+        if (write(nSocketHandlerWakeFd, &nWake, sizeof(nWake)) < 0) {}
+    }
+}
+#else
+void WakeSocketHandler() {}
+#endif
+
+bool UseSocketEventsEpoll()
+{
+#ifdef HAVE_SYS_EPOLL_H
+    return GetArg("-socketevents", DEFAULT_SOCKET_EVENTS) == "epoll";
+#else
+    return false;
+#endif
+}
+
+void ThreadSocketHandler()
+{
+#ifdef HAVE_SYS_EPOLL_H
+    if (UseSocketEventsEpoll()) {
+        if (ThreadSocketHandlerEpoll())
+            return;
+        LogPrintf("Waiting for socket events with select() instead\n");
+    }
+#endif
+    ThreadSocketHandlerSelect();
+}
+
 
 #ifdef USE_UPNP
 void ThreadMapPort()
@@ -1369,11 +1677,8 @@ bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant* grantOu
 }
 
 
-void ThreadMessageHandler()
+void ThreadMessageHandler(int nThread)
 {
-    boost::mutex condition_mutex;
-    boost::unique_lock<boost::mutex> lock(condition_mutex);
-
     SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
     while (true) {
         vector<CNode*> vNodesCopy;
@@ -1387,15 +1692,25 @@ void ThreadMessageHandler()
 
         // Poll the connected nodes for messages
         CNode* pnodeTrickle = NULL;
-        if (!vNodesCopy.empty())
+        if (nThread == 0 && !vNodesCopy.empty())
             pnodeTrickle = vNodesCopy[GetRand(vNodesCopy.size())];
 
+        // Start at a different node in each thread, so the threads spread
+        // over the nodes instead of queueing up behind each other.
+        size_t nStart = vNodesCopy.empty() ? 0 : GetRand(vNodesCopy.size());
+
         bool fSleep = true;
 
-        BOOST_FOREACH (CNode* pnode, vNodesCopy) {
+        for (size_t i = 0; i < vNodesCopy.size(); i++) {
+            CNode* pnode = vNodesCopy[(nStart + i) % vNodesCopy.size()];
             if (pnode->fDisconnect)
                 continue;
 
+            // Skip nodes another thread is serving
+            TRY_LOCK(pnode->cs_vProcessMsg, lockProcess);
+            if (!lockProcess)
+                continue;
+
             // Receive messages
             {
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
@@ -1427,8 +1742,10 @@ void ThreadMessageHandler()
                 pnode->Release();
         }
 
-        if (fSleep)
+        if (fSleep) {
+            boost::unique_lock<boost::mutex> lock(messageHandlerMutex);
             messageHandlerCondition.timed_wait(lock, boost::posix_time::microsec_clock::universal_time() + boost::posix_time::milliseconds(100));
+        }
     }
 }
 
@@ -1631,7 +1948,13 @@ void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "opencon", &ThreadOpenConnections));
 
     // Process messages
-    threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
+    int nMessageHandlerThreads = GetArg("-msghandlers", DEFAULT_MESSAGE_HANDLER_THREADS);
+    if (!mapArgs.count("-msghandlers"))
+        nMessageHandlerThreads = min(nMessageHandlerThreads, (int)boost::thread::hardware_concurrency());
+    nMessageHandlerThreads = max(1, min(nMessageHandlerThreads, MAX_MESSAGE_HANDLER_THREADS));
+    LogPrintf("Using %d threads for peer message processing\n", nMessageHandlerThreads);
+    for (int i = 0; i < nMessageHandlerThreads; i++)
+        threadGroup.create_thread(boost::bind(&TraceThread<boost::function<void()> >, "msghand", boost::function<void()>(boost::bind(&ThreadMessageHandler, i))));
 
     // Dump network addresses
     scheduler.scheduleEvery(&DumpAddresses, DUMP_ADDRESSES_INTERVAL);
@@ -1691,41 +2014,35 @@ public:
 
 
 void RelayTransaction(const CTransaction& tx)
-{
-    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-    ss.reserve(10000);
-    ss << tx;
-    RelayTransaction(tx, ss);
-}
-
-void RelayTransaction(const CTransaction& tx, const CDataStream& ss)
 {
     CInv inv(MSG_TX, tx.GetHash());
-    {
-        LOCK(cs_mapRelay);
-        // Expire old relay messages
-        while (!vRelayExpiration.empty() && vRelayExpiration.front().first < GetTime()) {
-            mapRelay.erase(vRelayExpiration.front().second);
-            vRelayExpiration.pop_front();
-        }
+    // Serialized once here; peers that ask for it share the message.
+    relayCache.Insert(inv, MakeTxMessage(tx));
+
+    // What peers' bloom filters match against is taken from the transaction
+    // once, when the first filter is met, and shared by all of them.
+    boost::scoped_ptr<CBloomTxElements> pelements;
 
-        // Save original serialized message so newer versions are preserved
-        mapRelay.insert(std::make_pair(inv, ss));
-        vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
-    }
     LOCK(cs_vNodes);
     BOOST_FOREACH (CNode* pnode, vNodes) {
         if (!pnode->fRelayTxes)
             continue;
         LOCK(pnode->cs_filter);
         if (pnode->pfilter) {
-            if (pnode->pfilter->IsRelevantAndUpdate(tx))
+            if (!pelements)
+                pelements.reset(new CBloomTxElements(tx));
+            if (pnode->pfilter->IsRelevantAndUpdate(*pelements))
                 pnode->PushInventory(inv);
         } else
             pnode->PushInventory(inv);
     }
 }
 
+int64_t PoissonNextSend(int64_t nNow, int average_interval_seconds)
+{
+    return nNow + (int64_t)(log1p(GetRand(1ULL << 48) * -0.0000000000000035527136788 /* -1/2^48 */) * average_interval_seconds * -1000000.0 + 0.5);
+}
+
 void CNode::RecordBytesRecv(uint64_t bytes)
 {
     LOCK(cs_totalBytesRecv);
@@ -1889,7 +2206,7 @@ unsigned int SendBufferSize() { return 1000 * GetArg("-maxsendbuffer", 1 * 1000)
 
 CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fInboundIn) : ssSend(SER_NETWORK, INIT_PROTO_VERSION),
                                                                                            addrKnown(5000, 0.001, insecure_rand()),
-                                                                                           setInventoryKnown(SendBufferSize() / 1000)
+                                                                                           filterInventoryKnown(INVENTORY_KNOWN_SIZE, 0.000001, insecure_rand())
 {
     nServices = 0;
     hSocket = hSocketIn;
@@ -1911,6 +2228,9 @@ CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fIn
     fNetworkNode = false;
     fSuccessfullyConnected = false;
     fDisconnect = false;
+    fSocketRegistered = false;
+    fRecvReady = false;
+    fSendReady = false;
     nRefCount = 0;
     nSendSize = 0;
     nSendOffset = 0;
@@ -1923,6 +2243,9 @@ CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fIn
     nPingUsecStart = 0;
     nPingUsecTime = 0;
     fPingQueued = false;
+    nNextInvSend = 0;
+    nInvSent = 0;
+    nInvBytesSent = 0;
 
     {
         LOCK(cs_nLastNodeId);
@@ -2022,13 +2345,28 @@ void CNode::EndMessage() UNLOCK_FUNCTION(cs_vSend)
 
     LogPrint("net", "(%d bytes) peer=%d\n", nSize, id);
 
-    std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
-    ssSend.GetAndClear(*it);
-    nSendSize += (*it).size();
+    boost::shared_ptr<CSerializeData> pmsg(new CSerializeData());
+    ssSend.GetAndClear(*pmsg);
+    nSendSize += pmsg->size();
+    vSendMsg.push_back(pmsg);
 
     // If write queue empty, attempt "optimistic write"
-    if (it == vSendMsg.begin())
+    if (vSendMsg.size() == 1)
         SocketSendData(this);
 
     LEAVE_CRITICAL_SECTION(cs_vSend);
 }
+
+void CNode::PushSerializedMessage(const char* pszCommand, const CSerializeDataRef& pmsg)
+{
+    LOCK(cs_vSend);
+    LogPrint("net", "sending: %s (%d bytes, preserialized) peer=%d\n", SanitizeString(pszCommand),
+             pmsg->size() - CMessageHeader::HEADER_SIZE, id);
+
+    nSendSize += pmsg->size();
+    vSendMsg.push_back(pmsg);
+
+    // If write queue empty, attempt "optimistic write"
+    if (vSendMsg.size() == 1)
+        SocketSendData(this);
+}
@@ -10,7 +10,6 @@
 #include "compat.h"
 #include "hash.h"
 #include "limitedmap.h"
-#include "mruset.h"
 #include "netbase.h"
 #include "protocol.h"
 #include "random.h"
@@ -30,6 +29,7 @@
 
 #include <boost/filesystem/path.hpp>
 #include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/signals2/signal.hpp>
 
 class CAddrMan;
@@ -49,6 +49,12 @@ static const int PING_INTERVAL = 2 * 60;
 static const int TIMEOUT_INTERVAL = 20 * 60;
 /** The maximum number of entries in an 'inv' protocol message */
 static const unsigned int MAX_INV_SZ = 50000;
+/** Average delay between transaction announcements to an inbound peer, in seconds; half of it to outbound peers */
+static const int INVENTORY_BROADCAST_INTERVAL = 5;
+/** The maximum number of transactions announced to a peer at once, which bounds the average rate of announcements */
+static const unsigned int INVENTORY_BROADCAST_MAX = 100 * INVENTORY_BROADCAST_INTERVAL;
+/** The number of recent inventory items a peer is remembered to know */
+static const unsigned int INVENTORY_KNOWN_SIZE = 5000;
 /** The maximum number of new addresses to accumulate before announcing. */
 static const unsigned int MAX_ADDR_TO_SEND = 1000;
 /** The maximum # of bytes to receive at once */
@@ -64,6 +70,16 @@ static const bool DEFAULT_UPNP = false;
 #endif
 /** The maximum number of entries in mapAskFor */
 static const size_t MAPASKFOR_MAX_SZ = MAX_INV_SZ;
+/** The default number of threads processing peer messages, if there are as many cores */
+static const int DEFAULT_MESSAGE_HANDLER_THREADS = 4;
+/** The maximum number of threads processing peer messages */
+static const int MAX_MESSAGE_HANDLER_THREADS = 32;
+/** Default for -socketevents, how the socket handler thread waits for socket readiness */
+#ifdef HAVE_SYS_EPOLL_H
+static const char DEFAULT_SOCKET_EVENTS[] = "epoll";
+#else
+static const char DEFAULT_SOCKET_EVENTS[] = "select";
+#endif
 
 // These variables for traffic shaping need to be globally scoped so the GUI and CLI can adjust the parameters
 extern CLeakyBucket receiveShaper;
@@ -85,7 +101,20 @@ unsigned short GetListenPort();
 bool BindListenPort(const CService& bindAddr, std::string& strError, bool fWhitelisted = false);
 void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler);
 bool StopNode();
-void SocketSendData(CNode* pnode);
+bool SocketSendData(CNode* pnode);
+/** Send and receive from sockets, accept connections */
+void ThreadSocketHandler();
+/** Make the socket handler thread look at the nodes again, e.g. after adding one */
+void WakeSocketHandler();
+/** Whether the socket handler waits on epoll, which unlike select() has no FD_SETSIZE limit */
+bool UseSocketEventsEpoll();
+/**
+ * Process received messages and send queued ones. Several of these threads
+ * run at once; each peer is served by at most one of them at a time, so a
+ * peer's messages are still handled in order. Thread 0 also picks the peer
+ * that gets the trickled inventory and addresses.
+ */
+void ThreadMessageHandler(int nThread);
 
 typedef int NodeId;
 
@@ -158,9 +187,6 @@ extern int nMaxConnections;
 
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
-extern std::map<CInv, CDataStream> mapRelay;
-extern std::deque<std::pair<int64_t, CInv> > vRelayExpiration;
-extern CCriticalSection cs_mapRelay;
 extern limitedmap<CInv, int64_t> mapAlreadyAskedFor;
 
 extern std::vector<std::string> vAddedNodes;
@@ -194,6 +220,9 @@ public:
     int nStartingHeight;
     uint64_t nSendBytes;
     uint64_t nRecvBytes;
+    uint64_t nInvSent;
+    uint64_t nInvBytesSent;
+    size_t nInvQueued;
     bool fWhitelisted;
     double dPingTime;
     double dPingWait;
@@ -245,6 +274,12 @@ public:
 };
 
 
+/**
+ * A message serialized for sending, header included. Shared, so that one
+ * message can be queued for several peers without copying it.
+ */
+typedef boost::shared_ptr<const CSerializeData> CSerializeDataRef;
+
 /** Information about a peer */
 class CNode
 {
@@ -256,12 +291,19 @@ public:
     size_t nSendSize;   // total size of all vSendMsg entries
     size_t nSendOffset; // offset inside the first vSendMsg already sent
     uint64_t nSendBytes;
-    std::deque<CSerializeData> vSendMsg;
+    std::deque<CSerializeDataRef> vSendMsg;
     CCriticalSection cs_vSend;
 
+    // Socket readiness, kept by the socket handler thread when it waits on epoll
+    bool fSocketRegistered; //! hSocket was added to the socket handler's epoll set
+    bool fRecvReady;        //! hSocket may have data to read
+    bool fSendReady;        //! hSocket may take more data
+
     std::deque<CInv> vRecvGetData;
     std::deque<CNetMessage> vRecvMsg;
     CCriticalSection cs_vRecvMsg;
+    // Held by the message handler thread currently serving this node
+    CCriticalSection cs_vProcessMsg;
     uint64_t nRecvBytes;
     int nRecvVersion;
 
@@ -317,13 +359,17 @@ public:
     // flood relay
     std::vector<CAddress> vAddrToSend;
     CRollingBloomFilter addrKnown;
+    CCriticalSection cs_vAddrToSend; // guards vAddrToSend and addrKnown
     bool fGetAddr;
-    std::set<uint256> setKnown;
+    std::set<uint256> setKnown; // guarded by cs_inventory
 
     // inventory based relay
-    mruset<CInv> setInventoryKnown;
+    CRollingBloomFilter filterInventoryKnown; // hashes of the inventory the peer has or was told about
     std::vector<CInv> vInventoryToSend;
-    CCriticalSection cs_inventory;
+    CCriticalSection cs_inventory; // guards filterInventoryKnown and vInventoryToSend
+    int64_t nNextInvSend; // when transactions are next announced, in usec
+    uint64_t nInvSent; // inventory items announced
+    uint64_t nInvBytesSent; // size of the inv messages announcing them
     std::multimap<int64_t, CInv> mapAskFor;
 
     // Ping time measurement:
@@ -395,6 +441,7 @@ public:
 
     void AddAddressKnown(const CAddress& addr)
     {
+        LOCK(cs_vAddrToSend);
         addrKnown.insert(addr.GetKey());
     }
 
@@ -403,6 +450,7 @@ public:
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
+        LOCK(cs_vAddrToSend);
         if (addr.IsValid() && !addrKnown.contains(addr.GetKey())) {
             if (vAddrToSend.size() >= MAX_ADDR_TO_SEND) {
                 vAddrToSend[insecure_rand() % vAddrToSend.size()] = addr;
@@ -417,7 +465,10 @@ public:
     {
         {
             LOCK(cs_inventory);
-            return setInventoryKnown.insert(inv).second;
+            if (filterInventoryKnown.contains(inv.hash))
+                return false;
+            filterInventoryKnown.insert(inv.hash);
+            return true;
         }
     }
 
@@ -425,7 +476,7 @@ public:
     {
         {
             LOCK(cs_inventory);
-            if (!setInventoryKnown.count(inv))
+            if (!filterInventoryKnown.contains(inv.hash))
                 vInventoryToSend.push_back(inv);
         }
     }
@@ -441,6 +492,9 @@ public:
     // TODO: Document the precondition of this function.  Is cs_vSend locked?
     void EndMessage() UNLOCK_FUNCTION(cs_vSend);
 
+    /** Queue a message that was serialized, header and all, beforehand. */
+    void PushSerializedMessage(const char* pszCommand, const CSerializeDataRef& pmsg);
+
     void PushVersion();
 
 
@@ -607,7 +661,9 @@ public:
 
 class CTransaction;
 void RelayTransaction(const CTransaction& tx);
-void RelayTransaction(const CTransaction& tx, const CDataStream& ss);
+
+/** Return a timestamp in the future (in microseconds) for exponentially distributed events. */
+int64_t PoissonNextSend(int64_t nNow, int average_interval_seconds);
 
 /** Access to the (IP) address database (peers.dat) */
 class CAddrDB
@@ -0,0 +1,284 @@
+// Copyright (c) 2015 The Bitcoin XT developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_PREVECTOR_H
+#define BITCOIN_PREVECTOR_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <new>
+
+#pragma pack(push, 1)
+/**
+ * A vector of plain old data that keeps up to N elements inside the object
+ * itself, and only goes to the heap when it grows beyond that.
+ *
+ * Most scripts are short (a pay-to-pubkey-hash output script is 25 bytes),
+ * so holding them in a prevector saves a heap allocation for every output
+ * read from a block or a transaction, and the memory malloc would spend on
+ * its bookkeeping.
+ *
+ * The interface is the part of std::vector that scripts need. Elements are
+ * moved with memcpy/memmove, so T must not have a constructor, destructor
+ * or assignment operator of its own. Iterators are plain pointers, and are
+ * invalidated by anything that changes the size, as with std::vector.
+ *
+ * The elements held directly share their space with the capacity and the
+ * pointer used once on the heap, so a prevector<28, unsigned char> takes
+ * 32 bytes with the packing.
+ */
+template<unsigned int N, typename T, typename Size = uint32_t, typename Diff = int32_t>
+class prevector
+{
+public:
+    typedef Size size_type;
+    typedef Diff difference_type;
+    typedef T value_type;
+    typedef value_type& reference;
+    typedef const value_type& const_reference;
+    typedef value_type* pointer;
+    typedef const value_type* const_pointer;
+    typedef T* iterator;
+    typedef const T* const_iterator;
+
+private:
+    //! The size when up to N elements are held directly, N + 1 + the size otherwise
+    size_type _size;
+    union direct_or_indirect {
+        char direct[sizeof(T) * N];
+        struct {
+            size_type capacity;
+            char* indirect;
+        } heap;
+    } _union;
+
+    T* direct_ptr(difference_type pos) { return reinterpret_cast<T*>(_union.direct) + pos; }
+    const T* direct_ptr(difference_type pos) const { return reinterpret_cast<const T*>(_union.direct) + pos; }
+    T* indirect_ptr(difference_type pos) { return reinterpret_cast<T*>(_union.heap.indirect) + pos; }
+    const T* indirect_ptr(difference_type pos) const { return reinterpret_cast<const T*>(_union.heap.indirect) + pos; }
+    bool is_direct() const { return _size <= N; }
+
+    void change_capacity(size_type new_capacity) {
+        if (new_capacity <= N) {
+            if (!is_direct()) {
+                T* indirect = indirect_ptr(0);
+                T* src = indirect;
+                T* dst = direct_ptr(0);
+                memcpy(dst, src, size() * sizeof(T));
+                free(indirect);
+                _size -= N + 1;
+            }
+        } else {
+            if (!is_direct()) {
+                char* new_indirect = static_cast<char*>(realloc(_union.heap.indirect, ((size_t)sizeof(T)) * new_capacity));
+                if (!new_indirect)
+                    throw std::bad_alloc();
+                _union.heap.indirect = new_indirect;
+                _union.heap.capacity = new_capacity;
+            } else {
+                char* new_indirect = static_cast<char*>(malloc(((size_t)sizeof(T)) * new_capacity));
+                if (!new_indirect)
+                    throw std::bad_alloc();
+                T* src = direct_ptr(0);
+                T* dst = reinterpret_cast<T*>(new_indirect);
+                memcpy(dst, src, size() * sizeof(T));
+                _union.heap.indirect = new_indirect;
+                _union.heap.capacity = new_capacity;
+                _size += N + 1;
+            }
+        }
+    }
+
+    T* item_ptr(difference_type pos) { return is_direct() ? direct_ptr(pos) : indirect_ptr(pos); }
+    const T* item_ptr(difference_type pos) const { return is_direct() ? direct_ptr(pos) : indirect_ptr(pos); }
+
+    /** Make room for at least n elements, at least doubling the capacity if it must grow. */
+    void grow_to(size_type n) {
+        if (capacity() < n)
+            change_capacity(std::max(n, (size_type)(capacity() * 2)));
+    }
+
+    /** Set the size, with the capacity already large enough. */
+    void set_size(size_type new_size) {
+        _size = is_direct() ? new_size : new_size + N + 1;
+    }
+
+public:
+    prevector() : _size(0) {}
+
+    explicit prevector(size_type n) : _size(0) {
+        resize(n);
+    }
+
+    explicit prevector(size_type n, const T& val) : _size(0) {
+        assign(n, val);
+    }
+
+    template<typename InputIterator>
+    prevector(InputIterator first, InputIterator last) : _size(0) {
+        assign(first, last);
+    }
+
+    prevector(const prevector<N, T, Size, Diff>& other) : _size(0) {
+        assign(other.begin(), other.end());
+    }
+
+    ~prevector() {
+        if (!is_direct())
+            free(_union.heap.indirect);
+    }
+
+    prevector& operator=(const prevector<N, T, Size, Diff>& other) {
+        if (&other == this)
+            return *this;
+        assign(other.begin(), other.end());
+        return *this;
+    }
+
+    void assign(size_type n, const T& val) {
+        clear();
+        grow_to(n);
+        T* dst = item_ptr(0);
+        for (size_type i = 0; i < n; i++)
+            dst[i] = val;
+        set_size(n);
+    }
+
+    template<typename InputIterator>
+    void assign(InputIterator first, InputIterator last) {
+        size_type n = std::distance(first, last);
+        clear();
+        if (capacity() < n)
+            change_capacity(n);
+        std::copy(first, last, item_ptr(0));
+        set_size(n);
+    }
+
+    size_type size() const { return is_direct() ? _size : _size - N - 1; }
+    bool empty() const { return size() == 0; }
+    size_type capacity() const { return is_direct() ? N : _union.heap.capacity; }
+
+    iterator begin() { return item_ptr(0); }
+    const_iterator begin() const { return item_ptr(0); }
+    iterator end() { return item_ptr(size()); }
+    const_iterator end() const { return item_ptr(size()); }
+
+    T& operator[](size_type pos) { return *item_ptr(pos); }
+    const T& operator[](size_type pos) const { return *item_ptr(pos); }
+    T& front() { return *item_ptr(0); }
+    const T& front() const { return *item_ptr(0); }
+    T& back() { return *item_ptr(size() - 1); }
+    const T& back() const { return *item_ptr(size() - 1); }
+    T* data() { return item_ptr(0); }
+    const T* data() const { return item_ptr(0); }
+
+    void reserve(size_type new_capacity) {
+        if (new_capacity > capacity())
+            change_capacity(new_capacity);
+    }
+
+    void shrink_to_fit() {
+        change_capacity(size());
+    }
+
+    void resize(size_type new_size) {
+        size_type cur_size = size();
+        if (new_size > cur_size) {
+            grow_to(new_size);
+            memset(item_ptr(cur_size), 0, (new_size - cur_size) * sizeof(T));
+        }
+        set_size(new_size);
+    }
+
+    void clear() {
+        set_size(0);
+    }
+
+    void push_back(const T& value) {
+        T copy = value; // value may point into this
+        size_type new_size = size() + 1;
+        grow_to(new_size);
+        *item_ptr(new_size - 1) = copy;
+        set_size(new_size);
+    }
+
+    void pop_back() {
+        set_size(size() - 1);
+    }
+
+    iterator insert(iterator pos, const T& value) {
+        size_type p = pos - begin();
+        T copy = value; // value may point into this
+        size_type new_size = size() + 1;
+        grow_to(new_size);
+        memmove(item_ptr(p + 1), item_ptr(p), (size() - p) * sizeof(T));
+        *item_ptr(p) = copy;
+        set_size(new_size);
+        return item_ptr(p);
+    }
+
+    void insert(iterator pos, size_type count, const T& value) {
+        size_type p = pos - begin();
+        T copy = value;
+        size_type new_size = size() + count;
+        grow_to(new_size);
+        memmove(item_ptr(p + count), item_ptr(p), (size() - p) * sizeof(T));
+        for (size_type i = 0; i < count; i++)
+            *item_ptr(p + i) = copy;
+        set_size(new_size);
+    }
+
+    template<typename InputIterator>
+    void insert(iterator pos, InputIterator first, InputIterator last) {
+        size_type p = pos - begin();
+        difference_type count = std::distance(first, last);
+        size_type new_size = size() + count;
+        grow_to(new_size);
+        memmove(item_ptr(p + count), item_ptr(p), (size() - p) * sizeof(T));
+        std::copy(first, last, item_ptr(p));
+        set_size(new_size);
+    }
+
+    iterator erase(iterator pos) {
+        return erase(pos, pos + 1);
+    }
+
+    iterator erase(iterator first, iterator last) {
+        size_type p = first - begin();
+        size_type count = last - first;
+        memmove(first, last, (end() - last) * sizeof(T));
+        set_size(size() - count);
+        return item_ptr(p);
+    }
+
+    void swap(prevector<N, T, Size, Diff>& other) {
+        std::swap(_union, other._union);
+        std::swap(_size, other._size);
+    }
+
+    bool operator==(const prevector<N, T, Size, Diff>& other) const {
+        if (other.size() != size())
+            return false;
+        return std::equal(begin(), end(), other.begin());
+    }
+
+    bool operator!=(const prevector<N, T, Size, Diff>& other) const {
+        return !(*this == other);
+    }
+
+    bool operator<(const prevector<N, T, Size, Diff>& other) const {
+        return std::lexicographical_compare(begin(), end(), other.begin(), other.end());
+    }
+
+    /** Bytes allocated on the heap, for memory usage accounting */
+    size_t allocated_memory() const {
+        return is_direct() ? 0 : ((size_t)(sizeof(T))) * _union.heap.capacity;
+    }
+};
+#pragma pack(pop)
+
+#endif // BITCOIN_PREVECTOR_H
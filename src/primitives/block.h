@@ -85,6 +85,7 @@ public:
 
     // memory only
     mutable std::vector<uint256> vMerkleTree;
+    mutable bool fChecked; //! Passed CheckBlock() with proof of work and merkle root
 
     CBlock()
     {
@@ -103,6 +104,8 @@ public:
     inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
         READWRITE(*(CBlockHeader*)this);
         READWRITE(vtx);
+        if (ser_action.ForRead())
+            fChecked = false;
     }
 
     void SetNull()
@@ -110,6 +113,7 @@ public:
         CBlockHeader::SetNull();
         vtx.clear();
         vMerkleTree.clear();
+        fChecked = false;
     }
 
     CBlockHeader GetBlockHeader() const
@@ -75,6 +75,15 @@ enum {
     // Bitcoin Core does not support this but a patch set called Bitcoin XT does.
     // See BIP 64 for details on how this is implemented.
     NODE_GETUTXO = (1 << 1),
+    // NODE_COMPACT_FILTERS means the node keeps a compact filter of every block
+    // and serves them, and their headers, with getcfilters and getcfheaders,
+    // so that light clients can test blocks for their scripts themselves.
+    // See BIP 157 and BIP 158, and blockfilter.h.
+    NODE_COMPACT_FILTERS = (1 << 6),
+    // NODE_THIN means the node can send and reconstruct thin blocks: a block header
+    // plus short transaction ids, with the missing transactions fetched separately.
+    // Bitcoin XT implements this, see thinblock.h.
+    NODE_THIN = (1 << 24),
 
     // Bits 24-31 are reserved for temporary experiments. Just pick a bit that
     // isn't getting used, or one not being used much, and notify the
@@ -153,6 +162,9 @@ enum {
     // Nodes may always request a MSG_FILTERED_BLOCK in a getdata, however,
     // MSG_FILTERED_BLOCK should not appear in any invs except as a part of getdata.
     MSG_FILTERED_BLOCK,
+    // Like MSG_FILTERED_BLOCK, MSG_THIN_BLOCK is only used in getdata, to ask a
+    // NODE_THIN peer for a "thinblock" instead of a full "block".
+    MSG_THIN_BLOCK,
 };
 
 #endif // BITCOIN_PROTOCOL_H
@@ -6,17 +6,163 @@
 
 #include "eccryptoverify.h"
 
-#include "ecwrapper.h"
+#include <secp256k1.h>
+
+namespace
+{
+/* Global secp256k1_context object used for verification. */
+secp256k1_context_t* secp256k1_context_verify = NULL;
+}
+
+/**
+ * Parse a DER signature as loosely as OpenSSL does and extract its R and S
+ * values into rs (big endian, 32 bytes each).
+ *
+ * Signatures that fail BIP66's strict encoding rules are still valid in
+ * blocks from before it was deployed, so this accepts what OpenSSL's
+ * d2i_ECDSA_SIG accepted: long form and overlong length descriptors,
+ * excess leading zeroes in R and S, and garbage after the signature.
+ * R and S values that don't fit in 32 bytes are set to zero, which no
+ * valid signature has.
+ *
+ * Returns false only if the input is not a DER sequence of two integers
+ * at all.
+ */
+static bool ecdsa_signature_parse_der_lax(const unsigned char *input, size_t inputlen, unsigned char rs[64])
+{
+    size_t rpos, rlen, spos, slen;
+    size_t pos = 0;
+    size_t lenbyte;
+    bool overflow = false;
+
+    memset(rs, 0, 64);
+
+    /* Sequence tag byte */
+    if (pos == inputlen || input[pos] != 0x30)
+        return false;
+    pos++;
+
+    /* Sequence length bytes */
+    if (pos == inputlen)
+        return false;
+    lenbyte = input[pos++];
+    if (lenbyte & 0x80) {
+        lenbyte -= 0x80;
+        if (lenbyte > inputlen - pos)
+            return false;
+        pos += lenbyte;
+    }
+
+    /* Integer tag byte for R */
+    if (pos == inputlen || input[pos] != 0x02)
+        return false;
+    pos++;
+
+    /* Integer length for R */
+    if (pos == inputlen)
+        return false;
+    lenbyte = input[pos++];
+    if (lenbyte & 0x80) {
+        lenbyte -= 0x80;
+        if (lenbyte > inputlen - pos)
+            return false;
+        while (lenbyte > 0 && input[pos] == 0) {
+            pos++;
+            lenbyte--;
+        }
+        if (lenbyte >= sizeof(size_t))
+            return false;
+        rlen = 0;
+        while (lenbyte > 0) {
+            rlen = (rlen << 8) + input[pos];
+            pos++;
+            lenbyte--;
+        }
+    } else {
+        rlen = lenbyte;
+    }
+    if (rlen > inputlen - pos)
+        return false;
+    rpos = pos;
+    pos += rlen;
+
+    /* Integer tag byte for S */
+    if (pos == inputlen || input[pos] != 0x02)
+        return false;
+    pos++;
+
+    /* Integer length for S */
+    if (pos == inputlen)
+        return false;
+    lenbyte = input[pos++];
+    if (lenbyte & 0x80) {
+        lenbyte -= 0x80;
+        if (lenbyte > inputlen - pos)
+            return false;
+        while (lenbyte > 0 && input[pos] == 0) {
+            pos++;
+            lenbyte--;
+        }
+        if (lenbyte >= sizeof(size_t))
+            return false;
+        slen = 0;
+        while (lenbyte > 0) {
+            slen = (slen << 8) + input[pos];
+            pos++;
+            lenbyte--;
+        }
+    } else {
+        slen = lenbyte;
+    }
+    if (slen > inputlen - pos)
+        return false;
+    spos = pos;
+
+    /* Ignore leading zeroes in R */
+    while (rlen > 0 && input[rpos] == 0) {
+        rlen--;
+        rpos++;
+    }
+    /* Copy R value */
+    if (rlen > 32)
+        overflow = true;
+    else
+        memcpy(rs + 32 - rlen, input + rpos, rlen);
+
+    /* Ignore leading zeroes in S */
+    while (slen > 0 && input[spos] == 0) {
+        slen--;
+        spos++;
+    }
+    /* Copy S value */
+    if (slen > 32)
+        overflow = true;
+    else
+        memcpy(rs + 64 - slen, input + spos, slen);
+
+    if (overflow)
+        memset(rs, 0, 64);
+    return true;
+}
 
 bool CPubKey::Verify(const uint256 &hash, const std::vector<unsigned char>& vchSig) const {
     if (!IsValid())
         return false;
-    CECKey key;
-    if (!key.SetPubKey(begin(), size()))
+    if (vchSig.empty())
         return false;
-    if (!key.Verify(hash, vchSig))
+    unsigned char rs[64];
+    if (!ecdsa_signature_parse_der_lax(&vchSig[0], vchSig.size(), rs))
         return false;
-    return true;
+    // Hand libsecp256k1 the same values in a canonical encoding: both
+    // integers padded to 33 bytes, which its parser strips back down.
+    unsigned char sig[72] = { 0x30, 0x46, 0x02, 0x21, 0x00 };
+    memcpy(sig + 5, rs, 32);
+    sig[37] = 0x02;
+    sig[38] = 0x21;
+    sig[39] = 0x00;
+    memcpy(sig + 40, rs + 32, 32);
+    assert(secp256k1_context_verify && "ECCVerifyHandle not held");
+    return secp256k1_ecdsa_verify(secp256k1_context_verify, hash.begin(), sig, sizeof(sig), begin(), size()) == 1;
 }
 
 bool CPubKey::RecoverCompact(const uint256 &hash, const std::vector<unsigned char>& vchSig) {
@@ -24,33 +170,32 @@ bool CPubKey::RecoverCompact(const uint256 &hash, const std::vector<unsigned cha
         return false;
     int recid = (vchSig[0] - 27) & 3;
     bool fComp = ((vchSig[0] - 27) & 4) != 0;
-    CECKey key;
-    if (!key.Recover(hash, &vchSig[1], recid))
+    unsigned char pub[65];
+    int publen = 0;
+    assert(secp256k1_context_verify && "ECCVerifyHandle not held");
+    if (!secp256k1_ecdsa_recover_compact(secp256k1_context_verify, hash.begin(), &vchSig[1], pub, &publen, fComp, recid))
         return false;
-    std::vector<unsigned char> pubkey;
-    key.GetPubKey(pubkey, fComp);
-    Set(pubkey.begin(), pubkey.end());
+    Set(pub, pub + publen);
     return true;
 }
 
 bool CPubKey::IsFullyValid() const {
     if (!IsValid())
         return false;
-    CECKey key;
-    if (!key.SetPubKey(begin(), size()))
-        return false;
-    return true;
+    assert(secp256k1_context_verify && "ECCVerifyHandle not held");
+    return secp256k1_ec_pubkey_verify(secp256k1_context_verify, begin(), size());
 }
 
 bool CPubKey::Decompress() {
     if (!IsValid())
         return false;
-    CECKey key;
-    if (!key.SetPubKey(begin(), size()))
+    unsigned char pub[65];
+    int publen = size();
+    memcpy(pub, begin(), publen);
+    assert(secp256k1_context_verify && "ECCVerifyHandle not held");
+    if (!secp256k1_ec_pubkey_decompress(secp256k1_context_verify, pub, &publen))
         return false;
-    std::vector<unsigned char> pubkey;
-    key.GetPubKey(pubkey, false);
-    Set(pubkey.begin(), pubkey.end());
+    Set(pub, pub + publen);
     return true;
 }
 
@@ -61,13 +206,13 @@ bool CPubKey::Derive(CPubKey& pubkeyChild, ChainCode &ccChild, unsigned int nChi
     unsigned char out[64];
     BIP32Hash(cc, nChild, *begin(), begin()+1, out);
     memcpy(ccChild.begin(), out+32, 32);
-    CECKey key;
-    bool ret = key.SetPubKey(begin(), size());
-    ret &= key.TweakPublic(out);
-    std::vector<unsigned char> pubkey;
-    key.GetPubKey(pubkey, true);
-    pubkeyChild.Set(pubkey.begin(), pubkey.end());
-    return ret;
+    unsigned char pub[33];
+    memcpy(pub, begin(), 33);
+    assert(secp256k1_context_verify && "ECCVerifyHandle not held");
+    if (!secp256k1_ec_pubkey_tweak_add(secp256k1_context_verify, pub, 33, out))
+        return false;
+    pubkeyChild.Set(pub, pub + 33);
+    return true;
 }
 
 void CExtPubKey::Encode(unsigned char code[74]) const {
@@ -95,3 +240,25 @@ bool CExtPubKey::Derive(CExtPubKey &out, unsigned int nChild) const {
     out.nChild = nChild;
     return pubkey.Derive(out.pubkey, out.chaincode, nChild, chaincode);
 }
+
+/* static */ int ECCVerifyHandle::refcount = 0;
+
+ECCVerifyHandle::ECCVerifyHandle()
+{
+    if (refcount == 0) {
+        assert(secp256k1_context_verify == NULL);
+        secp256k1_context_verify = secp256k1_context_create(SECP256K1_CONTEXT_VERIFY);
+        assert(secp256k1_context_verify != NULL);
+    }
+    refcount++;
+}
+
+ECCVerifyHandle::~ECCVerifyHandle()
+{
+    refcount--;
+    if (refcount == 0) {
+        assert(secp256k1_context_verify != NULL);
+        secp256k1_context_destroy(secp256k1_context_verify);
+        secp256k1_context_verify = NULL;
+    }
+}
@@ -205,4 +205,19 @@ struct CExtPubKey {
     bool Derive(CExtPubKey& out, unsigned int nChild) const;
 };
 
+/**
+ * Users of CPubKey's verification functions must hold an ECCVerifyHandle.
+ * The first handle creates the shared secp256k1 verification context and
+ * the last one destroys it. Handles may not be created or destroyed
+ * concurrently.
+ */
+class ECCVerifyHandle
+{
+    static int refcount;
+
+public:
+    ECCVerifyHandle();
+    ~ECCVerifyHandle();
+};
+
 #endif // BITCOIN_PUBKEY_H
@@ -0,0 +1,65 @@
+// Copyright (c) 2015 The Bitcoin XT developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "rawblockcache.h"
+
+CRawBlockCache rawBlockCache(DEFAULT_BLOCK_SERVE_CACHE << 20);
+
+CRawBlockCache::CRawBlockCache(size_t nMaxBytesIn) : nBytes(0), nMaxBytes(nMaxBytesIn), nHits(0), nMisses(0)
+{
+}
+
+CSerializeDataRef CRawBlockCache::Get(const uint256& hash)
+{
+    LOCK(cs);
+    std::map<uint256, list_type::iterator>::iterator it = mapBlocks.find(hash);
+    if (it == mapBlocks.end()) {
+        nMisses++;
+        return CSerializeDataRef();
+    }
+    nHits++;
+    listUsed.splice(listUsed.begin(), listUsed, it->second);
+    return it->second->second;
+}
+
+void CRawBlockCache::Insert(const uint256& hash, const CSerializeDataRef& pmsg)
+{
+    LOCK(cs);
+    if (pmsg->size() > nMaxBytes || mapBlocks.count(hash))
+        return;
+    listUsed.push_front(std::make_pair(hash, pmsg));
+    mapBlocks[hash] = listUsed.begin();
+    nBytes += pmsg->size();
+    Trim();
+}
+
+void CRawBlockCache::Trim()
+{
+    while (nBytes > nMaxBytes) {
+        const std::pair<uint256, CSerializeDataRef>& oldest = listUsed.back();
+        nBytes -= oldest.second->size();
+        mapBlocks.erase(oldest.first);
+        listUsed.pop_back();
+    }
+}
+
+void CRawBlockCache::Clear()
+{
+    LOCK(cs);
+    listUsed.clear();
+    mapBlocks.clear();
+    nBytes = 0;
+}
+
+void CRawBlockCache::SetMaxBytes(size_t nMaxBytesIn)
+{
+    LOCK(cs);
+    nMaxBytes = nMaxBytesIn;
+    Trim();
+}
+
+size_t CRawBlockCache::GetBytes() const { LOCK(cs); return nBytes; }
+size_t CRawBlockCache::GetCount() const { LOCK(cs); return mapBlocks.size(); }
+uint64_t CRawBlockCache::GetHits() const { LOCK(cs); return nHits; }
+uint64_t CRawBlockCache::GetMisses() const { LOCK(cs); return nMisses; }
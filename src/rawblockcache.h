@@ -0,0 +1,61 @@
+// Copyright (c) 2015 The Bitcoin XT developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_RAWBLOCKCACHE_H
+#define BITCOIN_RAWBLOCKCACHE_H
+
+#include "net.h"
+#include "sync.h"
+#include "uint256.h"
+
+#include <list>
+#include <map>
+#include <stdint.h>
+#include <utility>
+
+/** Default for -blockservecache, in MiB */
+static const unsigned int DEFAULT_BLOCK_SERVE_CACHE = 32;
+
+/**
+ * The "block" messages most recently sent to peers, serialized and ready to
+ * queue again. Peers downloading the chain tend to ask for the same blocks
+ * one after the other, and with this each block is read and checksummed
+ * once rather than once per peer.
+ *
+ * Bounded by the total size of the messages; the least recently used ones
+ * are dropped first. A message larger than the whole cache isn't kept.
+ */
+class CRawBlockCache
+{
+private:
+    typedef std::list<std::pair<uint256, CSerializeDataRef> > list_type;
+
+    mutable CCriticalSection cs;
+    list_type listUsed; //! Most recently used first
+    std::map<uint256, list_type::iterator> mapBlocks;
+    size_t nBytes;
+    size_t nMaxBytes;
+    uint64_t nHits;
+    uint64_t nMisses;
+
+    void Trim();
+
+public:
+    explicit CRawBlockCache(size_t nMaxBytesIn);
+
+    /** The message for the block with hash, or NULL if it isn't cached. */
+    CSerializeDataRef Get(const uint256& hash);
+    void Insert(const uint256& hash, const CSerializeDataRef& pmsg);
+    void Clear();
+
+    void SetMaxBytes(size_t nMaxBytesIn);
+    size_t GetBytes() const;
+    size_t GetCount() const;
+    uint64_t GetHits() const;
+    uint64_t GetMisses() const;
+};
+
+extern CRawBlockCache rawBlockCache;
+
+#endif // BITCOIN_RAWBLOCKCACHE_H
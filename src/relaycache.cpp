@@ -0,0 +1,112 @@
+// Copyright (c) 2015 The Bitcoin XT developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "relaycache.h"
+
+#include "chainparams.h"
+#include "memusage.h"
+#include "primitives/transaction.h"
+#include "utiltime.h"
+#include "version.h"
+
+CRelayCache relayCache(DEFAULT_MAX_RELAY_CACHE << 20);
+
+/** Memory held by one message: the vector and its buffer. */
+static size_t MessageUsage(const CSerializeDataRef& pmsg)
+{
+    return memusage::MallocUsage(sizeof(CSerializeData)) + memusage::MallocUsage(pmsg->capacity());
+}
+
+CRelayCache::CRelayCache(size_t nMaxUsageIn) :
+    nMessageUsage(0), nMaxUsage(nMaxUsageIn), nHits(0), nMisses(0), nEvicted(0)
+{
+}
+
+size_t CRelayCache::DynamicMemoryUsageLocked() const
+{
+    return nMessageUsage + memusage::DynamicUsage(mapRelay) +
+        vExpiration.size() * sizeof(std::pair<int64_t, CInv>);
+}
+
+void CRelayCache::EraseOldest()
+{
+    std::map<CInv, CSerializeDataRef>::iterator it = mapRelay.find(vExpiration.front().second);
+    nMessageUsage -= MessageUsage(it->second);
+    mapRelay.erase(it);
+    vExpiration.pop_front();
+}
+
+void CRelayCache::Trim(int64_t nNow)
+{
+    while (!vExpiration.empty() && vExpiration.front().first < nNow)
+        EraseOldest();
+    while (!vExpiration.empty() && DynamicMemoryUsageLocked() > nMaxUsage) {
+        EraseOldest();
+        nEvicted++;
+    }
+}
+
+void CRelayCache::Insert(const CInv& inv, const CSerializeDataRef& pmsg)
+{
+    LOCK(cs);
+    int64_t nNow = GetTime();
+    // The message first relayed is kept, so that newer versions of a
+    // transaction do not replace it.
+    if (mapRelay.insert(std::make_pair(inv, pmsg)).second) {
+        nMessageUsage += MessageUsage(pmsg);
+        vExpiration.push_back(std::make_pair(nNow + RELAY_CACHE_EXPIRY, inv));
+    }
+    Trim(nNow);
+}
+
+CSerializeDataRef CRelayCache::Get(const CInv& inv)
+{
+    LOCK(cs);
+    std::map<CInv, CSerializeDataRef>::const_iterator it = mapRelay.find(inv);
+    if (it == mapRelay.end()) {
+        nMisses++;
+        return CSerializeDataRef();
+    }
+    nHits++;
+    return it->second;
+}
+
+bool CRelayCache::Exists(const CInv& inv) const
+{
+    LOCK(cs);
+    return mapRelay.count(inv);
+}
+
+void CRelayCache::Clear()
+{
+    LOCK(cs);
+    mapRelay.clear();
+    vExpiration.clear();
+    nMessageUsage = 0;
+}
+
+void CRelayCache::SetMaxUsage(size_t nMaxUsageIn)
+{
+    LOCK(cs);
+    nMaxUsage = nMaxUsageIn;
+    Trim(GetTime());
+}
+
+size_t CRelayCache::GetMaxUsage() const { LOCK(cs); return nMaxUsage; }
+size_t CRelayCache::DynamicMemoryUsage() const { LOCK(cs); return DynamicMemoryUsageLocked(); }
+size_t CRelayCache::GetCount() const { LOCK(cs); return mapRelay.size(); }
+uint64_t CRelayCache::GetHits() const { LOCK(cs); return nHits; }
+uint64_t CRelayCache::GetMisses() const { LOCK(cs); return nMisses; }
+uint64_t CRelayCache::GetEvicted() const { LOCK(cs); return nEvicted; }
+
+CSerializeDataRef MakeTxMessage(const CTransaction& tx)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss.reserve(CMessageHeader::HEADER_SIZE + ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION));
+    ss << CMessageHeader(Params().MessageStart(), "tx", 0) << tx;
+    CNetMessage::FinalizeHeader(ss);
+    boost::shared_ptr<CSerializeData> pmsg(new CSerializeData());
+    ss.GetAndClear(*pmsg);
+    return pmsg;
+}
@@ -0,0 +1,78 @@
+// Copyright (c) 2015 The Bitcoin XT developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_RELAYCACHE_H
+#define BITCOIN_RELAYCACHE_H
+
+#include "net.h"
+#include "protocol.h"
+#include "sync.h"
+
+#include <deque>
+#include <map>
+#include <stdint.h>
+#include <utility>
+
+class CTransaction;
+
+/** Default for -maxrelaycache, in MiB */
+static const unsigned int DEFAULT_MAX_RELAY_CACHE = 32;
+/** How long a relayed transaction is kept to answer getdata, in seconds */
+static const int64_t RELAY_CACHE_EXPIRY = 15 * 60;
+
+/**
+ * The transactions we have relayed recently, as "tx" messages serialized
+ * and checksummed once, ready to be queued for any number of peers. Peers
+ * that ask for a transaction get a reference to the same message in their
+ * send queue, not a copy of it.
+ *
+ * A message is kept for RELAY_CACHE_EXPIRY seconds after it was first
+ * relayed, as the one first relayed. The cache is also bounded by its
+ * memory usage, counting the messages, which may be shared with send
+ * queues, and the cache's own bookkeeping; the oldest messages are dropped
+ * first. A transaction dropped early is still served from the memory pool.
+ */
+class CRelayCache
+{
+private:
+    mutable CCriticalSection cs;
+    std::map<CInv, CSerializeDataRef> mapRelay;
+    std::deque<std::pair<int64_t, CInv> > vExpiration; //! Oldest first
+    size_t nMessageUsage; //! Memory held by the messages
+    size_t nMaxUsage;
+    uint64_t nHits;
+    uint64_t nMisses;
+    uint64_t nEvicted;
+
+    size_t DynamicMemoryUsageLocked() const;
+    void EraseOldest();
+    void Trim(int64_t nNow);
+
+public:
+    explicit CRelayCache(size_t nMaxUsageIn);
+
+    /** Keep the message for inv, unless one is kept already. */
+    void Insert(const CInv& inv, const CSerializeDataRef& pmsg);
+    /** The message for inv, or NULL if it isn't kept. */
+    CSerializeDataRef Get(const CInv& inv);
+    /** Whether the message for inv is kept, without counting it as a request. */
+    bool Exists(const CInv& inv) const;
+    void Clear();
+
+    void SetMaxUsage(size_t nMaxUsageIn);
+    size_t GetMaxUsage() const;
+    size_t DynamicMemoryUsage() const;
+    size_t GetCount() const;
+    uint64_t GetHits() const;
+    uint64_t GetMisses() const;
+    //! Messages dropped before they expired, to stay within the memory limit
+    uint64_t GetEvicted() const;
+};
+
+/** A "tx" message for tx, header included. */
+CSerializeDataRef MakeTxMessage(const CTransaction& tx);
+
+extern CRelayCache relayCache;
+
+#endif // BITCOIN_RELAYCACHE_H
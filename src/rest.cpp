@@ -3,12 +3,14 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "blockfilter.h"
 #include "primitives/block.h"
 #include "primitives/transaction.h"
 #include "main.h"
 #include "rpcserver.h"
 #include "streams.h"
 #include "sync.h"
+#include "txdb.h"
 #include "txmempool.h"
 #include "utilstrencodings.h"
 #include "version.h"
@@ -333,6 +335,77 @@ static bool rest_tx(AcceptedConnection* conn,
     return true; // continue to process further HTTP reqs on this cxn
 }
 
+static bool rest_blockfilter(AcceptedConnection* conn,
+                             const std::string& strURIPart,
+                             const std::string& strRequest,
+                             const std::map<std::string, std::string>& mapHeaders,
+                             bool fRun)
+{
+    vector<string> params;
+    const RetFormat rf = ParseDataFormat(params, strURIPart);
+    vector<string> path;
+    boost::split(path, params[0], boost::is_any_of("/"));
+
+    if (path.size() != 2)
+        throw RESTERR(HTTP_BAD_REQUEST, "Invalid URI format. Use /rest/blockfilter/basic/<hash>.<ext>.");
+    if (path[0] != "basic")
+        throw RESTERR(HTTP_BAD_REQUEST, "Unknown filter type: " + path[0]);
+
+    string hashStr = path[1];
+    uint256 hash;
+    if (!ParseHashStr(hashStr, hash))
+        throw RESTERR(HTTP_BAD_REQUEST, "Invalid hash: " + hashStr);
+
+    if (!fBlockFilterIndex)
+        throw RESTERR(HTTP_NOT_FOUND, "Block filters are not kept, use -blockfilterindex");
+
+    {
+        LOCK(cs_main);
+        BlockMap::const_iterator it = mapBlockIndex.find(hash);
+        if (it == mapBlockIndex.end() || !(chainActive.Contains(it->second) || it->second->IsValid(BLOCK_VALID_SCRIPTS)))
+            throw RESTERR(HTTP_NOT_FOUND, hashStr + " not found");
+    }
+
+    CDiskBlockFilter filter;
+    if (!pblocktree->ReadBlockFilter(hash, filter))
+        throw RESTERR(HTTP_NOT_FOUND, hashStr + " not found");
+
+    // As in the "cfilter" message
+    CDataStream ssFilter(SER_NETWORK, PROTOCOL_VERSION);
+    ssFilter << (uint8_t)BASIC_FILTER << hash << filter.vFilter;
+
+    switch (rf) {
+    case RF_BINARY: {
+        string binaryFilter = ssFilter.str();
+        conn->stream() << HTTPReplyHeader(HTTP_OK, fRun, binaryFilter.size(), "application/octet-stream") << binaryFilter << std::flush;
+        return true;
+    }
+
+    case RF_HEX: {
+        string strHex = HexStr(ssFilter.begin(), ssFilter.end()) + "\n";
+        conn->stream() << HTTPReply(HTTP_OK, strHex, fRun, false, "text/plain") << std::flush;
+        return true;
+    }
+
+    case RF_JSON: {
+        Object objFilter;
+        objFilter.push_back(Pair("blockhash", hash.GetHex()));
+        objFilter.push_back(Pair("filter", HexStr(filter.vFilter)));
+        objFilter.push_back(Pair("header", filter.hashHeader.GetHex()));
+        string strJSON = write_string(Value(objFilter), false) + "\n";
+        conn->stream() << HTTPReply(HTTP_OK, strJSON, fRun) << std::flush;
+        return true;
+    }
+
+    default: {
+        throw RESTERR(HTTP_NOT_FOUND, "output format not found (available: " + AvailableDataFormatsString() + ")");
+    }
+    }
+
+    // not reached
+    return true; // continue to process further HTTP reqs on this cxn
+}
+
 static bool rest_getutxos(AcceptedConnection* conn,
                           const std::string& strURIPart,
                           const std::string& strRequest,
@@ -543,6 +616,7 @@ static const struct {
       {"/rest/chaininfo", rest_chaininfo},
       {"/rest/headers/", rest_headers},
       {"/rest/getutxos", rest_getutxos},
+      {"/rest/blockfilter/", rest_blockfilter},
 };
 
 bool HTTPReq_REST(AcceptedConnection* conn,
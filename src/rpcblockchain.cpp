@@ -8,7 +8,9 @@
 #include "main.h"
 #include "primitives/transaction.h"
 #include "rpcserver.h"
+#include "script/sigcache.h"
 #include "sync.h"
+#include "txoutsetstats.h"
 #include "util.h"
 
 #include <stdint.h>
@@ -188,10 +190,9 @@ Value getrawmempool(const Array& params, bool fHelp)
     {
         LOCK(mempool.cs);
         Object o;
-        BOOST_FOREACH(const PAIRTYPE(uint256, CTxMemPoolEntry)& entry, mempool.mapTx)
+        BOOST_FOREACH(const CTxMemPoolEntry& e, mempool.mapTx)
         {
-            const uint256& hash = entry.first;
-            const CTxMemPoolEntry& e = entry.second;
+            const uint256& hash = e.GetTx().GetHash();
             Object info;
             info.push_back(Pair("size", (int)e.GetTxSize()));
             info.push_back(Pair("fee", ValueFromAmount(e.GetFee())));
@@ -320,30 +321,54 @@ Value getblock(const Array& params, bool fHelp)
 
 Value gettxoutsetinfo(const Array& params, bool fHelp)
 {
-    if (fHelp || params.size() != 0)
+    if (fHelp || params.size() > 1)
         throw runtime_error(
-            "gettxoutsetinfo\n"
+            "gettxoutsetinfo ( fast )\n"
             "\nReturns statistics about the unspent transaction output set.\n"
-            "Note this call may take some time.\n"
+            "Note this call may take some time, unless fast is set: some of the statistics\n"
+            "are kept up to date as blocks are connected, and only those come back then.\n"
+            "\nArguments:\n"
+            "1. fast         (boolean, optional, default=false) Only return the statistics kept up to date\n"
             "\nResult:\n"
             "{\n"
             "  \"height\":n,     (numeric) The current block height (index)\n"
             "  \"bestblock\": \"hex\",   (string) the best block hash hex\n"
-            "  \"transactions\": n,      (numeric) The number of transactions\n"
+            "  \"transactions\": n,      (numeric) The number of transactions (not with fast)\n"
             "  \"txouts\": n,            (numeric) The number of output transactions\n"
-            "  \"bytes_serialized\": n,  (numeric) The serialized size\n"
-            "  \"hash_serialized\": \"hash\",   (string) The serialized hash\n"
-            "  \"total_amount\": x.xxx          (numeric) The total amount\n"
+            "  \"bytes_serialized\": n,  (numeric) The serialized size (not with fast)\n"
+            "  \"hash_serialized\": \"hash\",   (string) The serialized hash (not with fast)\n"
+            "  \"total_amount\": x.xxx,  (numeric) The total amount\n"
+            "  \"bytes_txouts\": n,      (numeric) The serialized size of the outputs and their outpoints\n"
+            "  \"hash_txouts\": \"hash\",  (string) A hash of the set of outputs, which does not depend on their order\n"
+            "  \"consistent\": true|false  (boolean) Whether the statistics kept up to date agree (not with fast, once known)\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("gettxoutsetinfo", "")
+            + HelpExampleCli("gettxoutsetinfo", "true")
             + HelpExampleRpc("gettxoutsetinfo", "")
         );
 
-    LOCK(cs_main);
+    bool fFast = params.size() > 0 && params[0].get_bool();
 
     Object ret;
 
+    CTxOutSetStats txouts;
+    uint256 hashBlock;
+    int nHeight;
+    if (fFast) {
+        if (!txoutsetstats.Get(txouts, hashBlock, nHeight))
+            throw JSONRPCError(RPC_IN_WARMUP, "The UTXO set statistics are still being computed");
+        ret.push_back(Pair("height", (int64_t)nHeight));
+        ret.push_back(Pair("bestblock", hashBlock.GetHex()));
+        ret.push_back(Pair("txouts", txouts.nTxOuts));
+        ret.push_back(Pair("total_amount", ValueFromAmount(txouts.nTotalAmount)));
+        ret.push_back(Pair("bytes_txouts", txouts.nSerializedSize));
+        ret.push_back(Pair("hash_txouts", txouts.hashTxOuts.GetHex()));
+        return ret;
+    }
+
+    LOCK(cs_main);
+
     CCoinsStats stats;
     FlushStateToDisk();
     if (pcoinsTip->GetStats(stats)) {
@@ -354,6 +379,12 @@ Value gettxoutsetinfo(const Array& params, bool fHelp)
         ret.push_back(Pair("bytes_serialized", (int64_t)stats.nSerializedSize));
         ret.push_back(Pair("hash_serialized", stats.hashSerialized.GetHex()));
         ret.push_back(Pair("total_amount", ValueFromAmount(stats.nTotalAmount)));
+        ret.push_back(Pair("bytes_txouts", stats.txouts.nSerializedSize));
+        ret.push_back(Pair("hash_txouts", stats.txouts.hashTxOuts.GetHex()));
+        // Blocks are connected under cs_main, so these are for the same block
+        // (unless they are still being computed).
+        if (txoutsetstats.Get(txouts, hashBlock, nHeight))
+            ret.push_back(Pair("consistent", hashBlock == stats.hashBlock && txouts == stats.txouts));
     }
     return ret;
 }
@@ -624,6 +655,8 @@ Value getmempoolinfo(const Array& params, bool fHelp)
             "{\n"
             "  \"size\": xxxxx                (numeric) Current tx count\n"
             "  \"bytes\": xxxxx               (numeric) Sum of all tx sizes\n"
+            "  \"maxmempool\": xxxxx          (numeric) Maximum size of the pool in bytes, 0 if unlimited\n"
+            "  \"mempoolminfee\": xxxxx       (numeric) Minimum fee per kB for a transaction to be accepted\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("getmempoolinfo", "")
@@ -633,6 +666,43 @@ Value getmempoolinfo(const Array& params, bool fHelp)
     Object ret;
     ret.push_back(Pair("size", (int64_t) mempool.size()));
     ret.push_back(Pair("bytes", (int64_t) mempool.GetTotalTxSize()));
+    uint64_t nMaxMempool = GetMaxMempoolSize();
+    ret.push_back(Pair("maxmempool", (int64_t) nMaxMempool));
+    ret.push_back(Pair("mempoolminfee", ValueFromAmount(nMaxMempool ? mempool.GetMinFee(nMaxMempool).GetFeePerK() : 0)));
+
+    return ret;
+}
+
+Value getsigcacheinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getsigcacheinfo\n"
+            "\nReturns details on the signature verification cache.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"bytes\": xxxxx               (numeric) Memory allocated for the cache\n"
+            "  \"capacity\": xxxxx            (numeric) Number of signatures the cache can hold\n"
+            "  \"hits\": xxxxx                (numeric) Lookups that found a cached signature\n"
+            "  \"misses\": xxxxx              (numeric) Lookups that did not\n"
+            "  \"inserts\": xxxxx             (numeric) Signatures added to the cache\n"
+            "  \"evictions\": xxxxx           (numeric) Signatures pushed out to make room\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getsigcacheinfo", "")
+            + HelpExampleRpc("getsigcacheinfo", "")
+        );
+
+    CSigCacheStats stats;
+    GetSignatureCacheStats(stats);
+
+    Object ret;
+    ret.push_back(Pair("bytes", (int64_t) stats.nBytes));
+    ret.push_back(Pair("capacity", (int64_t) stats.nCapacity));
+    ret.push_back(Pair("hits", (int64_t) stats.nHits));
+    ret.push_back(Pair("misses", (int64_t) stats.nMisses));
+    ret.push_back(Pair("inserts", (int64_t) stats.nInserts));
+    ret.push_back(Pair("evictions", (int64_t) stats.nEvictions));
 
     return ret;
 }
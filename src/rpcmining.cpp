@@ -487,47 +487,25 @@ Value getblocktemplate(const Array& params, bool fHelp)
         // TODO: Maybe recheck connections/IBD and (if something wrong) send an expires-immediately template to stop miners?
     }
 
-    // Update block
-    static CBlockIndex* pindexPrev;
-    static int64_t nStart;
-    static CBlockTemplate* pblocktemplate;
-    if (pindexPrev != chainActive.Tip() ||
-        (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast && GetTime() - nStart > 5))
-    {
-        // Clear pindexPrev so future calls make a new block, despite any failures from here on
-        pindexPrev = NULL;
-
-        // Store the pindexBest used before CreateNewBlock, to avoid races
-        nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
-        CBlockIndex* pindexPrevNew = chainActive.Tip();
-        nStart = GetTime();
-
-        // Create new block
-        if(pblocktemplate)
-        {
-            delete pblocktemplate;
-            pblocktemplate = NULL;
-        }
-        CScript scriptDummy = CScript() << OP_TRUE;
-        pblocktemplate = CreateNewBlock(scriptDummy);
-        if (!pblocktemplate)
-            throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
-
-        // Need to update only after we know CreateNewBlock succeeded
-        pindexPrev = pindexPrevNew;
-    }
-    CBlock* pblock = &pblocktemplate->block; // pointer for convenience
+    // The template is kept up to date as transactions come and go, and
+    // rebuilt on new tips, rather than being built here
+    unsigned int nTransactionsUpdatedTemplate;
+    boost::shared_ptr<const CBlockTemplate> pblocktemplate = liveBlockTemplate.Get(nTransactionsUpdatedTemplate);
+    nTransactionsUpdatedLast = nTransactionsUpdatedTemplate;
+    CBlockIndex* pindexPrev = chainActive.Tip();
+    const CBlock* pblock = &pblocktemplate->block; // pointer for convenience
 
     // Update nTime
-    UpdateTime(pblock, Params().GetConsensus(), pindexPrev);
-    pblock->nNonce = 0;
+    CBlockHeader header = pblock->GetBlockHeader();
+    UpdateTime(&header, Params().GetConsensus(), pindexPrev);
+    header.nNonce = 0;
 
     static const Array aCaps = boost::assign::list_of("proposal");
 
     Array transactions;
     map<uint256, int64_t> setTxIndex;
     int i = 0;
-    BOOST_FOREACH (CTransaction& tx, pblock->vtx)
+    BOOST_FOREACH (const CTransaction& tx, pblock->vtx)
     {
         uint256 txHash = tx.GetHash();
         setTxIndex[txHash] = i++;
@@ -559,7 +537,7 @@ Value getblocktemplate(const Array& params, bool fHelp)
     Object aux;
     aux.push_back(Pair("flags", HexStr(COINBASE_FLAGS.begin(), COINBASE_FLAGS.end())));
 
-    arith_uint256 hashTarget = arith_uint256().SetCompact(pblock->nBits);
+    arith_uint256 hashTarget = arith_uint256().SetCompact(header.nBits);
 
     static Array aMutable;
     if (aMutable.empty())
@@ -570,10 +548,10 @@ Value getblocktemplate(const Array& params, bool fHelp)
     }
 
     Object result;
-    int64_t nBlockTime = pblock->GetBlockTime();
+    int64_t nBlockTime = header.GetBlockTime();
     result.push_back(Pair("capabilities", aCaps));
-    result.push_back(Pair("version", pblock->nVersion));
-    result.push_back(Pair("previousblockhash", pblock->hashPrevBlock.GetHex()));
+    result.push_back(Pair("version", header.nVersion));
+    result.push_back(Pair("previousblockhash", header.hashPrevBlock.GetHex()));
     result.push_back(Pair("transactions", transactions));
     result.push_back(Pair("coinbaseaux", aux));
     result.push_back(Pair("coinbasevalue", (int64_t)pblock->vtx[0].vout[0].nValue));
@@ -594,7 +572,7 @@ Value getblocktemplate(const Array& params, bool fHelp)
     uint64_t sighashlimit = Params().GetConsensus().MaxBlockSighashBytes(nBlockTime, sizeForkTime.load());
     result.push_back(Pair("sighashlimit", std::min(JSON_NUMBER_LIMIT, sighashlimit)));
     result.push_back(Pair("curtime", nBlockTime));
-    result.push_back(Pair("bits", strprintf("%08x", pblock->nBits)));
+    result.push_back(Pair("bits", strprintf("%08x", header.nBits)));
     result.push_back(Pair("height", (int64_t)(pindexPrev->nHeight+1)));
 
     return result;
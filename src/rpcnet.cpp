@@ -9,7 +9,9 @@
 #include "net.h"
 #include "netbase.h"
 #include "protocol.h"
+#include "relaycache.h"
 #include "sync.h"
+#include "thinblock.h"
 #include "timedata.h"
 #include "util.h"
 #include "version.h"
@@ -90,6 +92,10 @@ Value getpeerinfo(const Array& params, bool fHelp)
             "    \"lastrecv\": ttt,           (numeric) The time in seconds since epoch (Jan 1 1970 GMT) of the last receive\n"
             "    \"bytessent\": n,            (numeric) The total bytes sent\n"
             "    \"bytesrecv\": n,            (numeric) The total bytes received\n"
+            "    \"invsent\": n,              (numeric) The inventory items announced\n"
+            "    \"invbytessent\": n,         (numeric) The bytes of inv messages sent\n"
+            "    \"invbytespersec\": n,       (numeric) The bytes of inv messages sent per second, on average since connecting\n"
+            "    \"invqueued\": n,            (numeric) The inventory items waiting to be announced\n"
             "    \"conntime\": ttt,           (numeric) The connection time in seconds since epoch (Jan 1 1970 GMT)\n"
             "    \"timeoffset\": ttt,         (numeric) The time offset in seconds\n"
             "    \"pingtime\": n,             (numeric) ping time\n"
@@ -104,7 +110,13 @@ Value getpeerinfo(const Array& params, bool fHelp)
             "    \"inflight\": [\n"
             "       n,                        (numeric) The heights of blocks we're currently asking from this peer\n"
             "       ...\n"
-            "    ]\n"
+            "    ],\n"
+            "    \"inflightmax\": n,          (numeric) How many blocks we ask from this peer at once at most, sized by its download speed\n"
+            "    \"blocksdownloaded\": n,     (numeric) The blocks we asked this peer for that it delivered\n"
+            "    \"blockbytesdownloaded\": n, (numeric) The size of those blocks, in bytes\n"
+            "    \"blockstakenover\": n,      (numeric) The blocks we asked this peer for that another peer delivered first\n"
+            "    \"blockdownloadtime\": n,    (numeric) The average time this peer takes to deliver a block, in seconds, once measured\n"
+            "    \"blockdownloadrate\": n,    (numeric) The average rate this peer delivers blocks at, in bytes per second, once measured\n"
             "  }\n"
             "  ,...\n"
             "]\n"
@@ -131,6 +143,10 @@ Value getpeerinfo(const Array& params, bool fHelp)
         obj.push_back(Pair("lastrecv", stats.nLastRecv));
         obj.push_back(Pair("bytessent", stats.nSendBytes));
         obj.push_back(Pair("bytesrecv", stats.nRecvBytes));
+        obj.push_back(Pair("invsent", stats.nInvSent));
+        obj.push_back(Pair("invbytessent", stats.nInvBytesSent));
+        obj.push_back(Pair("invbytespersec", (double)stats.nInvBytesSent / std::max((int64_t)1, GetTime() - stats.nTimeConnected)));
+        obj.push_back(Pair("invqueued", (uint64_t)stats.nInvQueued));
         obj.push_back(Pair("conntime", stats.nTimeConnected));
         obj.push_back(Pair("timeoffset", stats.nTimeOffset));
         obj.push_back(Pair("pingtime", stats.dPingTime));
@@ -152,6 +168,14 @@ Value getpeerinfo(const Array& params, bool fHelp)
                 heights.push_back(height);
             }
             obj.push_back(Pair("inflight", heights));
+            obj.push_back(Pair("inflightmax", statestats.nBlocksInTransitMax));
+            obj.push_back(Pair("blocksdownloaded", statestats.nBlocksDownloaded));
+            obj.push_back(Pair("blockbytesdownloaded", statestats.nBlockBytesDownloaded));
+            obj.push_back(Pair("blockstakenover", statestats.nBlocksTakenOver));
+            if (statestats.nBlockDownloadTime > 0) {
+                obj.push_back(Pair("blockdownloadtime", statestats.nBlockDownloadTime / 1e6));
+                obj.push_back(Pair("blockdownloadrate", statestats.nBlockDownloadRate));
+            }
         }
         obj.push_back(Pair("whitelisted", stats.fWhitelisted));
 
@@ -431,6 +455,44 @@ Value getnettotals(const Array& params, bool fHelp)
     return obj;
 }
 
+Value getthinblockstats(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 0)
+        throw runtime_error(
+            "getthinblockstats\n"
+            "\nReturns statistics about thin block relay since the node started.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"enabled\": true|false,       (boolean) Whether thin blocks are advertised and requested\n"
+            "  \"sent\": n,                   (numeric) Thin blocks served to peers\n"
+            "  \"received\": n,               (numeric) Thin blocks received from peers\n"
+            "  \"reconstructed\": n,          (numeric) Blocks successfully rebuilt from thin blocks\n"
+            "  \"fallbacks\": n,              (numeric) Thin blocks abandoned for the full block\n"
+            "  \"txtotal\": n,                (numeric) Transactions announced by short id\n"
+            "  \"txfrompool\": n,             (numeric) Of those, transactions found in the memory or orphan pool\n"
+            "  \"txrequested\": n,            (numeric) Of those, transactions requested from the peer\n"
+            "  \"hitrate\": x.xxx,            (numeric) txfrompool / txtotal\n"
+            "  \"thinbytes\": n,              (numeric) Bytes received in thinblock and thintx messages\n"
+            "  \"fullbytes\": n               (numeric) Serialized size of the reconstructed blocks\n"
+            "}\n"
+            "\nExamples:\n" +
+            HelpExampleCli("getthinblockstats", "") + HelpExampleRpc("getthinblockstats", ""));
+
+    Object obj;
+    obj.push_back(Pair("enabled", (nLocalServices & NODE_THIN) != 0));
+    obj.push_back(Pair("sent", thinBlockStats.GetSent()));
+    obj.push_back(Pair("received", thinBlockStats.GetReceived()));
+    obj.push_back(Pair("reconstructed", thinBlockStats.GetReconstructed()));
+    obj.push_back(Pair("fallbacks", thinBlockStats.GetFallbacks()));
+    obj.push_back(Pair("txtotal", thinBlockStats.GetTxTotal()));
+    obj.push_back(Pair("txfrompool", thinBlockStats.GetTxFromPool()));
+    obj.push_back(Pair("txrequested", thinBlockStats.GetTxRequested()));
+    obj.push_back(Pair("hitrate", thinBlockStats.GetHitRate()));
+    obj.push_back(Pair("thinbytes", thinBlockStats.GetBytesThin()));
+    obj.push_back(Pair("fullbytes", thinBlockStats.GetBytesFull()));
+    return obj;
+}
+
 static Array GetNetworksInfo()
 {
     Array networks;
@@ -475,6 +537,14 @@ Value getnetworkinfo(const Array& params, bool fHelp)
             "  ,...\n"
             "  ],\n"
             "  \"relayfee\": x.xxxxxxxx,                (numeric) minimum relay fee for non-free transactions in btc/kb\n"
+            "  \"relaycache\": {                        (object) transactions kept serialized to answer getdata\n"
+            "    \"transactions\": xxx,                  (numeric) number of transactions\n"
+            "    \"usage\": xxx,                         (numeric) memory usage in bytes, messages included\n"
+            "    \"maxusage\": xxx,                      (numeric) limit on the memory usage (-maxrelaycache)\n"
+            "    \"hits\": xxx,                          (numeric) requests answered from the cache\n"
+            "    \"misses\": xxx,                        (numeric) requests for transactions not in the cache\n"
+            "    \"evicted\": xxx                        (numeric) transactions dropped before they expired, to stay within maxusage\n"
+            "  },\n"
             "  \"localaddresses\": [                    (array) list of local addresses\n"
             "  {\n"
             "    \"address\": \"xxxx\",                 (string) network address\n"
@@ -499,6 +569,14 @@ Value getnetworkinfo(const Array& params, bool fHelp)
     obj.push_back(Pair("connections", (int)vNodes.size()));
     obj.push_back(Pair("networks", GetNetworksInfo()));
     obj.push_back(Pair("relayfee", ValueFromAmount(::minRelayTxFee.GetFeePerK())));
+    Object relayCacheInfo;
+    relayCacheInfo.push_back(Pair("transactions", (uint64_t)relayCache.GetCount()));
+    relayCacheInfo.push_back(Pair("usage", (uint64_t)relayCache.DynamicMemoryUsage()));
+    relayCacheInfo.push_back(Pair("maxusage", (uint64_t)relayCache.GetMaxUsage()));
+    relayCacheInfo.push_back(Pair("hits", relayCache.GetHits()));
+    relayCacheInfo.push_back(Pair("misses", relayCache.GetMisses()));
+    relayCacheInfo.push_back(Pair("evicted", relayCache.GetEvicted()));
+    obj.push_back(Pair("relaycache", relayCacheInfo));
     Array localAddresses;
     {
         LOCK(cs_mapLocalHost);
@@ -280,6 +280,7 @@ static const CRPCCommand vRPCCommands[] =
     { "network",            "getconnectioncount",     &getconnectioncount,     true  },
     { "network",            "getnettotals",           &getnettotals,           true  },
     { "network",            "getpeerinfo",            &getpeerinfo,            true  },
+    { "network",            "getthinblockstats",      &getthinblockstats,      true  },
     { "network",            "ping",                   &ping,                   true  },
     { "network",            "settrafficshaping",      &settrafficshaping,      true  },
     { "network",            "gettrafficshaping",      &gettrafficshaping,      true  },
@@ -293,6 +294,7 @@ static const CRPCCommand vRPCCommands[] =
     { "blockchain",         "getchaintips",           &getchaintips,           true  },
     { "blockchain",         "getdifficulty",          &getdifficulty,          true  },
     { "blockchain",         "getmempoolinfo",         &getmempoolinfo,         true  },
+    { "blockchain",         "getsigcacheinfo",        &getsigcacheinfo,        true  },
     { "blockchain",         "getrawmempool",          &getrawmempool,          true  },
     { "blockchain",         "gettxout",               &gettxout,               true  },
     { "blockchain",         "gettxoutproof",          &gettxoutproof,          true  },
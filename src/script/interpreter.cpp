@@ -12,6 +12,7 @@
 #include "eccryptoverify.h"
 #include "pubkey.h"
 #include "script/script.h"
+#include "streams.h"
 #include "uint256.h"
 
 using namespace std;
@@ -1033,7 +1034,31 @@ public:
 
 } // anon namespace
 
-uint256 SignatureHash(const CScript& scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, size_t* nHashedOut)
+PrecomputedTransactionData::PrecomputedTransactionData(const CTransaction& txTo)
+{
+    // Everything up to the first input
+    CHashWriter ss(SER_GETHASH, 0);
+    ss << txTo.nVersion;
+    ::WriteCompactSize(ss, txTo.vin.size());
+
+    CDataStream ssInputs(SER_GETHASH, 0);
+    vMidstates.reserve(txTo.vin.size());
+    vInputPos.reserve(txTo.vin.size() + 1);
+    for (unsigned int i = 0; i < txTo.vin.size(); i++) {
+        vMidstates.push_back(ss);
+        vInputPos.push_back(ssInputs.size());
+        ssInputs << txTo.vin[i].prevout << CScript() << txTo.vin[i].nSequence;
+        ss.write(&ssInputs[vInputPos.back()], ssInputs.size() - vInputPos.back());
+    }
+    vInputPos.push_back(ssInputs.size());
+    vchInputs.assign(ssInputs.begin(), ssInputs.end());
+
+    CDataStream ssOutputs(SER_GETHASH, 0);
+    ssOutputs << txTo.vout << txTo.nLockTime;
+    vchOutputs.assign(ssOutputs.begin(), ssOutputs.end());
+}
+
+uint256 SignatureHash(const CScript& scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, size_t* nHashedOut, const PrecomputedTransactionData* txdata)
 {
     static const uint256 one(uint256S("0000000000000000000000000000000000000000000000000000000000000001"));
     if (nIn >= txTo.vin.size()) {
@@ -1052,6 +1077,22 @@ uint256 SignatureHash(const CScript& scriptCode, const CTransaction& txTo, unsig
     // Wrapper to serialize only the necessary parts of the transaction being signed
     CTransactionSignatureSerializer txTmp(txTo, scriptCode, nIn, nHashType);
 
+    int nBaseType = nHashType & 0x1f;
+    if (txdata && !(nHashType & SIGHASH_ANYONECANPAY) && nBaseType != SIGHASH_SINGLE && nBaseType != SIGHASH_NONE) {
+        // Same bytes as below, with the parts shared by all inputs precomputed
+        assert(txdata->vMidstates.size() == txTo.vin.size());
+        CHashWriter ss(txdata->vMidstates[nIn]);
+        txTmp.SerializeInput(ss, nIn, SER_GETHASH, 0);
+        size_t nPos = txdata->vInputPos[nIn + 1];
+        if (nPos < txdata->vchInputs.size())
+            ss.write((const char*)&txdata->vchInputs[nPos], txdata->vchInputs.size() - nPos);
+        ss.write((const char*)&txdata->vchOutputs[0], txdata->vchOutputs.size());
+        ss << nHashType;
+        if (nHashedOut != NULL)
+            *nHashedOut = ss.GetNumBytesHashed();
+        return ss.GetHash();
+    }
+
     // Serialize and hash
     CHashWriter ss(SER_GETHASH, 0);
     ss << txTmp << nHashType;
@@ -1080,7 +1121,7 @@ bool TransactionSignatureChecker::CheckSig(const vector<unsigned char>& vchSigIn
     vchSig.pop_back();
 
     size_t nHashed = 0;
-    uint256 sighash = SignatureHash(scriptCode, *txTo, nIn, nHashType, &nHashed);
+    uint256 sighash = SignatureHash(scriptCode, *txTo, nIn, nHashType, &nHashed, txdata);
     nBytesHashed += nHashed;
     ++nSigops;
 
@@ -6,6 +6,7 @@
 #ifndef BITCOIN_SCRIPT_INTERPRETER_H
 #define BITCOIN_SCRIPT_INTERPRETER_H
 
+#include "hash.h"
 #include "script_error.h"
 #include "primitives/transaction.h"
 
@@ -78,7 +79,33 @@ enum
     SCRIPT_VERIFY_CLEANSTACK = (1U << 8),
 };
 
-uint256 SignatureHash(const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, size_t* nHashedOut=NULL);
+/**
+ * The parts of the signature hash of a transaction that are the same for
+ * all of its inputs, computed once and shared by the checks of each input.
+ *
+ * The legacy signature hash commits to the whole transaction for every
+ * input, so signing all n inputs hashes O(n^2) bytes. With this the
+ * transaction is serialized once, and hashing an input starts from the
+ * SHA-256 state after the inputs before it; only the input itself and the
+ * (pre-serialized) rest of the transaction are hashed per input. Only
+ * used for SIGHASH_ALL without SIGHASH_ANYONECANPAY; the other hash types
+ * are rare and hashed from scratch.
+ */
+class PrecomputedTransactionData
+{
+public:
+    explicit PrecomputedTransactionData(const CTransaction& txTo);
+
+private:
+    friend uint256 SignatureHash(const CScript&, const CTransaction&, unsigned int, int, size_t*, const PrecomputedTransactionData*);
+
+    std::vector<CHashWriter> vMidstates;      //! Hash state before each input
+    std::vector<unsigned char> vchInputs;     //! All inputs, with their scripts blanked
+    std::vector<size_t> vInputPos;            //! Offset of each input in vchInputs
+    std::vector<unsigned char> vchOutputs;    //! Outputs and nLockTime
+};
+
+uint256 SignatureHash(const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, size_t* nHashedOut=NULL, const PrecomputedTransactionData* txdata=NULL);
 
 class BaseSignatureChecker
 {
@@ -96,6 +123,7 @@ class TransactionSignatureChecker : public BaseSignatureChecker
 private:
     const CTransaction* txTo;
     unsigned int nIn;
+    const PrecomputedTransactionData* txdata;
     mutable size_t nBytesHashed;
     mutable size_t nSigops;
 
@@ -103,7 +131,8 @@ protected:
     virtual bool VerifySignature(const std::vector<unsigned char>& vchSig, const CPubKey& vchPubKey, const uint256& sighash) const;
 
 public:
-    TransactionSignatureChecker(const CTransaction* txToIn, unsigned int nInIn) : txTo(txToIn), nIn(nInIn), nBytesHashed(0), nSigops(0) {}
+    TransactionSignatureChecker(const CTransaction* txToIn, unsigned int nInIn, const PrecomputedTransactionData* txdataIn=NULL) :
+        txTo(txToIn), nIn(nInIn), txdata(txdataIn), nBytesHashed(0), nSigops(0) {}
     bool CheckSig(const std::vector<unsigned char>& scriptSig, const std::vector<unsigned char>& vchPubKey, const CScript& scriptCode) const;
     size_t GetBytesHashed() const { return nBytesHashed; }
     size_t GetNumSigops() const { return nSigops; }
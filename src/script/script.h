@@ -7,6 +7,8 @@
 #define BITCOIN_SCRIPT_SCRIPT_H
 
 #include "crypto/common.h"
+#include "prevector.h"
+#include "serialize.h"
 
 #include <assert.h>
 #include <climits>
@@ -342,8 +344,15 @@ private:
     int64_t m_value;
 };
 
+/**
+ * The storage of a script. Up to 28 bytes are kept in the CScript itself,
+ * which covers the standard pay-to-pubkey-hash and pay-to-script-hash
+ * output scripts without a heap allocation.
+ */
+typedef prevector<28, unsigned char> CScriptBase;
+
 /** Serialized script, used inside transaction inputs and outputs */
-class CScript : public std::vector<unsigned char>
+class CScript : public CScriptBase
 {
 protected:
     CScript& push_int64(int64_t n)
@@ -364,9 +373,9 @@ protected:
     }
 public:
     CScript() { }
-    CScript(const CScript& b) : std::vector<unsigned char>(b.begin(), b.end()) { }
-    CScript(const_iterator pbegin, const_iterator pend) : std::vector<unsigned char>(pbegin, pend) { }
-    CScript(const unsigned char* pbegin, const unsigned char* pend) : std::vector<unsigned char>(pbegin, pend) { }
+    CScript(const CScript& b) : CScriptBase(b.begin(), b.end()) { }
+    CScript(const_iterator pbegin, const_iterator pend) : CScriptBase(pbegin, pend) { }
+    CScript(std::vector<unsigned char>::const_iterator pbegin, std::vector<unsigned char>::const_iterator pend) : CScriptBase(pbegin, pend) { }
 
     CScript& operator+=(const CScript& b)
     {
@@ -598,9 +607,31 @@ public:
     std::string ToString() const;
     void clear()
     {
-        // The default std::vector::clear() does not release memory.
-        std::vector<unsigned char>().swap(*this);
+        // The default prevector::clear() does not release memory.
+        CScriptBase().swap(*this);
     }
 };
 
+/**
+ * Scripts are serialized as their CScriptBase, an opaque blob of bytes.
+ * These are declared in serialize.h, as the generic overloads for classes
+ * with Serialize methods would otherwise be taken.
+ */
+inline unsigned int GetSerializeSize(const CScript& v, int nType, int nVersion)
+{
+    return GetSerializeSize((const CScriptBase&)v, nType, nVersion);
+}
+
+template<typename Stream>
+void Serialize(Stream& os, const CScript& v, int nType, int nVersion)
+{
+    Serialize(os, (const CScriptBase&)v, nType, nVersion);
+}
+
+template<typename Stream>
+void Unserialize(Stream& is, CScript& v, int nType, int nVersion)
+{
+    Unserialize(is, (CScriptBase&)v, nType, nVersion);
+}
+
 #endif // BITCOIN_SCRIPT_SCRIPT_H
@@ -5,86 +5,228 @@
 
 #include "sigcache.h"
 
+#include "crypto/sha256.h"
 #include "pubkey.h"
 #include "random.h"
+#include "serialize.h"
 #include "uint256.h"
 #include "util.h"
 
-#include <boost/thread.hpp>
-#include <boost/tuple/tuple_comparison.hpp>
+#include <limits>
+#include <string.h>
+
+#include <boost/atomic.hpp>
+#include <boost/scoped_array.hpp>
+#include <boost/thread/mutex.hpp>
 
 namespace {
 
+/**
+ * One slot of the signature cache, holding the salted hash of a valid
+ * (signature hash, signature, public key) triple. Readers never lock: the
+ * writer makes nSequence odd while it rewrites the slot, and a reader that
+ * sees an odd or changed sequence number treats the slot as a miss.
+ */
+struct CSigCacheSlot
+{
+    boost::atomic<uint32_t> nSequence;
+    boost::atomic<bool> fErased;
+    boost::atomic<uint64_t> words[4];
+
+    CSigCacheSlot() : nSequence(0), fErased(false)
+    {
+        for (int i = 0; i < 4; i++)
+            words[i].store(0, boost::memory_order_relaxed);
+    }
+};
+
 /**
  * Valid signature cache, to avoid doing expensive ECDSA signature checking
  * twice for every transaction (once when accepted into memory pool, and
  * again when accepted into the block chain)
+ *
+ * Entries are 256-bit hashes of the triple salted with a random nonce, so an
+ * attacker cannot aim collisions at particular slots. Each entry can live in
+ * one of two slots; inserting into two occupied slots evicts one of them at
+ * random.
  */
 class CSignatureCache
 {
 private:
-     //! sigdata_type is (signature hash, signature, public key):
-    typedef boost::tuple<uint256, std::vector<unsigned char>, CPubKey> sigdata_type;
-    std::set< sigdata_type> setValid;
-    boost::shared_mutex cs_sigcache;
+    uint256 nonce;
+    boost::scoped_array<CSigCacheSlot> slots;
+    size_t nSlots;
+
+    //! Serializes writers; also guards nRandState.
+    boost::mutex cs_insert;
+    uint64_t nRandState;
+
+    boost::atomic<uint64_t> nHits;
+    boost::atomic<uint64_t> nMisses;
+    boost::atomic<uint64_t> nInserts;
+    boost::atomic<uint64_t> nEvictions;
+
+    static uint64_t Word(const uint256& entry, int n)
+    {
+        uint64_t w;
+        memcpy(&w, entry.begin() + 8 * n, sizeof(w));
+        return w;
+    }
+
+    size_t Position(const uint256& entry, int n) const
+    {
+        return Word(entry, n) % nSlots;
+    }
+
+    bool Matches(const CSigCacheSlot& slot, const uint256& entry) const
+    {
+        uint32_t nSeq = slot.nSequence.load(boost::memory_order_acquire);
+        if (nSeq == 0 || (nSeq & 1))
+            return false;
+        bool fMatch = true;
+        for (int i = 0; i < 4; i++)
+            fMatch &= slot.words[i].load(boost::memory_order_relaxed) == Word(entry, i);
+        bool fErased = slot.fErased.load(boost::memory_order_relaxed);
+        boost::atomic_thread_fence(boost::memory_order_acquire);
+        return fMatch && !fErased && slot.nSequence.load(boost::memory_order_relaxed) == nSeq;
+    }
+
+    void Write(CSigCacheSlot& slot, const uint256& entry)
+    {
+        uint32_t nSeq = slot.nSequence.load(boost::memory_order_relaxed);
+        slot.nSequence.store(nSeq + 1, boost::memory_order_relaxed);
+        boost::atomic_thread_fence(boost::memory_order_release);
+        for (int i = 0; i < 4; i++)
+            slot.words[i].store(Word(entry, i), boost::memory_order_relaxed);
+        slot.fErased.store(false, boost::memory_order_relaxed);
+        slot.nSequence.store(nSeq + 2, boost::memory_order_release);
+    }
+
+    bool IsFree(const CSigCacheSlot& slot) const
+    {
+        return slot.nSequence.load(boost::memory_order_relaxed) == 0 || slot.fErased.load(boost::memory_order_relaxed);
+    }
 
 public:
-    bool
-    Get(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
+    CSignatureCache() : nSlots(0), nHits(0), nMisses(0), nInserts(0), nEvictions(0)
     {
-        boost::shared_lock<boost::shared_mutex> lock(cs_sigcache);
+        GetRandBytes(nonce.begin(), 32);
+        GetRandBytes((unsigned char*)&nRandState, sizeof(nRandState));
+        nRandState |= 1;
+
+        nSlots = GetSignatureCacheBytes() / sizeof(CSigCacheSlot);
+        if (nSlots > 0)
+            slots.reset(new CSigCacheSlot[nSlots]);
+    }
 
-        sigdata_type k(hash, vchSig, pubKey);
-        std::set<sigdata_type>::iterator mi = setValid.find(k);
-        if (mi != setValid.end())
-            return true;
+    void ComputeEntry(uint256& entry, const uint256& hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubkey) const
+    {
+        CSHA256().Write(nonce.begin(), 32).Write(hash.begin(), 32).Write(pubkey.begin(), pubkey.size()).Write(begin_ptr(vchSig), vchSig.size()).Finalize(entry.begin());
+    }
+
+    bool Get(const uint256& entry, bool fErase)
+    {
+        for (int n = 0; n < 2 && nSlots > 0; n++) {
+            CSigCacheSlot& slot = slots[Position(entry, n)];
+            if (Matches(slot, entry)) {
+                // Signatures seen in a block are unlikely to be needed again.
+                if (fErase)
+                    slot.fErased.store(true, boost::memory_order_relaxed);
+                nHits.fetch_add(1, boost::memory_order_relaxed);
+                return true;
+            }
+        }
+        nMisses.fetch_add(1, boost::memory_order_relaxed);
         return false;
     }
 
-    void Set(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
+    void Set(const uint256& entry)
     {
-        // DoS prevention: limit cache size to less than 10MB
-        // (~200 bytes per cache entry times 50,000 entries)
-        // Since there are a maximum of 20,000 signature operations per block
-        // 50,000 is a reasonable default.
-        int64_t nMaxCacheSize = GetArg("-maxsigcachesize", 50000);
-        if (nMaxCacheSize <= 0) return;
-
-        boost::unique_lock<boost::shared_mutex> lock(cs_sigcache);
-
-        while (static_cast<int64_t>(setValid.size()) > nMaxCacheSize)
-        {
-            // Evict a random entry. Random because that helps
-            // foil would-be DoS attackers who might try to pre-generate
-            // and re-use a set of valid signatures just-slightly-greater
-            // than our cache size.
-            uint256 randomHash = GetRandHash();
-            std::vector<unsigned char> unused;
-            std::set<sigdata_type>::iterator it =
-                setValid.lower_bound(sigdata_type(randomHash, unused, unused));
-            if (it == setValid.end())
-                it = setValid.begin();
-            setValid.erase(*it);
+        if (nSlots == 0)
+            return;
+
+        boost::mutex::scoped_lock lock(cs_insert);
+        CSigCacheSlot& slot0 = slots[Position(entry, 0)];
+        CSigCacheSlot& slot1 = slots[Position(entry, 1)];
+        if (Matches(slot0, entry) || Matches(slot1, entry))
+            return;
+
+        CSigCacheSlot* pslot;
+        if (IsFree(slot0)) {
+            pslot = &slot0;
+        } else if (IsFree(slot1)) {
+            pslot = &slot1;
+        } else {
+            // Evict at random, so would-be DoS attackers cannot pre-generate
+            // a set of signatures that keeps pushing out a chosen victim.
+            nRandState ^= nRandState << 13;
+            nRandState ^= nRandState >> 7;
+            nRandState ^= nRandState << 17;
+            pslot = (nRandState & 1) ? &slot0 : &slot1;
+            nEvictions.fetch_add(1, boost::memory_order_relaxed);
         }
+        Write(*pslot, entry);
+        nInserts.fetch_add(1, boost::memory_order_relaxed);
+    }
 
-        sigdata_type k(hash, vchSig, pubKey);
-        setValid.insert(k);
+    void GetStats(CSigCacheStats& stats) const
+    {
+        stats.nBytes = nSlots * sizeof(CSigCacheSlot);
+        stats.nCapacity = nSlots;
+        stats.nHits = nHits.load(boost::memory_order_relaxed);
+        stats.nMisses = nMisses.load(boost::memory_order_relaxed);
+        stats.nInserts = nInserts.load(boost::memory_order_relaxed);
+        stats.nEvictions = nEvictions.load(boost::memory_order_relaxed);
     }
 };
 
+CSignatureCache& GetSignatureCache()
+{
+    static CSignatureCache signatureCache;
+    return signatureCache;
+}
+
+}
+
+size_t GetSignatureCacheBytes()
+{
+    uint64_t nBytes;
+    if (mapArgs.count("-sigcachesize") || !mapArgs.count("-maxsigcachesize"))
+        nBytes = (uint64_t)std::max((int64_t)0, std::min(MAX_SIG_CACHE_SIZE, GetArg("-sigcachesize", DEFAULT_SIG_CACHE_SIZE))) << 20;
+    else {
+        // -maxsigcachesize counted entries
+        int64_t nMaxEntries = (MAX_SIG_CACHE_SIZE << 20) / sizeof(CSigCacheSlot);
+        nBytes = (uint64_t)std::max((int64_t)0, std::min(nMaxEntries, GetArg("-maxsigcachesize", 0))) * sizeof(CSigCacheSlot);
+    }
+    return (size_t)std::min(nBytes, (uint64_t)std::numeric_limits<size_t>::max());
+}
+
+void InitSignatureCache()
+{
+    CSigCacheStats stats;
+    GetSignatureCache().GetStats(stats);
+    LogPrintf("Using %u MiB for signature cache, able to store %u elements\n",
+        (unsigned int)(stats.nBytes >> 20), (unsigned int)stats.nCapacity);
+}
+
+void GetSignatureCacheStats(CSigCacheStats& stats)
+{
+    GetSignatureCache().GetStats(stats);
 }
 
 bool CachingTransactionSignatureChecker::VerifySignature(const std::vector<unsigned char>& vchSig, const CPubKey& pubkey, const uint256& sighash) const
 {
-    static CSignatureCache signatureCache;
+    CSignatureCache& signatureCache = GetSignatureCache();
 
-    if (signatureCache.Get(sighash, vchSig, pubkey))
+    uint256 entry;
+    signatureCache.ComputeEntry(entry, sighash, vchSig, pubkey);
+    if (signatureCache.Get(entry, !store))
         return true;
 
     if (!TransactionSignatureChecker::VerifySignature(vchSig, pubkey, sighash))
         return false;
 
     if (store)
-        signatureCache.Set(sighash, vchSig, pubkey);
+        signatureCache.Set(entry);
     return true;
 }
@@ -12,15 +12,41 @@
 
 class CPubKey;
 
+//! Default -sigcachesize, in MiB. At 40 bytes per entry this holds about a million signatures.
+static const int64_t DEFAULT_SIG_CACHE_SIZE = 40;
+//! Upper bound on -sigcachesize, in MiB.
+static const int64_t MAX_SIG_CACHE_SIZE = 16384;
+
+struct CSigCacheStats
+{
+    size_t nBytes;
+    size_t nCapacity;
+    uint64_t nHits;
+    uint64_t nMisses;
+    uint64_t nInserts;
+    uint64_t nEvictions;
+};
+
+/**
+ * The size of the signature cache, in bytes: -sigcachesize MiB or, if only
+ * the older -maxsigcachesize is given, room for that many entries.
+ */
+size_t GetSignatureCacheBytes();
+
 class CachingTransactionSignatureChecker : public TransactionSignatureChecker
 {
 private:
     bool store;
 
 public:
-    CachingTransactionSignatureChecker(const CTransaction* txToIn, unsigned int nInIn, bool storeIn=true) : TransactionSignatureChecker(txToIn, nInIn), store(storeIn) {}
+    CachingTransactionSignatureChecker(const CTransaction* txToIn, unsigned int nInIn, bool storeIn=true, const PrecomputedTransactionData* txdataIn=NULL) :
+        TransactionSignatureChecker(txToIn, nInIn, txdataIn), store(storeIn) {}
 
     bool VerifySignature(const std::vector<unsigned char>& vchSig, const CPubKey& vchPubKey, const uint256& sighash) const;
 };
 
+/** Allocate the signature cache; call once after the arguments are parsed. */
+void InitSignatureCache();
+void GetSignatureCacheStats(CSigCacheStats& stats);
+
 #endif // BITCOIN_SCRIPT_SIGCACHE_H
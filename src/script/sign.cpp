@@ -117,7 +117,7 @@ bool ProduceSignature(const BaseSignatureCreator& creator, const CScript& fromPu
         bool fSolved =
             SignStep(creator, subscript, scriptSig, subType) && subType != TX_SCRIPTHASH;
         // Append serialized subscript whether or not it is completely signed:
-        scriptSig << static_cast<valtype>(subscript);
+        scriptSig << valtype(subscript.begin(), subscript.end());
         if (!fSolved) return false;
     }
 
@@ -0,0 +1,105 @@
+// Copyright (c) 2015 The Bitcoin XT developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "support/allocators/pooled.h"
+
+#if defined(HAVE_CONFIG_H)
+#include "config/bitcoin-config.h"
+#endif
+
+#include <algorithm>
+
+#if HAVE_DECL_MALLOC_TRIM
+#include <malloc.h>
+#endif
+
+namespace {
+
+boost::mutex& PoolsMutex()
+{
+    static boost::mutex* pmutex = new boost::mutex();
+    return *pmutex;
+}
+
+std::vector<pooled_allocator_pool*>& Pools()
+{
+    static std::vector<pooled_allocator_pool*>* pvPools = new std::vector<pooled_allocator_pool*>();
+    return *pvPools;
+}
+
+} // anon namespace
+
+pooled_allocator_pool::pooled_allocator_pool(size_t nObjectSizeIn) :
+    // Room for the free list's pointer, which must stay aligned
+    nObjectSize((std::max(nObjectSizeIn, sizeof(void*)) + sizeof(void*) - 1) / sizeof(void*) * sizeof(void*))
+{
+    boost::lock_guard<boost::mutex> lock(PoolsMutex());
+    Pools().push_back(this);
+}
+
+pooled_allocator_pool::block* pooled_allocator_pool::new_block()
+{
+    block* pblock = new (std::nothrow) block();
+    if (!pblock)
+        return NULL;
+    pblock->pbegin = new (std::nothrow) char[nObjectSize * POOLED_ALLOCATOR_BLOCK];
+    if (!pblock->pbegin) {
+        delete pblock;
+        return NULL;
+    }
+    pblock->pfree = NULL;
+    pblock->nUsed = pblock->nCarved = 0;
+    pblock->fAvailable = true;
+    size_t nPos = std::upper_bound(vBegins.begin(), vBegins.end(), pblock->pbegin) - vBegins.begin();
+    vBegins.insert(vBegins.begin() + nPos, pblock->pbegin);
+    vBlocks.insert(vBlocks.begin() + nPos, pblock);
+    vAvailable.push_back(pblock);
+    return pblock;
+}
+
+size_t pooled_allocator_pool::release_unused()
+{
+    boost::lock_guard<boost::mutex> lock(mutex);
+    size_t nReleased = 0;
+    std::vector<char*> vBeginsKept;
+    std::vector<block*> vBlocksKept;
+    for (size_t i = 0; i < vBlocks.size(); i++) {
+        if (vBlocks[i]->nUsed == 0) {
+            delete[] vBlocks[i]->pbegin;
+            delete vBlocks[i];
+            nReleased += nObjectSize * POOLED_ALLOCATOR_BLOCK;
+        } else {
+            vBeginsKept.push_back(vBegins[i]);
+            vBlocksKept.push_back(vBlocks[i]);
+        }
+    }
+    if (!nReleased)
+        return 0;
+    vBegins.swap(vBeginsKept);
+    vBlocks.swap(vBlocksKept);
+
+    vAvailable.clear();
+    for (size_t i = 0; i < vBlocks.size(); i++) {
+        if (vBlocks[i]->fAvailable)
+            vAvailable.push_back(vBlocks[i]);
+    }
+    return nReleased;
+}
+
+size_t ReleasePooledMemory()
+{
+    size_t nReleased = 0;
+    {
+        boost::lock_guard<boost::mutex> lock(PoolsMutex());
+        for (size_t i = 0; i < Pools().size(); i++)
+            nReleased += Pools()[i]->release_unused();
+    }
+#if HAVE_DECL_MALLOC_TRIM
+    // malloc may keep freed blocks in its heap, among what the objects
+    // allocated themselves, rather than returning them to the system.
+    if (nReleased)
+        malloc_trim(0);
+#endif
+    return nReleased;
+}
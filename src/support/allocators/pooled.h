@@ -0,0 +1,172 @@
+// Copyright (c) 2015 The Bitcoin XT developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_SUPPORT_ALLOCATORS_POOLED_H
+#define BITCOIN_SUPPORT_ALLOCATORS_POOLED_H
+
+#include <algorithm>
+#include <memory>
+#include <new>
+#include <stddef.h>
+#include <vector>
+
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+
+/** Objects carved at once out of each block the pool gets from malloc */
+static const unsigned int POOLED_ALLOCATOR_BLOCK = 4096;
+
+/**
+ * The pool shared by all objects of a size. Each block the pool gets from
+ * malloc keeps its own list of freed objects and a count of those in use,
+ * so that release_unused() can tell which blocks are unused and free them.
+ * Objects are handed out from the block most recently freed into, or the
+ * newest, which lets blocks drain when a large container is emptied.
+ */
+class pooled_allocator_pool
+{
+private:
+    // Disallow copies
+    pooled_allocator_pool(const pooled_allocator_pool&);
+    pooled_allocator_pool& operator=(const pooled_allocator_pool&);
+
+    struct block
+    {
+        char* pbegin;
+        void* pfree; //! Freed objects, each holding a pointer to the next
+        size_t nUsed;
+        size_t nCarved; //! Objects handed out at least once; the rest were never touched
+        bool fAvailable; //! Whether in vAvailable
+    };
+
+    boost::mutex mutex;
+    const size_t nObjectSize;
+    std::vector<char*> vBegins; //! Where each block starts, in order
+    std::vector<block*> vBlocks; //! In the same order
+    std::vector<block*> vAvailable; //! Blocks with room, the last one used first
+
+    static void*& nextof(void* p) { return *static_cast<void**>(p); }
+
+    block* new_block();
+
+    block* block_of(void* p) const
+    {
+        // The last block starting at or before p
+        return vBlocks[std::upper_bound(vBegins.begin(), vBegins.end(), static_cast<char*>(p)) - vBegins.begin() - 1];
+    }
+
+public:
+    explicit pooled_allocator_pool(size_t nObjectSizeIn);
+
+    void* malloc()
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        block* pblock = vAvailable.empty() ? new_block() : vAvailable.back();
+        if (!pblock)
+            return NULL;
+        void* p;
+        if (pblock->pfree) {
+            p = pblock->pfree;
+            pblock->pfree = nextof(p);
+        } else {
+            p = pblock->pbegin + nObjectSize * pblock->nCarved++;
+        }
+        if (++pblock->nUsed == POOLED_ALLOCATOR_BLOCK) {
+            vAvailable.pop_back();
+            pblock->fAvailable = false;
+        }
+        return p;
+    }
+
+    void free(void* p)
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        block* pblock = block_of(p);
+        nextof(p) = pblock->pfree;
+        pblock->pfree = p;
+        pblock->nUsed--;
+        if (!pblock->fAvailable) {
+            vAvailable.push_back(pblock);
+            pblock->fAvailable = true;
+        }
+    }
+
+    /** Free the blocks none of whose objects are in use. Returns the number of bytes freed. */
+    size_t release_unused();
+
+    /** The pool for objects of Size bytes. It is never destroyed. */
+    template <size_t Size>
+    static pooled_allocator_pool& get()
+    {
+        static pooled_allocator_pool* ppool = new pooled_allocator_pool(Size);
+        return *ppool;
+    }
+};
+
+/**
+ * Free the unused blocks of every pool (see
+ * pooled_allocator_pool::release_unused), and ask malloc to give what it
+ * can back to the system. Returns the number of bytes freed from the pools.
+ */
+size_t ReleasePooledMemory();
+
+/**
+ * Allocator that takes single objects from a pool shared by everything of
+ * the same size, instead of calling malloc for each. This is meant for the
+ * nodes of large node-based containers: an object costs exactly its size,
+ * without the 8 to 23 bytes malloc adds for its own bookkeeping and
+ * alignment. Arrays (such as the bucket array of a hash table) still come
+ * from malloc.
+ *
+ * Freed objects are kept in the pool for the next allocation of the same
+ * size; ReleasePooledMemory() gives back what isn't needed any more.
+ */
+template <typename T>
+struct pooled_allocator : public std::allocator<T> {
+    typedef std::allocator<T> base;
+    typedef typename base::size_type size_type;
+    typedef typename base::difference_type difference_type;
+    typedef typename base::pointer pointer;
+    typedef typename base::const_pointer const_pointer;
+    typedef typename base::reference reference;
+    typedef typename base::const_reference const_reference;
+    typedef typename base::value_type value_type;
+
+    pooled_allocator() throw() {}
+    pooled_allocator(const pooled_allocator& a) throw() : base(a) {}
+    template <typename U>
+    pooled_allocator(const pooled_allocator<U>& a) throw() : base(a)
+    {
+    }
+    ~pooled_allocator() throw() {}
+    template <typename _Other>
+    struct rebind {
+        typedef pooled_allocator<_Other> other;
+    };
+
+    T* allocate(std::size_t n, const void* hint = 0)
+    {
+        if (n != 1)
+            return base::allocate(n, hint);
+        void* p = pooled_allocator_pool::get<sizeof(T)>().malloc();
+        if (!p)
+            throw std::bad_alloc();
+        return static_cast<T*>(p);
+    }
+
+    void deallocate(T* p, std::size_t n)
+    {
+        if (n != 1)
+            base::deallocate(p, n);
+        else if (p != NULL)
+            pooled_allocator_pool::get<sizeof(T)>().free(p);
+    }
+};
+
+template <typename T, typename U>
+bool operator==(const pooled_allocator<T>&, const pooled_allocator<U>&) { return true; }
+template <typename T, typename U>
+bool operator!=(const pooled_allocator<T>&, const pooled_allocator<U>&) { return false; }
+
+#endif // BITCOIN_SUPPORT_ALLOCATORS_POOLED_H
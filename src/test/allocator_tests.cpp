@@ -4,6 +4,7 @@
 
 #include "util.h"
 
+#include "support/allocators/pooled.h"
 #include "support/allocators/secure.h"
 #include "test/test_bitcoin.h"
 
@@ -117,4 +118,38 @@ BOOST_AUTO_TEST_CASE(test_LockedPageManagerBase)
     BOOST_CHECK((last_unlock_len & (test_page_size-1)) == 0); // always unlock entire pages
 }
 
+// An object size nothing else uses, to have a pool of its own
+struct PooledTestObject
+{
+    char data[1013];
+};
+
+BOOST_AUTO_TEST_CASE(pooled_allocator_release)
+{
+    pooled_allocator<PooledTestObject> alloc;
+    pooled_allocator_pool& pool = pooled_allocator_pool::get<sizeof(PooledTestObject)>();
+    const size_t nBlockSize = 1016 * POOLED_ALLOCATOR_BLOCK;
+
+    std::vector<PooledTestObject*> vObjects;
+    for (unsigned int i = 0; i < 2 * POOLED_ALLOCATOR_BLOCK; i++)
+        vObjects.push_back(alloc.allocate(1));
+    BOOST_CHECK_EQUAL(pool.release_unused(), 0U);
+
+    // Objects in use keep their block, however few
+    for (unsigned int i = 1; i < vObjects.size(); i++)
+        alloc.deallocate(vObjects[i], 1);
+    BOOST_CHECK_EQUAL(pool.release_unused(), nBlockSize);
+    BOOST_CHECK_EQUAL(pool.release_unused(), 0U);
+
+    // What is left is still handed out again
+    PooledTestObject* p = alloc.allocate(1);
+    alloc.deallocate(p, 1);
+    alloc.deallocate(vObjects[0], 1);
+    BOOST_CHECK_EQUAL(pool.release_unused(), nBlockSize);
+
+    p = alloc.allocate(1);
+    alloc.deallocate(p, 1);
+    BOOST_CHECK(ReleasePooledMemory() >= nBlockSize);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
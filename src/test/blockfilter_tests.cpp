@@ -0,0 +1,136 @@
+// Copyright (c) 2015 The Bitcoin XT developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfilter.h"
+
+#include "chainparams.h"
+#include "primitives/block.h"
+#include "random.h"
+#include "undo.h"
+#include "utilstrencodings.h"
+
+#include "test/test_bitcoin.h"
+
+#include <boost/foreach.hpp>
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(blockfilter_tests, BasicTestingSetup)
+
+static GCSFilter::Element MakeElement(int i, unsigned char tag)
+{
+    GCSFilter::Element element(32, tag);
+    element[0] = i & 0xff;
+    element[1] = (i >> 8) & 0xff;
+    return element;
+}
+
+BOOST_AUTO_TEST_CASE(gcsfilter_test)
+{
+    GCSFilter::ElementSet included, excluded;
+    for (int i = 0; i < 100; i++) {
+        included.insert(MakeElement(i, 1));
+        excluded.insert(MakeElement(i, 2));
+    }
+
+    GCSFilter::Params params(0, 0, 20, 1 << 20);
+    GCSFilter filter(params, included);
+    BOOST_CHECK_EQUAL(filter.GetN(), 100);
+    BOOST_FOREACH(const GCSFilter::Element& element, included)
+        BOOST_CHECK(filter.Match(element));
+    BOOST_CHECK(filter.MatchAny(included));
+
+    // A filter read back from its encoding is the same.
+    GCSFilter decoded(params, filter.GetEncoded());
+    BOOST_CHECK_EQUAL(decoded.GetN(), 100);
+    BOOST_CHECK(decoded.GetEncoded() == filter.GetEncoded());
+    BOOST_FOREACH(const GCSFilter::Element& element, included)
+        BOOST_CHECK(decoded.Match(element));
+
+    // With M = 2^20 about one in a hundred such sets of 100 elements would
+    // give a false positive; the elements are fixed, and these do not.
+    BOOST_CHECK(!filter.MatchAny(excluded));
+
+    GCSFilter::ElementSet mixed(excluded);
+    mixed.insert(*included.begin());
+    BOOST_CHECK(filter.MatchAny(mixed));
+
+    // Truncated encodings are refused.
+    std::vector<unsigned char> vTruncated(filter.GetEncoded().begin(), filter.GetEncoded().end() - 1);
+    BOOST_CHECK_THROW(GCSFilter(params, vTruncated), std::ios_base::failure);
+    BOOST_CHECK_THROW(GCSFilter(params, std::vector<unsigned char>()), std::ios_base::failure);
+}
+
+BOOST_AUTO_TEST_CASE(gcsfilter_empty)
+{
+    GCSFilter::Params params(0, 0, 10, 1 << 10);
+    GCSFilter filter(params, GCSFilter::ElementSet());
+    BOOST_CHECK_EQUAL(filter.GetN(), 0);
+    BOOST_CHECK_EQUAL(HexStr(filter.GetEncoded()), "00");
+    BOOST_CHECK(!filter.Match(MakeElement(0, 1)));
+
+    GCSFilter decoded(params, filter.GetEncoded());
+    BOOST_CHECK_EQUAL(decoded.GetN(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(blockfilter_basic_test)
+{
+    CScript included1 = CScript() << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20, 1) << OP_EQUALVERIFY << OP_CHECKSIG;
+    CScript included2 = CScript() << OP_HASH160 << std::vector<unsigned char>(20, 2) << OP_EQUAL;
+    CScript spent = CScript() << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20, 3) << OP_EQUALVERIFY << OP_CHECKSIG;
+    CScript opreturn = CScript() << OP_RETURN << std::vector<unsigned char>(4, 4);
+    CScript excluded = CScript() << OP_HASH160 << std::vector<unsigned char>(20, 5) << OP_EQUAL;
+
+    CBlock block;
+    CMutableTransaction coinbase;
+    coinbase.vin.resize(1);
+    coinbase.vout.resize(2);
+    coinbase.vout[0].scriptPubKey = included1;
+    coinbase.vout[1].scriptPubKey = opreturn;
+    block.vtx.push_back(coinbase);
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    tx.vout.resize(2);
+    tx.vout[0].scriptPubKey = included2;
+    // Empty output scripts are left out.
+    block.vtx.push_back(tx);
+    block.hashMerkleRoot = block.BuildMerkleTree();
+
+    CBlockUndo blockundo;
+    blockundo.vtxundo.resize(1);
+    blockundo.vtxundo[0].vprevout.push_back(CTxInUndo(CTxOut(1000, spent)));
+
+    CBlockFilter filter(BASIC_FILTER, block, blockundo);
+    BOOST_CHECK(filter.GetBlockHash() == block.GetHash());
+    const GCSFilter& gcs = filter.GetFilter();
+    BOOST_CHECK_EQUAL(gcs.GetN(), 3);
+    BOOST_CHECK(gcs.Match(GCSFilter::Element(included1.begin(), included1.end())));
+    BOOST_CHECK(gcs.Match(GCSFilter::Element(included2.begin(), included2.end())));
+    BOOST_CHECK(gcs.Match(GCSFilter::Element(spent.begin(), spent.end())));
+    BOOST_CHECK(!gcs.Match(GCSFilter::Element(opreturn.begin(), opreturn.end())));
+    BOOST_CHECK(!gcs.Match(GCSFilter::Element(excluded.begin(), excluded.end())));
+
+    // Decoding needs the block hash, for the key.
+    CBlockFilter decoded(BASIC_FILTER, block.GetHash(), filter.GetEncodedFilter());
+    BOOST_CHECK(decoded.GetEncodedFilter() == filter.GetEncodedFilter());
+    BOOST_CHECK(decoded.GetFilter().Match(GCSFilter::Element(spent.begin(), spent.end())));
+
+    // Headers chain on from each other.
+    uint256 hashPrevHeader = GetRandHash();
+    uint256 hashHeader = filter.ComputeHeader(hashPrevHeader);
+    BOOST_CHECK(hashHeader == ComputeBlockFilterHeader(filter.GetHash(), hashPrevHeader));
+    BOOST_CHECK(hashHeader != filter.ComputeHeader(uint256()));
+}
+
+BOOST_AUTO_TEST_CASE(blockfilter_bip158_vector)
+{
+    // The first of the BIP 158 test vectors: the testnet genesis block.
+    const CBlock& genesis = Params(CBaseChainParams::TESTNET).GenesisBlock();
+    CBlockFilter filter(BASIC_FILTER, genesis, CBlockUndo());
+    BOOST_CHECK_EQUAL(HexStr(filter.GetEncodedFilter()), "019dfca8");
+    BOOST_CHECK_EQUAL(filter.ComputeHeader(uint256()).GetHex(),
+        "21584579b7eb08997773e5aeff3a7f932700042d0ed2a6129012b7d7ae81b750");
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,96 @@
+// Copyright (c) 2015 The Bitcoin XT developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+//
+// Unit tests for reading block files ahead of an import
+//
+
+#include "blockimport.h"
+#include "chainparams.h"
+#include "clientversion.h"
+#include "streams.h"
+
+#include "test/test_bitcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(blockimport_tests, BasicTestingSetup)
+
+/** Append a block record, as found in blk?????.dat files, and return the offset of the block. */
+static uint64_t WriteRecord(CAutoFile& file, const CBlock& block, uint64_t& nPos)
+{
+    unsigned int nSize = ::GetSerializeSize(block, SER_DISK, CLIENT_VERSION);
+    file << FLATDATA(Params().MessageStart()) << nSize << block;
+    nPos += MESSAGE_START_SIZE + sizeof(nSize);
+    uint64_t nBlockPos = nPos;
+    nPos += nSize;
+    return nBlockPos;
+}
+
+BOOST_AUTO_TEST_CASE(pipeline_keeps_file_order)
+{
+    const CBlock& genesis = Params().GenesisBlock();
+    CBlock block(genesis.GetBlockHeader());
+    block.vtx = genesis.vtx;
+    block.nNonce++; // Same transactions, no longer enough work
+
+    FILE* file = tmpfile();
+    BOOST_REQUIRE(file != NULL);
+    std::vector<uint256> vHashes;
+    std::vector<uint64_t> vPos;
+    {
+        CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
+        uint64_t nPos = 0;
+        for (int i = 0; i < 200; i++) {
+            if (i % 7 == 0) {
+                // Garbage between records is skipped
+                fileout << (uint32_t)0xdeadbeef;
+                nPos += 4;
+            }
+            const CBlock& b = i % 2 ? block : genesis;
+            vPos.push_back(WriteRecord(fileout, b, nPos));
+            vHashes.push_back(b.GetHash());
+        }
+        rewind(fileout.release());
+    }
+
+    CBlockImportPipeline pipeline(file, 1000000, 4);
+    boost::shared_ptr<CImportedBlock> pimported;
+    size_t n = 0;
+    while (pipeline.Next(pimported)) {
+        BOOST_REQUIRE(n < vHashes.size());
+        BOOST_CHECK(pimported->fParsed);
+        BOOST_CHECK_EQUAL(pimported->nPos, vPos[n]);
+        BOOST_CHECK(pimported->hash == vHashes[n]);
+        BOOST_CHECK(pimported->block.GetHash() == vHashes[n]);
+        // Checked ahead: only the genesis block has the work it claims
+        BOOST_CHECK_EQUAL(pimported->block.fChecked, n % 2 == 0);
+        n++;
+    }
+    BOOST_CHECK_EQUAL(n, vHashes.size());
+    BOOST_CHECK_EQUAL(pipeline.GetBytesLoaded(), 200 * ::GetSerializeSize(genesis, SER_DISK, CLIENT_VERSION));
+    std::string strError;
+    BOOST_CHECK(!pipeline.Failed(strError));
+}
+
+BOOST_AUTO_TEST_CASE(pipeline_stops_early)
+{
+    FILE* file = tmpfile();
+    BOOST_REQUIRE(file != NULL);
+    {
+        CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
+        uint64_t nPos = 0;
+        for (int i = 0; i < 1000; i++)
+            WriteRecord(fileout, Params().GenesisBlock(), nPos);
+        rewind(fileout.release());
+    }
+
+    // An importer that gives up early doesn't wait for the rest
+    CBlockImportPipeline pipeline(file, 1000000, 2);
+    boost::shared_ptr<CImportedBlock> pimported;
+    BOOST_CHECK(pipeline.Next(pimported));
+    BOOST_CHECK(pimported->fParsed);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
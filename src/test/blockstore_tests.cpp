@@ -0,0 +1,119 @@
+// Copyright (c) 2015 The Bitcoin XT developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+//
+// Unit tests for reading block files through their mappings
+//
+
+#include "blockstore.h"
+#include "chainparams.h"
+#include "clientversion.h"
+#include "main.h"
+
+#include "test/test_bitcoin.h"
+
+#include <boost/filesystem.hpp>
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(blockstore_tests, TestingSetup)
+
+BOOST_AUTO_TEST_CASE(blockstore_read_and_remap)
+{
+    CBlock genesis = Params().GenesisBlock();
+    CBlock block(genesis.GetBlockHeader());
+    block.vtx = genesis.vtx;
+    block.nTime++;
+
+    // A block file of its own
+    CDiskBlockPos pos1(1000, 0);
+    BOOST_REQUIRE(WriteBlockToDisk(genesis, pos1, Params().MessageStart()));
+
+    CBlockFileStore store(2);
+    {
+        CBlockFileReader filein(store, pos1, "blk", SER_DISK, CLIENT_VERSION);
+        CBlock read;
+        filein >> read;
+        BOOST_CHECK(read.GetHash() == genesis.GetHash());
+#ifndef WIN32
+        BOOST_CHECK(filein.IsMapped());
+        BOOST_CHECK_EQUAL(store.GetMappedCount(), 1);
+
+        // Nothing left in the file
+        char c;
+        BOOST_CHECK_THROW(filein.read(&c, 1), std::ios_base::failure);
+#endif
+    }
+
+    // The file grows past the mapping, which is redone
+    CDiskBlockPos pos2(1000, pos1.nPos + ::GetSerializeSize(genesis, SER_DISK, CLIENT_VERSION));
+    BOOST_REQUIRE(WriteBlockToDisk(block, pos2, Params().MessageStart()));
+    {
+        CBlockFileReader filein(store, pos2, "blk", SER_DISK, CLIENT_VERSION);
+        CBlock read;
+        filein >> read;
+        BOOST_CHECK(read.GetHash() == block.GetHash());
+    }
+
+    // Skipping ahead, as GetTransaction does
+    {
+        CBlockFileReader filein(store, pos1, "blk", SER_DISK, CLIENT_VERSION);
+        CBlockHeader header;
+        filein >> header;
+        filein.ignore(1); // number of transactions
+        CTransaction tx;
+        filein >> tx;
+        BOOST_CHECK(tx.GetHash() == genesis.vtx[0].GetHash());
+    }
+
+    // Files that don't exist can't be read
+    CBlockFileReader fileMissing(store, CDiskBlockPos(1001, 0), "blk", SER_DISK, CLIENT_VERSION);
+    BOOST_CHECK(fileMissing.IsNull());
+
+    store.Forget(1000);
+    BOOST_CHECK_EQUAL(store.GetMappedCount(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(blockstore_truncated_file)
+{
+    CBlock genesis = Params().GenesisBlock();
+    CDiskBlockPos pos1(1002, 0);
+    BOOST_REQUIRE(WriteBlockToDisk(genesis, pos1, Params().MessageStart()));
+    CDiskBlockPos pos2(1002, pos1.nPos + ::GetSerializeSize(genesis, SER_DISK, CLIENT_VERSION));
+    BOOST_REQUIRE(WriteBlockToDisk(genesis, pos2, Params().MessageStart()));
+
+    CBlockFileStore store(2);
+    {
+        CBlockFileReader filein(store, pos2, "blk", SER_DISK, CLIENT_VERSION);
+        CBlock read;
+        filein >> read;
+        BOOST_CHECK(read.GetHash() == genesis.GetHash());
+    }
+
+    // Cut the file in the middle of the second block, under the mapping
+    boost::filesystem::resize_file(GetBlockPosFilename(pos1, "blk"), pos2.nPos + 40);
+    {
+        CBlockFileReader filein(store, pos1, "blk", SER_DISK, CLIENT_VERSION);
+        CBlock read;
+        filein >> read;
+        BOOST_CHECK(read.GetHash() == genesis.GetHash());
+    }
+    {
+        // What was cut off fails to read, through stdio, instead of faulting
+        CBlockFileReader filein(store, pos2, "blk", SER_DISK, CLIENT_VERSION);
+        CBlock read;
+        BOOST_CHECK_THROW(filein >> read, std::ios_base::failure);
+        BOOST_CHECK(!filein.IsMapped());
+    }
+    store.Forget(1002);
+}
+
+BOOST_AUTO_TEST_CASE(blockstore_read_block)
+{
+    // TestingSetup stored the genesis block, which is read through blockFileStore
+    CBlock block;
+    BOOST_REQUIRE(ReadBlockFromDisk(block, chainActive.Genesis()));
+    BOOST_CHECK(block.GetHash() == Params().GenesisBlock().GetHash());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -185,6 +185,37 @@ BOOST_AUTO_TEST_CASE(bloom_match)
     BOOST_CHECK_MESSAGE(!filter.IsRelevantAndUpdate(tx), "Simple Bloom filter matched COutPoint for an output we didn't care about");
 }
 
+BOOST_AUTO_TEST_CASE(bloom_match_shared_elements)
+{
+    // The transaction of bloom_match, its elements prepared once and
+    // matched against many filters, as when it is relayed.
+    CTransaction tx;
+    CDataStream stream(ParseHex("01000000010b26e9b7735eb6aabdf358bab62f9816a21ba9ebdb719d5299e88607d722c190000000008b4830450220070aca44506c5cef3a16ed519d7c3c39f8aab192c4e1c90d065f37b8a4af6141022100a8e160b856c2d43d27d8fba71e5aef6405b8643ac4cb7cb3c462aced7f14711a0141046d11fee51b0e60666d5049a9101a72741df480b96ee26488a4d3466b95c9a40ac5eeef87e10a5cd336c19a84565f80fa6c547957b7700ff4dfbdefe76036c339ffffffff021bff3d11000000001976a91404943fdd508053c75000106d3bc6e2754dbcff1988ac2f15de00000000001976a914a266436d2965547608b9e15d9032a7b9d64fa43188ac00000000"), SER_DISK, CLIENT_VERSION);
+    stream >> tx;
+    CBloomTxElements elements(tx);
+
+    std::vector<CBloomFilter> vFilters(6, CBloomFilter(10, 0.000001, 0, BLOOM_UPDATE_ALL));
+    vFilters[0].insert(uint256S("0xb4749f017444b051c44dfd2720e88f314ff94f3dd6d56d40ef65854fcd7fff6b"));
+    vFilters[1].insert(ParseHex("30450220070aca44506c5cef3a16ed519d7c3c39f8aab192c4e1c90d065f37b8a4af6141022100a8e160b856c2d43d27d8fba71e5aef6405b8643ac4cb7cb3c462aced7f14711a01"));
+    vFilters[2].insert(ParseHex("a266436d2965547608b9e15d9032a7b9d64fa431"));
+    vFilters[3].insert(COutPoint(uint256S("0x90c122d70786e899529d71dbeba91ba216982fb6ba58f3bdaab65e73b7e9260b"), 0));
+    vFilters[4].insert(ParseHex("0000006d2965547608b9e15d9032a7b9d64fa431"));
+    vFilters[5].insert(COutPoint(uint256S("0x90c122d70786e899529d71dbeba91ba216982fb6ba58f3bdaab65e73b7e9260b"), 1));
+    for (int i = 0; i < 6; i++)
+        BOOST_CHECK_EQUAL(vFilters[i].IsRelevantAndUpdate(elements), i < 4);
+
+    // The matched output was added to the filter, for its spends.
+    BOOST_CHECK(vFilters[2].contains(COutPoint(tx.GetHash(), 1)));
+    BOOST_CHECK(!vFilters[2].contains(COutPoint(tx.GetHash(), 0)));
+
+    // Full and empty filters are answered without hashing.
+    CBloomFilter full;
+    BOOST_CHECK(full.IsRelevantAndUpdate(elements));
+    CBloomFilter empty(10, 0.000001, 0, BLOOM_UPDATE_ALL);
+    empty.clear();
+    BOOST_CHECK(!empty.IsRelevantAndUpdate(elements));
+}
+
 BOOST_AUTO_TEST_CASE(merkle_block_1)
 {
     // Random real block (0000000000013b8ab2cd513b0261a14096412195a72a0c4827d229dcc7e0f7af)
@@ -540,4 +571,66 @@ BOOST_AUTO_TEST_CASE(rolling_bloom)
     }
 }
 
+BOOST_AUTO_TEST_CASE(bloom_contains_prepared)
+{
+    // Prepared elements are found in exactly the filters that contain their
+    // data, for filters with any number of hash functions.
+    for (unsigned int nElements = 10; nElements <= 1000; nElements *= 10) {
+        for (double nFPRate = 0.1; nFPRate > 1e-9; nFPRate /= 100) {
+            CBloomFilter filter(nElements, nFPRate, insecure_rand(), BLOOM_UPDATE_NONE);
+            for (unsigned int i = 0; i < nElements; i++) {
+                std::vector<unsigned char> vData = RandomData();
+                filter.insert(vData);
+                BOOST_CHECK(filter.contains(CMurmurHash3Data(vData)));
+            }
+            for (int i = 0; i < 1000; i++) {
+                std::vector<unsigned char> vData = RandomData();
+                vData.resize(insecure_rand() % 40);
+                BOOST_CHECK_EQUAL(filter.contains(CMurmurHash3Data(vData)), filter.contains(vData));
+            }
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(bloom_insert_prepared)
+{
+    // Inserting a prepared element sets the same bits as inserting its data.
+    CBloomFilter filter1(100, 0.000001, insecure_rand(), BLOOM_UPDATE_NONE);
+    CBloomFilter filter2 = filter1;
+    for (int i = 0; i < 100; i++) {
+        std::vector<unsigned char> vData = RandomData();
+        vData.resize(insecure_rand() % 40);
+        filter1.insert(vData);
+        filter2.insert(CMurmurHash3Data(vData));
+    }
+    CDataStream ss1(SER_NETWORK, PROTOCOL_VERSION), ss2(SER_NETWORK, PROTOCOL_VERSION);
+    ss1 << filter1;
+    ss2 << filter2;
+    BOOST_CHECK(ss1.str() == ss2.str());
+}
+
+BOOST_AUTO_TEST_CASE(rolling_bloom_hash)
+{
+    // Hashes are the same elements as their 32 bytes of data.
+    CRollingBloomFilter rb(100, 0.000001, insecure_rand());
+    std::vector<uint256> vHashes;
+    for (int i = 0; i < 300; i++) {
+        vHashes.push_back(GetRandHash());
+        if (i % 2)
+            rb.insert(vHashes[i]);
+        else
+            rb.insert(std::vector<unsigned char>(vHashes[i].begin(), vHashes[i].end()));
+    }
+    for (int i = 200; i < 300; i++) {
+        BOOST_CHECK(rb.contains(vHashes[i]));
+        BOOST_CHECK(rb.contains(std::vector<unsigned char>(vHashes[i].begin(), vHashes[i].end())));
+    }
+    unsigned int nHits = 0;
+    for (int i = 0; i < 1000; i++) {
+        if (rb.contains(GetRandHash()))
+            ++nHits;
+    }
+    BOOST_CHECK(nHits < 5);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -197,4 +197,38 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     BOOST_CHECK(missed_an_entry);
 }
 
+/** A view that hands out coins with room to spare in vout, as reading them output by output leaves them. */
+class CCoinsViewGrown : public CCoinsView
+{
+public:
+    bool GetCoins(const uint256& txid, CCoins& coins) const
+    {
+        coins.Clear();
+        coins.nVersion = 1;
+        coins.vout.reserve(64);
+        coins.vout.resize(3);
+        coins.vout[2].nValue = 1;
+        coins.vout[2].scriptPubKey = CScript() << OP_TRUE;
+        return true;
+    }
+};
+
+BOOST_AUTO_TEST_CASE(coins_cache_entries_fit)
+{
+    CCoinsViewGrown base;
+    CCoinsViewCacheTest cache(&base);
+
+    const CCoins* coins = cache.AccessCoins(GetRandHash());
+    BOOST_REQUIRE(coins);
+    BOOST_CHECK_EQUAL(coins->vout.size(), 3U);
+    BOOST_CHECK_EQUAL(coins->vout.capacity(), 3U);
+
+    {
+        CCoinsModifier modified = cache.ModifyCoins(GetRandHash());
+        BOOST_CHECK_EQUAL(modified->vout.capacity(), 3U);
+        modified->Spend(2);
+    }
+    cache.SelfTest();
+}
+
 BOOST_AUTO_TEST_SUITE_END()
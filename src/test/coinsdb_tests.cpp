@@ -0,0 +1,353 @@
+// Copyright (c) 2015 The Bitcoin XT developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "coins.h"
+#include "coinsflush.h"
+#include "main.h"
+#include "random.h"
+#include "txdb.h"
+#include "uint256.h"
+
+#include "test/test_bitcoin.h"
+
+#include <map>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(coinsdb_tests, TestingSetup)
+
+typedef std::map<uint256, CCoins> CoinsMap;
+
+/** A transaction's coins with a random number of outputs, some already spent. */
+static CCoins RandomCoins()
+{
+    CCoins coins;
+    coins.fCoinBase = insecure_rand() % 8 == 0;
+    coins.nHeight = insecure_rand() % 400000;
+    coins.nVersion = 1 + insecure_rand() % 2;
+    coins.vout.resize(1 + insecure_rand() % 40);
+    for (size_t i = 0; i < coins.vout.size(); i++) {
+        if (insecure_rand() % 4 == 0)
+            continue;
+        coins.vout[i].nValue = insecure_rand() % 1000000;
+        coins.vout[i].scriptPubKey = CScript() << OP_DUP << OP_HASH160 << ToByteVector(GetRandHash()) << OP_EQUALVERIFY << OP_CHECKSIG;
+    }
+    coins.Cleanup();
+    return coins;
+}
+
+/** Apply the same random spends, re-additions and new transactions to each view. */
+static void RandomChanges(const std::vector<CCoinsViewCache*>& views, CoinsMap& expected)
+{
+    for (CoinsMap::iterator it = expected.begin(); it != expected.end(); it++) {
+        if (insecure_rand() % 3 != 0)
+            continue;
+        CCoins coins = it->second;
+        for (size_t i = 0; i < coins.vout.size(); i++) {
+            if (insecure_rand() % 3 == 0)
+                coins.Spend(i);
+        }
+        // Now and then bring an output back, as disconnecting a block does.
+        // Unspent outputs never change, so it goes past the ones there were.
+        if (insecure_rand() % 8 == 0 && !coins.IsPruned()) {
+            size_t n = it->second.vout.size() + insecure_rand() % 3;
+            coins.vout.resize(n + 1);
+            coins.vout[n].nValue = 1;
+            coins.vout[n].scriptPubKey = CScript() << OP_TRUE;
+        }
+        coins.Cleanup();
+        for (size_t v = 0; v < views.size(); v++)
+            *views[v]->ModifyCoins(it->first) = coins;
+        it->second = coins;
+    }
+    for (int i = 0; i < 20; i++) {
+        uint256 txid = GetRandHash();
+        CCoins coins = RandomCoins();
+        for (size_t v = 0; v < views.size(); v++)
+            *views[v]->ModifyCoins(txid) = coins;
+        expected[txid] = coins;
+    }
+}
+
+static void RandomChanges(CCoinsViewCache& view, CoinsMap& expected)
+{
+    RandomChanges(std::vector<CCoinsViewCache*>(1, &view), expected);
+}
+
+static void CheckCoins(const CCoinsView& view, const CoinsMap& expected)
+{
+    for (CoinsMap::const_iterator it = expected.begin(); it != expected.end(); it++) {
+        CCoins coins;
+        bool fHave = view.GetCoins(it->first, coins);
+        BOOST_CHECK_EQUAL(fHave, !it->second.IsPruned());
+        BOOST_CHECK_EQUAL(view.HaveCoins(it->first), !it->second.IsPruned());
+        if (fHave)
+            BOOST_CHECK(coins == it->second);
+    }
+}
+
+/** A BatchRead of all txids (and a few unknown ones) finds what GetCoins finds. */
+static void CheckBatchRead(const CCoinsView& view, const CoinsMap& expected)
+{
+    std::vector<CCoinsLookup> vLookups;
+    for (CoinsMap::const_iterator it = expected.begin(); it != expected.end(); it++)
+        vLookups.push_back(CCoinsLookup(it->first));
+    for (int i = 0; i < 10; i++)
+        vLookups.push_back(CCoinsLookup(GetRandHash()));
+    view.BatchRead(vLookups);
+    for (size_t i = 0; i < vLookups.size(); i++) {
+        CCoins coins;
+        bool fHave = view.GetCoins(vLookups[i].txid, coins);
+        BOOST_CHECK_EQUAL(vLookups[i].fFound, fHave);
+        if (fHave)
+            BOOST_CHECK(vLookups[i].coins == coins);
+    }
+}
+
+static uint256 HashCoins(const CCoinsView& view)
+{
+    CCoinsStats stats;
+    BOOST_CHECK(view.GetStats(stats));
+    return stats.hashSerialized;
+}
+
+BOOST_AUTO_TEST_CASE(coinsdb_layouts)
+{
+    CCoinsViewDB dbTxid(1 << 20, true, false, COINS_DB_PER_TXID);
+    CCoinsViewDB dbOutpoint(1 << 20, true, false, COINS_DB_PER_OUTPOINT);
+    BOOST_CHECK_EQUAL(dbTxid.GetLayout(), COINS_DB_PER_TXID);
+    BOOST_CHECK_EQUAL(dbOutpoint.GetLayout(), COINS_DB_PER_OUTPOINT);
+
+    uint256 hashBlock = chainActive.Tip()->GetBlockHash();
+    CoinsMap expected;
+    for (int round = 0; round < 10; round++) {
+        CCoinsViewCache viewTxid(&dbTxid);
+        CCoinsViewCache viewOutpoint(&dbOutpoint);
+        std::vector<CCoinsViewCache*> views;
+        views.push_back(&viewTxid);
+        views.push_back(&viewOutpoint);
+        RandomChanges(views, expected);
+        viewTxid.SetBestBlock(hashBlock);
+        viewOutpoint.SetBestBlock(hashBlock);
+        BOOST_CHECK(viewTxid.Flush());
+        BOOST_CHECK(viewOutpoint.Flush());
+
+        CheckCoins(dbTxid, expected);
+        CheckCoins(dbOutpoint, expected);
+        BOOST_CHECK(HashCoins(dbTxid) == HashCoins(dbOutpoint));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(coinsdb_spend_through_child_cache)
+{
+    // Outputs spent in a cache on top of the cache over the database, as
+    // ConnectBlock does, are erased although neither cache read them.
+    CCoinsViewDB db(1 << 20, true, false, COINS_DB_PER_OUTPOINT);
+    CoinsMap expected;
+    for (int round = 0; round < 10; round++) {
+        CCoinsViewCache view(&db);
+        {
+            CCoinsViewCache viewChild(&view);
+            RandomChanges(viewChild, expected);
+            BOOST_CHECK(viewChild.Flush());
+        }
+        // Spend the last output of a few, shrinking their vout.
+        for (CoinsMap::iterator it = expected.begin(); it != expected.end(); it++) {
+            if (it->second.IsPruned() || insecure_rand() % 4 != 0)
+                continue;
+            CCoins coinsBefore = it->second;
+            CCoinsViewCache viewChild(&view);
+            viewChild.ModifyCoins(it->first)->Spend(it->second.vout.size() - 1);
+            BOOST_CHECK(viewChild.Flush());
+            it->second.Spend(it->second.vout.size() - 1);
+            // Now and then the spend is undone again, as disconnecting a block does.
+            if (insecure_rand() % 2 == 0) {
+                CCoinsViewCache viewUndo(&view);
+                *viewUndo.ModifyCoins(it->first) = coinsBefore;
+                BOOST_CHECK(viewUndo.Flush());
+                it->second = coinsBefore;
+            }
+        }
+        view.SetBestBlock(GetRandHash());
+        BOOST_CHECK(view.Flush());
+        CheckCoins(db, expected);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(coinsdb_upgrade)
+{
+    CCoinsViewDB db(1 << 20, true, false, COINS_DB_PER_TXID);
+    uint256 hashBlock = chainActive.Tip()->GetBlockHash();
+    CoinsMap expected;
+    for (int round = 0; round < 3; round++) {
+        CCoinsViewCache view(&db);
+        RandomChanges(view, expected);
+        view.SetBestBlock(hashBlock);
+        BOOST_CHECK(view.Flush());
+    }
+    uint256 hashBefore = HashCoins(db);
+
+    BOOST_CHECK(db.Upgrade());
+    BOOST_CHECK_EQUAL(db.GetLayout(), COINS_DB_PER_OUTPOINT);
+    BOOST_CHECK(db.GetBestBlock() == hashBlock);
+    CheckCoins(db, expected);
+    BOOST_CHECK(HashCoins(db) == hashBefore);
+
+    // And it keeps working afterwards.
+    CCoinsViewCache view(&db);
+    RandomChanges(view, expected);
+    BOOST_CHECK(view.Flush());
+    CheckCoins(db, expected);
+}
+
+BOOST_AUTO_TEST_CASE(coinsdb_async_flush)
+{
+    CCoinsViewDB dbAsync(1 << 20, true, false, COINS_DB_PER_OUTPOINT);
+    CCoinsViewDB dbSync(1 << 20, true, false, COINS_DB_PER_OUTPOINT);
+    CCoinsViewFlusher flusherAsync(&dbAsync, true);
+    CCoinsViewFlusher flusherSync(&dbSync, false);
+
+    CoinsMap expected;
+    for (int round = 0; round < 10; round++) {
+        CCoinsViewCache viewAsync(&flusherAsync);
+        CCoinsViewCache viewSync(&flusherSync);
+        std::vector<CCoinsViewCache*> views;
+        views.push_back(&viewAsync);
+        views.push_back(&viewSync);
+        RandomChanges(views, expected);
+        uint256 hashBlock = GetRandHash();
+        viewAsync.SetBestBlock(hashBlock);
+        viewSync.SetBestBlock(hashBlock);
+        BOOST_CHECK(viewAsync.Flush());
+        BOOST_CHECK(viewSync.Flush());
+        BOOST_CHECK(!flusherSync.IsWriting());
+
+        // Whether or not the write is done, the flusher shows its result.
+        BOOST_CHECK(flusherAsync.GetBestBlock() == hashBlock);
+        CheckCoins(flusherAsync, expected);
+
+        // Once written, the database has it all.
+        BOOST_CHECK(flusherAsync.Wait());
+        BOOST_CHECK(!flusherAsync.IsWriting());
+        BOOST_CHECK(dbAsync.GetBestBlock() == hashBlock);
+        CheckCoins(dbAsync, expected);
+        CheckCoins(dbSync, expected);
+    }
+    BOOST_CHECK_EQUAL(flusherAsync.GetWriteCount(), 10U);
+    BOOST_CHECK_EQUAL(flusherSync.GetWriteCount(), 10U);
+}
+
+BOOST_AUTO_TEST_CASE(coinsdb_batch_read)
+{
+    CCoinsViewDB dbTxid(1 << 20, true, false, COINS_DB_PER_TXID);
+    CCoinsViewDB dbOutpoint(1 << 20, true, false, COINS_DB_PER_OUTPOINT);
+    CCoinsViewDB dbAsync(1 << 20, true, false, COINS_DB_PER_OUTPOINT);
+    CCoinsViewFlusher flusher(&dbAsync, true);
+
+    CoinsMap expected;
+    for (int round = 0; round < 5; round++) {
+        CCoinsViewCache viewTxid(&dbTxid);
+        CCoinsViewCache viewOutpoint(&dbOutpoint);
+        CCoinsViewCache viewAsync(&flusher);
+        std::vector<CCoinsViewCache*> views;
+        views.push_back(&viewTxid);
+        views.push_back(&viewOutpoint);
+        views.push_back(&viewAsync);
+        RandomChanges(views, expected);
+        uint256 hashBlock = GetRandHash();
+        for (size_t v = 0; v < views.size(); v++) {
+            views[v]->SetBestBlock(hashBlock);
+            BOOST_CHECK(views[v]->Flush());
+        }
+
+        CheckBatchRead(dbTxid, expected);
+        CheckBatchRead(dbOutpoint, expected);
+        // Whether or not it is still being written.
+        CheckBatchRead(flusher, expected);
+
+        // Prefetched txids are all in the cache afterwards, once each, with
+        // the ones the database does not have as empty entries.
+        CCoinsViewCache view(&dbOutpoint);
+        std::vector<uint256> vTxid;
+        for (CoinsMap::const_iterator it = expected.begin(); it != expected.end(); it++)
+            vTxid.push_back(it->first);
+        vTxid.push_back(vTxid.front());
+        uint256 txidUnknown = GetRandHash();
+        vTxid.push_back(txidUnknown);
+        view.Prefetch(vTxid);
+        BOOST_CHECK_EQUAL(view.GetCacheSize(), expected.size() + 1);
+        for (CoinsMap::const_iterator it = expected.begin(); it != expected.end(); it++) {
+            const CCoins* coins = view.AccessCoins(it->first);
+            BOOST_CHECK(coins != NULL && coins->IsPruned() == it->second.IsPruned());
+            if (coins != NULL && !it->second.IsPruned())
+                BOOST_CHECK(*coins == it->second);
+        }
+        BOOST_CHECK(!view.HaveCoins(txidUnknown));
+        BOOST_CHECK_EQUAL(view.GetCacheSize(), expected.size() + 1);
+        CheckBatchRead(view, expected);
+
+        BOOST_CHECK(flusher.Wait());
+    }
+}
+
+BOOST_AUTO_TEST_CASE(coinsdb_txoutset_stats)
+{
+    CCoinsViewDB dbTxid(1 << 20, true, false, COINS_DB_PER_TXID);
+    CCoinsViewDB dbOutpoint(1 << 20, true, false, COINS_DB_PER_OUTPOINT);
+    uint256 hashBlock = chainActive.Tip()->GetBlockHash();
+
+    CoinsMap expected;
+    CTxOutSetStats statsBefore;
+    for (int round = 0; round < 5; round++) {
+        const leveldb::Snapshot* snapshot = dbOutpoint.GetSnapshot();
+
+        CCoinsViewCache viewTxid(&dbTxid);
+        CCoinsViewCache viewOutpoint(&dbOutpoint);
+        std::vector<CCoinsViewCache*> views;
+        views.push_back(&viewTxid);
+        views.push_back(&viewOutpoint);
+        RandomChanges(views, expected);
+        viewTxid.SetBestBlock(hashBlock);
+        viewOutpoint.SetBestBlock(hashBlock);
+        BOOST_CHECK(viewTxid.Flush());
+        BOOST_CHECK(viewOutpoint.Flush());
+
+        // Whatever the layout, and whatever order the outputs are added in.
+        CTxOutSetStats txouts;
+        for (CoinsMap::const_reverse_iterator it = expected.rbegin(); it != expected.rend(); it++) {
+            for (unsigned int n = 0; n < it->second.vout.size(); n++) {
+                if (!it->second.vout[n].IsNull())
+                    txouts.AddTxOut(COutPoint(it->first, n), it->second.vout[n]);
+            }
+        }
+        CCoinsStats statsTxid, statsOutpoint;
+        BOOST_CHECK(dbTxid.GetStats(statsTxid));
+        BOOST_CHECK(dbOutpoint.GetStats(statsOutpoint));
+        BOOST_CHECK(statsTxid.txouts == txouts);
+        BOOST_CHECK(statsOutpoint.txouts == txouts);
+        BOOST_CHECK_EQUAL(txouts.nTxOuts, (int64_t)statsOutpoint.nTransactionOutputs);
+        BOOST_CHECK_EQUAL(txouts.nTotalAmount, statsOutpoint.nTotalAmount);
+
+        // The snapshot still shows the database as it was before the flush.
+        CCoinsStats statsSnapshot;
+        BOOST_CHECK(dbOutpoint.GetStats(statsSnapshot, snapshot));
+        BOOST_CHECK(statsSnapshot.txouts == statsBefore);
+        BOOST_CHECK(statsSnapshot.hashBlock == (round == 0 ? uint256() : hashBlock));
+        dbOutpoint.ReleaseSnapshot(snapshot);
+        statsBefore = txouts;
+    }
+
+    // Removing what was added leaves nothing.
+    CTxOutSetStats txouts = statsBefore;
+    for (CoinsMap::const_iterator it = expected.begin(); it != expected.end(); it++) {
+        for (unsigned int n = 0; n < it->second.vout.size(); n++) {
+            if (!it->second.vout[n].IsNull())
+                txouts.RemoveTxOut(COutPoint(it->first, n), it->second.vout[n]);
+        }
+    }
+    BOOST_CHECK(txouts == CTxOutSetStats());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
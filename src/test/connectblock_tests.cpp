@@ -0,0 +1,188 @@
+// Copyright (c) 2015 The Bitcoin XT developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "chain.h"
+#include "coins.h"
+#include "consensus/validation.h"
+#include "main.h"
+#include "random.h"
+#include "utiltime.h"
+
+#include "test/test_bitcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(connectblock_tests, TestingSetup)
+
+static const int BLOCK_HEIGHT = 200;
+
+/** Blocks of anyone-can-spend transactions connected on top of a bare coins view. */
+struct BlockBuilder
+{
+    CCoinsView coinsDummy;
+    CCoinsViewCache coins;
+    CBlock block;
+    uint256 hashPrev;
+    CBlockIndex indexPrev;
+    CBlockIndex index;
+    bool fCheckpointsEnabledSaved;
+
+    BlockBuilder() : coins(&coinsDummy)
+    {
+        // Our made up heights are below the last checkpoint; check scripts anyway.
+        fCheckpointsEnabledSaved = fCheckpointsEnabled;
+        fCheckpointsEnabled = false;
+
+        CMutableTransaction coinbase;
+        coinbase.vin.resize(1);
+        coinbase.vin[0].scriptSig = CScript() << BLOCK_HEIGHT << OP_0;
+        coinbase.vout.resize(1);
+        coinbase.vout[0].scriptPubKey = CScript() << OP_TRUE;
+        coinbase.vout[0].nValue = 0;
+        block.vtx.push_back(coinbase);
+        block.nTime = GetTime();
+
+        hashPrev = GetRandHash();
+        coins.SetBestBlock(hashPrev);
+        indexPrev.phashBlock = &hashPrev;
+        indexPrev.nHeight = BLOCK_HEIGHT - 1;
+        index.pprev = &indexPrev;
+        index.nHeight = BLOCK_HEIGHT;
+        index.nTime = block.nTime;
+    }
+
+    ~BlockBuilder()
+    {
+        fCheckpointsEnabled = fCheckpointsEnabledSaved;
+    }
+
+    /** A coin confirmed at nHeight, outside of the block. */
+    COutPoint AddCoin(int nHeight, bool fCoinBase = false)
+    {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        if (!fCoinBase)
+            tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+        tx.vout.resize(1);
+        tx.vout[0].scriptPubKey = CScript() << OP_TRUE;
+        tx.vout[0].nValue = 50 * COIN;
+        coins.ModifyCoins(tx.GetHash())->FromTx(tx, nHeight);
+        return COutPoint(tx.GetHash(), 0);
+    }
+
+    COutPoint AddTx(const COutPoint& prevout)
+    {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout = prevout;
+        tx.vout.resize(1);
+        tx.vout[0].scriptPubKey = CScript() << OP_TRUE;
+        tx.vout[0].nValue = 1 * COIN;
+        block.vtx.push_back(tx);
+        return COutPoint(tx.GetHash(), 0);
+    }
+
+    /** Connect the block with the given number of script check threads. */
+    bool Connect(int nThreads, std::string& strReason)
+    {
+        int nScriptCheckThreadsSaved = nScriptCheckThreads;
+        nScriptCheckThreads = nThreads;
+        CCoinsViewCache view(&coins);
+        CValidationState state;
+        bool fOk;
+        {
+            LOCK(cs_main);
+            fOk = ConnectBlock(block, state, &index, view, true);
+        }
+        nScriptCheckThreads = nScriptCheckThreadsSaved;
+        BOOST_CHECK_EQUAL(fOk, state.IsValid());
+        strReason = state.GetRejectReason();
+        return fOk;
+    }
+
+    /** Check that the serial and the parallel code agree on the block. */
+    void CheckConnect(bool fExpected, const std::string& strExpected = "")
+    {
+        std::string strReason;
+        BOOST_CHECK_EQUAL(Connect(0, strReason), fExpected);
+        BOOST_CHECK_EQUAL(strReason, strExpected);
+        BOOST_CHECK_EQUAL(Connect(nScriptCheckThreads, strReason), fExpected);
+        BOOST_CHECK_EQUAL(strReason, strExpected);
+    }
+};
+
+BOOST_AUTO_TEST_CASE(connectblock_dependent_transactions)
+{
+    BlockBuilder builder;
+    for (int i = 0; i < 50; i++) {
+        COutPoint out = builder.AddTx(builder.AddCoin(1));
+        // A chain of spends within the block
+        for (int j = 0; j < i % 4; j++)
+            out = builder.AddTx(out);
+    }
+    builder.CheckConnect(true);
+}
+
+BOOST_AUTO_TEST_CASE(connectblock_double_spend_in_block)
+{
+    BlockBuilder builder;
+    COutPoint coin = builder.AddCoin(1);
+    COutPoint out = builder.AddTx(coin);
+    builder.AddTx(out);
+    builder.AddTx(coin);
+    builder.CheckConnect(false, "bad-txns-inputs-missingorspent");
+
+    BlockBuilder builder2;
+    out = builder2.AddTx(builder2.AddCoin(1));
+    builder2.AddTx(out);
+    builder2.AddTx(out);
+    builder2.CheckConnect(false, "bad-txns-inputs-missingorspent");
+}
+
+BOOST_AUTO_TEST_CASE(connectblock_spend_later_transaction)
+{
+    BlockBuilder builder;
+    COutPoint coin = builder.AddCoin(1);
+    builder.AddTx(COutPoint());
+    builder.AddTx(coin);
+    // Point the first transaction at the output of the second.
+    CMutableTransaction tx(builder.block.vtx[1]);
+    tx.vin[0].prevout = COutPoint(builder.block.vtx[2].GetHash(), 0);
+    builder.block.vtx[1] = tx;
+    builder.CheckConnect(false, "bad-txns-inputs-missingorspent");
+}
+
+BOOST_AUTO_TEST_CASE(connectblock_missing_and_immature_inputs)
+{
+    BlockBuilder builder;
+    builder.AddTx(builder.AddCoin(1));
+    builder.AddTx(COutPoint(GetRandHash(), 0));
+    builder.CheckConnect(false, "bad-txns-inputs-missingorspent");
+
+    BlockBuilder builder2;
+    builder2.AddTx(builder2.AddCoin(1));
+    builder2.AddTx(builder2.AddCoin(BLOCK_HEIGHT - 1, true));
+    builder2.CheckConnect(false, "bad-txns-premature-spend-of-coinbase");
+
+    BlockBuilder builder3;
+    builder3.AddTx(builder3.AddCoin(BLOCK_HEIGHT - COINBASE_MATURITY, true));
+    builder3.CheckConnect(true);
+}
+
+BOOST_AUTO_TEST_CASE(connectblock_bad_script)
+{
+    BlockBuilder builder;
+    for (int i = 0; i < 20; i++)
+        builder.AddTx(builder.AddCoin(1));
+    CMutableTransaction tx(builder.block.vtx[7]);
+    tx.vin[0].scriptSig = CScript() << OP_RETURN;
+    builder.block.vtx[7] = tx;
+
+    // Script failures found on the check queue carry no reject reason.
+    std::string strReason;
+    BOOST_CHECK(!builder.Connect(0, strReason));
+    BOOST_CHECK(!builder.Connect(nScriptCheckThreads, strReason));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
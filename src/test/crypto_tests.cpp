@@ -8,6 +8,7 @@
 #include "crypto/sha512.h"
 #include "crypto/hmac_sha256.h"
 #include "crypto/hmac_sha512.h"
+#include "hash.h"
 #include "random.h"
 #include "utilstrencodings.h"
 #include "test/test_bitcoin.h"
@@ -109,7 +110,7 @@ BOOST_AUTO_TEST_CASE(sha1_testvectors) {
     TestSHA1(test1, "b7755760681cbfd971451668f32af5774f4656b5");
 }
 
-BOOST_AUTO_TEST_CASE(sha256_testvectors) {
+static void TestSHA256Vectors() {
     TestSHA256("", "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855");
     TestSHA256("abc", "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
     TestSHA256("message digest",
@@ -131,6 +132,35 @@ BOOST_AUTO_TEST_CASE(sha256_testvectors) {
     TestSHA256(test1, "a316d55510b49662420f49d145d42fb83f31ef8dc016aa4e32df049991a91e26");
 }
 
+//! SHA256AutoDetect masks covering each implementation on its own.
+static const int sha256Impls[] = {0, SHA256_IMPL_SSE41, SHA256_IMPL_AVX2, SHA256_IMPL_SHANI, SHA256_IMPL_ALL};
+
+BOOST_AUTO_TEST_CASE(sha256_testvectors) {
+    for (size_t i = 0; i < sizeof(sha256Impls) / sizeof(sha256Impls[0]); i++) {
+        BOOST_TEST_MESSAGE("Testing SHA256 implementation " << SHA256AutoDetect(sha256Impls[i]));
+        TestSHA256Vectors();
+    }
+    SHA256AutoDetect();
+}
+
+BOOST_AUTO_TEST_CASE(sha256d64) {
+    for (size_t n = 0; n < sizeof(sha256Impls) / sizeof(sha256Impls[0]); n++) {
+        SHA256AutoDetect(sha256Impls[n]);
+        for (int i = 0; i <= 32; i++) {
+            // Odd counts exercise the tails left over by the multi-way code.
+            unsigned char in[64 * 32];
+            unsigned char out1[32 * 32], out2[32 * 32];
+            for (int j = 0; j < 64 * i; j++)
+                in[j] = insecure_rand();
+            for (int j = 0; j < i; j++)
+                CHash256().Write(in + 64 * j, 64).Finalize(out1 + 32 * j);
+            SHA256D64(out2, in, i);
+            BOOST_CHECK(memcmp(out1, out2, 32 * i) == 0);
+        }
+    }
+    SHA256AutoDetect();
+}
+
 BOOST_AUTO_TEST_CASE(sha512_testvectors) {
     TestSHA512("",
                "cf83e1357eefb8bdf1542850d66d8007d620e4050b5715dc83f4a921d36ce9ce"
@@ -3,6 +3,7 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "hash.h"
+#include "random.h"
 #include "utilstrencodings.h"
 #include "test/test_bitcoin.h"
 
@@ -47,4 +48,48 @@ BOOST_AUTO_TEST_CASE(murmurhash3)
 #undef T
 }
 
+BOOST_AUTO_TEST_CASE(murmurhash3_prepared)
+{
+    // Prepared data hashes the same as MurmurHash3, whatever its length
+    // and however many seeds are hashed at once.
+    for (unsigned int nSize = 0; nSize < 80; nSize++) {
+        std::vector<unsigned char> vData(nSize);
+        for (unsigned int i = 0; i < nSize; i++)
+            vData[i] = insecure_rand();
+        CMurmurHash3Data data(vData);
+
+        std::vector<uint32_t> vSeeds, vHashes;
+        for (unsigned int nCount = 0; nCount <= 2 * MURMURHASH3_LANES + 1; nCount++) {
+            vHashes.assign(nCount + 1, 0x5a5a5a5a);
+            data.Hash(vSeeds.empty() ? NULL : &vSeeds[0], &vHashes[0], nCount);
+            for (unsigned int i = 0; i < nCount; i++)
+                BOOST_CHECK_EQUAL(vHashes[i], MurmurHash3(vSeeds[i], vData));
+            // Nothing written past the last seed's hash
+            BOOST_CHECK_EQUAL(vHashes[nCount], 0x5a5a5a5a);
+            vSeeds.push_back(insecure_rand());
+        }
+        BOOST_CHECK_EQUAL(data.Hash(0xFBA4C795), MurmurHash3(0xFBA4C795, vData));
+    }
+
+    BOOST_CHECK_EQUAL(CMurmurHash3Data(ParseHex("")).Hash(0xFBA4C795), 0x6a396f08);
+    BOOST_CHECK_EQUAL(CMurmurHash3Data(ParseHex("001122")).Hash(0), 0x8eb51c3d);
+    BOOST_CHECK_EQUAL(CMurmurHash3Data(ParseHex("001122334455667788")).Hash(0), 0xb4698def);
+}
+
+BOOST_AUTO_TEST_CASE(siphash)
+{
+    CSipHasher hasher(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL);
+    BOOST_CHECK_EQUAL(hasher.Finalize(), 0x726fdb47dd0e0e31ull);
+    static const unsigned char t0[1] = {0};
+    hasher.Write(t0, 1);
+    BOOST_CHECK_EQUAL(hasher.Finalize(), 0x74f839c593dc67fdull);
+    static const unsigned char t1[7] = {1,2,3,4,5,6,7};
+    hasher.Write(t1, 7);
+    BOOST_CHECK_EQUAL(hasher.Finalize(), 0x93f5f5799a932462ull);
+    static const unsigned char t2[7] = {8,9,10,11,12,13,14};
+    hasher.Write(t2, 7);
+    // The example of the SipHash paper
+    BOOST_CHECK_EQUAL(hasher.Finalize(), 0xa129ca6149be45e5ull);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
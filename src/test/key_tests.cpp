@@ -188,4 +188,34 @@ BOOST_AUTO_TEST_CASE(key_test1)
     BOOST_CHECK(detsigc == ParseHex("2052d8a32079c11e79db95af63bb9600c5b04f21a9ca33dc129c2bfa8ac9dc1cd561d8ae5e0f6c1a16bde3719c64c2fd70e404b6428ab9a69566962e8771b5944d"));
 }
 
+BOOST_AUTO_TEST_CASE(key_verify_lax_der)
+{
+    // Signatures from before BIP66 need not be strict DER; they verify
+    // as long as OpenSSL would have parsed them.
+    CBitcoinSecret bsecret1;
+    BOOST_CHECK(bsecret1.SetString(strSecret1));
+    CPubKey pubkey1 = bsecret1.GetKey().GetPubKey();
+    string strMsg = "Very deterministic message";
+    uint256 hashMsg = Hash(strMsg.begin(), strMsg.end());
+    const std::string R = "5dbbddda71772d95ce91cd2d14b592cfbc1dd0aabd6a394b6c2d377bbe59d31d";
+    const std::string S = "14ddda21494a4e221f0824f0b8b924c43fa43c0ad57dccdaa11f81a6bd4582f6";
+
+    BOOST_CHECK(pubkey1.Verify(hashMsg, ParseHex("30440220" + R + "0220" + S)));
+    // Long form lengths
+    BOOST_CHECK(pubkey1.Verify(hashMsg, ParseHex("3081460281" "20" + R + "022100" + S)));
+    BOOST_CHECK(pubkey1.Verify(hashMsg, ParseHex("3084000000460282" "0020" + R + "0220" + S)));
+    // Excess padding
+    BOOST_CHECK(pubkey1.Verify(hashMsg, ParseHex("304602220000" + R + "0220" + S)));
+    // Garbage after the signature
+    BOOST_CHECK(pubkey1.Verify(hashMsg, ParseHex("30440220" + R + "0220" + S + "0102")));
+    // Not a sequence
+    BOOST_CHECK(!pubkey1.Verify(hashMsg, ParseHex("31440220" + R + "0220" + S)));
+    // Truncated
+    BOOST_CHECK(!pubkey1.Verify(hashMsg, ParseHex("30440220" + R + "0220" + S.substr(2))));
+    // R too large
+    BOOST_CHECK(!pubkey1.Verify(hashMsg, ParseHex("30450221ff" + R + "0220" + S)));
+    // Another message
+    BOOST_CHECK(!pubkey1.Verify(Hash(strMsg.begin(), strMsg.end() - 1), ParseHex("30440220" + R + "0220" + S)));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -101,4 +101,286 @@ BOOST_AUTO_TEST_CASE(MempoolRemoveTest)
     removed.clear();
 }
 
+BOOST_AUTO_TEST_CASE(MempoolAncestorStateTest)
+{
+    // A chain of three transactions, each paying a different fee
+    CMutableTransaction tx[3];
+    for (int i = 0; i < 3; i++)
+    {
+        tx[i].vin.resize(1);
+        tx[i].vin[0].scriptSig = CScript() << OP_11;
+        if (i > 0)
+            tx[i].vin[0].prevout = COutPoint(tx[i-1].GetHash(), 0);
+        tx[i].vout.resize(1);
+        tx[i].vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        tx[i].vout[0].nValue = 10000LL;
+    }
+    const CAmount nFee[3] = { 1000, 2000, 5000 };
+
+    CTxMemPool testPool(CFeeRate(0));
+    std::list<CTransaction> removed;
+    for (int i = 0; i < 3; i++)
+        testPool.addUnchecked(tx[i].GetHash(), CTxMemPoolEntry(tx[i], nFee[i], 0, 0.0, 1));
+
+    uint64_t nSize[3];
+    for (int i = 0; i < 3; i++)
+        nSize[i] = testPool.mapTx.find(tx[i].GetHash())->GetTxSize();
+
+    const CTxMemPoolEntry& grandChild = *testPool.mapTx.find(tx[2].GetHash());
+    BOOST_CHECK_EQUAL(grandChild.GetCountWithAncestors(), 3);
+    BOOST_CHECK_EQUAL(grandChild.GetSizeWithAncestors(), nSize[0] + nSize[1] + nSize[2]);
+    BOOST_CHECK_EQUAL(grandChild.GetModFeesWithAncestors(), 8000);
+    BOOST_CHECK_EQUAL(testPool.mapTx.find(tx[1].GetHash())->GetModFeesWithAncestors(), 3000);
+    const CTxMemPoolEntry& parent = *testPool.mapTx.find(tx[0].GetHash());
+    BOOST_CHECK_EQUAL(parent.GetCountWithDescendants(), 3);
+    BOOST_CHECK_EQUAL(parent.GetSizeWithDescendants(), nSize[0] + nSize[1] + nSize[2]);
+    BOOST_CHECK_EQUAL(parent.GetModFeesWithDescendants(), 8000);
+
+    // Fee deltas count for the transaction and all its descendants
+    testPool.PrioritiseTransaction(tx[0].GetHash(), tx[0].GetHash().ToString(), 0.0, 500);
+    BOOST_CHECK_EQUAL(testPool.mapTx.find(tx[0].GetHash())->GetModifiedFee(), 1500);
+    BOOST_CHECK_EQUAL(testPool.mapTx.find(tx[1].GetHash())->GetModFeesWithAncestors(), 3500);
+    BOOST_CHECK_EQUAL(grandChild.GetModFeesWithAncestors(), 8500);
+    BOOST_CHECK_EQUAL(parent.GetModFeesWithDescendants(), 8500);
+
+    // ... and for all its ancestors
+    testPool.PrioritiseTransaction(tx[2].GetHash(), tx[2].GetHash().ToString(), 0.0, 100);
+    BOOST_CHECK_EQUAL(parent.GetModFeesWithDescendants(), 8600);
+    BOOST_CHECK_EQUAL(testPool.mapTx.find(tx[1].GetHash())->GetModFeesWithDescendants(), 7100);
+    testPool.PrioritiseTransaction(tx[2].GetHash(), tx[2].GetHash().ToString(), 0.0, -100);
+
+    // The parent being mined leaves its descendants with smaller packages
+    testPool.remove(tx[0], removed, false);
+    BOOST_CHECK_EQUAL(removed.size(), 1);
+    removed.clear();
+    BOOST_CHECK_EQUAL(testPool.mapTx.find(tx[1].GetHash())->GetCountWithAncestors(), 1);
+    BOOST_CHECK_EQUAL(testPool.mapTx.find(tx[1].GetHash())->GetSizeWithAncestors(), nSize[1]);
+    BOOST_CHECK_EQUAL(grandChild.GetCountWithAncestors(), 2);
+    BOOST_CHECK_EQUAL(grandChild.GetSizeWithAncestors(), nSize[1] + nSize[2]);
+    BOOST_CHECK_EQUAL(grandChild.GetModFeesWithAncestors(), 7000);
+    BOOST_CHECK_EQUAL(testPool.mapTx.find(tx[1].GetHash())->GetCountWithDescendants(), 2);
+
+    // Returned to the pool by a reorg, it is again part of their packages
+    testPool.addUnchecked(tx[0].GetHash(), CTxMemPoolEntry(tx[0], nFee[0], 0, 0.0, 1));
+    BOOST_CHECK_EQUAL(testPool.mapTx.find(tx[0].GetHash())->GetModifiedFee(), 1500);
+    BOOST_CHECK_EQUAL(testPool.mapTx.find(tx[1].GetHash())->GetCountWithAncestors(), 2);
+    BOOST_CHECK_EQUAL(grandChild.GetCountWithAncestors(), 3);
+    BOOST_CHECK_EQUAL(grandChild.GetSizeWithAncestors(), nSize[0] + nSize[1] + nSize[2]);
+    BOOST_CHECK_EQUAL(grandChild.GetModFeesWithAncestors(), 8500);
+    BOOST_CHECK_EQUAL(testPool.mapTx.find(tx[0].GetHash())->GetCountWithDescendants(), 3);
+    BOOST_CHECK_EQUAL(testPool.mapTx.find(tx[0].GetHash())->GetModFeesWithDescendants(), 8500);
+
+    // Removing the middle transaction takes the grandchild with it
+    testPool.remove(tx[1], removed, true);
+    BOOST_CHECK_EQUAL(removed.size(), 2);
+    removed.clear();
+    BOOST_CHECK_EQUAL(testPool.size(), 1);
+    BOOST_CHECK_EQUAL(testPool.mapTx.find(tx[0].GetHash())->GetCountWithAncestors(), 1);
+    BOOST_CHECK_EQUAL(testPool.mapTx.find(tx[0].GetHash())->GetCountWithDescendants(), 1);
+    BOOST_CHECK_EQUAL(testPool.mapTx.find(tx[0].GetHash())->GetSizeWithDescendants(), nSize[0]);
+}
+
+/** A transaction spending prevout, paying nFee out of nValueIn; nOutputs pads its size. */
+static CMutableTransaction MakeTx(const COutPoint& prevout, CAmount nValueIn, CAmount nFee, int nOutputs = 1)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = prevout;
+    tx.vin[0].scriptSig = CScript() << OP_11;
+    tx.vout.resize(nOutputs);
+    for (int i = 0; i < nOutputs; i++) {
+        tx.vout[i].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        tx.vout[i].nValue = (nValueIn - nFee) / nOutputs;
+    }
+    return tx;
+}
+
+template<typename name>
+static std::vector<uint256> IndexOrder(const CTxMemPool& pool)
+{
+    std::vector<uint256> vOrder;
+    typename CTxMemPool::indexed_transaction_set::index<name>::type::const_iterator it;
+    for (it = pool.mapTx.get<name>().begin(); it != pool.mapTx.get<name>().end(); ++it)
+        vOrder.push_back(it->GetTx().GetHash());
+    return vOrder;
+}
+
+BOOST_AUTO_TEST_CASE(MempoolIndexingTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+
+    // Three unrelated transactions of the same size, entering in turn
+    CMutableTransaction tx1 = MakeTx(COutPoint(uint256S("01"), 0), 100000, 10000);
+    CMutableTransaction tx2 = MakeTx(COutPoint(uint256S("02"), 0), 100000, 20000);
+    CMutableTransaction tx3 = MakeTx(COutPoint(uint256S("03"), 0), 100000, 5000);
+    pool.addUnchecked(tx1.GetHash(), CTxMemPoolEntry(tx1, 10000, 100, 0.0, 1));
+    pool.addUnchecked(tx2.GetHash(), CTxMemPoolEntry(tx2, 20000, 300, 0.0, 1));
+    pool.addUnchecked(tx3.GetHash(), CTxMemPoolEntry(tx3, 5000, 200, 0.0, 1));
+
+    std::vector<uint256> vExpected;
+    vExpected.push_back(tx2.GetHash());
+    vExpected.push_back(tx1.GetHash());
+    vExpected.push_back(tx3.GetHash());
+    BOOST_CHECK(IndexOrder<mining_score>(pool) == vExpected);
+    BOOST_CHECK(IndexOrder<ancestor_score>(pool) == vExpected);
+    std::reverse(vExpected.begin(), vExpected.end());
+    BOOST_CHECK(IndexOrder<descendant_score>(pool) == vExpected);
+
+    vExpected.clear();
+    vExpected.push_back(tx1.GetHash());
+    vExpected.push_back(tx3.GetHash());
+    vExpected.push_back(tx2.GetHash());
+    BOOST_CHECK(IndexOrder<entry_time>(pool) == vExpected);
+
+    // A child paying well lifts tx3's package above tx1 for eviction, and
+    // the package above tx2 for mining.
+    CMutableTransaction tx4 = MakeTx(COutPoint(tx3.GetHash(), 0), 95000, 40000);
+    pool.addUnchecked(tx4.GetHash(), CTxMemPoolEntry(tx4, 40000, 400, 0.0, 1));
+    std::vector<uint256> vDescendant = IndexOrder<descendant_score>(pool);
+    BOOST_CHECK(vDescendant[0] == tx1.GetHash());
+    std::vector<uint256> vMining = IndexOrder<mining_score>(pool);
+    BOOST_CHECK(vMining[0] == tx4.GetHash());
+    std::vector<uint256> vAncestor = IndexOrder<ancestor_score>(pool);
+    BOOST_CHECK(vAncestor[0] == tx4.GetHash());
+    BOOST_CHECK(vAncestor[1] == tx2.GetHash());
+
+    // Prioritising moves a transaction in every fee index
+    pool.PrioritiseTransaction(tx1.GetHash(), tx1.GetHash().ToString(), 0.0, 100000);
+    BOOST_CHECK(IndexOrder<mining_score>(pool)[0] == tx1.GetHash());
+    BOOST_CHECK(IndexOrder<ancestor_score>(pool)[0] == tx1.GetHash());
+    BOOST_CHECK(IndexOrder<descendant_score>(pool).back() == tx1.GetHash());
+}
+
+BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    std::list<CTransaction> removed;
+
+    // Fee rates: txLow < txParent+txChild package < txHigh
+    CMutableTransaction txLow = MakeTx(COutPoint(uint256S("01"), 0), 100000, 1000, 10);
+    CMutableTransaction txParent = MakeTx(COutPoint(uint256S("02"), 0), 100000, 1000, 10);
+    CMutableTransaction txChild = MakeTx(COutPoint(txParent.GetHash(), 0), 9900, 9000, 10);
+    CMutableTransaction txHigh = MakeTx(COutPoint(uint256S("03"), 0), 100000, 50000, 10);
+    pool.addUnchecked(txLow.GetHash(), CTxMemPoolEntry(txLow, 1000, 0, 0.0, 1));
+    pool.addUnchecked(txParent.GetHash(), CTxMemPoolEntry(txParent, 1000, 0, 0.0, 1));
+    pool.addUnchecked(txChild.GetHash(), CTxMemPoolEntry(txChild, 9000, 0, 0.0, 1));
+    pool.addUnchecked(txHigh.GetHash(), CTxMemPoolEntry(txHigh, 50000, 0, 0.0, 1));
+    const uint64_t nTxSize = pool.mapTx.find(txLow.GetHash())->GetTxSize();
+    BOOST_CHECK_EQUAL(pool.GetTotalTxSize(), 4 * nTxSize);
+    BOOST_CHECK_EQUAL(pool.GetMinFee(1).GetFeePerK(), 0);
+
+    // Under the limit nothing goes
+    pool.TrimToSize(pool.GetTotalTxSize(), removed);
+    BOOST_CHECK_EQUAL(pool.size(), 4);
+
+    // The cheapest package goes first, and sets the fee to get in
+    pool.TrimToSize(pool.GetTotalTxSize() - 1, removed);
+    BOOST_CHECK_EQUAL(removed.size(), 1);
+    BOOST_CHECK(removed.front().GetHash() == txLow.GetHash());
+    BOOST_CHECK(!pool.exists(txLow.GetHash()));
+    const CFeeRate minFee = pool.GetMinFee(1);
+    BOOST_CHECK(minFee > CFeeRate(1000, nTxSize));
+    removed.clear();
+
+    // Then the parent is evicted together with the child paying for it
+    pool.TrimToSize(nTxSize, removed);
+    BOOST_CHECK_EQUAL(removed.size(), 2);
+    BOOST_CHECK_EQUAL(pool.size(), 1);
+    BOOST_CHECK(pool.exists(txHigh.GetHash()));
+    BOOST_CHECK(pool.GetMinFee(1) > minFee);
+    removed.clear();
+
+    // Prioritised transactions are never evicted
+    pool.PrioritiseTransaction(txHigh.GetHash(), txHigh.GetHash().ToString(), 1.0, 0);
+    pool.TrimToSize(0, removed);
+    BOOST_CHECK(removed.empty());
+    BOOST_CHECK(pool.exists(txHigh.GetHash()));
+
+    // Trimming goes on past them, evicting everything else in one go
+    CMutableTransaction txKept = MakeTx(COutPoint(uint256S("04"), 0), 100000, 1000, 10);
+    CMutableTransaction txA = MakeTx(COutPoint(uint256S("05"), 0), 100000, 2000, 10);
+    CMutableTransaction txB = MakeTx(COutPoint(uint256S("06"), 0), 100000, 3000, 10);
+    pool.addUnchecked(txKept.GetHash(), CTxMemPoolEntry(txKept, 1000, 0, 0.0, 1));
+    pool.addUnchecked(txA.GetHash(), CTxMemPoolEntry(txA, 2000, 0, 0.0, 1));
+    pool.addUnchecked(txB.GetHash(), CTxMemPoolEntry(txB, 3000, 0, 0.0, 1));
+    pool.PrioritiseTransaction(txKept.GetHash(), txKept.GetHash().ToString(), 1.0, 0);
+    pool.TrimToSize(0, removed);
+    BOOST_CHECK_EQUAL(removed.size(), 2);
+    BOOST_CHECK_EQUAL(pool.size(), 2);
+    BOOST_CHECK(pool.exists(txKept.GetHash()));
+    BOOST_CHECK(pool.exists(txHigh.GetHash()));
+    removed.clear();
+
+    // The minimum fee decays only after a block, and quicker in an emptier pool
+    const int64_t nStart = GetTime();
+    SetMockTime(nStart + 42 * 60 * 60);
+    BOOST_CHECK(pool.GetMinFee(1) > minFee);
+    std::vector<CTransaction> vtx;
+    std::list<CTransaction> conflicts;
+    pool.removeForBlock(vtx, 2, conflicts);
+    const CFeeRate minFeeAfterBlock = pool.GetMinFee(10 * pool.GetTotalTxSize());
+    SetMockTime(nStart + 42 * 60 * 60 + CTxMemPool::ROLLING_FEE_HALFLIFE / 4 + 1);
+    BOOST_CHECK(pool.GetMinFee(10 * pool.GetTotalTxSize()).GetFeePerK() < minFeeAfterBlock.GetFeePerK() * 6 / 10);
+    SetMockTime(nStart + 1000 * 60 * 60);
+    BOOST_CHECK_EQUAL(pool.GetMinFee(10 * pool.GetTotalTxSize()).GetFeePerK(), 0);
+    SetMockTime(0);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolExpireTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    std::list<CTransaction> removed;
+
+    CMutableTransaction txOld = MakeTx(COutPoint(uint256S("01"), 0), 100000, 1000);
+    CMutableTransaction txChild = MakeTx(COutPoint(txOld.GetHash(), 0), 99000, 1000);
+    CMutableTransaction txNew = MakeTx(COutPoint(uint256S("02"), 0), 100000, 1000);
+    pool.addUnchecked(txOld.GetHash(), CTxMemPoolEntry(txOld, 1000, 100, 0.0, 1));
+    pool.addUnchecked(txChild.GetHash(), CTxMemPoolEntry(txChild, 1000, 300, 0.0, 1));
+    pool.addUnchecked(txNew.GetHash(), CTxMemPoolEntry(txNew, 1000, 200, 0.0, 1));
+
+    // Expiring a transaction takes its descendants, however new
+    BOOST_CHECK_EQUAL(pool.Expire(100, removed), 0);
+    BOOST_CHECK_EQUAL(pool.Expire(150, removed), 2);
+    BOOST_CHECK_EQUAL(pool.size(), 1);
+    BOOST_CHECK(pool.exists(txNew.GetHash()));
+}
+
+BOOST_AUTO_TEST_CASE(MempoolChainLimitTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    LOCK(pool.cs);
+
+    // A chain of five transactions, each spending the one before
+    std::vector<CMutableTransaction> vtx;
+    vtx.push_back(MakeTx(COutPoint(uint256S("01"), 0), 100000, 1000, 2));
+    for (int i = 1; i < 5; i++)
+        vtx.push_back(MakeTx(COutPoint(vtx.back().GetHash(), 0), 40000, 1000, 2));
+    for (size_t i = 0; i < vtx.size(); i++)
+        pool.addUnchecked(vtx[i].GetHash(), CTxMemPoolEntry(vtx[i], 1000, 0, 0.0, 1));
+    const uint64_t nTxSize = pool.mapTx.find(vtx[0].GetHash())->GetTxSize();
+
+    // A child of the last one has five ancestors, and makes six descendants of the first.
+    CMutableTransaction txChild = MakeTx(COutPoint(vtx.back().GetHash(), 0), 10000, 1000);
+    std::set<uint256> setAncestors;
+    std::string errString;
+    BOOST_CHECK(pool.CalculateMemPoolAncestors(txChild, nTxSize, setAncestors, 6, 6 * nTxSize, 6, 6 * nTxSize, errString));
+    BOOST_CHECK_EQUAL(setAncestors.size(), 5);
+
+    setAncestors.clear();
+    BOOST_CHECK(!pool.CalculateMemPoolAncestors(txChild, nTxSize, setAncestors, 5, 100 * nTxSize, 100, 100 * nTxSize, errString));
+    setAncestors.clear();
+    BOOST_CHECK(!pool.CalculateMemPoolAncestors(txChild, nTxSize, setAncestors, 100, 5 * nTxSize, 100, 100 * nTxSize, errString));
+    setAncestors.clear();
+    BOOST_CHECK(!pool.CalculateMemPoolAncestors(txChild, nTxSize, setAncestors, 100, 100 * nTxSize, 5, 100 * nTxSize, errString));
+    setAncestors.clear();
+    BOOST_CHECK(!pool.CalculateMemPoolAncestors(txChild, nTxSize, setAncestors, 100, 100 * nTxSize, 100, 5 * nTxSize, errString));
+
+    // A sibling spending the first one's other output only adds to its descendants.
+    CMutableTransaction txSibling = MakeTx(COutPoint(vtx[0].GetHash(), 1), 40000, 1000);
+    setAncestors.clear();
+    BOOST_CHECK(pool.CalculateMemPoolAncestors(txSibling, nTxSize, setAncestors, 2, 100 * nTxSize, 6, 100 * nTxSize, errString));
+    setAncestors.clear();
+    BOOST_CHECK(!pool.CalculateMemPoolAncestors(txSibling, nTxSize, setAncestors, 2, 100 * nTxSize, 5, 100 * nTxSize, errString));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
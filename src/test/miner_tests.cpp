@@ -6,8 +6,11 @@
 #include "main.h"
 #include "miner.h"
 #include "pubkey.h"
+#include "random.h"
+#include "txoutsetstats.h"
 #include "uint256.h"
 #include "util.h"
+#include "validationinterface.h"
 
 #include "test/test_bitcoin.h"
 
@@ -50,6 +53,23 @@ struct {
     {2, 0xbbbeb305}, {2, 0xfe1c810a},
 };
 
+/** The UTXO set statistics kept up to date agree with a pass over the coin database. */
+static void CheckTxOutSetStats()
+{
+    CTxOutSetStats txouts;
+    uint256 hashBlock;
+    int nHeight;
+    BOOST_CHECK(txoutsetstats.Get(txouts, hashBlock, nHeight));
+    BOOST_CHECK(hashBlock == chainActive.Tip()->GetBlockHash());
+    BOOST_CHECK_EQUAL(nHeight, chainActive.Height());
+    BOOST_CHECK_EQUAL(txouts.nTxOuts, chainActive.Height());
+
+    FlushStateToDisk();
+    CCoinsStats stats;
+    BOOST_CHECK(pcoinsTip->GetStats(stats));
+    BOOST_CHECK(txouts == stats.txouts);
+}
+
 // NOTE: These tests rely on CreateNewBlock doing its own self-validation!
 BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
 {
@@ -65,6 +85,12 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
     // Simple block creation, nothing special yet:
     BOOST_CHECK(pblocktemplate = CreateNewBlock(scriptPubKey));
 
+    // Keep the UTXO set statistics up to date from here on.
+    FlushStateToDisk();
+    const leveldb::Snapshot* snapshot = InitTxOutSetStats(pcoinsdbview);
+    if (snapshot)
+        ThreadTxOutSetStats(pcoinsdbview, snapshot);
+
     // We can't make transactions until we have inputs
     // Therefore, load 100 blocks :)
     std::vector<CTransaction*>txFirst;
@@ -90,6 +116,20 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
     }
     delete pblocktemplate;
 
+    // The UTXO set statistics kept up to date follow blocks connected and
+    // disconnected. Each block adds the one output of its coinbase.
+    CheckTxOutSetStats();
+    CBlockIndex* pindexTip = chainActive.Tip();
+    {
+        CValidationState state;
+        BOOST_CHECK(InvalidateBlock(state, pindexTip));
+        CheckTxOutSetStats();
+        BOOST_CHECK(ReconsiderBlock(state, pindexTip));
+        BOOST_CHECK(ActivateBestChain(state));
+        BOOST_CHECK(chainActive.Tip() == pindexTip);
+        CheckTxOutSetStats();
+    }
+
     // Just to make sure we can still make simple blocks
     BOOST_CHECK(pblocktemplate = CreateNewBlock(scriptPubKey));
     delete pblocktemplate;
@@ -179,7 +219,7 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
     hash = tx.GetHash();
     mempool.addUnchecked(hash, CTxMemPoolEntry(tx, 11, GetTime(), 111.0, 11));
     tx.vin[0].prevout.hash = hash;
-    tx.vin[0].scriptSig = CScript() << (std::vector<unsigned char>)script;
+    tx.vin[0].scriptSig = CScript() << ToByteVector(script);
     tx.vout[0].nValue -= 1000000;
     hash = tx.GetHash();
     mempool.addUnchecked(hash, CTxMemPoolEntry(tx, 11, GetTime(), 111.0, 11));
@@ -201,6 +241,38 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
     delete pblocktemplate;
     mempool.clear();
 
+    // child pays for parent, while a free transaction on its own stays out
+    mapArgs["-blockprioritysize"] = "0";
+    CMutableTransaction txParent, txChild, txFree;
+    txParent.vin.resize(1);
+    txParent.vin[0].prevout = COutPoint(txFirst[0]->GetHash(), 0);
+    txParent.vin[0].scriptSig = CScript() << OP_1;
+    txParent.vout.resize(1);
+    txParent.vout[0].nValue = 5000000000LL;
+    txParent.vout[0].scriptPubKey = CScript() << OP_1;
+    mempool.addUnchecked(txParent.GetHash(), CTxMemPoolEntry(txParent, 0, GetTime(), 111.0, 11));
+    txChild.vin.resize(1);
+    txChild.vin[0].prevout = COutPoint(txParent.GetHash(), 0);
+    txChild.vin[0].scriptSig = CScript() << OP_1;
+    txChild.vout.resize(1);
+    txChild.vout[0].nValue = 4990000000LL;
+    txChild.vout[0].scriptPubKey = CScript() << OP_1;
+    mempool.addUnchecked(txChild.GetHash(), CTxMemPoolEntry(txChild, 10000000LL, GetTime(), 111.0, 11));
+    txFree.vin.resize(1);
+    txFree.vin[0].prevout = COutPoint(txFirst[1]->GetHash(), 0);
+    txFree.vin[0].scriptSig = CScript() << OP_1;
+    txFree.vout.resize(1);
+    txFree.vout[0].nValue = 5000000000LL;
+    txFree.vout[0].scriptPubKey = CScript() << OP_1;
+    mempool.addUnchecked(txFree.GetHash(), CTxMemPoolEntry(txFree, 0, GetTime(), 111.0, 11));
+    BOOST_CHECK(pblocktemplate = CreateNewBlock(scriptPubKey));
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 3);
+    BOOST_CHECK(pblocktemplate->block.vtx[1].GetHash() == txParent.GetHash());
+    BOOST_CHECK(pblocktemplate->block.vtx[2].GetHash() == txChild.GetHash());
+    delete pblocktemplate;
+    mapArgs.erase("-blockprioritysize");
+    mempool.clear();
+
     // subsidy changing
     int nHeight = chainActive.Height();
     chainActive.Tip()->nHeight = 209999;
@@ -268,4 +340,62 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
     fCheckpointsEnabled = true;
 }
 
+BOOST_AUTO_TEST_CASE(LiveBlockTemplate_updates)
+{
+    CLiveBlockTemplate live;
+    RegisterValidationInterface(&live);
+    LOCK(cs_main);
+
+    unsigned int nTransactionsUpdated;
+    boost::shared_ptr<const CBlockTemplate> ptemplate = live.Get(nTransactionsUpdated);
+    BOOST_CHECK_EQUAL(ptemplate->block.vtx.size(), 1);
+    BOOST_CHECK(ptemplate->block.hashPrevBlock == chainActive.Tip()->GetBlockHash());
+    // Nothing changed, nothing to copy
+    BOOST_CHECK(live.Get(nTransactionsUpdated) == ptemplate);
+
+    // A confirmed coin to spend
+    CMutableTransaction txFunding;
+    txFunding.vin.resize(1);
+    txFunding.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    txFunding.vout.resize(1);
+    txFunding.vout[0].nValue = 5000000000LL;
+    txFunding.vout[0].scriptPubKey = CScript() << OP_1;
+    pcoinsTip->ModifyCoins(txFunding.GetHash())->FromTx(txFunding, 0);
+
+    // A transaction entering the mempool is appended, and so is its child
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(txFunding.GetHash(), 0);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 4990000000LL;
+    tx.vout[0].scriptPubKey = CScript() << OP_1;
+    CTransaction txParent(tx);
+    mempool.addUnchecked(txParent.GetHash(), CTxMemPoolEntry(txParent, 10000000LL, GetTime(), 0.0, 0));
+    SyncWithWallets(txParent, NULL);
+
+    tx.vin[0].prevout = COutPoint(txParent.GetHash(), 0);
+    tx.vout[0].nValue = 4980000000LL;
+    CTransaction txChild(tx);
+    mempool.addUnchecked(txChild.GetHash(), CTxMemPoolEntry(txChild, 10000000LL, GetTime(), 0.0, 0));
+    SyncWithWallets(txChild, NULL);
+
+    ptemplate = live.Get(nTransactionsUpdated);
+    BOOST_CHECK_EQUAL(nTransactionsUpdated, mempool.GetTransactionsUpdated());
+    BOOST_REQUIRE_EQUAL(ptemplate->block.vtx.size(), 3);
+    BOOST_CHECK(ptemplate->block.vtx[1].GetHash() == txParent.GetHash());
+    BOOST_CHECK(ptemplate->block.vtx[2].GetHash() == txChild.GetHash());
+    BOOST_CHECK_EQUAL(ptemplate->vTxFees[0], -20000000LL);
+    BOOST_CHECK_EQUAL(ptemplate->block.vtx[0].vout[0].nValue, 20000000LL + GetBlockSubsidy(1, Params().GetConsensus()));
+
+    // A free transaction isn't worth adding
+    tx.vin[0].prevout = COutPoint(txChild.GetHash(), 0);
+    CTransaction txFree(tx);
+    mempool.addUnchecked(txFree.GetHash(), CTxMemPoolEntry(txFree, 0, GetTime(), 0.0, 0));
+    SyncWithWallets(txFree, NULL);
+    BOOST_CHECK(live.Get(nTransactionsUpdated) == ptemplate);
+
+    UnregisterValidationInterface(&live);
+    mempool.clear();
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,129 @@
+// Copyright (c) 2015 The Bitcoin XT developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+//
+// Unit tests for the message handler threads
+//
+
+#include "chainparams.h"
+#include "compat.h"
+#include "net.h"
+#include "protocol.h"
+#include "streams.h"
+#include "tinyformat.h"
+#include "utiltime.h"
+
+#include "test/test_bitcoin.h"
+
+#include <boost/foreach.hpp>
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(msghandler_tests, TestingSetup)
+
+#ifndef WIN32
+
+static void ReceivePing(CNode* pnode, uint64_t nonce)
+{
+    CDataStream s(SER_NETWORK, PROTOCOL_VERSION);
+    s << CMessageHeader(Params().MessageStart(), "ping", 0);
+    s << nonce;
+    CNetMessage::FinalizeHeader(s);
+
+    LOCK(pnode->cs_vRecvMsg);
+    BOOST_CHECK(pnode->ReceiveMsgBytes(&s[0], s.size()));
+}
+
+static bool HasPendingMessages(CNode* pnode)
+{
+    LOCK(pnode->cs_vRecvMsg);
+    return !pnode->vRecvMsg.empty();
+}
+
+/** The nonces of the pongs sent to the other end of a connection, in order. */
+static std::vector<uint64_t> ReceivedPongs(SOCKET hSocket)
+{
+    CDataStream s(SER_NETWORK, PROTOCOL_VERSION);
+    char buf[4096];
+    int nBytes;
+    while ((nBytes = recv(hSocket, buf, sizeof(buf), MSG_DONTWAIT)) > 0)
+        s.write(buf, nBytes);
+
+    std::vector<uint64_t> vNonces;
+    while (!s.empty()) {
+        CMessageHeader hdr(Params().MessageStart());
+        s >> hdr;
+        CDataStream payload(s.begin(), s.begin() + hdr.nMessageSize, SER_NETWORK, PROTOCOL_VERSION);
+        s.ignore(hdr.nMessageSize);
+        if (hdr.GetCommand() == "pong") {
+            uint64_t nonce;
+            payload >> nonce;
+            vNonces.push_back(nonce);
+        }
+    }
+    return vNonces;
+}
+
+BOOST_AUTO_TEST_CASE(handlers_keep_peer_order)
+{
+    const int nPeers = 16;
+    const int nPings = 50;
+
+    // Each peer is connected to a socket the test reads its replies from.
+    std::vector<CNode*> vPeers;
+    std::vector<SOCKET> vRemote;
+    for (int i = 0; i < nPeers; i++) {
+        int sockets[2];
+        BOOST_REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == 0);
+        vRemote.push_back(sockets[1]);
+        CNode* pnode = new CNode(sockets[0], CAddress(CService(strprintf("10.0.0.%d", i + 1), 8333), NODE_NETWORK));
+        pnode->nVersion = PROTOCOL_VERSION;
+        pnode->fClient = true;
+        vPeers.push_back(pnode);
+    }
+    {
+        LOCK(cs_vNodes);
+        vNodes.insert(vNodes.end(), vPeers.begin(), vPeers.end());
+    }
+
+    boost::thread_group handlers;
+    for (int i = 0; i < 4; i++)
+        handlers.create_thread(boost::bind(&ThreadMessageHandler, i));
+
+    // Every peer sends its pings numbered from 1, while the handlers run.
+    for (int n = 1; n <= nPings; n++)
+        BOOST_FOREACH(CNode* pnode, vPeers)
+            ReceivePing(pnode, n);
+
+    int64_t nTimeout = GetTime() + 60;
+    for (size_t i = 0; i < vPeers.size() && GetTime() < nTimeout; ) {
+        if (HasPendingMessages(vPeers[i]))
+            MilliSleep(1);
+        else
+            i++;
+    }
+
+    handlers.interrupt_all();
+    handlers.join_all();
+
+    // Each peer got all its pongs, in the order of its pings.
+    BOOST_FOREACH(SOCKET hSocket, vRemote) {
+        std::vector<uint64_t> vNonces = ReceivedPongs(hSocket);
+        BOOST_CHECK_EQUAL(vNonces.size(), (size_t)nPings);
+        for (size_t n = 0; n < vNonces.size(); n++)
+            BOOST_CHECK_EQUAL(vNonces[n], (uint64_t)(n + 1));
+    }
+
+    {
+        LOCK(cs_vNodes);
+        vNodes.erase(vNodes.end() - nPeers, vNodes.end());
+    }
+    BOOST_FOREACH(CNode* pnode, vPeers)
+        delete pnode;
+    BOOST_FOREACH(SOCKET hSocket, vRemote)
+        CloseSocket(hSocket);
+}
+#endif // WIN32
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,60 @@
+// Copyright (c) 2015 The Bitcoin XT developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+//
+// Unit tests for announcing inventory to peers
+//
+
+#include "net.h"
+#include "random.h"
+
+#include "test/test_bitcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(net_tests, BasicTestingSetup)
+
+BOOST_AUTO_TEST_CASE(poisson_next_send)
+{
+    int64_t nNow = 1000000000000LL;
+    int64_t nTotal = 0;
+    static const int COUNT = 10000;
+    for (int i = 0; i < COUNT; i++) {
+        int64_t nNext = PoissonNextSend(nNow, INVENTORY_BROADCAST_INTERVAL);
+        BOOST_CHECK(nNext >= nNow);
+        nTotal += nNext - nNow;
+    }
+    // The mean delay is within a few percent of the interval.
+    double dMean = (double)nTotal / COUNT / 1000000;
+    BOOST_CHECK(dMean > INVENTORY_BROADCAST_INTERVAL * 0.9);
+    BOOST_CHECK(dMean < INVENTORY_BROADCAST_INTERVAL * 1.1);
+}
+
+BOOST_AUTO_TEST_CASE(inventory_known)
+{
+    CAddress addr(CService("1.2.3.4", 8333));
+    CNode node(INVALID_SOCKET, addr, "", true);
+
+    // Inventory the peer announced is not announced back.
+    CInv inv1(MSG_TX, GetRandHash());
+    BOOST_CHECK(node.AddInventoryKnown(inv1));
+    BOOST_CHECK(!node.AddInventoryKnown(inv1));
+    node.PushInventory(inv1);
+    BOOST_CHECK(node.vInventoryToSend.empty());
+
+    CInv inv2(MSG_BLOCK, GetRandHash());
+    node.PushInventory(inv2);
+    BOOST_CHECK_EQUAL(node.vInventoryToSend.size(), 1);
+
+    // The peer is remembered to know the last INVENTORY_KNOWN_SIZE items.
+    std::vector<CInv> vInv;
+    for (unsigned int i = 0; i < INVENTORY_KNOWN_SIZE; i++) {
+        vInv.push_back(CInv(MSG_TX, GetRandHash()));
+        BOOST_CHECK(node.AddInventoryKnown(vInv.back()));
+    }
+    BOOST_FOREACH(const CInv& inv, vInv)
+        BOOST_CHECK(!node.AddInventoryKnown(inv));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
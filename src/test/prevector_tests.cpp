@@ -0,0 +1,223 @@
+// Copyright (c) 2015 The Bitcoin XT developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "prevector.h"
+#include "random.h"
+#include "script/script.h"
+#include "serialize.h"
+#include "streams.h"
+#include "version.h"
+
+#include "test/test_bitcoin.h"
+
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(prevector_tests, BasicTestingSetup)
+
+typedef prevector<8, int> pretype;
+typedef std::vector<int> realtype;
+
+/** Apply every operation to a prevector and a std::vector, and check they stay the same */
+class prevector_tester
+{
+    realtype real_vector;
+    pretype pre_vector;
+
+    void test() {
+        const pretype& const_pre_vector = pre_vector;
+        BOOST_REQUIRE_EQUAL(real_vector.size(), pre_vector.size());
+        BOOST_CHECK_EQUAL(real_vector.empty(), pre_vector.empty());
+        BOOST_CHECK(pre_vector.capacity() >= pre_vector.size());
+        for (size_t s = 0; s < real_vector.size(); s++) {
+            BOOST_CHECK_EQUAL(real_vector[s], pre_vector[s]);
+            BOOST_CHECK(&(pre_vector[s]) == &(pre_vector.begin()[s]));
+            BOOST_CHECK(&(pre_vector[s]) == &*(pre_vector.begin() + s));
+        }
+        BOOST_CHECK(const_pre_vector.end() - const_pre_vector.begin() == (int)real_vector.size());
+
+        pretype copy(pre_vector);
+        BOOST_CHECK(copy == pre_vector);
+        pretype assigned;
+        assigned = pre_vector;
+        BOOST_CHECK(assigned == pre_vector);
+        pretype fromreal(real_vector.begin(), real_vector.end());
+        BOOST_CHECK(fromreal == pre_vector);
+
+        CDataStream ss1(SER_DISK, 0);
+        CDataStream ss2(SER_DISK, 0);
+        ss1 << real_vector;
+        ss2 << pre_vector;
+        BOOST_CHECK_EQUAL(ss1.size(), ss2.size());
+        BOOST_CHECK(std::equal(ss1.begin(), ss1.end(), ss2.begin()));
+        pretype unserialized;
+        ss2 >> unserialized;
+        BOOST_CHECK(unserialized == pre_vector);
+    }
+
+public:
+    void resize(size_t s) {
+        real_vector.resize(s);
+        pre_vector.resize(s);
+        test();
+    }
+
+    void reserve(size_t s) {
+        real_vector.reserve(s);
+        pre_vector.reserve(s);
+        BOOST_CHECK(pre_vector.capacity() >= s);
+        test();
+    }
+
+    void insert(size_t position, const int& value) {
+        real_vector.insert(real_vector.begin() + position, value);
+        pre_vector.insert(pre_vector.begin() + position, value);
+        test();
+    }
+
+    void insert(size_t position, size_t count, const int& value) {
+        real_vector.insert(real_vector.begin() + position, count, value);
+        pre_vector.insert(pre_vector.begin() + position, count, value);
+        test();
+    }
+
+    void insert_range(size_t position, const std::vector<int>& values) {
+        real_vector.insert(real_vector.begin() + position, values.begin(), values.end());
+        pre_vector.insert(pre_vector.begin() + position, values.begin(), values.end());
+        test();
+    }
+
+    void erase(size_t position) {
+        real_vector.erase(real_vector.begin() + position);
+        pre_vector.erase(pre_vector.begin() + position);
+        test();
+    }
+
+    void erase(size_t first, size_t last) {
+        real_vector.erase(real_vector.begin() + first, real_vector.begin() + last);
+        pre_vector.erase(pre_vector.begin() + first, pre_vector.begin() + last);
+        test();
+    }
+
+    void update(size_t pos, const int& value) {
+        real_vector[pos] = value;
+        pre_vector[pos] = value;
+        test();
+    }
+
+    void push_back(const int& value) {
+        real_vector.push_back(value);
+        pre_vector.push_back(value);
+        test();
+    }
+
+    void pop_back() {
+        real_vector.pop_back();
+        pre_vector.pop_back();
+        test();
+    }
+
+    void clear() {
+        real_vector.clear();
+        pre_vector.clear();
+        test();
+    }
+
+    void assign(size_t n, const int& value) {
+        real_vector.assign(n, value);
+        pre_vector.assign(n, value);
+        test();
+    }
+
+    void shrink_to_fit() {
+        pre_vector.shrink_to_fit();
+        test();
+    }
+
+    void swap() {
+        real_vector.swap(real_vector); // no-op, for symmetry
+        pretype other(pre_vector);
+        pre_vector.swap(other);
+        test();
+    }
+
+    size_t size() const { return real_vector.size(); }
+};
+
+BOOST_AUTO_TEST_CASE(prevector_random_ops)
+{
+    for (int j = 0; j < 64; j++) {
+        prevector_tester test;
+        for (int i = 0; i < 2048; i++) {
+            int r = insecure_rand();
+            if ((r % 4) == 0)
+                test.insert(insecure_rand() % (test.size() + 1), insecure_rand());
+            if (test.size() > 0 && ((r >> 2) % 4) == 1)
+                test.erase(insecure_rand() % test.size());
+            if (((r >> 4) % 8) == 2) {
+                int new_size = std::max<int>(0, std::min<int>(30, test.size() + (insecure_rand() % 5) - 2));
+                test.resize(new_size);
+            }
+            if (((r >> 7) % 8) == 3)
+                test.insert(insecure_rand() % (test.size() + 1), 1 + (insecure_rand() % 2), insecure_rand());
+            if (((r >> 10) % 8) == 4) {
+                int del = std::min<int>(test.size(), 1 + (insecure_rand() % 2));
+                int beg = insecure_rand() % (test.size() + 1 - del);
+                test.erase(beg, beg + del);
+            }
+            if (((r >> 13) % 16) == 5)
+                test.push_back(insecure_rand());
+            if (test.size() > 0 && ((r >> 17) % 16) == 6)
+                test.pop_back();
+            if (((r >> 21) % 32) == 7) {
+                std::vector<int> values(insecure_rand() % 5);
+                for (size_t k = 0; k < values.size(); k++)
+                    values[k] = insecure_rand();
+                test.insert_range(insecure_rand() % (test.size() + 1), values);
+            }
+            if (((r >> 26) % 32) == 8)
+                test.reserve(insecure_rand() % 32);
+            if (((r >> 5) % 64) == 9)
+                test.shrink_to_fit();
+            if (test.size() > 0 && ((r >> 11) % 16) == 10)
+                test.update(insecure_rand() % test.size(), insecure_rand());
+            if (((r >> 15) % 256) == 11)
+                test.clear();
+            if (((r >> 19) % 256) == 12)
+                test.assign(insecure_rand() % 32, insecure_rand());
+            if (((r >> 23) % 64) == 13)
+                test.swap();
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(prevector_script_storage)
+{
+    // Standard output scripts are held in the CScript itself
+    CScript p2pkh = CScript() << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20, 0x11) << OP_EQUALVERIFY << OP_CHECKSIG;
+    BOOST_CHECK_EQUAL(p2pkh.size(), 25U);
+    BOOST_CHECK_EQUAL(p2pkh.allocated_memory(), 0U);
+    CScript p2sh = CScript() << OP_HASH160 << std::vector<unsigned char>(20, 0x22) << OP_EQUAL;
+    BOOST_CHECK(p2sh.IsPayToScriptHash());
+    BOOST_CHECK_EQUAL(p2sh.allocated_memory(), 0U);
+
+    // Longer ones are kept on the heap, and come back after being serialized
+    CScript scriptSig = CScript() << std::vector<unsigned char>(72, 0x33) << std::vector<unsigned char>(33, 0x44);
+    BOOST_CHECK(scriptSig.allocated_memory() >= scriptSig.size());
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << scriptSig << p2pkh;
+    BOOST_CHECK_EQUAL(ss.size(), 1 + scriptSig.size() + 1 + p2pkh.size());
+    CScript scriptSig2, p2pkh2;
+    ss >> scriptSig2 >> p2pkh2;
+    BOOST_CHECK(scriptSig2 == scriptSig);
+    BOOST_CHECK(p2pkh2 == p2pkh);
+    BOOST_CHECK_EQUAL(p2pkh2.allocated_memory(), 0U);
+
+    // clear() gives the memory back
+    scriptSig2.clear();
+    BOOST_CHECK_EQUAL(scriptSig2.allocated_memory(), 0U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,85 @@
+// Copyright (c) 2015 The Bitcoin XT developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+//
+// Unit tests for serving blocks as stored on disk
+//
+
+#include "chain.h"
+#include "chainparams.h"
+#include "main.h"
+#include "rawblockcache.h"
+#include "random.h"
+
+#include "test/test_bitcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(rawblockcache_tests, TestingSetup)
+
+static CSerializeDataRef MakeMessage(size_t nSize)
+{
+    return CSerializeDataRef(new CSerializeData(nSize));
+}
+
+BOOST_AUTO_TEST_CASE(rawblockcache_lru)
+{
+    CRawBlockCache cache(1000);
+    uint256 hash1 = GetRandHash(), hash2 = GetRandHash(), hash3 = GetRandHash();
+    cache.Insert(hash1, MakeMessage(400));
+    cache.Insert(hash2, MakeMessage(400));
+    BOOST_CHECK_EQUAL(cache.GetBytes(), 800);
+
+    // hash1 was used last, so hash2 makes room for hash3
+    BOOST_CHECK(cache.Get(hash1));
+    cache.Insert(hash3, MakeMessage(400));
+    BOOST_CHECK_EQUAL(cache.GetCount(), 2);
+    BOOST_CHECK(cache.Get(hash1));
+    BOOST_CHECK(!cache.Get(hash2));
+    BOOST_CHECK(cache.Get(hash3));
+    BOOST_CHECK_EQUAL(cache.GetHits(), 3);
+    BOOST_CHECK_EQUAL(cache.GetMisses(), 1);
+
+    // Too big to keep at all
+    cache.Insert(GetRandHash(), MakeMessage(1001));
+    BOOST_CHECK_EQUAL(cache.GetCount(), 2);
+
+    cache.SetMaxBytes(500);
+    BOOST_CHECK_EQUAL(cache.GetCount(), 1);
+    BOOST_CHECK(cache.Get(hash3));
+}
+
+BOOST_AUTO_TEST_CASE(rawblockcache_block_message)
+{
+    // TestingSetup stored the genesis block
+    CBlockIndex* pindex = chainActive.Genesis();
+    BOOST_REQUIRE(pindex != NULL);
+    const CBlock& genesis = Params().GenesisBlock();
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << CMessageHeader(Params().MessageStart(), "block", 0) << genesis;
+    CNetMessage::FinalizeHeader(ss);
+    CSerializeData expected(ss.begin(), ss.end());
+
+    rawBlockCache.Clear();
+    CSerializeDataRef pmsg = GetBlockMessage(genesis.GetHash(), pindex->GetBlockPos());
+    BOOST_REQUIRE(pmsg);
+    BOOST_CHECK(*pmsg == expected);
+    BOOST_CHECK_EQUAL(rawBlockCache.GetCount(), 1);
+
+    // The second time it comes from the cache
+    BOOST_CHECK(GetBlockMessage(genesis.GetHash(), pindex->GetBlockPos()) == pmsg);
+
+    // Not the block asked for
+    rawBlockCache.Clear();
+    BOOST_CHECK(!GetBlockMessage(GetRandHash(), pindex->GetBlockPos()));
+    BOOST_CHECK_EQUAL(rawBlockCache.GetCount(), 0);
+
+    // No block record there
+    CDiskBlockPos posBad = pindex->GetBlockPos();
+    posBad.nPos += 4;
+    BOOST_CHECK(!GetBlockMessage(genesis.GetHash(), posBad));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,121 @@
+// Copyright (c) 2015 The Bitcoin XT developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+//
+// Unit tests for the cache of relayed transaction messages
+//
+
+#include "chainparams.h"
+#include "primitives/transaction.h"
+#include "random.h"
+#include "relaycache.h"
+#include "utiltime.h"
+
+#include "test/test_bitcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(relaycache_tests, BasicTestingSetup)
+
+static CSerializeDataRef MakeMessage(size_t nSize)
+{
+    return CSerializeDataRef(new CSerializeData(nSize));
+}
+
+BOOST_AUTO_TEST_CASE(relaycache_shared)
+{
+    CRelayCache cache(1 << 20);
+    CInv inv(MSG_TX, GetRandHash());
+    CSerializeDataRef pmsg = MakeMessage(300);
+    cache.Insert(inv, pmsg);
+    BOOST_CHECK_EQUAL(cache.GetCount(), 1);
+
+    // Every request gets the same message, not a copy.
+    BOOST_CHECK(cache.Get(inv) == pmsg);
+    BOOST_CHECK(cache.Get(inv) == pmsg);
+    BOOST_CHECK(!cache.Get(CInv(MSG_TX, GetRandHash())));
+    BOOST_CHECK_EQUAL(cache.GetHits(), 2);
+    BOOST_CHECK_EQUAL(cache.GetMisses(), 1);
+
+    // The message relayed first is kept.
+    cache.Insert(inv, MakeMessage(200));
+    BOOST_CHECK(cache.Get(inv) == pmsg);
+    BOOST_CHECK_EQUAL(cache.GetCount(), 1);
+
+    BOOST_CHECK(cache.DynamicMemoryUsage() >= 300);
+    cache.Clear();
+    BOOST_CHECK_EQUAL(cache.GetCount(), 0);
+    BOOST_CHECK_EQUAL(cache.DynamicMemoryUsage(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(relaycache_expiry)
+{
+    int64_t nNow = GetTime();
+    SetMockTime(nNow);
+    CRelayCache cache(1 << 20);
+    CInv inv1(MSG_TX, GetRandHash()), inv2(MSG_TX, GetRandHash());
+    cache.Insert(inv1, MakeMessage(100));
+    SetMockTime(nNow + 60);
+    cache.Insert(inv2, MakeMessage(100));
+
+    // Expired messages go when the next one comes in.
+    SetMockTime(nNow + RELAY_CACHE_EXPIRY + 1);
+    cache.Insert(CInv(MSG_TX, GetRandHash()), MakeMessage(100));
+    BOOST_CHECK(!cache.Get(inv1));
+    BOOST_CHECK(cache.Get(inv2));
+    BOOST_CHECK_EQUAL(cache.GetCount(), 2);
+    BOOST_CHECK_EQUAL(cache.GetEvicted(), 0);
+    SetMockTime(0);
+}
+
+BOOST_AUTO_TEST_CASE(relaycache_limit)
+{
+    CRelayCache cache(1 << 20);
+    std::vector<CInv> vInv;
+    for (int i = 0; i < 10; i++) {
+        vInv.push_back(CInv(MSG_TX, GetRandHash()));
+        cache.Insert(vInv.back(), MakeMessage(10000));
+    }
+    size_t nUsage = cache.DynamicMemoryUsage();
+    BOOST_CHECK(nUsage >= 100000);
+
+    // Shrinking the cache drops the oldest messages. All entries take the
+    // same memory, so just under half of it leaves four.
+    cache.SetMaxUsage(nUsage / 2 - 1);
+    BOOST_CHECK(cache.DynamicMemoryUsage() < nUsage / 2);
+    BOOST_CHECK_EQUAL(cache.GetCount(), 4);
+    BOOST_CHECK_EQUAL(cache.GetEvicted(), 6);
+    BOOST_CHECK(!cache.Get(vInv[5]));
+    BOOST_CHECK(cache.Get(vInv[6]));
+    BOOST_CHECK(cache.Get(vInv[9]));
+
+    // A message dropped from the cache stays valid for the send queues
+    // still holding it.
+    CSerializeDataRef pmsg = cache.Get(vInv[6]);
+    cache.SetMaxUsage(0);
+    BOOST_CHECK_EQUAL(cache.GetCount(), 0);
+    BOOST_CHECK_EQUAL(pmsg->size(), 10000);
+}
+
+BOOST_AUTO_TEST_CASE(relaycache_tx_message)
+{
+    CMutableTransaction mtx;
+    mtx.vin.resize(1);
+    mtx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    mtx.vout.resize(1);
+    mtx.vout[0].nValue = 1000;
+    mtx.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    CTransaction tx(mtx);
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << CMessageHeader(Params().MessageStart(), "tx", 0) << tx;
+    CNetMessage::FinalizeHeader(ss);
+
+    CSerializeDataRef pmsg = MakeTxMessage(tx);
+    BOOST_CHECK(*pmsg == CSerializeData(ss.begin(), ss.end()));
+    // Nothing allocated beyond the message itself
+    BOOST_CHECK_EQUAL(pmsg->capacity(), pmsg->size());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,121 @@
+// Copyright (c) 2015 The Bitcoin XT developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "script/sigcache.h"
+
+#include "key.h"
+#include "primitives/transaction.h"
+#include "pubkey.h"
+#include "random.h"
+#include "util.h"
+
+#include "test/test_bitcoin.h"
+
+#include <limits>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(sigcache_tests, BasicTestingSetup)
+
+struct SigCacheDelta
+{
+    CSigCacheStats before;
+
+    SigCacheDelta() { GetSignatureCacheStats(before); }
+
+    void Check(uint64_t nHits, uint64_t nMisses, uint64_t nInserts)
+    {
+        CSigCacheStats after;
+        GetSignatureCacheStats(after);
+        BOOST_CHECK_EQUAL(after.nHits - before.nHits, nHits);
+        BOOST_CHECK_EQUAL(after.nMisses - before.nMisses, nMisses);
+        BOOST_CHECK_EQUAL(after.nInserts - before.nInserts, nInserts);
+        before = after;
+    }
+};
+
+BOOST_AUTO_TEST_CASE(sigcache_store_and_erase)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    CPubKey pubkey = key.GetPubKey();
+    uint256 hash = GetRandHash();
+    std::vector<unsigned char> vchSig;
+    BOOST_CHECK(key.Sign(hash, vchSig));
+
+    CTransaction tx;
+    CachingTransactionSignatureChecker mempoolChecker(&tx, 0, true);
+    CachingTransactionSignatureChecker blockChecker(&tx, 0, false);
+
+    CSigCacheStats stats;
+    GetSignatureCacheStats(stats);
+    BOOST_CHECK(stats.nCapacity > 0);
+    BOOST_CHECK_EQUAL(stats.nBytes >> 20, (size_t)DEFAULT_SIG_CACHE_SIZE);
+
+    SigCacheDelta delta;
+    // Invalid signatures are never cached.
+    uint256 hashOther = GetRandHash();
+    BOOST_CHECK(!mempoolChecker.VerifySignature(vchSig, pubkey, hashOther));
+    delta.Check(0, 1, 0);
+
+    BOOST_CHECK(mempoolChecker.VerifySignature(vchSig, pubkey, hash));
+    delta.Check(0, 1, 1);
+    BOOST_CHECK(mempoolChecker.VerifySignature(vchSig, pubkey, hash));
+    delta.Check(1, 0, 0);
+
+    // Block validation consumes the entry...
+    BOOST_CHECK(blockChecker.VerifySignature(vchSig, pubkey, hash));
+    delta.Check(1, 0, 0);
+    // ...and does not put it back.
+    BOOST_CHECK(blockChecker.VerifySignature(vchSig, pubkey, hash));
+    delta.Check(0, 1, 0);
+
+    BOOST_CHECK(!mempoolChecker.VerifySignature(vchSig, pubkey, hashOther));
+    delta.Check(0, 1, 0);
+}
+
+BOOST_AUTO_TEST_CASE(sigcache_many_entries)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    CPubKey pubkey = key.GetPubKey();
+    CTransaction tx;
+    CachingTransactionSignatureChecker checker(&tx, 0, true);
+
+    std::vector<uint256> hashes(100);
+    std::vector<std::vector<unsigned char> > sigs(hashes.size());
+    for (size_t i = 0; i < hashes.size(); i++) {
+        hashes[i] = GetRandHash();
+        BOOST_CHECK(key.Sign(hashes[i], sigs[i]));
+        BOOST_CHECK(checker.VerifySignature(sigs[i], pubkey, hashes[i]));
+    }
+
+    SigCacheDelta delta;
+    for (size_t i = 0; i < hashes.size(); i++)
+        BOOST_CHECK(checker.VerifySignature(sigs[i], pubkey, hashes[i]));
+    delta.Check(hashes.size(), 0, 0);
+}
+
+BOOST_AUTO_TEST_CASE(sigcache_size_option)
+{
+    BOOST_CHECK_EQUAL(GetSignatureCacheBytes(), (size_t)DEFAULT_SIG_CACHE_SIZE << 20);
+
+    // -maxsigcachesize still counts entries, as it used to.
+    mapArgs["-maxsigcachesize"] = "50000";
+    size_t nBytes = GetSignatureCacheBytes();
+    BOOST_CHECK(nBytes >= 50000 * 40 && nBytes < 50000 * 100);
+
+    mapArgs["-sigcachesize"] = "10";
+    BOOST_CHECK_EQUAL(GetSignatureCacheBytes(), (size_t)10 << 20);
+
+    mapArgs["-sigcachesize"] = "1000000000";
+    BOOST_CHECK_EQUAL(GetSignatureCacheBytes(), (size_t)std::min((uint64_t)MAX_SIG_CACHE_SIZE << 20, (uint64_t)std::numeric_limits<size_t>::max()));
+    mapArgs["-sigcachesize"] = "-1";
+    BOOST_CHECK_EQUAL(GetSignatureCacheBytes(), 0);
+
+    mapArgs.erase("-sigcachesize");
+    mapArgs.erase("-maxsigcachesize");
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -165,6 +165,31 @@ BOOST_AUTO_TEST_CASE(sighash_test)
     #endif
 }
 
+// Goal: check that the precomputed transaction data doesn't change any hash
+BOOST_AUTO_TEST_CASE(sighash_precomputed)
+{
+    seed_insecure_rand(false);
+
+    for (int i=0; i<2000; i++) {
+        int nHashType = insecure_rand() % 2 ? SIGHASH_ALL : insecure_rand();
+        CMutableTransaction txTo;
+        RandomTransaction(txTo, (nHashType & 0x1f) == SIGHASH_SINGLE);
+        CTransaction tx(txTo);
+        PrecomputedTransactionData txdata(tx);
+        CScript scriptCode;
+        RandomScript(scriptCode);
+
+        for (unsigned int nIn = 0; nIn < tx.vin.size(); nIn++) {
+            size_t nHashed = 0, nHashedCached = 0;
+            uint256 sh = SignatureHash(scriptCode, tx, nIn, nHashType, &nHashed);
+            uint256 shc = SignatureHash(scriptCode, tx, nIn, nHashType, &nHashedCached, &txdata);
+            BOOST_CHECK(shc == sh);
+            BOOST_CHECK(shc == SignatureHashOld(scriptCode, tx, nIn, nHashType));
+            BOOST_CHECK_EQUAL(nHashedCached, nHashed);
+        }
+    }
+}
+
 // Goal: check that SignatureHash generates correct hash
 BOOST_AUTO_TEST_CASE(sighash_from_data)
 {
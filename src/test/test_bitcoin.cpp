@@ -6,6 +6,7 @@
 
 #include "test_bitcoin.h"
 
+#include "crypto/sha256.h"
 #include "key.h"
 #include "main.h"
 #include "random.h"
@@ -29,6 +30,7 @@ extern void noui_connect();
 
 BasicTestingSetup::BasicTestingSetup()
 {
+        SHA256AutoDetect();
         ECC_Start();
         SetupEnvironment();
         fPrintToDebugLog = false; // don't want to write to debug.log file
@@ -60,8 +62,11 @@ TestingSetup::TestingSetup()
         RegisterValidationInterface(pwalletMain);
 #endif
         nScriptCheckThreads = 3;
-        for (int i=0; i < nScriptCheckThreads-1; i++)
+        for (int i=0; i < nScriptCheckThreads-1; i++) {
             threadGroup.create_thread(&ThreadScriptCheck);
+            threadGroup.create_thread(&ThreadTxInputsCheck);
+            threadGroup.create_thread(&ThreadCoinsRead);
+        }
         RegisterNodeSignals(GetNodeSignals());
 }
 
@@ -0,0 +1,178 @@
+// Copyright (c) 2015 The Bitcoin XT developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "thinblock.h"
+
+#include "random.h"
+#include "streams.h"
+#include "txmempool.h"
+#include "version.h"
+
+#include "test/test_bitcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(thinblock_tests, BasicTestingSetup)
+
+static CBlock BuildBlock(int nTx)
+{
+    CBlock block;
+    for (int i = 0; i < nTx; i++) {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].scriptSig = CScript() << i;
+        if (i > 0)
+            tx.vin[0].prevout.hash = block.vtx[i - 1].GetHash();
+        tx.vout.resize(1);
+        tx.vout[0].scriptPubKey = CScript() << OP_TRUE;
+        tx.vout[0].nValue = 1000 + i;
+        block.vtx.push_back(tx);
+    }
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    return block;
+}
+
+static void AddToPool(CTxMemPool& pool, const CTransaction& tx)
+{
+    pool.addUnchecked(tx.GetHash(), CTxMemPoolEntry(tx, 0, 0, 0.0, 1));
+}
+
+BOOST_AUTO_TEST_CASE(thinblock_serialization)
+{
+    CBlock block = BuildBlock(5);
+    CThinBlock thinBlock(block);
+    BOOST_CHECK_EQUAL(thinBlock.vShortTxIDs.size(), 5);
+    BOOST_CHECK_EQUAL(thinBlock.vPrefilledTx.size(), 1);
+    BOOST_CHECK(thinBlock.vPrefilledTx[0].GetHash() == block.vtx[0].GetHash());
+
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << thinBlock;
+    CThinBlock thinBlock2;
+    stream >> thinBlock2;
+    BOOST_CHECK(thinBlock2.header.GetHash() == block.GetHash());
+    BOOST_CHECK_EQUAL(thinBlock2.nNonce, thinBlock.nNonce);
+    BOOST_CHECK(thinBlock2.vShortTxIDs == thinBlock.vShortTxIDs);
+    CShortTxIDKey key = thinBlock2.GetShortTxIDKey();
+    for (size_t i = 0; i < block.vtx.size(); i++)
+        BOOST_CHECK_EQUAL(key.GetShortTxID(block.vtx[i].GetHash()), thinBlock.vShortTxIDs[i]);
+}
+
+BOOST_AUTO_TEST_CASE(thinblock_short_ids_salted)
+{
+    // Each thin block sent has short ids of its own, which depend on the
+    // block and the nonce.
+    CBlock block = BuildBlock(5);
+    CThinBlock thinBlock1(block), thinBlock2(block);
+    BOOST_CHECK(thinBlock1.nNonce != thinBlock2.nNonce);
+    for (size_t i = 0; i < block.vtx.size(); i++) {
+        BOOST_CHECK(thinBlock1.vShortTxIDs[i] != thinBlock2.vShortTxIDs[i]);
+        BOOST_CHECK(thinBlock1.vShortTxIDs[i] != block.vtx[i].GetHash().GetCheapHash());
+    }
+    CBlockHeader header = block.GetBlockHeader();
+    header.nNonce++;
+    BOOST_CHECK(CShortTxIDKey(header, thinBlock1.nNonce).GetShortTxID(block.vtx[1].GetHash()) != thinBlock1.vShortTxIDs[1]);
+}
+
+BOOST_AUTO_TEST_CASE(thinblock_rebuild_from_mempool)
+{
+    CBlock block = BuildBlock(10);
+    CTxMemPool pool(CFeeRate(0));
+    for (size_t i = 1; i < block.vtx.size(); i++)
+        AddToPool(pool, block.vtx[i]);
+
+    CThinBlockBuilder builder((CThinBlock(block)));
+    builder.FillFromMempool(pool);
+    BOOST_CHECK(builder.IsComplete());
+    BOOST_CHECK_EQUAL(builder.GetFromPoolCount(), 9);
+
+    CBlock rebuilt;
+    BOOST_CHECK(builder.Finish(rebuilt));
+    BOOST_CHECK(rebuilt.GetHash() == block.GetHash());
+    BOOST_CHECK_EQUAL(rebuilt.vtx.size(), block.vtx.size());
+    for (size_t i = 0; i < block.vtx.size(); i++)
+        BOOST_CHECK(rebuilt.vtx[i].GetHash() == block.vtx[i].GetHash());
+}
+
+BOOST_AUTO_TEST_CASE(thinblock_missing_transactions)
+{
+    CBlock block = BuildBlock(10);
+    CTxMemPool pool(CFeeRate(0));
+    for (size_t i = 1; i < block.vtx.size(); i++)
+        if (i % 3 != 0)
+            AddToPool(pool, block.vtx[i]);
+
+    CThinBlockBuilder builder((CThinBlock(block)));
+    builder.FillFromMempool(pool);
+    BOOST_CHECK(!builder.IsComplete());
+    BOOST_CHECK(!builder.IsFailed());
+
+    std::vector<uint32_t> vMissing = builder.GetMissing();
+    BOOST_CHECK_EQUAL(vMissing.size(), 3);
+    BOOST_CHECK_EQUAL(builder.GetMissingCount(), 3);
+
+    // A reply that does not answer the request fails the builder.
+    {
+        CThinBlockBuilder builderBad((CThinBlock(block)));
+        builderBad.FillFromMempool(pool);
+        builderBad.GetMissing();
+        std::vector<CTransaction> vtxWrong(1, block.vtx[3]);
+        builderBad.AddRequestedTransactions(vtxWrong);
+        BOOST_CHECK(builderBad.IsFailed());
+    }
+
+    std::vector<CTransaction> vtx;
+    for (size_t i = 0; i < vMissing.size(); i++)
+        vtx.push_back(block.vtx[vMissing[i]]);
+    builder.AddRequestedTransactions(vtx);
+    BOOST_CHECK(builder.IsComplete());
+
+    CBlock rebuilt;
+    BOOST_CHECK(builder.Finish(rebuilt));
+    BOOST_CHECK(rebuilt.BuildMerkleTree() == block.hashMerkleRoot);
+}
+
+BOOST_AUTO_TEST_CASE(thinblock_bad_merkle_root)
+{
+    CBlock block = BuildBlock(4);
+    block.hashMerkleRoot = GetRandHash();
+    CThinBlock thinBlock(block);
+
+    CThinBlockBuilder builder(thinBlock);
+    for (size_t i = 1; i < block.vtx.size(); i++)
+        builder.AddTransaction(block.vtx[i]);
+    BOOST_CHECK(builder.IsComplete());
+
+    CBlock rebuilt;
+    BOOST_CHECK(!builder.Finish(rebuilt));
+    BOOST_CHECK(builder.IsFailed());
+}
+
+BOOST_AUTO_TEST_CASE(thinblock_short_id_collision)
+{
+    CBlock block = BuildBlock(3);
+    CThinBlock thinBlock(block);
+
+    // Duplicate short ids within the block can't be resolved.
+    thinBlock.vShortTxIDs[2] = thinBlock.vShortTxIDs[1];
+    CThinBlockBuilder builder(thinBlock);
+    BOOST_CHECK(builder.IsFailed());
+}
+
+BOOST_AUTO_TEST_CASE(thinblock_stats)
+{
+    CThinBlockStats stats;
+    BOOST_CHECK_EQUAL(stats.GetHitRate(), 0.0);
+    stats.Received(10, 9, 1, 1000);
+    stats.ReceivedTx(250);
+    stats.Reconstructed(5000);
+    stats.Fallback();
+    BOOST_CHECK_EQUAL(stats.GetReceived(), 1);
+    BOOST_CHECK_EQUAL(stats.GetReconstructed(), 1);
+    BOOST_CHECK_EQUAL(stats.GetFallbacks(), 1);
+    BOOST_CHECK_EQUAL(stats.GetBytesThin(), 1250);
+    BOOST_CHECK_EQUAL(stats.GetBytesFull(), 5000);
+    BOOST_CHECK_CLOSE(stats.GetHitRate(), 0.9, 0.0001);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,219 @@
+// Copyright (c) 2015 The Bitcoin XT developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "thinblock.h"
+
+#include "crypto/common.h"
+#include "crypto/sha256.h"
+#include "hash.h"
+#include "random.h"
+#include "streams.h"
+#include "txmempool.h"
+#include "version.h"
+
+#include <limits>
+
+#include <boost/foreach.hpp>
+
+using namespace std;
+
+CThinBlockStats thinBlockStats;
+
+CShortTxIDKey::CShortTxIDKey(const CBlockHeader& header, uint64_t nNonce)
+{
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << header << nNonce;
+    unsigned char hash[CSHA256::OUTPUT_SIZE];
+    CSHA256().Write((const unsigned char*)&stream[0], stream.size()).Finalize(hash);
+    k0 = ReadLE64(hash);
+    k1 = ReadLE64(hash + 8);
+}
+
+uint64_t CShortTxIDKey::GetShortTxID(const uint256& txid) const
+{
+    return CSipHasher(k0, k1).Write(txid.begin(), txid.size()).Finalize();
+}
+
+CThinBlock::CThinBlock(const CBlock& block) : header(block.GetBlockHeader()), nNonce(GetRand(std::numeric_limits<uint64_t>::max()))
+{
+    CShortTxIDKey key = GetShortTxIDKey();
+    vShortTxIDs.reserve(block.vtx.size());
+    BOOST_FOREACH(const CTransaction& tx, block.vtx)
+        vShortTxIDs.push_back(key.GetShortTxID(tx.GetHash()));
+
+    // The coinbase can never be in the receiver's memory pool.
+    if (!block.vtx.empty())
+        vPrefilledTx.push_back(block.vtx[0]);
+}
+
+CThinBlockBuilder::CThinBlockBuilder(const CThinBlock& thinBlock) :
+    header(thinBlock.header), key(thinBlock.GetShortTxIDKey()), nMissing(thinBlock.vShortTxIDs.size()), nFromPool(0), fFailed(false)
+{
+    vtx.resize(thinBlock.vShortTxIDs.size());
+    vHave.resize(thinBlock.vShortTxIDs.size(), false);
+    for (uint32_t i = 0; i < thinBlock.vShortTxIDs.size(); i++) {
+        // Two transactions of the block sharing a short id cannot be told
+        // apart; give up and let the caller fetch the full block.
+        if (!mapPosition.insert(make_pair(thinBlock.vShortTxIDs[i], i)).second)
+            fFailed = true;
+    }
+    if (vtx.empty())
+        fFailed = true;
+
+    BOOST_FOREACH(const CTransaction& tx, thinBlock.vPrefilledTx)
+        Offer(tx);
+}
+
+bool CThinBlockBuilder::Fill(uint32_t nPos, const CTransaction& tx)
+{
+    if (vHave[nPos]) {
+        // A different transaction with the same short id is a collision.
+        if (vtx[nPos].GetHash() != tx.GetHash())
+            fFailed = true;
+        return false;
+    }
+    vtx[nPos] = tx;
+    vHave[nPos] = true;
+    nMissing--;
+    return true;
+}
+
+bool CThinBlockBuilder::Offer(const CTransaction& tx)
+{
+    if (fFailed)
+        return false;
+    boost::unordered_map<uint64_t, uint32_t, ShortTxIDHasher>::const_iterator it = mapPosition.find(key.GetShortTxID(tx.GetHash()));
+    return it != mapPosition.end() && Fill(it->second, tx);
+}
+
+void CThinBlockBuilder::AddTransaction(const CTransaction& tx)
+{
+    if (Offer(tx))
+        nFromPool++;
+}
+
+void CThinBlockBuilder::FillFromMempool(const CTxMemPool& pool)
+{
+    LOCK(pool.cs);
+    for (CTxMemPool::indexed_transaction_set::const_iterator mi = pool.mapTx.begin(); mi != pool.mapTx.end() && nMissing > 0 && !fFailed; ++mi) {
+        boost::unordered_map<uint64_t, uint32_t, ShortTxIDHasher>::const_iterator it = mapPosition.find(key.GetShortTxID(mi->GetTx().GetHash()));
+        if (it != mapPosition.end() && Fill(it->second, mi->GetTx()))
+            nFromPool++;
+    }
+}
+
+std::vector<uint32_t> CThinBlockBuilder::GetMissing()
+{
+    vRequested.clear();
+    for (uint32_t i = 0; i < vHave.size(); i++)
+        if (!vHave[i])
+            vRequested.push_back(i);
+    return vRequested;
+}
+
+void CThinBlockBuilder::AddRequestedTransactions(const std::vector<CTransaction>& vtxIn)
+{
+    if (fFailed)
+        return;
+    if (vtxIn.size() != vRequested.size()) {
+        fFailed = true;
+        return;
+    }
+    for (size_t i = 0; i < vtxIn.size(); i++) {
+        uint32_t nPos = vRequested[i];
+        boost::unordered_map<uint64_t, uint32_t, ShortTxIDHasher>::const_iterator it = mapPosition.find(key.GetShortTxID(vtxIn[i].GetHash()));
+        if (it == mapPosition.end() || it->second != nPos || !Fill(nPos, vtxIn[i])) {
+            fFailed = true;
+            return;
+        }
+    }
+    vRequested.clear();
+}
+
+bool CThinBlockBuilder::Finish(CBlock& block)
+{
+    if (!IsComplete())
+        return false;
+
+    block = CBlock(header);
+    block.vtx.swap(vtx);
+    bool fMutated = false;
+    if (block.BuildMerkleTree(&fMutated) != header.hashMerkleRoot || fMutated) {
+        fFailed = true;
+        return false;
+    }
+    return true;
+}
+
+CThinBlockStats::CThinBlockStats()
+{
+    Clear();
+}
+
+void CThinBlockStats::Clear()
+{
+    LOCK(cs);
+    nSent = 0;
+    nReceived = 0;
+    nReconstructed = 0;
+    nFallbacks = 0;
+    nTxTotal = 0;
+    nTxFromPool = 0;
+    nTxRequested = 0;
+    nBytesThin = 0;
+    nBytesFull = 0;
+}
+
+void CThinBlockStats::Sent()
+{
+    LOCK(cs);
+    nSent++;
+}
+
+void CThinBlockStats::Received(size_t nTxTotalIn, size_t nTxFromPoolIn, size_t nTxRequestedIn, size_t nBytes)
+{
+    LOCK(cs);
+    nReceived++;
+    nTxTotal += nTxTotalIn;
+    nTxFromPool += nTxFromPoolIn;
+    nTxRequested += nTxRequestedIn;
+    nBytesThin += nBytes;
+}
+
+void CThinBlockStats::ReceivedTx(size_t nBytes)
+{
+    LOCK(cs);
+    nBytesThin += nBytes;
+}
+
+void CThinBlockStats::Reconstructed(size_t nBytesFullIn)
+{
+    LOCK(cs);
+    nReconstructed++;
+    nBytesFull += nBytesFullIn;
+}
+
+void CThinBlockStats::Fallback()
+{
+    LOCK(cs);
+    nFallbacks++;
+}
+
+uint64_t CThinBlockStats::GetSent() const { LOCK(cs); return nSent; }
+uint64_t CThinBlockStats::GetReceived() const { LOCK(cs); return nReceived; }
+uint64_t CThinBlockStats::GetReconstructed() const { LOCK(cs); return nReconstructed; }
+uint64_t CThinBlockStats::GetFallbacks() const { LOCK(cs); return nFallbacks; }
+uint64_t CThinBlockStats::GetTxTotal() const { LOCK(cs); return nTxTotal; }
+uint64_t CThinBlockStats::GetTxFromPool() const { LOCK(cs); return nTxFromPool; }
+uint64_t CThinBlockStats::GetTxRequested() const { LOCK(cs); return nTxRequested; }
+uint64_t CThinBlockStats::GetBytesThin() const { LOCK(cs); return nBytesThin; }
+uint64_t CThinBlockStats::GetBytesFull() const { LOCK(cs); return nBytesFull; }
+
+double CThinBlockStats::GetHitRate() const
+{
+    LOCK(cs);
+    if (nTxTotal == 0)
+        return 0.0;
+    return (double)nTxFromPool / nTxTotal;
+}
@@ -0,0 +1,210 @@
+// Copyright (c) 2015 The Bitcoin XT developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_THINBLOCK_H
+#define BITCOIN_THINBLOCK_H
+
+#include "primitives/block.h"
+#include "serialize.h"
+#include "sync.h"
+#include "uint256.h"
+
+#include <stdint.h>
+#include <vector>
+
+#include <boost/unordered_map.hpp>
+
+class CTxMemPool;
+
+/** Default for -use-thin-blocks */
+static const bool DEFAULT_USE_THIN_BLOCKS = true;
+/** How many of the thin blocks last sent to a peer it may still ask transactions for */
+static const unsigned int MAX_THIN_BLOCKS_SENT = 4;
+
+/**
+ * Short transaction ids of one thin block: SipHash-2-4 of the txid, keyed
+ * by the block header and a nonce the sender picks for each thin block it
+ * sends, so that colliding transactions cannot be ground in advance.
+ */
+class CShortTxIDKey
+{
+private:
+    uint64_t k0;
+    uint64_t k1;
+
+public:
+    CShortTxIDKey() : k0(0), k1(0) {}
+    CShortTxIDKey(const CBlockHeader& header, uint64_t nNonce);
+
+    uint64_t GetShortTxID(const uint256& txid) const;
+};
+
+/**
+ * A block as relayed to peers that advertise NODE_THIN: the header, the nonce
+ * keying its short ids, the short ids of all its transactions in block order
+ * and, in full, the transactions the receiver cannot have in its memory pool
+ * (the coinbase).
+ *
+ * The receiver rebuilds the block from its memory pool and asks for whatever
+ * is left with a "getthintx" message. Short ids are not collision resistant;
+ * a receiver that finds an ambiguous match or a merkle root mismatch simply
+ * falls back to requesting the full block, so collisions cost a round trip
+ * and never correctness.
+ */
+class CThinBlock
+{
+public:
+    CBlockHeader header;
+    uint64_t nNonce;
+    std::vector<uint64_t> vShortTxIDs;
+    std::vector<CTransaction> vPrefilledTx;
+
+    CThinBlock() : nNonce(0) {}
+    explicit CThinBlock(const CBlock& block);
+
+    CShortTxIDKey GetShortTxIDKey() const { return CShortTxIDKey(header, nNonce); }
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(header);
+        READWRITE(nNonce);
+        READWRITE(vShortTxIDs);
+        READWRITE(vPrefilledTx);
+    }
+};
+
+/** Request for the transactions of a thin block, by position in the block. */
+class CThinBlockTxRequest
+{
+public:
+    uint256 blockhash;
+    std::vector<uint32_t> vIndexes;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(blockhash);
+        READWRITE(vIndexes);
+    }
+};
+
+/** Transactions sent in reply to a CThinBlockTxRequest, in the requested order. */
+class CThinBlockTx
+{
+public:
+    uint256 blockhash;
+    std::vector<CTransaction> vtx;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(blockhash);
+        READWRITE(vtx);
+    }
+};
+
+struct ShortTxIDHasher
+{
+    size_t operator()(uint64_t id) const { return (size_t)id; }
+};
+
+/**
+ * Reassembles a block from a CThinBlock, the memory pool and the
+ * transactions received in a later "thintx" message.
+ */
+class CThinBlockBuilder
+{
+private:
+    CBlockHeader header;
+    CShortTxIDKey key;
+    std::vector<CTransaction> vtx;
+    std::vector<bool> vHave;
+    boost::unordered_map<uint64_t, uint32_t, ShortTxIDHasher> mapPosition;
+    std::vector<uint32_t> vRequested;
+    size_t nMissing;
+    size_t nFromPool;
+    bool fFailed;
+
+    bool Fill(uint32_t nPos, const CTransaction& tx);
+    bool Offer(const CTransaction& tx);
+
+public:
+    explicit CThinBlockBuilder(const CThinBlock& thinBlock);
+
+    uint256 GetHash() const { return header.GetHash(); }
+
+    /** Fill in every transaction we can find in the memory pool. */
+    void FillFromMempool(const CTxMemPool& pool);
+
+    /** Offer a transaction we have from another source (e.g. the orphan pool). */
+    void AddTransaction(const CTransaction& tx);
+
+    /**
+     * Add the reply to our "getthintx" request. Fails the builder if the
+     * reply does not exactly answer the outstanding request.
+     */
+    void AddRequestedTransactions(const std::vector<CTransaction>& vtxIn);
+
+    /** Positions of the transactions still missing; remembered as requested. */
+    std::vector<uint32_t> GetMissing();
+
+    bool IsFailed() const { return fFailed; }
+    bool IsComplete() const { return !fFailed && nMissing == 0; }
+    size_t GetTxCount() const { return vtx.size(); }
+    size_t GetMissingCount() const { return nMissing; }
+    size_t GetFromPoolCount() const { return nFromPool; }
+
+    /**
+     * Move the reassembled block into block. Returns false if the builder
+     * failed or the transactions do not hash to the header's merkle root,
+     * in which case the full block must be fetched instead.
+     */
+    bool Finish(CBlock& block);
+};
+
+/** Thin block relay counters, reported by the getthinblockstats RPC. */
+class CThinBlockStats
+{
+private:
+    mutable CCriticalSection cs;
+    uint64_t nSent;
+    uint64_t nReceived;
+    uint64_t nReconstructed;
+    uint64_t nFallbacks;
+    uint64_t nTxTotal;
+    uint64_t nTxFromPool;
+    uint64_t nTxRequested;
+    uint64_t nBytesThin;
+    uint64_t nBytesFull;
+
+public:
+    CThinBlockStats();
+
+    void Clear();
+    void Sent();
+    void Received(size_t nTxTotalIn, size_t nTxFromPoolIn, size_t nTxRequestedIn, size_t nBytes);
+    void ReceivedTx(size_t nBytes);
+    void Reconstructed(size_t nBytesFullIn);
+    void Fallback();
+
+    uint64_t GetSent() const;
+    uint64_t GetReceived() const;
+    uint64_t GetReconstructed() const;
+    uint64_t GetFallbacks() const;
+    uint64_t GetTxTotal() const;
+    uint64_t GetTxFromPool() const;
+    uint64_t GetTxRequested() const;
+    uint64_t GetBytesThin() const;
+    uint64_t GetBytesFull() const;
+    /** Fraction of non-prefilled transactions found without asking the peer. */
+    double GetHitRate() const;
+};
+
+extern CThinBlockStats thinBlockStats;
+
+#endif // BITCOIN_THINBLOCK_H
@@ -5,30 +5,187 @@
 
 #include "txdb.h"
 
+#include "blockfilter.h"
 #include "chainparams.h"
+#include "checkqueue.h"
 #include "hash.h"
 #include "main.h"
 #include "pow.h"
+#include "ui_interface.h"
 #include "uint256.h"
 
 #include <stdint.h>
+#include <string.h>
 
+#include <boost/foreach.hpp>
 #include <boost/thread.hpp>
 
 using namespace std;
 
 static const char DB_COINS = 'c';
+static const char DB_COIN = 'C';
 static const char DB_BLOCK_FILES = 'f';
 static const char DB_TXINDEX = 't';
+static const char DB_BLOCK_FILTER = 'g';
 static const char DB_BLOCK_INDEX = 'b';
 
 static const char DB_BEST_BLOCK = 'B';
 static const char DB_FLAG = 'F';
 static const char DB_REINDEX_FLAG = 'R';
 static const char DB_LAST_BLOCK = 'l';
+static const char DB_COINS_LAYOUT = 'L';
+static const char DB_TXOUTSET_STATS = 'S';
 
 static const char DB_FORK_ACTIVATION = 'a';
 
+//! Transactions converted per batch while upgrading.
+static const size_t UPGRADE_BATCH_SIZE = 10000;
+//! Idle iterators CCoinsViewDB keeps for reuse by per-outpoint lookups.
+static const size_t MAX_IDLE_ITERATORS = 16;
+
+namespace {
+
+/** Key of a per-outpoint coin record. */
+struct CCoinKey
+{
+    char chType;
+    uint256 txid;
+    uint32_t n;
+
+    CCoinKey() : chType(DB_COIN), n(0) {}
+    CCoinKey(const uint256& txidIn, uint32_t nIn) : chType(DB_COIN), txid(txidIn), n(nIn) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(chType);
+        READWRITE(txid);
+        READWRITE(VARINT(n));
+    }
+};
+
+/**
+ * A single unspent output with the metadata of its transaction.
+ *
+ * Serialized format:
+ * - VARINT(nHeight * 2 + fCoinBase)
+ * - VARINT(nTxVersion)
+ * - the CTxOut (via CTxOutCompressor)
+ */
+struct CDiskCoin
+{
+    bool fCoinBase;
+    int nHeight;
+    int nTxVersion;
+    CTxOut out;
+
+    CDiskCoin() : fCoinBase(false), nHeight(0), nTxVersion(0) {}
+    CDiskCoin(const CCoins& coins, uint32_t n) : fCoinBase(coins.fCoinBase), nHeight(coins.nHeight), nTxVersion(coins.nVersion), out(coins.vout[n]) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        unsigned int nCode = nHeight * 2 + (fCoinBase ? 1 : 0);
+        READWRITE(VARINT(nCode));
+        if (ser_action.ForRead()) {
+            nHeight = nCode / 2;
+            fCoinBase = nCode & 1;
+        }
+        READWRITE(VARINT(nTxVersion));
+        READWRITE(REF(CTxOutCompressor(REF(out))));
+    }
+};
+
+/**
+ * Gather the per-outpoint records of txid into coins, leaving pcursor on the
+ * first record past them. Returns false if there are none.
+ */
+bool ReadCoinRecords(leveldb::Iterator* pcursor, const uint256& txid, CCoins& coins, uint64_t* pnValueSize = NULL)
+{
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << CCoinKey(txid, 0);
+    pcursor->Seek(ssKeySet.str());
+
+    coins.Clear();
+    bool fFound = false;
+    for (; pcursor->Valid(); pcursor->Next()) {
+        leveldb::Slice slKey = pcursor->key();
+        if (slKey.size() == 0 || slKey[0] != DB_COIN)
+            break;
+        CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+        CCoinKey key;
+        ssKey >> key;
+        if (key.txid != txid)
+            break;
+        leveldb::Slice slValue = pcursor->value();
+        CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+        CDiskCoin coin;
+        ssValue >> coin;
+        if (pnValueSize)
+            *pnValueSize += 32 + slValue.size();
+        if (!fFound) {
+            coins.fCoinBase = coin.fCoinBase;
+            coins.nHeight = coin.nHeight;
+            coins.nVersion = coin.nTxVersion;
+            fFound = true;
+        }
+        if (key.n >= coins.vout.size())
+            coins.vout.resize(key.n + 1);
+        coins.vout[key.n] = coin.out;
+    }
+    return fFound;
+}
+
+/**
+ * Queue the writes that turn the per-outpoint records of txid into the
+ * entry's coins, without reading them: the database has no record at or
+ * past nMaxOutputs, none at all for fresh entries, and unless outputs were
+ * ADDED the unspent ones are already there.
+ */
+void BatchWriteCoinRecords(CLevelDBBatch& batch, const uint256& txid, const CCoinsCacheEntry& entry, size_t& nWritten, size_t& nErased)
+{
+    const CCoins& coins = entry.coins;
+    bool fFresh = entry.flags & CCoinsCacheEntry::FRESH;
+    bool fWriteUnspent = entry.flags & (CCoinsCacheEntry::FRESH | CCoinsCacheEntry::ADDED);
+    size_t nOutputs = fFresh ? coins.vout.size() : std::max<size_t>(coins.vout.size(), entry.nMaxOutputs);
+    for (size_t i = 0; i < nOutputs; i++) {
+        if (i < coins.vout.size() && !coins.vout[i].IsNull()) {
+            if (fWriteUnspent) {
+                batch.Write(CCoinKey(txid, i), CDiskCoin(coins, i));
+                nWritten++;
+            }
+        } else if (!fFresh) {
+            batch.Erase(CCoinKey(txid, i));
+            nErased++;
+        }
+    }
+}
+
+/** Add one transaction's unspent outputs to the statistics and their hash. */
+void AddCoinsToStats(CCoinsStats& stats, CHashWriter& ss, CAmount& nTotalAmount, const uint256& txid, const CCoins& coins)
+{
+    ss << txid;
+    ss << VARINT(coins.nVersion);
+    ss << (coins.fCoinBase ? 'c' : 'n');
+    ss << VARINT(coins.nHeight);
+    stats.nTransactions++;
+    for (unsigned int i=0; i<coins.vout.size(); i++) {
+        const CTxOut &out = coins.vout[i];
+        if (!out.IsNull()) {
+            stats.nTransactionOutputs++;
+            ss << VARINT(i+1);
+            ss << out;
+            nTotalAmount += out.nValue;
+            stats.txouts.AddTxOut(COutPoint(txid, i), out);
+        }
+    }
+    ss << VARINT(0);
+}
+
+}
+
 void static BatchWriteCoins(CLevelDBBatch &batch, const uint256 &hash, const CCoins &coins) {
     if (coins.IsPruned())
         batch.Erase(make_pair(DB_COINS, hash));
@@ -40,15 +197,171 @@ void static BatchWriteHashBestChain(CLevelDBBatch &batch, const uint256 &hash) {
     batch.Write(DB_BEST_BLOCK, hash);
 }
 
-CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe) {
+CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe, int nNewLayout) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe), nLayout(COINS_DB_PER_TXID), nIteratorGeneration(0) {
+    int nMarker;
+    if (db.Read(DB_COINS_LAYOUT, nMarker)) {
+        nLayout = nMarker;
+    } else if (GetBestBlock().IsNull()) {
+        // A new database. Existing ones without a marker predate the
+        // per-outpoint layout.
+        nLayout = nNewLayout;
+        db.Write(DB_COINS_LAYOUT, nLayout);
+    }
+}
+
+CCoinsViewDB::~CCoinsViewDB() {
+    ResetIterators();
+}
+
+/**
+ * An iterator of the database, taken from the idle ones if there are any,
+ * and put back when done unless the database was written in the meantime.
+ */
+class CCoinsViewDB::CPooledIterator
+{
+private:
+    const CCoinsViewDB& view;
+    uint64_t nGeneration;
+    leveldb::Iterator* pcursor;
+
+public:
+    CPooledIterator(const CCoinsViewDB& viewIn) : view(viewIn), pcursor(NULL)
+    {
+        {
+            LOCK(view.cs_iterators);
+            nGeneration = view.nIteratorGeneration;
+            if (!view.vIterators.empty()) {
+                pcursor = view.vIterators.back();
+                view.vIterators.pop_back();
+            }
+        }
+        if (!pcursor)
+            pcursor = const_cast<CLevelDBWrapper*>(&view.db)->NewIterator();
+    }
+
+    ~CPooledIterator()
+    {
+        {
+            LOCK(view.cs_iterators);
+            if (nGeneration == view.nIteratorGeneration && view.vIterators.size() < MAX_IDLE_ITERATORS && pcursor->status().ok()) {
+                view.vIterators.push_back(pcursor);
+                return;
+            }
+        }
+        delete pcursor;
+    }
+
+    leveldb::Iterator* get() const { return pcursor; }
+};
+
+void CCoinsViewDB::ResetIterators() {
+    std::vector<leveldb::Iterator*> vOld;
+    {
+        LOCK(cs_iterators);
+        nIteratorGeneration++;
+        vOld.swap(vIterators);
+    }
+    BOOST_FOREACH(leveldb::Iterator* pcursor, vOld)
+        delete pcursor;
 }
 
 bool CCoinsViewDB::GetCoins(const uint256 &txid, CCoins &coins) const {
-    return db.Read(make_pair(DB_COINS, txid), coins);
+    if (nLayout == COINS_DB_PER_TXID)
+        return db.Read(make_pair(DB_COINS, txid), coins);
+
+    CPooledIterator pcursor(*this);
+    try {
+        return ReadCoinRecords(pcursor.get(), txid, coins);
+    } catch (const std::exception& e) {
+        return error("%s: Deserialize or I/O error - %s", __func__, e.what());
+    }
+}
+
+namespace {
+
+/** Reads the coins of one txid of a CCoinsViewDB::BatchRead */
+class CCoinsReadCheck
+{
+private:
+    const CCoinsViewDB* view;
+    CCoinsLookup* lookup;
+    char* pfDone;
+
+public:
+    CCoinsReadCheck() : view(NULL), lookup(NULL), pfDone(NULL) {}
+    CCoinsReadCheck(const CCoinsViewDB& viewIn, CCoinsLookup& lookupIn, char& fDoneIn) :
+        view(&viewIn), lookup(&lookupIn), pfDone(&fDoneIn) {}
+
+    bool operator()()
+    {
+        try {
+            lookup->fFound = view->GetCoins(lookup->txid, lookup->coins);
+        } catch (const std::exception& e) {
+            // Left undone, for the caller to read again and run into the
+            // error on its own thread.
+            return false;
+        }
+        *pfDone = true;
+        return true;
+    }
+
+    void swap(CCoinsReadCheck& check)
+    {
+        std::swap(view, check.view);
+        std::swap(lookup, check.lookup);
+        std::swap(pfDone, check.pfDone);
+    }
+};
+
+} // anon namespace
+
+static CCheckQueue<CCoinsReadCheck> coinsreadqueue(8);
+//! Held by the BatchRead using coinsreadqueue
+static boost::mutex csCoinsRead;
+
+void ThreadCoinsRead() {
+    RenameThread("bitcoin-coinsread");
+    coinsreadqueue.Thread();
+}
+
+void CCoinsViewDB::BatchRead(std::vector<CCoinsLookup> &vLookups) const {
+    boost::unique_lock<boost::mutex> lock(csCoinsRead, boost::try_to_lock);
+    if (vLookups.size() < 2 || !lock.owns_lock()) {
+        CCoinsView::BatchRead(vLookups);
+        return;
+    }
+
+    std::vector<char> vDone(vLookups.size(), false);
+    {
+        CCheckQueueControl<CCoinsReadCheck> control(&coinsreadqueue);
+        std::vector<CCoinsReadCheck> vChecks;
+        vChecks.reserve(vLookups.size());
+        for (size_t i = 0; i < vLookups.size(); i++)
+            vChecks.push_back(CCoinsReadCheck(*this, vLookups[i], vDone[i]));
+        control.Add(vChecks);
+        control.Wait();
+    }
+    lock.unlock();
+
+    for (size_t i = 0; i < vLookups.size(); i++) {
+        if (!vDone[i])
+            vLookups[i].fFound = GetCoins(vLookups[i].txid, vLookups[i].coins);
+    }
 }
 
 bool CCoinsViewDB::HaveCoins(const uint256 &txid) const {
-    return db.Exists(make_pair(DB_COINS, txid));
+    if (nLayout == COINS_DB_PER_TXID)
+        return db.Exists(make_pair(DB_COINS, txid));
+
+    CPooledIterator pcursor(*this);
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << CCoinKey(txid, 0);
+    pcursor.get()->Seek(ssKeySet.str());
+    if (!pcursor.get()->Valid())
+        return false;
+    // Any record of this transaction starts with the same type and txid.
+    leveldb::Slice slKey = pcursor.get()->key();
+    return slKey.size() > 33 && memcmp(slKey.data(), &ssKeySet[0], 33) == 0;
 }
 
 uint256 CCoinsViewDB::GetBestBlock() const {
@@ -58,24 +371,125 @@ uint256 CCoinsViewDB::GetBestBlock() const {
     return hashBestChain;
 }
 
+void CCoinsViewDB::BatchWriteEntry(CLevelDBBatch &batch, const uint256 &txid, const CCoinsCacheEntry &entry, size_t &written, size_t &erased) const {
+    if (nLayout == COINS_DB_PER_TXID)
+        BatchWriteCoins(batch, txid, entry.coins);
+    else
+        BatchWriteCoinRecords(batch, txid, entry, written, erased);
+}
+
+bool CCoinsViewDB::CommitBatch(CLevelDBBatch &batch, const uint256 &hashBlock, size_t count, size_t changed, size_t written, size_t erased) {
+    if (!hashBlock.IsNull())
+        BatchWriteHashBestChain(batch, hashBlock);
+
+    if (nLayout == COINS_DB_PER_TXID)
+        LogPrint("coindb", "Committing %u changed transactions (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)count);
+    else
+        LogPrint("coindb", "Committing %u changed transactions (out of %u), %u outputs written and %u erased, to coin database...\n", (unsigned int)changed, (unsigned int)count, (unsigned int)written, (unsigned int)erased);
+    bool ret = db.WriteBatch(batch);
+    // Idle iterators would not see the batch.
+    ResetIterators();
+    return ret;
+}
+
 bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
     CLevelDBBatch batch;
     size_t count = 0;
     size_t changed = 0;
+    size_t written = 0;
+    size_t erased = 0;
     for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end();) {
         if (it->second.flags & CCoinsCacheEntry::DIRTY) {
-            BatchWriteCoins(batch, it->first, it->second.coins);
+            BatchWriteEntry(batch, it->first, it->second, written, erased);
             changed++;
         }
         count++;
         CCoinsMap::iterator itOld = it++;
         mapCoins.erase(itOld);
     }
-    if (!hashBlock.IsNull())
-        BatchWriteHashBestChain(batch, hashBlock);
+    return CommitBatch(batch, hashBlock, count, changed, written, erased);
+}
+
+bool CCoinsViewDB::WriteCoins(const CCoinsMap &mapCoins, const uint256 &hashBlock) {
+    CLevelDBBatch batch;
+    size_t changed = 0;
+    size_t written = 0;
+    size_t erased = 0;
+    for (CCoinsMap::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++) {
+        if (it->second.flags & CCoinsCacheEntry::DIRTY) {
+            BatchWriteEntry(batch, it->first, it->second, written, erased);
+            changed++;
+        }
+    }
+    return CommitBatch(batch, hashBlock, mapCoins.size(), changed, written, erased);
+}
+
+bool CCoinsViewDB::Upgrade() {
+    if (nLayout == COINS_DB_PER_OUTPOINT)
+        return true;
+
+    LogPrintf("Upgrading coins database to per-outpoint records...\n");
+    uiInterface.ShowProgress(_("Upgrading coins database..."), 0);
+    // From here on the database is only usable once the upgrade is done.
+    if (nLayout != COINS_DB_UPGRADING) {
+        nLayout = COINS_DB_UPGRADING;
+        db.Write(DB_COINS_LAYOUT, nLayout, true);
+    }
+
+    boost::scoped_ptr<leveldb::Iterator> pcursor(db.NewIterator());
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << make_pair(DB_COINS, uint256());
+    pcursor->Seek(ssKeySet.str());
+
+    CLevelDBBatch batch;
+    size_t nBatch = 0, nTransactions = 0, nOutputs = 0;
+    int nLastProgress = 0;
+    for (; pcursor->Valid(); pcursor->Next()) {
+        leveldb::Slice slKey = pcursor->key();
+        if (slKey.size() == 0 || slKey[0] != DB_COINS)
+            break;
+        uint256 txid;
+        CCoins coins;
+        try {
+            CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+            char chType;
+            ssKey >> chType >> txid;
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+            ssValue >> coins;
+        } catch (const std::exception& e) {
+            return error("%s: Deserialize or I/O error - %s", __func__, e.what());
+        }
 
-    LogPrint("coindb", "Committing %u changed transactions (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)count);
-    return db.WriteBatch(batch);
+        for (unsigned int i = 0; i < coins.vout.size(); i++) {
+            if (!coins.vout[i].IsNull()) {
+                batch.Write(CCoinKey(txid, i), CDiskCoin(coins, i));
+                nOutputs++;
+            }
+        }
+        batch.Erase(make_pair(DB_COINS, txid));
+        nTransactions++;
+
+        if (++nBatch == UPGRADE_BATCH_SIZE) {
+            db.WriteBatch(batch);
+            batch.Clear();
+            nBatch = 0;
+            // Records are in txid order, so the first txid byte tells how far along we are.
+            int nProgress = *txid.begin() * 100 / 256;
+            if (nProgress != nLastProgress) {
+                uiInterface.ShowProgress(_("Upgrading coins database..."), nProgress);
+                nLastProgress = nProgress;
+            }
+        }
+    }
+
+    nLayout = COINS_DB_PER_OUTPOINT;
+    batch.Write(DB_COINS_LAYOUT, nLayout);
+    db.WriteBatch(batch, true);
+    ResetIterators();
+    uiInterface.ShowProgress("", 100);
+    LogPrintf("Upgraded %u transactions into %u outputs\n", (unsigned int)nTransactions, (unsigned int)nOutputs);
+    return true;
 }
 
 CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe) {
@@ -102,14 +516,27 @@ bool CBlockTreeDB::ReadLastBlockFile(int &nFile) {
 }
 
 bool CCoinsViewDB::GetStats(CCoinsStats &stats) const {
+    return GetStats(stats, NULL);
+}
+
+bool CCoinsViewDB::GetStats(CCoinsStats &stats, const leveldb::Snapshot* snapshot) const {
     /* It seems that there are no "const iterators" for LevelDB.  Since we
        only need read operations on it, use a const-cast to get around
        that restriction.  */
-    boost::scoped_ptr<leveldb::Iterator> pcursor(const_cast<CLevelDBWrapper*>(&db)->NewIterator());
-    pcursor->SeekToFirst();
+    boost::scoped_ptr<leveldb::Iterator> pcursor(const_cast<CLevelDBWrapper*>(&db)->NewIterator(snapshot));
 
     CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
-    stats.hashBlock = GetBestBlock();
+    // The best block as of the snapshot, if there is one.
+    CDataStream ssKeyBest(SER_DISK, CLIENT_VERSION);
+    ssKeyBest << DB_BEST_BLOCK;
+    pcursor->Seek(ssKeyBest.str());
+    stats.hashBlock.SetNull();
+    if (pcursor->Valid() && pcursor->key() == ssKeyBest.str()) {
+        leveldb::Slice slValue = pcursor->value();
+        CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+        ssValue >> stats.hashBlock;
+    }
+    pcursor->SeekToFirst();
     ss << stats.hashBlock;
     CAmount nTotalAmount = 0;
     while (pcursor->Valid()) {
@@ -126,34 +553,55 @@ bool CCoinsViewDB::GetStats(CCoinsStats &stats) const {
                 ssValue >> coins;
                 uint256 txhash;
                 ssKey >> txhash;
-                ss << txhash;
-                ss << VARINT(coins.nVersion);
-                ss << (coins.fCoinBase ? 'c' : 'n');
-                ss << VARINT(coins.nHeight);
-                stats.nTransactions++;
-                for (unsigned int i=0; i<coins.vout.size(); i++) {
-                    const CTxOut &out = coins.vout[i];
-                    if (!out.IsNull()) {
-                        stats.nTransactionOutputs++;
-                        ss << VARINT(i+1);
-                        ss << out;
-                        nTotalAmount += out.nValue;
-                    }
-                }
+                AddCoinsToStats(stats, ss, nTotalAmount, txhash, coins);
                 stats.nSerializedSize += 32 + slValue.size();
-                ss << VARINT(0);
+            } else if (chType == DB_COIN) {
+                // Gather the transaction's records back into one CCoins, so
+                // both layouts hash to the same value. This leaves the
+                // cursor past them.
+                uint256 txhash;
+                ssKey >> txhash;
+                CCoins coins;
+                ReadCoinRecords(pcursor.get(), txhash, coins, &stats.nSerializedSize);
+                AddCoinsToStats(stats, ss, nTotalAmount, txhash, coins);
+                continue;
             }
             pcursor->Next();
         } catch (const std::exception& e) {
             return error("%s: Deserialize or I/O error - %s", __func__, e.what());
         }
     }
-    stats.nHeight = mapBlockIndex.find(GetBestBlock())->second->nHeight;
+    {
+        LOCK(cs_main);
+        BlockMap::const_iterator it = mapBlockIndex.find(stats.hashBlock);
+        stats.nHeight = it != mapBlockIndex.end() ? it->second->nHeight : -1;
+    }
     stats.hashSerialized = ss.GetHash();
     stats.nTotalAmount = nTotalAmount;
     return true;
 }
 
+bool CCoinsViewDB::ReadTxOutSetStats(uint256 &hashBlock, CTxOutSetStats &stats) const {
+    std::pair<uint256, CTxOutSetStats> value;
+    if (!db.Read(DB_TXOUTSET_STATS, value))
+        return false;
+    hashBlock = value.first;
+    stats = value.second;
+    return true;
+}
+
+bool CCoinsViewDB::WriteTxOutSetStats(const uint256 &hashBlock, const CTxOutSetStats &stats) {
+    return db.Write(DB_TXOUTSET_STATS, std::make_pair(hashBlock, stats));
+}
+
+const leveldb::Snapshot* CCoinsViewDB::GetSnapshot() {
+    return db.GetSnapshot();
+}
+
+void CCoinsViewDB::ReleaseSnapshot(const leveldb::Snapshot* snapshot) {
+    db.ReleaseSnapshot(snapshot);
+}
+
 bool CBlockTreeDB::WriteBatchSync(const std::vector<std::pair<int, const CBlockFileInfo*> >& fileInfo, int nLastFile, const std::vector<const CBlockIndex*>& blockinfo) {
     CLevelDBBatch batch;
     for (std::vector<std::pair<int, const CBlockFileInfo*> >::const_iterator it=fileInfo.begin(); it != fileInfo.end(); it++) {
@@ -177,6 +625,14 @@ bool CBlockTreeDB::WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos>
     return WriteBatch(batch);
 }
 
+bool CBlockTreeDB::ReadBlockFilter(const uint256 &hashBlock, CDiskBlockFilter &filter) {
+    return Read(make_pair(DB_BLOCK_FILTER, hashBlock), filter);
+}
+
+bool CBlockTreeDB::WriteBlockFilter(const uint256 &hashBlock, const CDiskBlockFilter &filter) {
+    return Write(make_pair(DB_BLOCK_FILTER, hashBlock), filter);
+}
+
 bool CBlockTreeDB::WriteFlag(const std::string &name, bool fValue) {
     return Write(std::make_pair(DB_FLAG, name), fValue ? '1' : '0');
 }
@@ -8,6 +8,7 @@
 
 #include "coins.h"
 #include "leveldbwrapper.h"
+#include "sync.h"
 
 #include <map>
 #include <string>
@@ -16,6 +17,7 @@
 
 class CBlockFileInfo;
 class CBlockIndex;
+class CDiskBlockFilter;
 struct CDiskTxPos;
 class uint256;
 
@@ -26,19 +28,94 @@ static const int64_t nMaxDbCache = sizeof(void*) > 4 ? 16384 : 1024;
 //! min. -dbcache in (MiB)
 static const int64_t nMinDbCache = 4;
 
+/** On-disk layouts of the coin database. */
+enum CoinsDBLayout
+{
+    //! One CCoins record per transaction, keyed by txid
+    COINS_DB_PER_TXID = 0,
+    //! One record per unspent output, keyed by outpoint
+    COINS_DB_PER_OUTPOINT = 1,
+    //! An upgrade to COINS_DB_PER_OUTPOINT was interrupted; it has to be
+    //! completed before the database can be used
+    COINS_DB_UPGRADING = -1,
+};
+
+//! Layout used for newly created coin databases (-coinsdblayout)
+static const int DEFAULT_COINS_DB_LAYOUT = COINS_DB_PER_TXID;
+
 /** CCoinsView backed by the LevelDB coin database (chainstate/) */
 class CCoinsViewDB : public CCoinsView
 {
 protected:
     CLevelDBWrapper db;
+    int nLayout;
+
+private:
+    class CPooledIterator;
+
+    //! Iterators kept for GetCoins and HaveCoins of a per-outpoint database,
+    //! as creating one for every lookup is costly
+    mutable CCriticalSection cs_iterators;
+    mutable std::vector<leveldb::Iterator*> vIterators;
+    //! Bumped whenever the database is written, retiring older iterators
+    uint64_t nIteratorGeneration;
+
 public:
-    CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    /**
+     * Open the coin database. A new (or wiped) database is created with
+     * nNewLayout; an existing one keeps its layout until Upgrade is called.
+     */
+    CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false, int nNewLayout = DEFAULT_COINS_DB_LAYOUT);
+    ~CCoinsViewDB();
 
     bool GetCoins(const uint256 &txid, CCoins &coins) const;
     bool HaveCoins(const uint256 &txid) const;
     uint256 GetBestBlock() const;
     bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock);
     bool GetStats(CCoinsStats &stats) const;
+
+    /**
+     * Compute the statistics of the database as of snapshot (taken with
+     * GetSnapshot), so that they can be computed while it is being written.
+     */
+    bool GetStats(CCoinsStats &stats, const leveldb::Snapshot* snapshot) const;
+    const leveldb::Snapshot* GetSnapshot();
+    void ReleaseSnapshot(const leveldb::Snapshot* snapshot);
+
+    /**
+     * The output statistics saved on shutdown, and the best block they are
+     * for, so that they need not be computed again on startup.
+     */
+    bool ReadTxOutSetStats(uint256 &hashBlock, CTxOutSetStats &stats) const;
+    bool WriteTxOutSetStats(const uint256 &hashBlock, const CTxOutSetStats &stats);
+
+    /**
+     * Look the txids up on the coin read threads, several at a time, so that
+     * the disk is kept busy with more than one read. Without the threads (or
+     * while another BatchRead has them) the lookups are done one by one.
+     */
+    void BatchRead(std::vector<CCoinsLookup> &vLookups) const;
+
+    /**
+     * Write the dirty entries of mapCoins and the best block in one batch,
+     * like BatchWrite, but without touching mapCoins. This lets other
+     * threads keep reading the entries while they are being written.
+     */
+    bool WriteCoins(const CCoinsMap &mapCoins, const uint256 &hashBlock);
+
+    int GetLayout() const { return nLayout; }
+
+    /**
+     * Convert a per-txid database to per-outpoint records. Safe to
+     * interrupt: the database is left COINS_DB_UPGRADING, and calling this
+     * again completes the upgrade.
+     */
+    bool Upgrade();
+
+private:
+    void BatchWriteEntry(CLevelDBBatch &batch, const uint256 &txid, const CCoinsCacheEntry &entry, size_t &written, size_t &erased) const;
+    void ResetIterators();
+    bool CommitBatch(CLevelDBBatch &batch, const uint256 &hashBlock, size_t count, size_t changed, size_t written, size_t erased);
 };
 
 /** Access to the block database (blocks/index/) */
@@ -59,6 +136,8 @@ public:
     bool ReadReindexing(bool &fReindex);
     bool ReadTxIndex(const uint256 &txid, CDiskTxPos &pos);
     bool WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> > &list);
+    bool ReadBlockFilter(const uint256 &hashBlock, CDiskBlockFilter &filter);
+    bool WriteBlockFilter(const uint256 &hashBlock, const CDiskBlockFilter &filter);
     bool WriteFlag(const std::string &name, bool fValue);
     bool ReadFlag(const std::string &name, bool &fValue);
     bool LoadBlockIndexGuts();
@@ -66,4 +145,7 @@ public:
     bool ActivateFork(int32_t nForkVersion, const uint256& blockHash);
 };
 
+/** Run an instance of the thread reading coins for CCoinsViewDB::BatchRead */
+void ThreadCoinsRead();
+
 #endif // BITCOIN_TXDB_H
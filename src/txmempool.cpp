@@ -15,10 +15,14 @@
 #include "utilmoneystr.h"
 #include "version.h"
 
+#include <math.h>
+
 using namespace std;
 
 CTxMemPoolEntry::CTxMemPoolEntry():
-    nFee(0), nTxSize(0), nModSize(0), nTime(0), dPriority(0.0), hadNoDependencies(false)
+    nFee(0), nTxSize(0), nModSize(0), nTime(0), dPriority(0.0), hadNoDependencies(false),
+    nFeeDelta(0), nCountWithAncestors(1), nSizeWithAncestors(0), nModFeesWithAncestors(0),
+    nCountWithDescendants(1), nSizeWithDescendants(0), nModFeesWithDescendants(0)
 {
     nHeight = MEMPOOL_HEIGHT;
 }
@@ -27,10 +31,17 @@ CTxMemPoolEntry::CTxMemPoolEntry(const CTransaction& _tx, const CAmount& _nFee,
                                  int64_t _nTime, double _dPriority,
                                  unsigned int _nHeight, bool poolHasNoInputsOf):
     tx(_tx), nFee(_nFee), nTime(_nTime), dPriority(_dPriority), nHeight(_nHeight),
-    hadNoDependencies(poolHasNoInputsOf)
+    hadNoDependencies(poolHasNoInputsOf), nFeeDelta(0)
 {
     nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
     nModSize = tx.CalculateModifiedSize(nTxSize);
+
+    nCountWithAncestors = 1;
+    nSizeWithAncestors = nTxSize;
+    nModFeesWithAncestors = nFee;
+    nCountWithDescendants = 1;
+    nSizeWithDescendants = nTxSize;
+    nModFeesWithDescendants = nFee;
 }
 
 CTxMemPoolEntry::CTxMemPoolEntry(const CTxMemPoolEntry& other)
@@ -47,8 +58,32 @@ CTxMemPoolEntry::GetPriority(unsigned int currentHeight) const
     return dResult;
 }
 
+void CTxMemPoolEntry::UpdateAncestorState(int64_t nSizeChange, CAmount nFeeChange, int64_t nCountChange)
+{
+    nSizeWithAncestors += nSizeChange;
+    nModFeesWithAncestors += nFeeChange;
+    nCountWithAncestors += nCountChange;
+    assert(int64_t(nCountWithAncestors) > 0);
+}
+
+void CTxMemPoolEntry::UpdateDescendantState(int64_t nSizeChange, CAmount nFeeChange, int64_t nCountChange)
+{
+    nSizeWithDescendants += nSizeChange;
+    nModFeesWithDescendants += nFeeChange;
+    nCountWithDescendants += nCountChange;
+    assert(int64_t(nCountWithDescendants) > 0);
+}
+
+void CTxMemPoolEntry::UpdateFeeDelta(CAmount nNewFeeDelta)
+{
+    nModFeesWithAncestors += nNewFeeDelta - nFeeDelta;
+    nModFeesWithDescendants += nNewFeeDelta - nFeeDelta;
+    nFeeDelta = nNewFeeDelta;
+}
+
 CTxMemPool::CTxMemPool(const CFeeRate& _minRelayFee) :
-    nTransactionsUpdated(0)
+    nTransactionsUpdated(0), totalTxSize(0), lastRollingFeeUpdate(GetTime()),
+    blockSinceLastRollingFeeBump(false), rollingMinimumFeeRate(0)
 {
     // Sanity checks off by default for performance, because otherwise
     // accepting transactions becomes O(N^2) where N is the number
@@ -95,10 +130,42 @@ bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry,
     // Used by main.cpp AcceptToMemoryPool(), which DOES do
     // all the appropriate checks.
     LOCK(cs);
-    mapTx[hash] = entry;
-    const CTransaction& tx = mapTx[hash].GetTx();
+    std::set<uint256> setAncestors;
+    CalculateMemPoolAncestors(entry.GetTx(), setAncestors);
+
+    // Entries can't be changed in place once in mapTx, so settle the
+    // ancestor totals of the new one before inserting it.
+    CTxMemPoolEntry newEntry(entry);
+    std::map<uint256, std::pair<double, CAmount> >::const_iterator pos = mapDeltas.find(hash);
+    if (pos != mapDeltas.end())
+        newEntry.UpdateFeeDelta(pos->second.second);
+    BOOST_FOREACH(const uint256& hashAncestor, setAncestors) {
+        const CTxMemPoolEntry& ancestor = *mapTx.find(hashAncestor);
+        newEntry.UpdateAncestorState(ancestor.GetTxSize(), ancestor.GetModifiedFee(), 1);
+    }
+    txiter newit = mapTx.insert(newEntry).first;
+
+    const CTransaction& tx = newit->GetTx();
     for (unsigned int i = 0; i < tx.vin.size(); i++)
         mapNextTx[tx.vin[i].prevout] = CInPoint(&tx, i);
+
+    std::set<uint256> setDescendants;
+    CalculateDescendants(hash, setDescendants);
+    if (setDescendants.empty()) {
+        BOOST_FOREACH(const uint256& hashAncestor, setAncestors)
+            mapTx.modify(mapTx.find(hashAncestor), update_descendant_state(newit->GetTxSize(), newit->GetModifiedFee(), 1));
+    } else {
+        // A transaction returned to the pool by a reorg can already have
+        // children here. Their ancestor totals now have to include it, and
+        // the descendant totals of it and its ancestors have to include
+        // them; recount those from scratch.
+        BOOST_FOREACH(const uint256& hashDescendant, setDescendants)
+            UpdateAncestorsOf(mapTx.find(hashDescendant));
+        UpdateDescendantsOf(newit);
+        BOOST_FOREACH(const uint256& hashAncestor, setAncestors)
+            UpdateDescendantsOf(mapTx.find(hashAncestor));
+    }
+
     nTransactionsUpdated++;
     totalTxSize += entry.GetTxSize();
     minerPolicyEstimator->processTransaction(entry, fCurrentEstimate);
@@ -106,6 +173,38 @@ bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry,
     return true;
 }
 
+void CTxMemPool::UpdateAncestorsOf(txiter it)
+{
+    std::set<uint256> setAncestors;
+    CalculateMemPoolAncestors(it->GetTx(), setAncestors);
+    int64_t nSize = it->GetTxSize();
+    CAmount nFees = it->GetModifiedFee();
+    BOOST_FOREACH(const uint256& hashAncestor, setAncestors) {
+        const CTxMemPoolEntry& ancestor = *mapTx.find(hashAncestor);
+        nSize += ancestor.GetTxSize();
+        nFees += ancestor.GetModifiedFee();
+    }
+    mapTx.modify(it, update_ancestor_state(nSize - it->GetSizeWithAncestors(),
+                                           nFees - it->GetModFeesWithAncestors(),
+                                           setAncestors.size() + 1 - it->GetCountWithAncestors()));
+}
+
+void CTxMemPool::UpdateDescendantsOf(txiter it)
+{
+    std::set<uint256> setDescendants;
+    CalculateDescendants(it->GetTx().GetHash(), setDescendants);
+    int64_t nSize = it->GetTxSize();
+    CAmount nFees = it->GetModifiedFee();
+    BOOST_FOREACH(const uint256& hashDescendant, setDescendants) {
+        const CTxMemPoolEntry& descendant = *mapTx.find(hashDescendant);
+        nSize += descendant.GetTxSize();
+        nFees += descendant.GetModifiedFee();
+    }
+    mapTx.modify(it, update_descendant_state(nSize - it->GetSizeWithDescendants(),
+                                             nFees - it->GetModFeesWithDescendants(),
+                                             setDescendants.size() + 1 - it->GetCountWithDescendants()));
+}
+
 
 void CTxMemPool::remove(const CTransaction &origTx, std::list<CTransaction>& removed, bool fRecursive)
 {
@@ -126,27 +225,53 @@ void CTxMemPool::remove(const CTransaction &origTx, std::list<CTransaction>& rem
                 txToRemove.push_back(it->second.ptx->GetHash());
             }
         }
+        // Find everything to remove first, so the totals of the ancestors
+        // and descendants staying behind can be corrected.
+        std::vector<txiter> vRemove;
+        std::set<uint256> setRemove;
         while (!txToRemove.empty())
         {
             uint256 hash = txToRemove.front();
             txToRemove.pop_front();
-            if (!mapTx.count(hash))
+            txiter it = mapTx.find(hash);
+            if (it == mapTx.end() || !setRemove.insert(hash).second)
                 continue;
-            const CTransaction& tx = mapTx[hash].GetTx();
+            vRemove.push_back(it);
             if (fRecursive) {
-                for (unsigned int i = 0; i < tx.vout.size(); i++) {
-                    std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(hash, i));
-                    if (it == mapNextTx.end())
+                for (unsigned int i = 0; i < it->GetTx().vout.size(); i++) {
+                    std::map<COutPoint, CInPoint>::iterator itNext = mapNextTx.find(COutPoint(hash, i));
+                    if (itNext == mapNextTx.end())
                         continue;
-                    txToRemove.push_back(it->second.ptx->GetHash());
+                    txToRemove.push_back(itNext->second.ptx->GetHash());
                 }
             }
+        }
+        BOOST_FOREACH(txiter it, vRemove)
+        {
+            const CTxMemPoolEntry& entry = *it;
+            std::set<uint256> setRelatives;
+            CalculateDescendants(entry.GetTx().GetHash(), setRelatives);
+            BOOST_FOREACH(const uint256& hashDescendant, setRelatives) {
+                if (!setRemove.count(hashDescendant))
+                    mapTx.modify(mapTx.find(hashDescendant), update_ancestor_state(-(int64_t)entry.GetTxSize(), -entry.GetModifiedFee(), -1));
+            }
+            setRelatives.clear();
+            CalculateMemPoolAncestors(entry.GetTx(), setRelatives);
+            BOOST_FOREACH(const uint256& hashAncestor, setRelatives) {
+                if (!setRemove.count(hashAncestor))
+                    mapTx.modify(mapTx.find(hashAncestor), update_descendant_state(-(int64_t)entry.GetTxSize(), -entry.GetModifiedFee(), -1));
+            }
+        }
+        BOOST_FOREACH(txiter it, vRemove)
+        {
+            const CTransaction& tx = it->GetTx();
             BOOST_FOREACH(const CTxIn& txin, tx.vin)
                 mapNextTx.erase(txin.prevout);
 
+            uint256 hash = tx.GetHash();
             removed.push_back(tx);
-            totalTxSize -= mapTx[hash].GetTxSize();
-            mapTx.erase(hash);
+            totalTxSize -= it->GetTxSize();
+            mapTx.erase(it);
             nTransactionsUpdated++;
             minerPolicyEstimator->removeTx(hash);
         }
@@ -158,10 +283,10 @@ void CTxMemPool::removeCoinbaseSpends(const CCoinsViewCache *pcoins, unsigned in
     // Remove transactions spending a coinbase which are now immature
     LOCK(cs);
     list<CTransaction> transactionsToRemove;
-    for (std::map<uint256, CTxMemPoolEntry>::const_iterator it = mapTx.begin(); it != mapTx.end(); it++) {
-        const CTransaction& tx = it->second.GetTx();
+    for (indexed_transaction_set::const_iterator it = mapTx.begin(); it != mapTx.end(); it++) {
+        const CTransaction& tx = it->GetTx();
         BOOST_FOREACH(const CTxIn& txin, tx.vin) {
-            std::map<uint256, CTxMemPoolEntry>::const_iterator it2 = mapTx.find(txin.prevout.hash);
+            indexed_transaction_set::const_iterator it2 = mapTx.find(txin.prevout.hash);
             if (it2 != mapTx.end())
                 continue;
             const CCoins *coins = pcoins->AccessCoins(txin.prevout.hash);
@@ -204,9 +329,9 @@ void CTxMemPool::removeForBlock(const std::vector<CTransaction>& vtx, unsigned i
     std::vector<CTxMemPoolEntry> entries;
     BOOST_FOREACH(const CTransaction& tx, vtx)
     {
-        uint256 hash = tx.GetHash();
-        if (mapTx.count(hash))
-            entries.push_back(mapTx[hash]);
+        indexed_transaction_set::const_iterator it = mapTx.find(tx.GetHash());
+        if (it != mapTx.end())
+            entries.push_back(*it);
     }
     BOOST_FOREACH(const CTransaction& tx, vtx)
     {
@@ -217,24 +342,8 @@ void CTxMemPool::removeForBlock(const std::vector<CTransaction>& vtx, unsigned i
     }
     // After the txs in the new block have been removed from the mempool, update policy estimates
     minerPolicyEstimator->processBlock(nBlockHeight, entries, fCurrentEstimate);
-}
-
-void CTxMemPool::evictRandom(std::list<CTransaction>& evicted)
-{
-    LOCK(cs);
-    if (mapTx.empty())
-        return;
-    for (int i = 0; i < 11; i++) {
-        map<uint256, CTxMemPoolEntry>::iterator it = mapTx.lower_bound(GetRandHash());
-        if (it == mapTx.end())
-            it = mapTx.begin();
-        if (mapDeltas.find(it->first) != mapDeltas.end())
-            continue;  // prioritised: try again
-        remove(it->second.GetTx(), evicted, true);
-        return;
-    }
-    // There is a small chance nothing will be evicted if the mempool is mostly
-    // prioritised transactions. That's OK.
+    lastRollingFeeUpdate = GetTime();
+    blockSinceLastRollingFeeBump = true;
 }
 
 void CTxMemPool::clear()
@@ -259,16 +368,16 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
 
     LOCK(cs);
     list<const CTxMemPoolEntry*> waitingOnDependants;
-    for (std::map<uint256, CTxMemPoolEntry>::const_iterator it = mapTx.begin(); it != mapTx.end(); it++) {
+    for (indexed_transaction_set::const_iterator it = mapTx.begin(); it != mapTx.end(); it++) {
         unsigned int i = 0;
-        checkTotal += it->second.GetTxSize();
-        const CTransaction& tx = it->second.GetTx();
+        checkTotal += it->GetTxSize();
+        const CTransaction& tx = it->GetTx();
         bool fDependsWait = false;
         BOOST_FOREACH(const CTxIn &txin, tx.vin) {
             // Check that every mempool transaction's inputs refer to available coins, or other mempool tx's.
-            std::map<uint256, CTxMemPoolEntry>::const_iterator it2 = mapTx.find(txin.prevout.hash);
+            indexed_transaction_set::const_iterator it2 = mapTx.find(txin.prevout.hash);
             if (it2 != mapTx.end()) {
-                const CTransaction& tx2 = it2->second.GetTx();
+                const CTransaction& tx2 = it2->GetTx();
                 assert(tx2.vout.size() > txin.prevout.n && !tx2.vout[txin.prevout.n].IsNull());
                 fDependsWait = true;
             } else {
@@ -282,8 +391,35 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
             assert(it3->second.n == i);
             i++;
         }
+        // Check the ancestor totals against a fresh walk of the ancestors.
+        std::set<uint256> setAncestors;
+        CalculateMemPoolAncestors(tx, setAncestors);
+        uint64_t nSizeCheck = it->GetTxSize();
+        CAmount nFeesCheck = it->GetModifiedFee();
+        BOOST_FOREACH(const uint256& hashAncestor, setAncestors) {
+            const CTxMemPoolEntry& ancestor = *mapTx.find(hashAncestor);
+            nSizeCheck += ancestor.GetTxSize();
+            nFeesCheck += ancestor.GetModifiedFee();
+        }
+        assert(it->GetCountWithAncestors() == setAncestors.size() + 1);
+        assert(it->GetSizeWithAncestors() == nSizeCheck);
+        assert(it->GetModFeesWithAncestors() == nFeesCheck);
+        // ... and the descendant totals likewise.
+        std::set<uint256> setDescendants;
+        CalculateDescendants(tx.GetHash(), setDescendants);
+        nSizeCheck = it->GetTxSize();
+        nFeesCheck = it->GetModifiedFee();
+        BOOST_FOREACH(const uint256& hashDescendant, setDescendants) {
+            const CTxMemPoolEntry& descendant = *mapTx.find(hashDescendant);
+            nSizeCheck += descendant.GetTxSize();
+            nFeesCheck += descendant.GetModifiedFee();
+        }
+        assert(it->GetCountWithDescendants() == setDescendants.size() + 1);
+        assert(it->GetSizeWithDescendants() == nSizeCheck);
+        assert(it->GetModFeesWithDescendants() == nFeesCheck);
+
         if (fDependsWait)
-            waitingOnDependants.push_back(&it->second);
+            waitingOnDependants.push_back(&*it);
         else {
             CValidationState state;
             assert(CheckInputs(tx, state, mempoolDuplicate, false, 0, false, NULL));
@@ -307,9 +443,9 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
     }
     for (std::map<COutPoint, CInPoint>::const_iterator it = mapNextTx.begin(); it != mapNextTx.end(); it++) {
         uint256 hash = it->second.ptx->GetHash();
-        map<uint256, CTxMemPoolEntry>::const_iterator it2 = mapTx.find(hash);
-        const CTransaction& tx = it2->second.GetTx();
+        indexed_transaction_set::const_iterator it2 = mapTx.find(hash);
         assert(it2 != mapTx.end());
+        const CTransaction& tx = it2->GetTx();
         assert(&tx == it->second.ptx);
         assert(tx.vin.size() > it->second.n);
         assert(it->first == it->second.ptx->vin[it->second.n].prevout);
@@ -324,16 +460,16 @@ void CTxMemPool::queryHashes(vector<uint256>& vtxid)
 
     LOCK(cs);
     vtxid.reserve(mapTx.size());
-    for (map<uint256, CTxMemPoolEntry>::iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
-        vtxid.push_back((*mi).first);
+    for (indexed_transaction_set::const_iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
+        vtxid.push_back(mi->GetTx().GetHash());
 }
 
 bool CTxMemPool::lookup(uint256 hash, CTransaction& result) const
 {
     LOCK(cs);
-    map<uint256, CTxMemPoolEntry>::const_iterator i = mapTx.find(hash);
+    indexed_transaction_set::const_iterator i = mapTx.find(hash);
     if (i == mapTx.end()) return false;
-    result = i->second.GetTx();
+    result = i->GetTx();
     return true;
 }
 
@@ -390,6 +526,21 @@ void CTxMemPool::PrioritiseTransaction(const uint256 hash, const string strHash,
         std::pair<double, CAmount> &deltas = mapDeltas[hash];
         deltas.first += dPriorityDelta;
         deltas.second += nFeeDelta;
+
+        // The fee delta counts towards the packages of every descendant
+        // and every ancestor
+        txiter it = mapTx.find(hash);
+        if (it != mapTx.end() && nFeeDelta != 0) {
+            mapTx.modify(it, update_fee_delta(deltas.second));
+            std::set<uint256> setRelatives;
+            CalculateDescendants(hash, setRelatives);
+            BOOST_FOREACH(const uint256& hashDescendant, setRelatives)
+                mapTx.modify(mapTx.find(hashDescendant), update_ancestor_state(0, nFeeDelta, 0));
+            setRelatives.clear();
+            CalculateMemPoolAncestors(it->GetTx(), setRelatives);
+            BOOST_FOREACH(const uint256& hashAncestor, setRelatives)
+                mapTx.modify(mapTx.find(hashAncestor), update_descendant_state(0, nFeeDelta, 0));
+        }
     }
     LogPrint("mempool", "PrioritiseTransaction: %s priority += %f, fee += %d\n", strHash, dPriorityDelta, FormatMoney(nFeeDelta));
 }
@@ -411,6 +562,169 @@ void CTxMemPool::ClearPrioritisation(const uint256 hash)
     mapDeltas.erase(hash);
 }
 
+void CTxMemPool::CalculateMemPoolAncestors(const CTransaction& tx, std::set<uint256>& setAncestors) const
+{
+    AssertLockHeld(cs);
+    std::vector<const CTransaction*> vToVisit(1, &tx);
+    while (!vToVisit.empty()) {
+        const CTransaction* ptx = vToVisit.back();
+        vToVisit.pop_back();
+        BOOST_FOREACH(const CTxIn& txin, ptx->vin) {
+            indexed_transaction_set::const_iterator it = mapTx.find(txin.prevout.hash);
+            if (it != mapTx.end() && setAncestors.insert(txin.prevout.hash).second)
+                vToVisit.push_back(&it->GetTx());
+        }
+    }
+}
+
+bool CTxMemPool::CalculateMemPoolAncestors(const CTransaction& tx, uint64_t nTxSize, std::set<uint256>& setAncestors,
+                                           uint64_t limitAncestorCount, uint64_t limitAncestorSize,
+                                           uint64_t limitDescendantCount, uint64_t limitDescendantSize,
+                                           std::string& errString) const
+{
+    AssertLockHeld(cs);
+    uint64_t nSizeWithAncestors = nTxSize;
+    std::vector<const CTransaction*> vToVisit(1, &tx);
+    while (!vToVisit.empty()) {
+        const CTransaction* ptx = vToVisit.back();
+        vToVisit.pop_back();
+        BOOST_FOREACH(const CTxIn& txin, ptx->vin) {
+            indexed_transaction_set::const_iterator it = mapTx.find(txin.prevout.hash);
+            if (it == mapTx.end() || !setAncestors.insert(txin.prevout.hash).second)
+                continue;
+            // Stop as soon as a limit is hit, so a long chain is not walked in full.
+            if (setAncestors.size() + 1 > limitAncestorCount) {
+                errString = strprintf("too many unconfirmed ancestors [limit: %u]", limitAncestorCount);
+                return false;
+            }
+            nSizeWithAncestors += it->GetTxSize();
+            if (nSizeWithAncestors > limitAncestorSize) {
+                errString = strprintf("exceeds ancestor size limit [limit: %u]", limitAncestorSize);
+                return false;
+            }
+            if (it->GetCountWithDescendants() + 1 > limitDescendantCount) {
+                errString = strprintf("too many descendants for tx %s [limit: %u]", it->GetTx().GetHash().ToString(), limitDescendantCount);
+                return false;
+            }
+            if (it->GetSizeWithDescendants() + nTxSize > limitDescendantSize) {
+                errString = strprintf("exceeds descendant size limit for tx %s [limit: %u]", it->GetTx().GetHash().ToString(), limitDescendantSize);
+                return false;
+            }
+            vToVisit.push_back(&it->GetTx());
+        }
+    }
+    return true;
+}
+
+void CTxMemPool::CalculateDescendants(const uint256& hash, std::set<uint256>& setDescendants) const
+{
+    AssertLockHeld(cs);
+    std::vector<uint256> vToVisit(1, hash);
+    while (!vToVisit.empty()) {
+        uint256 hashVisit = vToVisit.back();
+        vToVisit.pop_back();
+        std::map<COutPoint, CInPoint>::const_iterator it = mapNextTx.lower_bound(COutPoint(hashVisit, 0));
+        for (; it != mapNextTx.end() && it->first.hash == hashVisit; ++it) {
+            const uint256& hashChild = it->second.ptx->GetHash();
+            if (setDescendants.insert(hashChild).second)
+                vToVisit.push_back(hashChild);
+        }
+    }
+}
+
+void CTxMemPool::trackPackageRemoved(const CFeeRate& rate)
+{
+    AssertLockHeld(cs);
+    if (rate.GetFeePerK() > rollingMinimumFeeRate) {
+        rollingMinimumFeeRate = rate.GetFeePerK();
+        blockSinceLastRollingFeeBump = false;
+    }
+}
+
+CFeeRate CTxMemPool::GetMinFee(size_t sizelimit) const
+{
+    LOCK(cs);
+    if (!blockSinceLastRollingFeeBump || rollingMinimumFeeRate == 0)
+        return CFeeRate(rollingMinimumFeeRate);
+
+    int64_t time = GetTime();
+    if (time > lastRollingFeeUpdate + 10) {
+        // Decay faster the more room the pool has
+        double halflife = ROLLING_FEE_HALFLIFE;
+        if (totalTxSize < sizelimit / 4)
+            halflife /= 4;
+        else if (totalTxSize < sizelimit / 2)
+            halflife /= 2;
+
+        rollingMinimumFeeRate = rollingMinimumFeeRate / pow(2.0, (time - lastRollingFeeUpdate) / halflife);
+        lastRollingFeeUpdate = time;
+
+        if (rollingMinimumFeeRate < ::minRelayTxFee.GetFeePerK() / 2) {
+            rollingMinimumFeeRate = 0;
+            return CFeeRate(0);
+        }
+    }
+    return std::max(CFeeRate(rollingMinimumFeeRate), ::minRelayTxFee);
+}
+
+void CTxMemPool::TrimToSize(size_t sizelimit, std::list<CTransaction>& removed)
+{
+    LOCK(cs);
+
+    typedef indexed_transaction_set::index<descendant_score>::type::iterator byscore_iter;
+    byscore_iter it = mapTx.get<descendant_score>().begin();
+    while (totalTxSize > sizelimit && it != mapTx.get<descendant_score>().end()) {
+        const uint256& hash = it->GetTx().GetHash();
+
+        // Never evict a package holding a prioritised transaction, such as
+        // one from our own wallet.
+        std::set<uint256> setPackage;
+        CalculateDescendants(hash, setPackage);
+        setPackage.insert(hash);
+        bool fPrioritised = false;
+        BOOST_FOREACH(const uint256& hashPackage, setPackage) {
+            if (mapDeltas.count(hashPackage)) {
+                fPrioritised = true;
+                break;
+            }
+        }
+        if (fPrioritised) {
+            ++it;
+            continue;
+        }
+
+        // Anyone replacing what was evicted has to pay more than it did,
+        // by at least the relay fee, or the pool just churns.
+        CFeeRate rateRemoved(it->GetModFeesWithDescendants(), it->GetSizeWithDescendants());
+        trackPackageRemoved(CFeeRate(rateRemoved.GetFeePerK() + ::minRelayTxFee.GetFeePerK()));
+
+        LogPrint("mempool", "mempool full, evicting %s and %u descendants\n", hash.ToString(), setPackage.size() - 1);
+        CTxMemPoolEntry entry(*it);
+        remove(entry.GetTx(), removed, true);
+        // Carry on from where the package was rather than from the lowest
+        // score, so that prioritised packages are not looked at again after
+        // every eviction. Evicting a package can only raise the score of its
+        // ancestors; transactions that also had a parent outside it may sink
+        // below, and are left for the next trim.
+        it = mapTx.get<descendant_score>().lower_bound(entry);
+    }
+}
+
+int CTxMemPool::Expire(int64_t time, std::list<CTransaction>& removed)
+{
+    LOCK(cs);
+    std::vector<CTransaction> vExpired;
+    typedef indexed_transaction_set::index<entry_time>::type::iterator bytime_iter;
+    for (bytime_iter it = mapTx.get<entry_time>().begin();
+         it != mapTx.get<entry_time>().end() && it->GetTime() < time; ++it) {
+        vExpired.push_back(it->GetTx());
+    }
+    size_t nRemovedBefore = removed.size();
+    BOOST_FOREACH(const CTransaction& tx, vExpired)
+        remove(tx, removed, true);
+    return removed.size() - nRemovedBefore;
+}
+
 bool CTxMemPool::HasNoInputsOf(const CTransaction &tx) const
 {
     for (unsigned int i = 0; i < tx.vin.size(); i++)
@@ -436,3 +750,29 @@ bool CCoinsViewMemPool::GetCoins(const uint256 &txid, CCoins &coins) const {
 bool CCoinsViewMemPool::HaveCoins(const uint256 &txid) const {
     return mempool.exists(txid) || base->HaveCoins(txid);
 }
+
+void CCoinsViewMemPool::BatchRead(std::vector<CCoinsLookup> &vLookups) const {
+    // As in GetCoins, the mempool goes first; the rest is read from the base
+    // view in one batch.
+    std::vector<CCoinsLookup> vBase;
+    std::vector<size_t> vIndex;
+    for (size_t i = 0; i < vLookups.size(); i++) {
+        CTransaction tx;
+        if (mempool.lookup(vLookups[i].txid, tx)) {
+            vLookups[i].coins = CCoins(tx, MEMPOOL_HEIGHT);
+            vLookups[i].fFound = true;
+        } else {
+            vIndex.push_back(i);
+        }
+    }
+    vBase.reserve(vIndex.size());
+    BOOST_FOREACH(size_t i, vIndex)
+        vBase.push_back(CCoinsLookup(vLookups[i].txid));
+    base->BatchRead(vBase);
+    for (size_t j = 0; j < vIndex.size(); j++) {
+        CCoinsLookup& lookup = vLookups[vIndex[j]];
+        lookup.fFound = vBase[j].fFound && !vBase[j].coins.IsPruned();
+        if (lookup.fFound)
+            lookup.coins.swap(vBase[j].coins);
+    }
+}
@@ -7,12 +7,17 @@
 #define BITCOIN_TXMEMPOOL_H
 
 #include <list>
+#include <set>
 
 #include "amount.h"
 #include "coins.h"
 #include "primitives/transaction.h"
 #include "sync.h"
 
+#include <boost/multi_index_container.hpp>
+#include <boost/multi_index/identity.hpp>
+#include <boost/multi_index/ordered_index.hpp>
+
 class CAutoFile;
 
 inline double AllowFreeThreshold()
@@ -44,6 +49,21 @@ private:
     double dPriority; //! Priority when entering the mempool
     unsigned int nHeight; //! Chain height when entering the mempool
     bool hadNoDependencies; //! Not dependent on any other txs when it entered the mempool
+    CAmount nFeeDelta; //! Fee delta from PrioritiseTransaction
+
+    // Totals over this transaction and its in-mempool ancestors, kept up to
+    // date by CTxMemPool. A transaction can only be mined with all of its
+    // ancestors, so these describe the package it would bring into a block.
+    uint64_t nCountWithAncestors;
+    uint64_t nSizeWithAncestors;
+    CAmount nModFeesWithAncestors; //! Including fee deltas
+
+    // Totals over this transaction and its in-mempool descendants. Evicting
+    // a transaction evicts all of its descendants with it, so these describe
+    // the package that would leave the pool.
+    uint64_t nCountWithDescendants;
+    uint64_t nSizeWithDescendants;
+    CAmount nModFeesWithDescendants; //! Including fee deltas
 
 public:
     CTxMemPoolEntry(const CTransaction& _tx, const CAmount& _nFee,
@@ -58,8 +78,154 @@ public:
     int64_t GetTime() const { return nTime; }
     unsigned int GetHeight() const { return nHeight; }
     bool WasClearAtEntry() const { return hadNoDependencies; }
+    //! The fee, including any delta from PrioritiseTransaction
+    CAmount GetModifiedFee() const { return nFee + nFeeDelta; }
+
+    uint64_t GetCountWithAncestors() const { return nCountWithAncestors; }
+    uint64_t GetSizeWithAncestors() const { return nSizeWithAncestors; }
+    CAmount GetModFeesWithAncestors() const { return nModFeesWithAncestors; }
+
+    uint64_t GetCountWithDescendants() const { return nCountWithDescendants; }
+    uint64_t GetSizeWithDescendants() const { return nSizeWithDescendants; }
+    CAmount GetModFeesWithDescendants() const { return nModFeesWithDescendants; }
+
+    //! Adjust the ancestor totals for an ancestor entering or leaving the pool
+    void UpdateAncestorState(int64_t nSizeChange, CAmount nFeeChange, int64_t nCountChange);
+    //! Adjust the descendant totals for a descendant entering or leaving the pool
+    void UpdateDescendantState(int64_t nSizeChange, CAmount nFeeChange, int64_t nCountChange);
+    void UpdateFeeDelta(CAmount nNewFeeDelta);
+};
+
+// Entries are immutable once in CTxMemPool::mapTx, since every index but
+// the txid one is sorted on state that changes. These functors are applied
+// with mapTx.modify(), which moves the entry to its new place in each index.
+struct update_ancestor_state
+{
+    update_ancestor_state(int64_t _nSize, CAmount _nFee, int64_t _nCount) :
+        nSize(_nSize), nFee(_nFee), nCount(_nCount) {}
+
+    void operator()(CTxMemPoolEntry& e) { e.UpdateAncestorState(nSize, nFee, nCount); }
+
+private:
+    int64_t nSize;
+    CAmount nFee;
+    int64_t nCount;
+};
+
+struct update_descendant_state
+{
+    update_descendant_state(int64_t _nSize, CAmount _nFee, int64_t _nCount) :
+        nSize(_nSize), nFee(_nFee), nCount(_nCount) {}
+
+    void operator()(CTxMemPoolEntry& e) { e.UpdateDescendantState(nSize, nFee, nCount); }
+
+private:
+    int64_t nSize;
+    CAmount nFee;
+    int64_t nCount;
+};
+
+struct update_fee_delta
+{
+    update_fee_delta(CAmount _nFeeDelta) : nFeeDelta(_nFeeDelta) {}
+
+    void operator()(CTxMemPoolEntry& e) { e.UpdateFeeDelta(nFeeDelta); }
+
+private:
+    CAmount nFeeDelta;
 };
 
+/** Extract the txid of an entry, the primary key of CTxMemPool::mapTx. */
+struct mempoolentry_txid
+{
+    typedef uint256 result_type;
+    result_type operator()(const CTxMemPoolEntry& entry) const
+    {
+        return entry.GetTx().GetHash();
+    }
+};
+
+/** Sort by a transaction's own fee rate, including fee deltas, highest first. */
+class CompareTxMemPoolEntryByScore
+{
+public:
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
+    {
+        double f1 = (double)a.GetModifiedFee() * b.GetTxSize();
+        double f2 = (double)b.GetModifiedFee() * a.GetTxSize();
+        if (f1 == f2)
+            return b.GetTx().GetHash() < a.GetTx().GetHash();
+        return f1 > f2;
+    }
+};
+
+/** Sort by the time a transaction entered the pool, oldest first. */
+class CompareTxMemPoolEntryByEntryTime
+{
+public:
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
+    {
+        return a.GetTime() < b.GetTime();
+    }
+};
+
+/**
+ * Sort by the better of a transaction's own fee rate and the fee rate of it
+ * together with its descendants, lowest first: the front of this order is
+ * the package that is least worth keeping. Taking the better of the two
+ * keeps a well-paying parent from being evicted for a cheap child.
+ */
+class CompareTxMemPoolEntryByDescendantScore
+{
+public:
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
+    {
+        bool fUseADescendants = UseDescendantScore(a);
+        bool fUseBDescendants = UseDescendantScore(b);
+
+        double aFees = fUseADescendants ? a.GetModFeesWithDescendants() : a.GetModifiedFee();
+        double aSize = fUseADescendants ? a.GetSizeWithDescendants() : a.GetTxSize();
+        double bFees = fUseBDescendants ? b.GetModFeesWithDescendants() : b.GetModifiedFee();
+        double bSize = fUseBDescendants ? b.GetSizeWithDescendants() : b.GetTxSize();
+
+        // Compare aFees / aSize with bFees / bSize without dividing
+        double f1 = aFees * bSize;
+        double f2 = aSize * bFees;
+        if (f1 == f2)
+            return a.GetTime() > b.GetTime();
+        return f1 < f2;
+    }
+
+    //! Whether the descendant fee rate is the better of the two
+    static bool UseDescendantScore(const CTxMemPoolEntry& a)
+    {
+        double f1 = (double)a.GetModifiedFee() * a.GetSizeWithDescendants();
+        double f2 = (double)a.GetModFeesWithDescendants() * a.GetTxSize();
+        return f2 > f1;
+    }
+};
+
+/** Sort by the fee rate of a transaction together with its ancestors, highest first. */
+class CompareTxMemPoolEntryByAncestorFee
+{
+public:
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
+    {
+        // Compare nModFeesWithAncestors / nSizeWithAncestors without dividing
+        double f1 = (double)a.GetModFeesWithAncestors() * b.GetSizeWithAncestors();
+        double f2 = (double)b.GetModFeesWithAncestors() * a.GetSizeWithAncestors();
+        if (f1 == f2)
+            return a.GetTx().GetHash() < b.GetTx().GetHash();
+        return f1 > f2;
+    }
+};
+
+// Tags for the secondary indexes of CTxMemPool::mapTx
+struct mining_score {};
+struct entry_time {};
+struct descendant_score {};
+struct ancestor_score {};
+
 class CBlockPolicyEstimator;
 
 /** An inpoint - a combination of a transaction and an index n into its vin */
@@ -84,6 +250,18 @@ public:
  * are added to the pool: if a new transaction double-spends
  * an input of a transaction in the pool, it is dropped,
  * as are non-standard transactions.
+ *
+ * mapTx is a boost::multi_index_container holding each entry once, sorted
+ * by several criteria at the same time:
+ * - txid, for lookups;
+ * - mining_score, the transaction's own fee rate;
+ * - entry_time, for expiring old transactions;
+ * - descendant_score, the fee rate of the transaction and what depends on
+ *   it, lowest first, so TrimToSize() finds the package to evict in O(log n);
+ * - ancestor_score, the fee rate of the transaction and what it depends
+ *   on, highest first, the order CreateNewBlock() considers packages in.
+ * The txid index is ordered rather than hashed so that peers cannot degrade
+ * it by choosing colliding transactions.
  */
 class CTxMemPool
 {
@@ -94,12 +272,64 @@ private:
 
     uint64_t totalTxSize; //! sum of all mempool tx' byte sizes
 
+    // The fee rate TrimToSize() last had to evict at, decaying while the
+    // pool has room again so that it doesn't stay high after a spam wave.
+    mutable int64_t lastRollingFeeUpdate;
+    mutable bool blockSinceLastRollingFeeBump;
+    mutable double rollingMinimumFeeRate; //! satoshis per 1000 bytes
+
+    void trackPackageRemoved(const CFeeRate& rate);
+
 public:
+    //! Time for the rolling minimum fee to halve when the pool is at least half full
+    static const int ROLLING_FEE_HALFLIFE = 60 * 60 * 12;
+
+    typedef boost::multi_index_container<
+        CTxMemPoolEntry,
+        boost::multi_index::indexed_by<
+            // sorted by txid
+            boost::multi_index::ordered_unique<mempoolentry_txid>,
+            // sorted by own fee rate
+            boost::multi_index::ordered_non_unique<
+                boost::multi_index::tag<mining_score>,
+                boost::multi_index::identity<CTxMemPoolEntry>,
+                CompareTxMemPoolEntryByScore
+            >,
+            // sorted by entry time
+            boost::multi_index::ordered_non_unique<
+                boost::multi_index::tag<entry_time>,
+                boost::multi_index::identity<CTxMemPoolEntry>,
+                CompareTxMemPoolEntryByEntryTime
+            >,
+            // sorted by fee rate with descendants, for eviction
+            boost::multi_index::ordered_non_unique<
+                boost::multi_index::tag<descendant_score>,
+                boost::multi_index::identity<CTxMemPoolEntry>,
+                CompareTxMemPoolEntryByDescendantScore
+            >,
+            // sorted by fee rate with ancestors, for mining
+            boost::multi_index::ordered_non_unique<
+                boost::multi_index::tag<ancestor_score>,
+                boost::multi_index::identity<CTxMemPoolEntry>,
+                CompareTxMemPoolEntryByAncestorFee
+            >
+        >
+    > indexed_transaction_set;
+    typedef indexed_transaction_set::nth_index<0>::type::iterator txiter;
+
     mutable CCriticalSection cs;
-    std::map<uint256, CTxMemPoolEntry> mapTx;
+    indexed_transaction_set mapTx;
     std::map<COutPoint, CInPoint> mapNextTx;
     std::map<uint256, std::pair<double, CAmount> > mapDeltas;
 
+private:
+    //! Recount the ancestor totals of an entry from its in-pool ancestors
+    void UpdateAncestorsOf(txiter it);
+    //! Recount the descendant totals of an entry from its in-pool descendants
+    void UpdateDescendantsOf(txiter it);
+
+public:
+
     CTxMemPool(const CFeeRate& _minRelayFee);
     ~CTxMemPool();
 
@@ -112,17 +342,31 @@ public:
     void check(const CCoinsViewCache *pcoins) const;
     void setSanityCheck(bool _fSanityCheck) { fSanityCheck = _fSanityCheck; }
 
+    /**
+     * Add an entry, setting its ancestor totals from the transactions it
+     * depends on that are already in the pool.
+     */
     bool addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry, bool fCurrentEstimate = true);
     void remove(const CTransaction &tx, std::list<CTransaction>& removed, bool fRecursive = false);
     void removeCoinbaseSpends(const CCoinsViewCache *pcoins, unsigned int nMemPoolHeight);
     void removeConflicts(const CTransaction &tx, std::list<CTransaction>& removed);
     void removeForBlock(const std::vector<CTransaction>& vtx, unsigned int nBlockHeight,
                         std::list<CTransaction>& conflicts, bool fCurrentEstimate = true);
-    // Try to evict a random transaction and its descendants,
-    // BUT will not evict prioritised transactions. Returns list of transactions
-    // evicted. If the memory pool is full of prioritised transactions, there is
-    // a chance it will evict nothing.
-    void evictRandom(std::list<CTransaction>& evicted);
+    /**
+     * Evict the packages with the lowest descendant score until the pool is
+     * no larger than sizelimit bytes, and raise the rolling minimum fee to
+     * what they paid. Packages holding a prioritised transaction are never
+     * evicted, so the pool can stay above the limit if it is full of them.
+     */
+    void TrimToSize(size_t sizelimit, std::list<CTransaction>& removed);
+    /** Remove transactions, and their descendants, that entered the pool before time. */
+    int Expire(int64_t time, std::list<CTransaction>& removed);
+    /**
+     * The fee rate a transaction needs to enter a pool limited to sizelimit
+     * bytes: zero, or at least minRelayTxFee once TrimToSize() has had to
+     * evict, halving every ROLLING_FEE_HALFLIFE after the next block.
+     */
+    CFeeRate GetMinFee(size_t sizelimit) const;
     void clear();
     void queryHashes(std::vector<uint256>& vtxid);
     void pruneSpent(const uint256& hash, CCoins &coins);
@@ -134,6 +378,27 @@ public:
      */
     bool HasNoInputsOf(const CTransaction& tx) const;
 
+    /**
+     * Collect the hashes of the in-pool transactions that tx depends on,
+     * directly or indirectly. tx itself need not be in the pool. Requires cs.
+     */
+    void CalculateMemPoolAncestors(const CTransaction& tx, std::set<uint256>& setAncestors) const;
+    /**
+     * Like the above, for a transaction of nTxSize bytes about to be added,
+     * but fail with errString if it would have more in-pool ancestors (or
+     * any of them more descendants) than the limits allow. Sizes count the
+     * transactions themselves too. Requires cs.
+     */
+    bool CalculateMemPoolAncestors(const CTransaction& tx, uint64_t nTxSize, std::set<uint256>& setAncestors,
+                                   uint64_t limitAncestorCount, uint64_t limitAncestorSize,
+                                   uint64_t limitDescendantCount, uint64_t limitDescendantSize,
+                                   std::string& errString) const;
+    /**
+     * Collect the hashes of the in-pool transactions that depend on the
+     * transaction with the given hash, directly or indirectly. Requires cs.
+     */
+    void CalculateDescendants(const uint256& hash, std::set<uint256>& setDescendants) const;
+
     /** Affect CreateNewBlock prioritisation of transactions */
     void PrioritiseTransaction(const uint256 hash, const std::string strHash, double dPriorityDelta, const CAmount& nFeeDelta);
     void ApplyDeltas(const uint256 hash, double &dPriorityDelta, CAmount &nFeeDelta);
@@ -182,6 +447,7 @@ public:
     CCoinsViewMemPool(CCoinsView *baseIn, CTxMemPool &mempoolIn);
     bool GetCoins(const uint256 &txid, CCoins &coins) const;
     bool HaveCoins(const uint256 &txid) const;
+    void BatchRead(std::vector<CCoinsLookup> &vLookups) const;
 };
 
 #endif // BITCOIN_TXMEMPOOL_H
@@ -0,0 +1,95 @@
+// Copyright (c) 2015 The Bitcoin XT developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "txoutsetstats.h"
+
+#include "chain.h"
+#include "main.h"
+#include "txdb.h"
+#include "util.h"
+#include "utiltime.h"
+
+CTxOutSetStatsTracker::CTxOutSetStatsTracker() : fBase(false), nHeight(-1)
+{
+}
+
+void CTxOutSetStatsTracker::Reset(const CBlockIndex* pindex)
+{
+    boost::unique_lock<boost::mutex> lock(cs);
+    stats = CTxOutSetStats();
+    fBase = false;
+    hashBlock = pindex ? pindex->GetBlockHash() : uint256();
+    nHeight = pindex ? pindex->nHeight : -1;
+}
+
+void CTxOutSetStatsTracker::SetBase(const CTxOutSetStats& base)
+{
+    boost::unique_lock<boost::mutex> lock(cs);
+    assert(!fBase);
+    stats += base;
+    fBase = true;
+}
+
+void CTxOutSetStatsTracker::Update(const CTxOutSetStats& delta, const CBlockIndex* pindex)
+{
+    boost::unique_lock<boost::mutex> lock(cs);
+    stats += delta;
+    hashBlock = pindex ? pindex->GetBlockHash() : uint256();
+    nHeight = pindex ? pindex->nHeight : -1;
+}
+
+bool CTxOutSetStatsTracker::Get(CTxOutSetStats& statsOut, uint256& hashBlockOut, int& nHeightOut) const
+{
+    boost::unique_lock<boost::mutex> lock(cs);
+    if (!fBase)
+        return false;
+    statsOut = stats;
+    hashBlockOut = hashBlock;
+    nHeightOut = nHeight;
+    return true;
+}
+
+const leveldb::Snapshot* InitTxOutSetStats(CCoinsViewDB* db)
+{
+    AssertLockHeld(cs_main);
+    txoutsetstats.Reset(chainActive.Tip());
+    uint256 hashBest = db->GetBestBlock();
+    if (hashBest != (chainActive.Tip() ? chainActive.Tip()->GetBlockHash() : uint256())) {
+        // Not expected at startup: the coins of the tip aren't all in db.
+        LogPrintf("%s: the coin database is not at the tip, the UTXO set statistics won't be known\n", __func__);
+        return NULL;
+    }
+    uint256 hashSaved;
+    CTxOutSetStats saved;
+    if (db->ReadTxOutSetStats(hashSaved, saved) && hashSaved == hashBest) {
+        txoutsetstats.SetBase(saved);
+        LogPrintf("%s: using the UTXO set statistics saved at %s\n", __func__, hashSaved.ToString());
+        return NULL;
+    }
+    return db->GetSnapshot();
+}
+
+void ThreadTxOutSetStats(CCoinsViewDB* db, const leveldb::Snapshot* snapshot)
+{
+    RenameThread("bitcoin-txoutstats");
+
+    // Blocks connected since the snapshot are added by the tracker as they come.
+    LogPrintf("%s: computing the UTXO set statistics...\n", __func__);
+    int64_t nStart = GetTimeMillis();
+    CCoinsStats stats;
+    bool fOk;
+    try {
+        fOk = db->GetStats(stats, snapshot);
+    } catch (const boost::thread_interrupted&) {
+        db->ReleaseSnapshot(snapshot);
+        throw;
+    }
+    db->ReleaseSnapshot(snapshot);
+    if (!fOk) {
+        LogPrintf("%s: failed to compute the UTXO set statistics\n", __func__);
+        return;
+    }
+    txoutsetstats.SetBase(stats.txouts);
+    LogPrintf("%s: computed the UTXO set statistics at height %d in %dms\n", __func__, stats.nHeight, GetTimeMillis() - nStart);
+}
@@ -0,0 +1,70 @@
+// Copyright (c) 2015 The Bitcoin XT developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_TXOUTSETSTATS_H
+#define BITCOIN_TXOUTSETSTATS_H
+
+#include "coins.h"
+#include "uint256.h"
+
+#include <boost/thread/mutex.hpp>
+
+class CBlockIndex;
+class CCoinsViewDB;
+namespace leveldb {
+class Snapshot;
+}
+
+/**
+ * The output statistics (CTxOutSetStats) of the UTXO set at the tip of the
+ * active chain, kept up to date as blocks are connected and disconnected,
+ * so that they can be had without a pass over the coin database, and
+ * without cs_main.
+ *
+ * What each block changes is added as it comes. The statistics of the set
+ * those changes were made to (the base) are either the ones saved in the
+ * coin database when it was last written, or computed in the background
+ * from a snapshot of it (see ThreadTxOutSetStats). Until the base is known,
+ * so are not the statistics.
+ */
+class CTxOutSetStatsTracker
+{
+public:
+    CTxOutSetStatsTracker();
+
+    /** Start over from the UTXO set at pindex, with the base not known yet. */
+    void Reset(const CBlockIndex* pindex);
+    /** Set the statistics of the UTXO set Reset was called for. */
+    void SetBase(const CTxOutSetStats& base);
+    /** Add the changes of a block connected or disconnected, leaving the tip at pindex. */
+    void Update(const CTxOutSetStats& delta, const CBlockIndex* pindex);
+
+    /** The statistics at the tip, if known, and which block that is. */
+    bool Get(CTxOutSetStats& stats, uint256& hashBlock, int& nHeight) const;
+
+private:
+    mutable boost::mutex cs;
+    //! The base plus the changes since, or just the changes while fBase is false
+    CTxOutSetStats stats;
+    bool fBase;
+    uint256 hashBlock;
+    int nHeight;
+};
+
+/**
+ * Start the tracker at the tip, before any block is connected on top of
+ * what db holds. Uses the statistics saved in db (see
+ * CCoinsViewFlusher::SaveTxOutSetStats) if they are for its best block;
+ * otherwise returns a snapshot of db for ThreadTxOutSetStats to compute
+ * them from. Requires cs_main.
+ */
+const leveldb::Snapshot* InitTxOutSetStats(CCoinsViewDB* db);
+
+/**
+ * Compute the statistics of the snapshot InitTxOutSetStats returned, and
+ * release it. Run on a thread of its own, as that can take minutes.
+ */
+void ThreadTxOutSetStats(CCoinsViewDB* db, const leveldb::Snapshot* snapshot);
+
+#endif // BITCOIN_TXOUTSETSTATS_H
@@ -639,6 +639,16 @@ void AllocateFileRange(FILE *file, unsigned int offset, unsigned int length) {
 #endif
 }
 
+/**
+ * this function tells the OS that the file will be read from start to end, so that it
+ * reads further ahead. it is advisory, like AllocateFileRange
+ */
+void FileAdviseSequential(FILE *file) {
+#if defined(POSIX_FADV_SEQUENTIAL)
+    posix_fadvise(fileno(file), 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+}
+
 void ShrinkDebugFile()
 {
     // Scroll debug.log if it's getting too big